@@ -11,16 +11,37 @@
  * player or spectator depending on the presence of a playerName
  * argument; it then forwards keystrokes to the server and handles
  * display update events as necessary before exiting on error, quit,
- * or game end.
+ * or game end.  It announces (with CAPS) that it can decode run-length
+ * encoded DISPLAYZ frames, which a server may send instead of DISPLAY,
+ * and the binary encoding of support/proto.h; once the server answers in
+ * the latter, the client sends its keystrokes that way too.  If the
+ * terminal is smaller than the map, it asks (with VIEW) for just a
+ * screenful around the player; a spectator pans that view with the
+ * movement keys.  Each frame redraws only the cells that changed, and a
+ * burst of frames is drawn to the terminal once.  With --predict, a
+ * player's '@' moves as soon as a key is pressed, and the server's
+ * frames are reconciled with the keystrokes it has yet to acknowledge.
  *
  * Jordan Mann, February 2022
  *
- * Usage: client hostname port [playerName]
+ * Usage: client [--reliable] [--predict] hostname port [playerName]
+ *   --reliable   frame messages with sequence numbers and acknowledgements,
+ *                so that lost OK/GRID/GOLD/QUIT messages are resent and a
+ *                lost DISPLAY is healed by the next (see message.h)
+ *   --predict    number each KEY, and show its move before the server's
+ *                DISPLAY does
  */
 
+#ifdef BENCH
+#define _POSIX_C_SOURCE 200112L  // for setenv, dup and fdopen in the benchmark
+#endif
+
 #include <log.h>
 #include <message.h>
+#include <ctype.h>
 #include <ncurses.h>
+#include <proto.h>
+#include <rle.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -37,6 +58,9 @@
 // Make output look more like the assignment's sample client output
 // #define USE_COMPAT
 
+// Keystrokes that may await acknowledgement at once, with --predict
+#define MAX_PENDING 64
+
 // Global game state.
 typedef struct gameState {
     addr_t server;
@@ -45,8 +69,36 @@ typedef struct gameState {
     int statusIndex;
     char* hostname;
     char* port;
+    char* grid;    // decoded DISPLAYZ map; allocated once GRID is known
+    int gridSize;  // bytes allocated to grid
+    bool binary;   // the server has sent a message encoded with proto.h
+    int gridRows, gridCols;  // size of the map, from GRID
+    int viewRows, viewCols;  // size of our viewport; 0 if none
+    int viewTop, viewLeft;   // its corner, as last shown
+    char* shown;     // the map as on screen, shownRows lines of shownCols
+    int shownRows, shownCols;  // the screen's size, below the status line
+    bool dirty;      // the map has been drawn but not yet refreshed
+    uint64_t lastRefresh;  // message_now() at the last refresh of the map
+    // client-side prediction (--predict): the server's latest frame, with
+    // the moves of the keystrokes it has not yet acknowledged applied
+    bool predict;    // number KEYs, and predict their moves
+    int keySeq;      // number of the last KEY sent
+    int ackedSeq;    // the latest SEQ: frames since reflect KEYs up to it
+    char pending[MAX_PENDING];     // unacknowledged keystrokes, by seq
+    int predictedY[MAX_PENDING];   // ... and where each left '@', in map
+    int predictedX[MAX_PENDING];   //     coordinates
+    char* frame;     // the server's latest frame (empty if none yet)
+    int frameTop, frameLeft;  // its corner in the map (0 0 if a DISPLAY)
+    char* predicted; // the frame with the pending moves applied
+    char* terrain;   // the floor ('.' or '#') last seen at each map cell
+    long predictions, mispredictions;  // KEYs predicted; and wrongly
 } gameState_t;
 
+// Draw at most one frame this often while DISPLAYs arrive in a burst, and
+// catch up this soon after the burst ends
+static const uint64_t frameNanos = 1000000000ULL / 60;
+static const float flushSeconds = 0.05;
+
 gameState_t* state;
 
 static void plogf(const char* format, ...);
@@ -54,16 +106,34 @@ static void printStatus(const char* format, ...);
 static void clearStatus();
 int main(const int argc, char* argv[]);
 static bool parseArgs(const int argc, char* argv[], char** hostname,
-                      char** port, char** playername);
+                      char** port, char** playername, bool* reliable,
+                      bool* predict);
 static gameState_t* setup(char* hostname, char* port, char* playername);
 static bool game(char* playername);
 static void sendMsg(char* type, char* body);
 static bool handleEvent(void* arg, const addr_t server, const char* message);
+static bool dispatch(const char* message, const int length);
+static bool isType(const char* message, const int typeLength,
+                   const char* type);
+static bool handleBinary(const char* message, const int length);
 static bool setupGrid(const char* body);
+static bool setupScreen(const int gridRows, const int gridCols);
+static void sendView();
 static void showGrid(const char* body);
+static void flushGrid();
+static void showFrame(const char* frame, const int top, const int left);
+static void showPrediction();
+static void predictMove(char* frame, const int rows, const int cols,
+                       int* y, int* x, const char key);
+static void handleSeq(const int seq);
+static void showViewport(const char* body, const int length,
+                         const bool packed);
 static bool showGold(const char* body);
+static void showPurse(const int collected, const int purse,
+                      const int remaining);
 static void showQuit(const char* body);
 static bool handleAction();
+static bool handleTimeout(void* arg);
 
 /**************** plogf ****************/
 /*
@@ -85,13 +155,14 @@ static void plogf(const char* format, ...)
  */
 static void printStatus(const char* format, ...)
 {
-    clearStatus();
-    move(0, state->statusIndex);
+    char line[256];
     va_list argp;
     va_start(argp, format);
-    vw_printw(stdscr, format, argp);
-    plogf(format, argp);
+    vsnprintf(line, sizeof(line), format, argp);
     va_end(argp);
+    clearStatus();
+    mvaddstr(0, state->statusIndex, line);
+    plogf("%s", line);
     refresh();
 }
 
@@ -107,14 +178,18 @@ static void clearStatus()
  * Parse the command-line arguments, set up the TUI and server connection,
  * start the game, and run the game.
  */
+#ifndef BENCH
 int main(const int argc, char* argv[])
 {
     plogf("START OF LOG");
     char* hostname = NULL;
     char* port = NULL;
     char* playerName = NULL;
+    bool reliable = false;
+    bool predict = false;
 
-    if (!parseArgs(argc, argv, &hostname, &port, &playerName)) {
+    if (!parseArgs(argc, argv, &hostname, &port, &playerName, &reliable,
+                   &predict)) {
         return EXIT_FAILURE;
     }
     state = setup(hostname, port, playerName);
@@ -122,6 +197,8 @@ int main(const int argc, char* argv[])
         plogf("%s: can't form address from %s %s", argv[0], hostname, port);
         return EXIT_FAILURE;
     }
+    message_setReliable(reliable);
+    state->predict = predict && !state->isSpectator;
     bool gameStatus = game(playerName);
     /* clean up */
     message_done();
@@ -132,27 +209,62 @@ int main(const int argc, char* argv[])
     }
     mem_free(state->hostname);
     mem_free(state->port);
+    if (state->grid != NULL) {
+        mem_free(state->grid);
+    }
+    if (state->shown != NULL) {
+        mem_free(state->shown);
+    }
+    if (state->frame != NULL) {
+        plogf("predicted %ld keystrokes, %ld wrongly", state->predictions,
+              state->mispredictions);
+        mem_free(state->frame);
+        mem_free(state->predicted);
+        mem_free(state->terrain);
+    }
     mem_free(state);
     plogf("END OF LOG");
     return EXIT_SUCCESS;
 }
+#endif  // BENCH
 
 /**************** parseArgs ****************/
 /*
- * Parse and validate the command-line arguments.
+ * Parse and validate the command-line arguments; options may appear
+ * anywhere among the positional arguments.
  */
 static bool parseArgs(const int argc, char* argv[], char** hostname,
-                      char** port, char** playername)
+                      char** port, char** playername, bool* reliable,
+                      bool* predict)
 {
-    if (!(argc == 3 + 1 || argc == 2 + 1)) {
-        plogf("usage: too few (or too many) arguments %d", argc - 1);
-        plogf("usage: %s hostname port [yourname]", argv[0]);
+    char* positional[3] = {NULL, NULL, NULL};
+    int count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reliable") == 0) {
+            *reliable = true;
+        } else if (strcmp(argv[i], "--predict") == 0) {
+            *predict = true;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            plogf("usage: unknown option %s", argv[i]);
+            plogf("usage: %s [--reliable] [--predict] hostname port [yourname]",
+                  argv[0]);
+            return false;
+        } else if (count < 3) {
+            positional[count++] = argv[i];
+        } else {
+            count++;
+        }
+    }
+    if (!(count == 3 || count == 2)) {
+        plogf("usage: too few (or too many) arguments %d", count);
+        plogf("usage: %s [--reliable] [--predict] hostname port [yourname]",
+              argv[0]);
         return false;
     }
 
-    *hostname = argv[1];
-    *port = argv[2];
-    *playername = argv[3];
+    *hostname = positional[0];
+    *port = positional[1];
+    *playername = positional[2];
 
     return true;
 }
@@ -182,6 +294,21 @@ static gameState_t* setup(char* hostname, char* port, char* playername)
     state->isSpectator = playername == NULL;
     state->playerID = '\0';
     state->statusIndex = 0;
+    state->grid = NULL;
+    state->gridSize = 0;
+    state->binary = false;
+    state->gridRows = state->gridCols = 0;
+    state->viewRows = state->viewCols = 0;
+    state->viewTop = state->viewLeft = 0;
+    state->shown = NULL;
+    state->shownRows = state->shownCols = 0;
+    state->dirty = false;
+    state->lastRefresh = 0;
+    state->predict = false;
+    state->keySeq = state->ackedSeq = 0;
+    state->frame = state->predicted = state->terrain = NULL;
+    state->frameTop = state->frameLeft = 0;
+    state->predictions = state->mispredictions = 0;
     state->hostname =
         mem_malloc_assert(sizeof(char) * strlen(hostname) + 1, "hostname copy");
     strcpy(state->hostname, hostname);
@@ -205,13 +332,15 @@ static bool game(char* playerName)
 {
     //     (show 'connecting')
 
+    sendMsg("CAPS", "RLE1 BIN1");
     if (state->isSpectator) {
         sendMsg("SPECTATE", NULL);
     } else {
         sendMsg("PLAY", playerName);
     }
 
-    return message_loop(&state, 0, NULL, handleAction, handleEvent);
+    return message_loop(&state, flushSeconds, handleTimeout, handleAction,
+                        handleEvent);
 }
 
 /**************** sendMsg ****************/
@@ -241,45 +370,61 @@ static void sendMsg(char* type, char* body)
  */
 static bool handleEvent(void* arg, const addr_t server, const char* message)
 {
-    int typeLength = -1;
-    for (int i = 0; i < strlen(message); i++) {
-        if (message[i] == ' ' || message[i] == '\n') {
-            typeLength = i;
-            break;
-        }
+    return dispatch(message, message_length());
+}
+
+/**************** dispatch ****************/
+/*
+ * Handle a message of the given length, in place: its type is compared
+ * where it lies in the receive buffer, and its body is the rest of that
+ * buffer (which the message module terminates with a NUL), so nothing is
+ * copied and only the type is scanned, whatever the size of the map.
+ */
+static bool dispatch(const char* message, const int length)
+{
+    if (proto_isBinary(message, length)) {
+        return handleBinary(message, length);
     }
-    if (typeLength == -1) {
+
+    const int typeLength = strcspn(message, " \n");
+    if (typeLength >= length) {
         plogf("error: could not find space delimiter in message '%s'", message);
         return true;
     }
-    char* type = mem_malloc_assert(sizeof(char) * (typeLength + 1), "type");
-    char* body = mem_malloc_assert(
-        sizeof(char) * (strlen(message) - typeLength - 1 + 1), "body");
-    if (type == NULL || body == NULL) {
-        plogf("couldn't malloc type, body buffers");
-        return true;
-    }
-    strncpy(type, message, typeLength);
-    type[typeLength] = '\0';  // terminate the string
-    // include the null terminator here:
-    strncpy(body, message + typeLength + 1, strlen(message) - typeLength);
+    const char* body = message + typeLength + 1;
+    const int bodyLength = length - typeLength - 1;
 
     bool terminate = false;
 
-    if (strcmp(type, "DISPLAY") == 0) {
-        showGrid(body);
+    if (isType(message, typeLength, "DISPLAY")) {
+        showFrame(body, 0, 0);
+    } else if (isType(message, typeLength, "SEQ")) {
+        handleSeq(atoi(body));
+    } else if (isType(message, typeLength, "DISPLAYZ")) {
+        if (state->grid == NULL) {
+            plogf("warning: ignoring DISPLAYZ before GRID");
+        } else if (rle_decode(body, bodyLength, state->grid,
+                              state->gridSize) < 0) {
+            plogf("warning: ignoring malformed DISPLAYZ");
+        } else {
+            showFrame(state->grid, 0, 0);
+        }
+    } else if (isType(message, typeLength, "VIEWPORT")) {
+        showViewport(body, bodyLength, false);
+    } else if (isType(message, typeLength, "VIEWPORTZ")) {
+        showViewport(body, bodyLength, true);
     } else {
-        plogf("%s message received: %s", type, message);
-        if (strcmp(type, "QUIT") == 0) {
+        plogf("%.*s message received: %s", typeLength, message, message);
+        if (isType(message, typeLength, "QUIT")) {
             showQuit(body);
             terminate = true;
-        } else if (strcmp(type, "OK") == 0) {
+        } else if (isType(message, typeLength, "OK")) {
             if (!state->isSpectator && state->playerID == '\0') {
                 state->playerID = body[0];
             } else {
                 plogf("warning: ignoring unexpected OK");
             }
-        } else if (strcmp(type, "GRID") == 0) {
+        } else if (isType(message, typeLength, "GRID")) {
             if (!state->isSpectator && state->playerID == '\0') {
                 plogf("warning: ignoring unexpected GRID");
             } else {
@@ -287,7 +432,7 @@ static bool handleEvent(void* arg, const addr_t server, const char* message)
                     terminate = true;
                 }
             }
-        } else if (strcmp(type, "GOLD") == 0) {
+        } else if (isType(message, typeLength, "GOLD")) {
             if (!state->isSpectator && state->playerID == '\0') {
                 plogf("warning: ignoring unexpected GOLD");
             } else {
@@ -295,21 +440,122 @@ static bool handleEvent(void* arg, const addr_t server, const char* message)
                     terminate = true;
                 }
             }
-        } else if (strcmp(type, "ERROR") == 0) {
-            printStatus(body);
+        } else if (isType(message, typeLength, "ERROR")) {
+            printStatus("%s", body);
         }
     }
+    return terminate;
+}
+
+/**************** isType ****************/
+/*
+ * Is the message's type, its first typeLength characters, this one?
+ */
+static bool isType(const char* message, const int typeLength,
+                   const char* type)
+{
+    return strncmp(message, type, typeLength) == 0 &&
+           type[typeLength] == '\0';
+}
+
+/**************** handleBinary ****************/
+/*
+ * Handle a message from the server in the binary encoding (see proto.h),
+ * as handleEvent does its text equivalent.
+ */
+static bool handleBinary(const char* message, const int length)
+{
+    proto_msg_t msg;
+    if (!proto_decode(message, length, &msg)) {
+        plogf("warning: ignoring malformed binary message");
+        return false;
+    }
+    state->binary = true;
 
-    mem_free(type);
-    mem_free(body);
+    bool terminate = false;
+    char* text = NULL;  // QUIT or ERROR explanation, terminated
+    switch (msg.type) {
+        case PROTO_DISPLAY:
+        case PROTO_VIEWPORT:
+            if (msg.type == PROTO_VIEWPORT) {
+                state->viewTop = msg.top;
+                state->viewLeft = msg.left;
+            }
+            if (state->grid == NULL) {
+                plogf("warning: ignoring DISPLAY before GRID");
+            } else if (proto_unpackMap(&msg, state->grid, state->gridSize) <
+                       0) {
+                plogf("warning: ignoring malformed DISPLAY");
+            } else {
+                showFrame(state->grid, msg.top, msg.left);
+            }
+            break;
+        case PROTO_SEQ:
+            handleSeq(msg.seq);
+            break;
+        case PROTO_OK:
+            if (!state->isSpectator && state->playerID == '\0') {
+                state->playerID = msg.ch;
+            } else {
+                plogf("warning: ignoring unexpected OK");
+            }
+            break;
+        case PROTO_GRID:
+            if (!state->isSpectator && state->playerID == '\0') {
+                plogf("warning: ignoring unexpected GRID");
+            } else {
+                terminate = !setupScreen(msg.rows, msg.cols);
+            }
+            break;
+        case PROTO_GOLD:
+            if (!state->isSpectator && state->playerID == '\0') {
+                plogf("warning: ignoring unexpected GOLD");
+            } else {
+                showPurse(msg.n, msg.p, msg.r);
+            }
+            break;
+        case PROTO_QUIT:
+        case PROTO_ERROR:
+            text = mem_malloc_assert(msg.textLength + 1, "text");
+            memcpy(text, msg.text, msg.textLength);
+            text[msg.textLength] = '\0';
+            plogf("%s message received: %s",
+                  msg.type == PROTO_QUIT ? "QUIT" : "ERROR", text);
+            if (msg.type == PROTO_QUIT) {
+                showQuit(text);
+                terminate = true;
+            } else {
+                printStatus("%s", text);
+            }
+            mem_free(text);
+            break;
+        default:
+            plogf("warning: ignoring binary message of type %d", msg.type);
+            break;
+    }
     return terminate;
 }
 
 /**************** setupGrid ****************/
 /*
- * Ensure that the client's screen is the correct size.
+ * Ensure that the client's screen is the correct size for a GRID body.
  */
 static bool setupGrid(const char* body)
+{
+    int gridRows = 0;
+    int gridCols = 0;
+    if (sscanf(body, "%d %d", &gridRows, &gridCols) != 2) {
+        plogf("error: couldn't parse GRID body: %s", body);
+        return false;
+    }
+    return setupScreen(gridRows, gridCols);
+}
+
+/**************** setupScreen ****************/
+/*
+ * Ensure that the client's screen is the correct size for the grid.
+ */
+static bool setupScreen(const int gridRows, const int gridCols)
 {
     initscr();      // initialize the screen
     cbreak();       // accept keystrokes immediately
@@ -319,55 +565,309 @@ static bool setupGrid(const char* body)
     init_pair(2, COLOR_BLACK, COLOR_YELLOW);
     attron(COLOR_PAIR(1));  // set the screen color using color 1
 
-    int gridRows = 0;
-    int gridCols = 0;
     int currRows = getmaxy(stdscr);
     int currCols = getmaxx(stdscr);
-    if (sscanf(body, "%d %d", &gridRows, &gridCols) != 2) {
-        plogf("error: couldn't parse GRID body: %s", body);
-        return false;
+    // room for a DISPLAYZ map: every row, with its newline
+    if (state->grid != NULL) {
+        mem_free(state->grid);
     }
+    state->gridSize = gridRows * (gridCols + 1) + 1;
+    state->grid = mem_malloc_assert(state->gridSize, "grid");
+    state->gridRows = gridRows;
+    state->gridCols = gridCols;
+    state->dirty = false;
+#ifdef USE_COMPAT
     while (currRows < gridRows + 1 || currCols < gridCols) {
         clear();
-#ifdef USE_COMPAT
         mvprintw(0, 0,
                  "Your window must be at least %d high\n"
                  "Your window must be at least %d wide\n"
                  "Resize your window, and press Enter to continue.",
                  gridRows, gridCols);
-#else
-        mvprintw(0, 0,
-                 "Window is:\n"
-                 "%2d/%2d chars tall %s\n"
-                 "%2d/%2d chars wide %s\n"
-                 "resize to continue.",
-                 currRows, gridRows + 1,
-                 currRows < gridRows + 1 ? "(make it taller!)" : "", currCols,
-                 gridCols, currCols < gridCols ? "(make it wider!)" : "");
-#endif
         refresh();
         const int returnKey = 10;
-        for (int c = getch(); c != returnKey
-#ifndef USE_COMPAT
-                              && c != KEY_RESIZE
-#endif
-             ;
-             c = getch()) {
+        for (int c = getch(); c != returnKey; c = getch()) {
         }
         currRows = getmaxy(stdscr);
         currCols = getmaxx(stdscr);
     }
+#else
+    // a window too small for the map gets a viewport of it instead
+    state->viewRows = state->viewCols = 0;
+    if (currRows < gridRows + 1 || currCols < gridCols) {
+        state->viewRows = currRows - 1 < gridRows ? currRows - 1 : gridRows;
+        state->viewCols = currCols < gridCols ? currCols : gridCols;
+        if (state->viewRows < 1) {
+            state->viewRows = 1;
+        }
+        sendView();
+    }
+#endif
+    // what's on screen below the status line: blanks, so far
+    clear();
+    if (state->shown != NULL) {
+        mem_free(state->shown);
+    }
+    state->shownRows = currRows - 1 > 0 ? currRows - 1 : 0;
+    state->shownCols = currCols;
+    state->shown = mem_malloc_assert(state->shownRows * state->shownCols + 1,
+                                     "shown");
+    memset(state->shown, ' ', state->shownRows * state->shownCols);
+
+    if (state->predict) {
+        if (state->frame != NULL) {
+            mem_free(state->frame);
+            mem_free(state->predicted);
+            mem_free(state->terrain);
+        }
+        state->frame = mem_malloc_assert(state->gridSize, "frame");
+        state->predicted = mem_malloc_assert(state->gridSize, "predicted");
+        state->terrain = mem_malloc_assert(gridRows * gridCols, "terrain");
+        state->frame[0] = '\0';
+        memset(state->terrain, 0, gridRows * gridCols);
+    }
     return true;
 }
 
+/**************** sendView ****************/
+/*
+ * Ask the server for DISPLAYs of just our viewport (for a spectator, at
+ * the corner it has panned to).
+ */
+static void sendView()
+{
+    char body[64];
+    if (state->isSpectator) {
+        snprintf(body, sizeof(body), "%d %d %d %d", state->viewRows,
+                 state->viewCols, state->viewTop, state->viewLeft);
+    } else {
+        snprintf(body, sizeof(body), "%d %d", state->viewRows,
+                 state->viewCols);
+    }
+    sendMsg("VIEW", body);
+}
+
 /**************** showGrid ****************/
 /*
- * Show the game grid as sent by the server.
+ * Show the game grid as sent by the server, as much of it as fits.
+ * Only the span of each line that differs from what is on screen is
+ * drawn, and the screen is refreshed only if no other message is waiting
+ * (or a frame's time has passed), so a burst of DISPLAYs costs one update.
  */
 static void showGrid(const char* body)
 {
-    mvprintw(1, 0, body);
-    refresh();
+    if (state->shown == NULL) {
+        return;  // no GRID yet
+    }
+    const char* line = body;
+    for (int y = 0; y < state->shownRows && *line != '\0'; y++) {
+        int length = strcspn(line, "\n");
+        if (length > state->shownCols) {
+            length = state->shownCols;
+        }
+        char* shown = state->shown + y * state->shownCols;
+        int first = 0, last = length - 1;
+        while (first < length && line[first] == shown[first]) {
+            first++;
+        }
+        while (last > first && line[last] == shown[last]) {
+            last--;
+        }
+        if (first < length) {
+            mvaddnstr(1 + y, first, line + first, last - first + 1);
+            memcpy(shown + first, line + first, last - first + 1);
+            state->dirty = true;
+        }
+        line += strcspn(line, "\n");
+        if (*line == '\n') {
+            line++;
+        }
+    }
+    if (!message_pending() ||
+        message_now() - state->lastRefresh >= frameNanos) {
+        flushGrid();
+    }
+}
+
+/**************** flushGrid ****************/
+/*
+ * Refresh the screen, if the map has been drawn since it last was.
+ */
+static void flushGrid()
+{
+    if (state->dirty) {
+        refresh();
+        state->dirty = false;
+        state->lastRefresh = message_now();
+    }
+}
+
+/**************** showFrame ****************/
+/*
+ * Show a frame from the server: a DISPLAY, or a VIEWPORT whose corner is
+ * at (top, left) in the map.  With prediction, remember it, and the
+ * floor it shows, and show it with the moves of any keystrokes the server
+ * has yet to acknowledge applied.
+ */
+static void showFrame(const char* frame, const int top, const int left)
+{
+    if (state->frame == NULL) {
+        showGrid(frame);  // not predicting
+        return;
+    }
+    const int length = strlen(frame);
+    if (length >= state->gridSize) {
+        showGrid(frame);
+        return;
+    }
+    memcpy(state->frame, frame, length + 1);
+    state->frameTop = top;
+    state->frameLeft = left;
+
+    const int cols = strcspn(frame, "\n");
+    for (int i = 0; i < length; i++) {
+        if (frame[i] == '.' || frame[i] == '#') {
+            int y = top + i / (cols + 1), x = left + i % (cols + 1);
+            if (y < state->gridRows && x < state->gridCols) {
+                state->terrain[y * state->gridCols + x] = frame[i];
+            }
+        }
+    }
+    showPrediction();
+}
+
+/**************** showPrediction ****************/
+/*
+ * Show the server's latest frame with the moves of every keystroke it has
+ * yet to acknowledge applied, noting where each one leaves '@'.
+ */
+static void showPrediction()
+{
+    if (state->frame == NULL || state->frame[0] == '\0') {
+        return;  // nothing to predict from, yet
+    }
+    strcpy(state->predicted, state->frame);
+    const int cols = strcspn(state->predicted, "\n");
+    const int rows = strlen(state->predicted) / (cols + 1);
+    const char* at = strchr(state->predicted, '@');
+    if (at != NULL) {
+        int y = (at - state->predicted) / (cols + 1);
+        int x = (at - state->predicted) % (cols + 1);
+        int first = state->ackedSeq + 1;
+        if (first <= state->keySeq - MAX_PENDING) {
+            first = state->keySeq - MAX_PENDING + 1;  // forgotten; skip
+        }
+        for (int seq = first; seq <= state->keySeq; seq++) {
+            predictMove(state->predicted, rows, cols, &y, &x,
+                        state->pending[seq % MAX_PENDING]);
+            state->predictedY[seq % MAX_PENDING] = state->frameTop + y;
+            state->predictedX[seq % MAX_PENDING] = state->frameLeft + x;
+        }
+    }
+    showGrid(state->predicted);
+}
+
+/**************** predictMove ****************/
+/*
+ * Move '@' at (y, x) in a frame of rows lines of cols characters as the
+ * server would for this keystroke: onto floor, passage or gold, but not
+ * into walls, other players or the unknown; a capital repeats the move
+ * until blocked.  The cell left behind shows the floor last seen there.
+ */
+static void predictMove(char* frame, const int rows, const int cols,
+                        int* y, int* x, const char key)
+{
+    int dy = 0, dx = 0;
+    switch (tolower(key)) {
+        case 'h': dx = -1; break;
+        case 'l': dx = 1; break;
+        case 'k': dy = -1; break;
+        case 'j': dy = 1; break;
+        case 'y': dy = -1; dx = -1; break;
+        case 'u': dy = -1; dx = 1; break;
+        case 'b': dy = 1; dx = -1; break;
+        case 'n': dy = 1; dx = 1; break;
+        default: return;  // not a move
+    }
+    do {
+        const int ny = *y + dy, nx = *x + dx;
+        if (ny < 0 || ny >= rows || nx < 0 || nx >= cols) {
+            return;
+        }
+        char* to = frame + ny * (cols + 1) + nx;
+        if (*to != '.' && *to != '#' && *to != '*') {
+            return;
+        }
+        const int my = state->frameTop + *y, mx = state->frameLeft + *x;
+        char floor = '\0';
+        if (my < state->gridRows && mx < state->gridCols) {
+            floor = state->terrain[my * state->gridCols + mx];
+        }
+        frame[*y * (cols + 1) + *x] = floor != '\0' ? floor : '.';
+        *to = '@';
+        *y = ny;
+        *x = nx;
+    } while (isupper(key));
+}
+
+/**************** handleSeq ****************/
+/*
+ * The server has begun replying to our keystroke seq, so every frame from
+ * now on reflects it.  By now the frames for the keystroke acknowledged
+ * before it have all arrived: if they didn't put '@' where we predicted,
+ * count a misprediction.  Then show the latest frame with the keystrokes
+ * still unacknowledged applied.
+ */
+static void handleSeq(const int seq)
+{
+    if (state->frame == NULL || seq <= state->ackedSeq || seq > state->keySeq) {
+        return;  // not predicting, or stale
+    }
+    const int last = state->ackedSeq;
+    const char* at = strchr(state->frame, '@');
+    if (last > 0 && last > state->keySeq - MAX_PENDING && at != NULL) {
+        const int cols = strcspn(state->frame, "\n");
+        const int y = state->frameTop + (at - state->frame) / (cols + 1);
+        const int x = state->frameLeft + (at - state->frame) % (cols + 1);
+        if (y != state->predictedY[last % MAX_PENDING] ||
+            x != state->predictedX[last % MAX_PENDING]) {
+            state->mispredictions++;
+            plogf("mispredicted key %d ('%c'): at %d,%d, not %d,%d", last,
+                  state->pending[last % MAX_PENDING], y, x,
+                  state->predictedY[last % MAX_PENDING],
+                  state->predictedX[last % MAX_PENDING]);
+        }
+    }
+    state->ackedSeq = seq;
+    showPrediction();
+}
+
+/**************** showViewport ****************/
+/*
+ * Show a VIEWPORT (or, if packed, a VIEWPORTZ) body of the given length:
+ * its corner and size, then the rectangle of the map.
+ */
+static void showViewport(const char* body, const int length,
+                         const bool packed)
+{
+    int top, left, rows, cols, header = 0;
+    if (sscanf(body, "%d %d %d %d\n%n", &top, &left, &rows, &cols,
+               &header) != 4 || header == 0) {
+        plogf("warning: ignoring malformed VIEWPORT");
+        return;
+    }
+    state->viewTop = top;
+    state->viewLeft = left;
+    if (!packed) {
+        showFrame(body + header, top, left);
+    } else if (state->grid == NULL) {
+        plogf("warning: ignoring VIEWPORTZ before GRID");
+    } else if (rle_decode(body + header, length - header, state->grid,
+                          state->gridSize) < 0) {
+        plogf("warning: ignoring malformed VIEWPORTZ");
+    } else {
+        showFrame(state->grid, top, left);
+    }
 }
 
 /**************** showGold ****************/
@@ -383,6 +883,17 @@ static bool showGold(const char* body)
         plogf("error: couldn't parse GOLD body: %s", body);
         return false;
     }
+    showPurse(collected, purse, remaining);
+    return true;
+}
+
+/**************** showPurse ****************/
+/*
+ * Show the player's gold, as parsed from GOLD.
+ */
+static void showPurse(const int collected, const int purse,
+                      const int remaining)
+{
     if (state->isSpectator) {
         mvprintw(0, 0, "Spectator: %d nuggets unclaimed.  ", remaining);
     } else {
@@ -403,7 +914,6 @@ static bool showGold(const char* body)
     // (move to status)
     // (print state.player has purse of remaining)
     // (if collected > 0 print collected)
-    return true;
 }
 
 /**************** showQuit ****************/
@@ -417,6 +927,17 @@ static void showQuit(const char* body)
     printf("\n");
 }
 
+/**************** handleTimeout ****************/
+/*
+ * A moment has passed with no message; show any map left undrawn by the
+ * last burst.
+ */
+static bool handleTimeout(void* arg)
+{
+    flushGrid();
+    return false;
+}
+
 /**************** handleAction ****************/
 /*
  * Handle client input - a keypress.
@@ -440,7 +961,29 @@ static bool handleAction(void* arg)
     }
 
     if (state->isSpectator && key != 'Q') {
-        printStatus("usage: unknown spectator keystroke");
+        // pan the viewport, by one cell or (capitals) a screenful
+        int dy = 0, dx = 0;
+        switch (key) {
+            case 'h': dx = -1; break;
+            case 'l': dx = 1; break;
+            case 'k': dy = -1; break;
+            case 'j': dy = 1; break;
+            case 'H': dx = -state->viewCols; break;
+            case 'L': dx = state->viewCols; break;
+            case 'K': dy = -state->viewRows; break;
+            case 'J': dy = state->viewRows; break;
+        }
+        if (state->viewRows == 0 || (dy == 0 && dx == 0)) {
+            printStatus("usage: unknown spectator keystroke");
+        } else {
+            int top = state->viewTop + dy;
+            int left = state->viewLeft + dx;
+            int maxTop = state->gridRows - state->viewRows;
+            int maxLeft = state->gridCols - state->viewCols;
+            state->viewTop = top < 0 ? 0 : top > maxTop ? maxTop : top;
+            state->viewLeft = left < 0 ? 0 : left > maxLeft ? maxLeft : left;
+            sendView();
+        }
     } else {
         switch (key) {
             case 'Q':
@@ -462,7 +1005,29 @@ static bool handleAction(void* arg)
             case 'Y':
             case 'U':
 #endif
-                sendMsg("KEY", buf);
+                if (state->predict) {
+                    // number it, and show its move before the server does
+                    int seq = ++state->keySeq;
+                    state->pending[seq % MAX_PENDING] = key;
+                    state->predictions++;
+                    showPrediction();
+                }
+                if (state->binary) {
+                    char packed[PROTO_MAX_FIXED];
+                    proto_msg_t msg = {.type = PROTO_KEY, .ch = key,
+                                       .seq = state->predict ? state->keySeq
+                                                             : 0};
+                    message_sendBytes(state->server, packed,
+                                      proto_encode(&msg, packed,
+                                                   sizeof(packed)));
+                } else if (state->predict) {
+                    char body[32];
+                    snprintf(body, sizeof(body), "%c %d", key,
+                             state->keySeq);
+                    sendMsg("KEY", body);
+                } else {
+                    sendMsg("KEY", buf);
+                }
                 break;
             default:
                 printStatus("usage: unknown keystroke");
@@ -475,4 +1040,169 @@ static bool handleAction(void* arg)
     // let key = (get key)
     // if state.playerID == NULL return true
     // if (key is of accepted keys) send(state, { KEY, key })
-}
\ No newline at end of file
+}
+/* ****************************************************************** */
+/* *************************** BENCH ******************************** */
+/*
+ * An offline benchmark of the client's message handling: replay server
+ * traffic captured by loadgen (see --capture in support/loadgen.c)
+ * through dispatch, exactly as handleEvent would, drawing with curses to
+ * /dev/null, and report the time per message.  The capture's first OK
+ * and GRID set up the screen (as big as the map); every other message but
+ * QUIT (and any fragment of a message too long for one datagram) is then
+ * replayed, over and over.
+ *
+ * Compile with -DBENCH (see the client-bench target in the Makefile):
+ *   ./client-bench [--passes=N] capture ...
+ */
+
+#ifdef BENCH
+
+#include <unistd.h>
+
+static bool benchCapture(const char* path, int passes, FILE* out);
+
+int main(const int argc, char* argv[])
+{
+    int passes = 100;
+    int numCaptures = 0;
+
+    // curses draws to stdout, and the client logs to stderr; keep the
+    // report apart from both
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL ||
+        freopen("/dev/null", "w", stderr) == NULL) {
+        perror("client-bench");
+        return EXIT_FAILURE;
+    }
+    setenv("TERM", "xterm", 0);
+
+    for (int i = 1; i < argc; i++) {
+        if (sscanf(argv[i], "--passes=%d", &passes) == 1 && passes > 0) {
+            continue;
+        }
+        if (strncmp(argv[i], "--", strlen("--")) == 0 || numCaptures > 0) {
+            fprintf(out, "usage: %s [--passes=N] capture\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        numCaptures++;
+        if (!benchCapture(argv[i], passes, out)) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (numCaptures == 0) {
+        fprintf(out, "usage: %s [--passes=N] capture\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    fclose(out);
+    return EXIT_SUCCESS;
+}
+
+/**************** benchCapture ****************/
+/*
+ * Run and report the benchmark for one capture file.
+ */
+static bool benchCapture(const char* path, int passes, FILE* out)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(out, "%s: can't read\n", path);
+        return false;
+    }
+
+    // read every datagram, each followed by a NUL as message_loop does
+    int count = 0, max = 0;
+    char** messages = NULL;
+    int* lengths = NULL;
+    int length;
+    while (fscanf(fp, "%d", &length) == 1 && fgetc(fp) == '\n' &&
+           length >= 0) {
+        if (count == max) {
+            max = max == 0 ? 1024 : 2 * max;
+            messages = mem_assert(realloc(messages, max * sizeof(char*)),
+                                  "messages");
+            lengths = mem_assert(realloc(lengths, max * sizeof(int)),
+                                 "lengths");
+        }
+        messages[count] = mem_malloc_assert(length + 1, "message");
+        if (fread(messages[count], 1, length, fp) != length) {
+            mem_free(messages[count]);
+            break;  // truncated capture; drop the last
+        }
+        messages[count][length] = '\0';
+        lengths[count++] = length;
+    }
+    fclose(fp);
+
+    // join, as the capturing player did, with a screen the size of the map;
+    // nothing is sent to the (nonexistent) server
+    state = setup("localhost", "9999", "bench");
+    if (state == NULL) {
+        return false;
+    }
+    bool joined = false, sized = false;
+    for (int i = 0; i < count && !(joined && sized); i++) {
+        int rows, cols;
+        if (!joined && strncmp(messages[i], "OK ", 3) == 0) {
+            joined = !dispatch(messages[i], lengths[i]);
+        } else if (!sized && joined &&
+                   sscanf(messages[i], "GRID %d %d", &rows, &cols) == 2) {
+            char value[16];
+            snprintf(value, sizeof(value), "%d", rows + 1);
+            setenv("LINES", value, 1);
+            snprintf(value, sizeof(value), "%d", cols);
+            setenv("COLUMNS", value, 1);
+            sized = !dispatch(messages[i], lengths[i]);
+        }
+    }
+    if (!joined || !sized) {
+        fprintf(out, "%s: no OK and GRID to join with\n", path);
+        return false;
+    }
+
+    long handled = 0, displays = 0;
+    uint64_t bytes = 0;
+    uint64_t start = message_now();
+    for (int pass = 0; pass < passes; pass++) {
+        for (int i = 0; i < count; i++) {
+            const char* message = messages[i];
+            if (strncmp(message, "OK ", 3) == 0 ||
+                strncmp(message, "GRID ", 5) == 0 ||
+                strncmp(message, "QUIT ", 5) == 0 ||
+                strncmp(message, "FRAG ", 5) == 0) {
+                continue;
+            }
+            dispatch(message, lengths[i]);
+            handled++;
+            bytes += lengths[i];
+            if (strncmp(message, "DISPLAY", strlen("DISPLAY")) == 0 ||
+                strncmp(message, "VIEWPORT", strlen("VIEWPORT")) == 0) {
+                displays++;
+            }
+        }
+    }
+    double seconds = (message_now() - start) / 1e9;
+    endwin();
+
+    fprintf(out,
+            "%s: %d messages x %d passes: %ld handled "
+            "(%ld DISPLAY), %.0f bytes each; %.2f us/message, %.0f MB/s\n",
+            path, count, passes, handled, displays,
+            handled > 0 ? (double)bytes / handled : 0.0,
+            handled > 0 ? seconds * 1e6 / handled : 0.0, bytes / seconds / 1e6);
+
+    for (int i = 0; i < count; i++) {
+        mem_free(messages[i]);
+    }
+    free(messages);
+    free(lengths);
+    message_done();
+    mem_free(state->hostname);
+    mem_free(state->port);
+    mem_free(state->grid);
+    mem_free(state->shown);
+    mem_free(state);
+    return true;
+}
+
+#endif  // BENCH
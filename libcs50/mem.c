@@ -8,13 +8,36 @@
  * 2. Variants that 'assert' the result is non-NULL;
  *    if NULL occurs, kick out an error and die.
  *
+ * 3. Arenas: a list of blocks, newest first; small allocations are
+ *    carved off the front of the newest block, and a large allocation
+ *    gets a block of its own, linked in behind the newest one so that
+ *    the space left in the newest block is not wasted.
+ *
  * David Kotz, April 2016, 2017, 2019, 2021
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include "mem.h"
 
+/**************** file-local types ****************/
+typedef struct arenaBlock {
+  struct arenaBlock* next;      // older block, or NULL
+  size_t size;                  // bytes of data
+  size_t used;                  // bytes of data handed out
+  max_align_t data[];           // the space itself, aligned for any type
+} arenaBlock_t;
+
+struct mem_arena {
+  arenaBlock_t* head;           // newest block, or NULL
+  size_t blockSize;             // default size of a new block
+  size_t used;                  // bytes handed out, in all blocks
+};
+
+static arenaBlock_t* arenaBlock_new(const size_t size);
+
 /**************** file-local global variables ****************/
 // track malloc and free across *all* calls within this program.
 static int nmalloc = 0;         // number of successful malloc calls
@@ -125,3 +148,153 @@ mem_net(void)
 {
   return nmalloc - nfree - nfreenull;
 }
+
+/**************** mem_arena_new() ****************/
+/* see mem.h for description */
+mem_arena_t*
+mem_arena_new(const size_t blockSize)
+{
+  mem_arena_t* arena = mem_malloc(sizeof(mem_arena_t));
+  if (arena != NULL) {
+    arena->head = NULL;   // the first block is obtained on first use
+    arena->blockSize = blockSize > 0 ? blockSize : 1;
+    arena->used = 0;
+  }
+  return arena;
+}
+
+/**************** mem_arena_alloc() ****************/
+/* see mem.h for description */
+void*
+mem_arena_alloc(mem_arena_t* arena, const size_t size)
+{
+  if (arena == NULL) {
+    return NULL;
+  }
+  // round up, so the next allocation is aligned too
+  const size_t align = sizeof(max_align_t);
+  const size_t rounded = (size + align - 1) / align * align;
+  if (rounded < size) {
+    return NULL;        // overflow
+  }
+
+  arenaBlock_t* block = arena->head;
+  if (block == NULL || block->size - block->used < rounded) {
+    if (rounded > arena->blockSize && block != NULL) {
+      // large: a block of its own, behind the newest
+      arenaBlock_t* large = arenaBlock_new(rounded);
+      if (large == NULL) {
+        return NULL;
+      }
+      large->next = block->next;
+      block->next = large;
+      block = large;
+    } else {
+      // start a new newest block
+      block = arenaBlock_new(rounded > arena->blockSize ?
+                             rounded : arena->blockSize);
+      if (block == NULL) {
+        return NULL;
+      }
+      block->next = arena->head;
+      arena->head = block;
+    }
+  }
+
+  void* ptr = (char*)block->data + block->used;
+  block->used += rounded;
+  arena->used += rounded;
+  return ptr;
+}
+
+/**************** mem_arena_alloc_assert() ****************/
+/* see mem.h for description */
+void*
+mem_arena_alloc_assert(mem_arena_t* arena, const size_t size,
+                       const char* message)
+{
+  void* ptr = mem_arena_alloc(arena, size);
+  if (ptr == NULL) {
+    fprintf(stderr, "Out of memory: %s\n", message);
+    exit (99);
+  }
+  return ptr;
+}
+
+/**************** mem_arena_calloc_assert() ****************/
+/* see mem.h for description */
+void*
+mem_arena_calloc_assert(mem_arena_t* arena, const size_t nmemb,
+                        const size_t size, const char* message)
+{
+  if (size != 0 && nmemb > (size_t)-1 / size) {
+    fprintf(stderr, "Out of memory: %s\n", message);
+    exit (99);
+  }
+  void* ptr = mem_arena_alloc_assert(arena, nmemb * size, message);
+  memset(ptr, 0, nmemb * size);
+  return ptr;
+}
+
+/**************** mem_arena_reset() ****************/
+/* see mem.h for description */
+void
+mem_arena_reset(mem_arena_t* arena)
+{
+  if (arena == NULL || arena->head == NULL) {
+    return;
+  }
+  if (arena->head->next == NULL) {
+    arena->head->used = 0;      // the usual case: nothing to free
+  } else {
+    // replace all the blocks with one that would have held everything
+    size_t size = arena->used > arena->blockSize ?
+      arena->used : arena->blockSize;
+    while (arena->head != NULL) {
+      arenaBlock_t* next = arena->head->next;
+      mem_free(arena->head);
+      arena->head = next;
+    }
+    arena->head = arenaBlock_new(size);   // if NULL, retried on next use
+  }
+  arena->used = 0;
+}
+
+/**************** mem_arena_used() ****************/
+/* see mem.h for description */
+size_t
+mem_arena_used(const mem_arena_t* arena)
+{
+  return arena == NULL ? 0 : arena->used;
+}
+
+/**************** mem_arena_delete() ****************/
+/* see mem.h for description */
+void
+mem_arena_delete(mem_arena_t* arena)
+{
+  if (arena != NULL) {
+    while (arena->head != NULL) {
+      arenaBlock_t* next = arena->head->next;
+      mem_free(arena->head);
+      arena->head = next;
+    }
+    mem_free(arena);
+  }
+}
+
+/**************** arenaBlock_new() ****************/
+/* Allocate an empty arena block with the given number of bytes of data;
+ * return NULL on out-of-memory.
+ */
+static arenaBlock_t*
+arenaBlock_new(const size_t size)
+{
+  arenaBlock_t* block = mem_malloc(sizeof(arenaBlock_t) + size);
+  if (block != NULL) {
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+  }
+  return block;
+}
@@ -14,6 +14,11 @@
  *    that needs to defensively check function parameters that
  *    "should never be NULL".
  *
+ * 4. Arenas (regions): many small allocations carved out of a few large
+ *    blocks, all released at once by mem_arena_reset or mem_arena_delete,
+ *    for data that share one lifetime.  Arena blocks are obtained with
+ *    mem_malloc, so they are counted like any other allocation.
+ *
  * David Kotz, April 2016, 2017, 2019, 2021
  */
 
@@ -113,4 +118,64 @@ void mem_report(FILE* fp, const char* message);
  */
 int mem_net(void);
 
+/**************** mem_arena_t ****************/
+/* An arena is opaque to its users; see mem_arena_new.
+ */
+typedef struct mem_arena mem_arena_t;
+
+/**************** mem_arena_new() ****************/
+/* Create an empty arena.
+ * Caller provides:
+ *   the size of each block the arena obtains from mem_malloc;
+ *   allocations larger than that get a block of their own.
+ * We return:
+ *   pointer to the new arena, or NULL on out-of-memory.
+ * Caller is responsible for:
+ *   later calling mem_arena_delete.
+ */
+mem_arena_t* mem_arena_new(const size_t blockSize);
+
+/**************** mem_arena_alloc() ****************/
+/* Like mem_malloc(), but the space comes from the arena, and is
+ * aligned for any type.  The space must not be passed to mem_free();
+ * it remains valid until the arena is reset or deleted.
+ * We return:
+ *   pointer to allocated space, or NULL if failure.
+ */
+void* mem_arena_alloc(mem_arena_t* arena, const size_t size);
+
+/**************** mem_arena_alloc_assert() ****************/
+/* Like mem_arena_alloc() but, if response is NULL, print error and die.
+ * We assume:
+ *   caller provides a message string suitable for printf.
+ */
+void* mem_arena_alloc_assert(mem_arena_t* arena, const size_t size,
+                             const char* message);
+
+/**************** mem_arena_calloc_assert() ****************/
+/* Like mem_arena_alloc_assert() but the space is zeroed, as in calloc().
+ */
+void* mem_arena_calloc_assert(mem_arena_t* arena, const size_t nmemb,
+                              const size_t size, const char* message);
+
+/**************** mem_arena_reset() ****************/
+/* Release everything allocated from the arena, all at once.
+ * The arena keeps (at most) one block, grown if need be to hold
+ * everything that was in use, so that an arena reset after each of
+ * many similar tasks soon stops calling mem_malloc at all.
+ */
+void mem_arena_reset(mem_arena_t* arena);
+
+/**************** mem_arena_used() ****************/
+/* Return the number of bytes allocated from the arena since it was
+ * created or last reset, including alignment padding.
+ */
+size_t mem_arena_used(const mem_arena_t* arena);
+
+/**************** mem_arena_delete() ****************/
+/* Release everything allocated from the arena, and the arena itself.
+ * NULL is ignored.
+ */
+void mem_arena_delete(mem_arena_t* arena);
+
 #endif // __MEM_H
@@ -0,0 +1,349 @@
+/*
+ * ┌───────────────────────┐
+ * │ ┌┐┌┬ ┬┌─┐┌─┐┌─┐┌┬┐┌─┐ │
+ * │ ││││ ││ ┬│ ┬├┤  │ └─┐ │
+ * │ ┘└┘└─┘└─┘└─┘└─┘ ┴ └─┘ │
+ * └───────────────────────┘
+ *    CS50 nuggets relay
+ *
+ * The relay lets many spectators watch one game without adding to the
+ * server's load.  It joins the server as one of its spectators, then acts
+ * as a server to any number of spectator clients: each GOLD and DISPLAY
+ * the server sends it is sent on to every one of them, with a single
+ * message_sendMany, which splits a long frame into fragments once and
+ * hands the datagrams to the kernel in batches.  A spectator that joins
+ * late is sent the latest GRID, GOLD and DISPLAY at once, so it need not
+ * wait for the next move to see the game.  Relays may be chained: a
+ * relay's address serves as a server's to a client or another relay.
+ *
+ * Palmer's Scholars, March 2022
+ *
+ * Usage: ./relay hostname port [--max=N] [--log-level=LEVEL] [--log-async]
+ *   hostname port   the server's (or another relay's) address
+ *   --max=N         serve at most N spectators (default 1000)
+ *   --log-level=error|info|debug
+ *                   log only errors; or also events, message addresses
+ *                   and lengths (the default); or also full message bodies
+ *   --log-async     do logging I/O on a background thread
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "mem.h"
+#include "message.h"
+
+/**************** global types ****************/
+
+/* The latest of one type of message from the server, for late joiners */
+typedef struct keyframe {
+    char* message;  // NULL until the first arrives
+    int length;
+    int size;       // bytes allocated to message
+} keyframe_t;
+
+/* Everything the relay knows */
+typedef struct relayState {
+    addr_t server;        // where the game is
+    addr_t* watchers;     // the spectators we relay to
+    int numWatchers;
+    int maxWatchers;      // the limit, from --max
+    keyframe_t grid, gold, display;  // the latest of each from the server
+    long relayed;         // messages relayed to all watchers
+    long sent;            // ... and the copies sent
+    int mostWatchers;     // the most watchers at once
+    int logLevel;         // from --log-level
+    bool logAsync;        // from --log-async
+} relayState_t;
+
+/**************** global constants ****************/
+static const int defaultMaxWatchers = 1000;
+static const float retrySeconds = 1.0;  // resend SPECTATE until answered
+
+/**************** function prototypes ****************/
+static bool parseArgs(const int argc, char* argv[], relayState_t* relay);
+static bool parseLogLevel(const char* value, int* level);
+static bool handleMessage(void* arg, const addr_t from, const char* message);
+static bool handleServer(relayState_t* relay, const char* message,
+                         const int length);
+static void handleWatcher(relayState_t* relay, const addr_t from,
+                          const char* message);
+static bool handleTimeout(void* arg);
+static void relayToAll(relayState_t* relay, const char* message,
+                       const int length);
+static void sendKeyframes(relayState_t* relay, const addr_t to);
+static void keep(keyframe_t* frame, const char* message, const int length);
+static int findWatcher(relayState_t* relay, const addr_t addr);
+static void dropWatcher(relayState_t* relay, const int i);
+static bool isType(const char* message, const char* type);
+
+/**************** main ****************/
+/*
+ * Parse the arguments, join the server as a spectator, and relay its
+ * messages until it sends QUIT.
+ */
+int main(const int argc, char* argv[])
+{
+    relayState_t relay = {.maxWatchers = defaultMaxWatchers,
+                          .logLevel = LOG_INFO};
+    log_init(stderr);
+    if (!parseArgs(argc, argv, &relay)) {
+        fprintf(stderr, "usage: %s hostname port [--max=N] "
+                "[--log-level=error|info|debug] [--log-async]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    log_setLevel(relay.logLevel);
+    if (relay.logAsync && !log_startAsync()) {
+        log_v("relay: could not start async logging; logging synchronously");
+    }
+    int port = message_init(stderr);
+    if (port == 0) {
+        log_stopAsync();
+        return EXIT_FAILURE;
+    }
+    relay.watchers = mem_malloc_assert(relay.maxWatchers * sizeof(addr_t),
+                                       "Watchers could not be allocated.");
+
+    printf("Relaying on port %d for spectators...\n", port);
+    fflush(stdout);  // in case stdout is a pipe
+    message_send(relay.server, "SPECTATE");
+    bool ok = message_loop(&relay, retrySeconds, handleTimeout, NULL,
+                           handleMessage);
+
+    char summary[100];
+    snprintf(summary, sizeof(summary), "%ld messages, in %ld copies",
+             relay.relayed, relay.sent);
+    log_s("relay: relayed %s", summary);
+    log_d("relay: to at most %d spectators at once", relay.mostWatchers);
+    message_done();
+    mem_free(relay.watchers);
+    free(relay.grid.message);
+    free(relay.gold.message);
+    free(relay.display.message);
+    log_done();
+    log_stopAsync();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**************** parseArgs ****************/
+/*
+ * Fill in the server's address, and the options.
+ * Returns false if the arguments are malformed.
+ */
+static bool parseArgs(const int argc, char* argv[], relayState_t* relay)
+{
+    const char* positional[2];
+    int numPositional = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--max=", strlen("--max=")) == 0) {
+            char extra;
+            if (sscanf(argv[i], "--max=%d%c", &relay->maxWatchers,
+                       &extra) != 1 ||
+                relay->maxWatchers < 1) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--log-level=",
+                           strlen("--log-level=")) == 0) {
+            if (!parseLogLevel(argv[i] + strlen("--log-level="),
+                               &relay->logLevel)) {
+                return false;
+            }
+        } else if (strcmp(argv[i], "--log-async") == 0) {
+            relay->logAsync = true;
+        } else if (numPositional < 2) {
+            positional[numPositional++] = argv[i];
+        } else {
+            return false;
+        }
+    }
+    return numPositional == 2 &&
+           message_setAddr(positional[0], positional[1], &relay->server);
+}
+
+/**************** parseLogLevel ****************/
+/*
+ * Set *level from the name of a log level.
+ * Returns false if value names none.
+ */
+static bool parseLogLevel(const char* value, int* level)
+{
+    if (strcmp(value, "error") == 0) {
+        *level = LOG_ERROR;
+    } else if (strcmp(value, "info") == 0) {
+        *level = LOG_INFO;
+    } else if (strcmp(value, "debug") == 0) {
+        *level = LOG_DEBUG;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**************** handleMessage ****************/
+/*
+ * Relay a message from the server, or serve one from a spectator.
+ * Returns true, ending the loop, when the server sends QUIT.
+ */
+static bool handleMessage(void* arg, const addr_t from, const char* message)
+{
+    relayState_t* relay = arg;
+    if (message_eqAddr(from, relay->server)) {
+        return handleServer(relay, message, message_length());
+    }
+    handleWatcher(relay, from, message);
+    return false;
+}
+
+/**************** handleServer ****************/
+/*
+ * Keep GRID, GOLD and DISPLAY for late joiners, and send everything but
+ * ERROR on to every watcher.  Returns true on QUIT: the game is over, or
+ * the relay has made way for a new spectator.
+ */
+static bool handleServer(relayState_t* relay, const char* message,
+                         const int length)
+{
+    if (isType(message, "GRID ")) {
+        keep(&relay->grid, message, length);
+    } else if (isType(message, "GOLD ")) {
+        keep(&relay->gold, message, length);
+    } else if (isType(message, "DISPLAY\n")) {
+        keep(&relay->display, message, length);
+    } else if (isType(message, "ERROR ")) {
+        log_s("relay: server says %s", message);
+        return false;
+    }
+    relayToAll(relay, message, length);
+    return isType(message, "QUIT");
+}
+
+/**************** handleWatcher ****************/
+/*
+ * Serve a spectator as the server would: SPECTATE joins (or, for a
+ * watcher who lost them, resends the keyframes), KEY Q leaves.
+ */
+static void handleWatcher(relayState_t* relay, const addr_t from,
+                          const char* message)
+{
+    int i = findWatcher(relay, from);
+    if (isType(message, "SPECTATE")) {
+        if (i < 0 && relay->numWatchers == relay->maxWatchers) {
+            message_send(from, "QUIT Sorry - this relay is full.");
+            return;
+        }
+        if (i < 0) {
+            relay->watchers[relay->numWatchers++] = from;
+            if (relay->numWatchers > relay->mostWatchers) {
+                relay->mostWatchers = relay->numWatchers;
+            }
+            log_s("relay: new spectator %s", message_stringAddr(from));
+        }
+        sendKeyframes(relay, from);
+    } else if (isType(message, "PLAY ")) {
+        message_send(from, "QUIT Sorry - this relay is for spectators; "
+                           "players join the server itself.");
+    } else if (isType(message, "KEY ") && i >= 0) {
+        if (strcmp(message, "KEY Q") == 0) {
+            message_send(from, "QUIT Thanks for watching!");
+            dropWatcher(relay, i);
+        } else {
+            message_send(from, "ERROR Unknown keystroke.");
+        }
+    } else if (isType(message, "CAPS ") || isType(message, "VIEW ")) {
+        // we relay the plain protocol, and the whole map, to everyone
+    } else {
+        message_send(from, "ERROR Unknown command.");
+    }
+}
+
+/**************** handleTimeout ****************/
+/*
+ * Until the server answers with GRID, keep asking to spectate, in case
+ * SPECTATE (or its answer) was lost.  Returns false to keep looping.
+ */
+static bool handleTimeout(void* arg)
+{
+    relayState_t* relay = arg;
+    if (relay->grid.message == NULL) {
+        message_send(relay->server, "SPECTATE");
+    }
+    return false;
+}
+
+/**************** relayToAll ****************/
+/*
+ * Send a message to every watcher at once.
+ */
+static void relayToAll(relayState_t* relay, const char* message,
+                       const int length)
+{
+    message_sendMany(relay->watchers, relay->numWatchers, message, length);
+    relay->relayed++;
+    relay->sent += relay->numWatchers;
+}
+
+/**************** sendKeyframes ****************/
+/*
+ * Bring a watcher up to date with the latest GRID, GOLD and DISPLAY,
+ * in the order the server sends them to a new spectator.
+ */
+static void sendKeyframes(relayState_t* relay, const addr_t to)
+{
+    keyframe_t* frames[] = {&relay->grid, &relay->gold, &relay->display};
+    for (int i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+        if (frames[i]->message != NULL) {
+            message_sendBytes(to, frames[i]->message, frames[i]->length);
+        }
+    }
+}
+
+/**************** keep ****************/
+/*
+ * Copy a message into a keyframe, growing it if need be.
+ */
+static void keep(keyframe_t* frame, const char* message, const int length)
+{
+    if (length + 1 > frame->size) {
+        frame->size = length + 1;
+        frame->message = realloc(frame->message, frame->size);
+        mem_assert(frame->message, "Keyframe could not be allocated.");
+    }
+    memcpy(frame->message, message, length);
+    frame->message[length] = '\0';
+    frame->length = length;
+}
+
+/**************** findWatcher ****************/
+/*
+ * Return the index of the watcher at addr, or -1 if there is none.
+ */
+static int findWatcher(relayState_t* relay, const addr_t addr)
+{
+    for (int i = 0; i < relay->numWatchers; i++) {
+        if (message_eqAddr(relay->watchers[i], addr)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**************** dropWatcher ****************/
+/*
+ * Stop relaying to watcher i; the last watcher takes its place.
+ */
+static void dropWatcher(relayState_t* relay, const int i)
+{
+    relay->watchers[i] = relay->watchers[--relay->numWatchers];
+}
+
+/**************** isType ****************/
+/*
+ * Does the message begin with this type (including any separator)?
+ */
+static bool isType(const char* message, const char* type)
+{
+    return strncmp(message, type, strlen(type)) == 0;
+}
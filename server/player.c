@@ -10,6 +10,7 @@
 
 #include "player.h"
 
+#include <limits.h>
 #include <math.h>
 #include <mem.h>
 #include <stdbool.h>
@@ -33,57 +34,130 @@ typedef struct player {
     addr_t address;
     bool** visible;
     int gold;
+    int caps;              // protocol capabilities announced by the client
+    int viewRows, viewCols;  // size of the client's viewport; 0 if none
+    int viewTop, viewLeft;   // a spectator's choice of its corner
+    uint64_t frameHash;    // hash of the last frame sent; 0 if none yet
+    playerPool_t* pool;    // the pool this record belongs to
+    player_t* nextFree;    // next record in pool->free, while not in use
+    player_t* nextRecord;  // next record the pool created, in use or not
 } player_t;
 
+/* A pool of player records for one map size.  Each record is a single
+ * block: the player_t, then the row pointers of its two grids, then the
+ * grids themselves (rows contiguous), then room for the name.
+ */
+typedef struct playerPool {
+    int gridWidth;
+    int gridHeight;
+    int maxNameLength;
+    size_t recordSize;       // bytes in each record
+    mem_arena_t* arena;      // where records come from; NULL for the heap
+    player_t* free;          // records not in use
+    player_t* records;       // every record, for playerPool_delete
+    int inUse;               // records handed out and not yet deleted
+    int highWater;           // most records ever in use at once
+    int created;             // records allocated
+} playerPool_t;
+
+/**************** file-local functions ****************/
+static player_t* newRecord(playerPool_t* pool);
+static int clampView(int value, int min, int max);
+
 /**************** functions ****************/
 
+/**************** playerPool_new ****************/
+playerPool_t* playerPool_new(int gridWidth, int gridHeight, int maxNameLength,
+                             mem_arena_t* arena)
+{
+    if (gridWidth <= 0 || gridHeight <= 0 || maxNameLength < 0) {
+        log_v("playerPool_new called with bad sizes");
+        return NULL;  // error in usage
+    }
+    playerPool_t* pool = arena == NULL
+        ? mem_malloc(sizeof(playerPool_t))
+        : mem_arena_alloc(arena, sizeof(playerPool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->gridWidth = gridWidth;
+    pool->gridHeight = gridHeight;
+    pool->maxNameLength = maxNameLength;
+    pool->recordSize = sizeof(player_t) + 2 * gridHeight * sizeof(bool*) +
+                       2 * gridHeight * gridWidth * sizeof(bool) +
+                       maxNameLength + 1;
+    pool->arena = arena;
+    pool->free = NULL;
+    pool->records = NULL;
+    pool->inUse = 0;
+    pool->highWater = 0;
+    pool->created = 0;
+    return pool;
+}
+
+/**************** playerPool_report ****************/
+void playerPool_report(playerPool_t* pool, FILE* fp)
+{
+    if (pool == NULL || fp == NULL) {
+        return;
+    }
+    fprintf(fp, "player pool: %d in use, high water %d, %d records of "
+            "%zu bytes\n", pool->inUse, pool->highWater, pool->created,
+            pool->recordSize);
+}
+
+/**************** playerPool_delete ****************/
+void playerPool_delete(playerPool_t* pool)
+{
+    if (pool == NULL || pool->arena != NULL) {
+        return;  // records and pool are freed with the arena
+    }
+    while (pool->records != NULL) {
+        player_t* next = pool->records->nextRecord;
+        mem_free(pool->records);
+        pool->records = next;
+    }
+    mem_free(pool);
+}
+
 /**************** player_newPlayer ****************/
 player_t* player_newPlayer(const char* userName, char letterID,
-                           bool isSpectator, char** map, int gridWidth,
-                           int gridHeight, addr_t address)
+                           bool isSpectator, char** map, int py, int px,
+                           addr_t address, playerPool_t* pool)
 {
-    char c;      // temp char
-    int py, px;  // temp for index of player location
-
-    bool** visible = mem_malloc_assert(gridHeight * sizeof(bool*), "visible");
-    bool** discovered =
-        mem_malloc_assert(gridHeight * sizeof(bool*), "discovered");
-    for (int y = 0; y < gridHeight; y++) {
-        visible[y] = mem_malloc_assert(gridWidth * sizeof(bool), "visible row");
-        discovered[y] =
-            mem_malloc_assert(gridWidth * sizeof(bool), "discovered row");
-        for (int x = 0; x < gridWidth; x++) {
-            if (isSpectator) {
-                visible[y][x] = true;
-                discovered[y][x] = true;
-            } else {
-                visible[y][x] = false;
-                discovered[y][x] = false;
-            }
-        }
+    if (pool == NULL || map == NULL || (!isSpectator && userName == NULL)) {
+        log_v("player_newPlayer called with NULL argument");
+        return NULL;  // error in usage
+    }
+    int gridWidth = pool->gridWidth;
+    int gridHeight = pool->gridHeight;
+    if (!isSpectator &&
+        (py < 0 || py >= gridHeight || px < 0 || px >= gridWidth)) {
+        log_v("player_newPlayer called with location off the map");
+        return NULL;  // error in usage
     }
 
-    // setting random start in map if not a spectator
-    if (!isSpectator) {
-        for (bool validLocation = false; !validLocation;) {
-            py = rand() % gridHeight;
-            px = rand() % gridWidth;
-            c = map[py][px];
-            if (c == '.') {
-                validLocation = true;
-            }
-        }
+    // reuse a record if we can
+    player_t* player = pool->free;
+    if (player != NULL) {
+        pool->free = player->nextFree;
+    } else if ((player = newRecord(pool)) == NULL) {
+        return NULL;
+    }
+    if (++pool->inUse > pool->highWater) {
+        pool->highWater = pool->inUse;
     }
 
-    player_t* player = mem_malloc_assert(sizeof(player_t), "player");
+    // a spectator sees everything; a player starts out seeing nothing
+    // (the grids are contiguous, so one memset clears both)
+    memset(player->visible[0], isSpectator,
+           2 * gridHeight * gridWidth * sizeof(bool));
 
     if (!isSpectator) {
-        // create a local copy of the username
-        player->userName =
-            mem_malloc_assert((strlen(userName) + 1), "localUserName");
-        strcpy(player->userName, userName);
+        // copy the username, truncated to fit the record if need be
+        snprintf(player->userName, pool->maxNameLength + 1, "%s", userName);
     } else {
-        player->userName = NULL; // no user name for spectator
+        player->userName[0] = '\0'; // no user name for spectator
     }
 
     // initialize contents of player structure
@@ -92,14 +166,13 @@ player_t* player_newPlayer(const char* userName, char letterID,
     player->px = px;
     player->isSpectator = isSpectator;
     player->map = map;
-    player->gridWidth = gridWidth;
-    player->gridHeight = gridHeight;
-    player->discovered = discovered;
-    player->visible = visible;
     player->gold = 0;
+    player->caps = 0;
+    player->viewRows = player->viewCols = 0;
+    player->viewTop = player->viewLeft = 0;
+    player->frameHash = 0;
     player->address = address;
-    player_setLocation(player, py, px);
-    player_updateVisible(player);
+    player_setLocation(player, py, px);  // also updates what a player sees
     return player;
 }
 
@@ -159,7 +232,7 @@ char player_getID(player_t* player)
 /**************** getPlayerName ****************/
 char* player_getName(player_t* player)
 {
-    if (player != NULL) {
+    if (player != NULL && !player->isSpectator) {
         return player->userName;
     }
     return NULL;
@@ -184,22 +257,214 @@ bool player_isSpectator(player_t* player)
     return false;
 }
 
+/**************** player_setCaps ****************/
+void player_setCaps(player_t* player, int caps)
+{
+    if (player != NULL) {
+        player->caps = caps;
+    }
+}
+
+/**************** player_getCaps ****************/
+int player_getCaps(player_t* player)
+{
+    if (player != NULL) {
+        return player->caps;
+    }
+    return 0;
+}
+
+/**************** player_setView ****************/
+void player_setView(player_t* player, int rows, int cols, int top, int left)
+{
+    if (player == NULL) {
+        return;
+    }
+    if (rows <= 0 || cols <= 0) {  // no viewport
+        rows = cols = 0;
+    }
+    player->viewRows = rows;
+    player->viewCols = cols;
+    player->viewTop = top;
+    player->viewLeft = left;
+}
+
+/**************** player_getView ****************/
+bool player_getView(player_t* player, int* top, int* left, int* rows,
+                    int* cols)
+{
+    if (player == NULL || player->viewRows == 0 ||
+        (player->viewRows >= player->gridHeight &&
+         player->viewCols >= player->gridWidth)) {
+        return false;  // the whole map fits
+    }
+    *rows = clampView(player->viewRows, 1, player->gridHeight);
+    *cols = clampView(player->viewCols, 1, player->gridWidth);
+    if (player->isSpectator) {
+        *top = player->viewTop;
+        *left = player->viewLeft;
+    } else {  // centred on the player
+        *top = player->py - *rows / 2;
+        *left = player->px - *cols / 2;
+    }
+    *top = clampView(*top, 0, player->gridHeight - *rows);
+    *left = clampView(*left, 0, player->gridWidth - *cols);
+    return true;
+}
+
+/**************** player_frameChanged ****************/
+bool player_frameChanged(player_t* player, uint64_t frameHash)
+{
+    if (player == NULL) {
+        return true;
+    }
+    if (player->frameHash == frameHash) {
+        return false;
+    }
+    player->frameHash = frameHash;
+    return true;
+}
+
+/**************** player_save ****************/
+bool player_save(player_t* player, FILE* fp)
+{
+    if (player == NULL || fp == NULL) {
+        return false;
+    }
+    const unsigned char nameLength = strlen(player->userName);
+    const int fields[] = {player->py, player->px, player->gold, player->caps,
+                          player->viewRows, player->viewCols, player->viewTop,
+                          player->viewLeft};
+    bool ok = putc(player->letterID, fp) != EOF &&
+              putc(player->isSpectator, fp) != EOF &&
+              putc(nameLength, fp) != EOF &&
+              fwrite(player->userName, 1, nameLength, fp) == nameLength &&
+              fwrite(fields, sizeof(fields), 1, fp) == 1 &&
+              fwrite(&player->address.sin_addr.s_addr,
+                     sizeof(player->address.sin_addr.s_addr), 1, fp) == 1 &&
+              fwrite(&player->address.sin_port,
+                     sizeof(player->address.sin_port), 1, fp) == 1;
+
+    // discovered cells, eight to a byte
+    const int cells = player->gridHeight * player->gridWidth;
+    const bool* discovered = player->discovered[0];  // rows are contiguous
+    for (int i = 0; ok && i < cells; i += 8) {
+        unsigned char bits = 0;
+        for (int b = 0; b < 8 && i + b < cells; b++) {
+            bits |= discovered[i + b] << b;
+        }
+        ok = putc(bits, fp) != EOF;
+    }
+    return ok;
+}
+
+/**************** player_load ****************/
+player_t* player_load(FILE* fp, char** map, playerPool_t* pool)
+{
+    if (fp == NULL || map == NULL || pool == NULL) {
+        return NULL;
+    }
+    const int letterID = getc(fp);
+    const int isSpectator = getc(fp);
+    const int nameLength = getc(fp);
+    if (letterID == EOF || (isSpectator != 0 && isSpectator != 1) ||
+        nameLength == EOF || nameLength > pool->maxNameLength) {
+        return NULL;
+    }
+    char userName[UCHAR_MAX + 1];
+    int fields[8];  // as in player_save
+    addr_t address = message_noAddr();
+    address.sin_family = AF_INET;
+    if (fread(userName, 1, nameLength, fp) != nameLength ||
+        fread(fields, sizeof(fields), 1, fp) != 1 ||
+        fread(&address.sin_addr.s_addr, sizeof(address.sin_addr.s_addr), 1,
+              fp) != 1 ||
+        fread(&address.sin_port, sizeof(address.sin_port), 1, fp) != 1) {
+        return NULL;
+    }
+    userName[nameLength] = '\0';
+
+    player_t* player = player_newPlayer(userName, letterID, isSpectator, map,
+                                        fields[0], fields[1], address, pool);
+    if (player == NULL) {
+        return NULL;  // e.g., a location off this map
+    }
+    player->gold = fields[2];
+    player->caps = fields[3];
+    player_setView(player, fields[4], fields[5], fields[6], fields[7]);
+
+    // discovered cells, eight to a byte
+    const int cells = player->gridHeight * player->gridWidth;
+    bool* discovered = player->discovered[0];  // rows are contiguous
+    for (int i = 0; i < cells; i += 8) {
+        const int bits = getc(fp);
+        if (bits == EOF) {
+            player_delete(player);
+            return NULL;
+        }
+        for (int b = 0; b < 8 && i + b < cells; b++) {
+            discovered[i + b] = (bits >> b) & 1;
+        }
+    }
+    return player;
+}
+
+/**************** clampView ****************/
+/* value, limited to [min, max] */
+static int clampView(int value, int min, int max)
+{
+    return value < min ? min : value > max ? max : value;
+}
+
 /**************** deletePlayer ****************/
 void player_delete(void* arg)
 {
     player_t* p = arg;
     if (p != NULL) {
-        mem_free(p->userName);
-        for (int y = 0; y < p->gridHeight; y++) {
-            mem_free(p->discovered[y]);
-            mem_free(p->visible[y]);
-        }
-        mem_free(p->discovered);
-        mem_free(p->visible);
-        mem_free(p);
+        // return the record to its pool, for the next player to join
+        p->nextFree = p->pool->free;
+        p->pool->free = p;
+        p->pool->inUse--;
     }
 }
 
+/**************** newRecord ****************/
+/* Allocate and lay out a new record for the pool; NULL if out of memory.
+ * The record is not on the free list.
+ */
+static player_t* newRecord(playerPool_t* pool)
+{
+    const int height = pool->gridHeight;
+    const int width = pool->gridWidth;
+    char* block = pool->arena == NULL
+        ? mem_malloc(pool->recordSize)
+        : mem_arena_alloc(pool->arena, pool->recordSize);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    player_t* player = (player_t*)block;
+    block += sizeof(player_t);
+    player->visible = (bool**)block;
+    block += height * sizeof(bool*);
+    player->discovered = (bool**)block;
+    block += height * sizeof(bool*);
+    for (int y = 0; y < height; y++) {
+        player->visible[y] = (bool*)block + y * width;
+        player->discovered[y] = (bool*)block + (height + y) * width;
+    }
+    block += 2 * height * width * sizeof(bool);
+    player->userName = block;
+
+    player->gridWidth = width;
+    player->gridHeight = height;
+    player->pool = pool;
+    player->nextRecord = pool->records;
+    pool->records = player;
+    pool->created++;
+    return player;
+}
+
 static bool blocks(player_t* player, int y, int x)
 {
     char** grid = player->map;
@@ -283,13 +548,24 @@ void player_updateVisible(player_t* player)
 }
 
 void player_compositeDisplay(player_t* player, char** items, char** output)
+{
+    if (player == NULL) {
+        return;
+    }
+    player_compositeView(player, items, 0, 0, player->gridHeight,
+                         player->gridWidth, output);
+}
+
+/**************** player_compositeView ****************/
+void player_compositeView(player_t* player, char** items, int top, int left,
+                          int rows, int cols, char** output)
 {
     if (output == NULL || player == NULL || items == NULL) {
         return;
     }
     char* ochar = *output;
-    for (int y = 0; y < player->gridHeight; y++) {
-        for (int x = 0; x < player->gridWidth; x++) {
+    for (int y = top; y < top + rows; y++) {
+        for (int x = left; x < left + cols; x++) {
             if (!player->isSpectator && items[y][x] == player->letterID) {
                 *(ochar++) = '@';
                 continue;
@@ -304,4 +580,5 @@ void player_compositeDisplay(player_t* player, char** items, char** output)
         }
         *(ochar++) = '\n';
     }
+    *ochar = '\0';
 }
\ No newline at end of file
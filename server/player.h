@@ -8,15 +8,49 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "mem.h"
 #include "message.h"
 
 /**************** global types ****************/
 typedef struct player player_t;
+typedef struct playerPool playerPool_t;
 
 /**************** functions ****************/
 
+/**************** playerPool_new ****************/
+/* Create a pool of player records for maps of the given size.
+ * A record holds a player and its visibility grids in one block; records
+ * are recycled by player_delete, so joining a game that has seen players
+ * leave costs a memset, not an allocation.
+ *
+ * Caller provides:
+ *   grid width and height, the longest user name to be stored
+ *   (longer names are truncated), and an arena to allocate the pool and
+ *   its records from, or NULL to use the heap
+ * We return:
+ *   pointer to the new pool; return NULL if error.
+ * Caller is responsible for:
+ *   later calling playerPool_delete, after every player from the pool
+ *   has been deleted; for a pool allocated from an arena, that frees
+ *   nothing, and the memory is released with the arena.
+ */
+playerPool_t* playerPool_new(int gridWidth, int gridHeight, int maxNameLength,
+                             mem_arena_t* arena);
+
+/**************** playerPool_report ****************/
+/* Print one line to fp: the number of records in use, the most ever in
+ * use at once (high-water mark), and the number allocated.
+ */
+void playerPool_report(playerPool_t* pool, FILE* fp);
+
+/**************** playerPool_delete ****************/
+/* Delete the pool and every record in it; see playerPool_new.
+ */
+void playerPool_delete(playerPool_t* pool);
+
 /**************** newPlayer ****************/
 /* Create a new player
  *
@@ -25,13 +59,16 @@ typedef struct player player_t;
  *   letterID
  *   true if spectator
  *   gameMap
+ *   starting location (y, x), chosen by the caller; ignored for spectators
+ *   address
+ *   pool to take the player's record from; the pool sets the grid size
  * We return:
  *   pointer to the new player; return NULL if error.
  * Caller is responsible for:
  *   later calling player_delete.
  */
 player_t* player_newPlayer(const char* userName, char letterID, bool isSpectator, char** map,
-                    int gridWidth, int gridHeight, addr_t address);
+                    int y, int x, addr_t address, playerPool_t* pool);
 /**************** player_setLocation ****************/
 /* Move them player on  the map
  *
@@ -137,12 +174,98 @@ void player_getLocation(player_t* player, int* y, int* x);
  */
 bool player_isSpectator(player_t* player);
 
+/**************** player_setCaps ****************/
+/* Record the protocol capabilities a player's client announced
+ *
+ * Caller provides:
+ *   player, and a bitmask of capabilities (the server defines the bits)
+ * We return:
+ *   nothing
+ */
+void player_setCaps(player_t* player, int caps);
+
+/**************** player_getCaps ****************/
+/* Get a player's protocol capabilities
+ *
+ * Caller provides:
+ *   player
+ * We return:
+ *   the bitmask given to player_setCaps; 0 for a new player
+ */
+int player_getCaps(player_t* player);
+
+/**************** player_setView ****************/
+/* Limit the player's DISPLAY to a viewport the size of its client's screen
+ *
+ * Caller provides:
+ *   player, and the viewport's size in rows and columns (0 for none: the
+ *   whole map); for a spectator, also the viewport's top-left corner
+ *   (ignored for players, whose viewport follows them)
+ * We return:
+ *   nothing
+ */
+void player_setView(player_t* player, int rows, int cols, int top, int left);
+
+/**************** player_getView ****************/
+/* Where is the player's viewport now?
+ *
+ * Caller provides:
+ *   player, and where to put the viewport's corner and size
+ * We return:
+ *   false if the player has no viewport, or the whole map fits in it;
+ *   else true, having filled in a rectangle that lies within the map:
+ *   centred on a player, as near as the map's edges allow, or at the
+ *   corner a spectator chose
+ */
+bool player_getView(player_t* player, int* top, int* left, int* rows,
+                    int* cols);
+
+/**************** player_frameChanged ****************/
+/* Is this frame different from the last one the player was sent?
+ *
+ * Caller provides:
+ *   player, and a hash of the frame about to be sent (never 0)
+ * We remember the hash, for next time
+ * We return:
+ *   false if it is the hash of the last frame; else true, as it is for
+ *   the player's first frame
+ */
+bool player_frameChanged(player_t* player, uint64_t frameHash);
+
+/**************** player_save ****************/
+/* Write everything there is to know about a player to a snapshot
+ *
+ * Caller provides:
+ *   player, and a file open for writing
+ * We write its letter, name, location, purse, capabilities, viewport,
+ * address and discovered cells (one bit each), in this machine's byte
+ * order: a snapshot is for restarting the server, not for exchange
+ * We return:
+ *   false if the file could not be written
+ */
+bool player_save(player_t* player, FILE* fp);
+
+/**************** player_load ****************/
+/* Re-create a player written by player_save
+ *
+ * Caller provides:
+ *   a file open for reading, positioned where player_save began writing;
+ *   the game map and pool, as for player_newPlayer, for a map of the
+ *   same size as the player was saved from
+ * We return:
+ *   the player, as it was when saved, except that its next frame will be
+ *   sent even if unchanged; NULL if the file is short or malformed
+ * Caller is responsible for:
+ *   later calling player_delete.
+ */
+player_t* player_load(FILE* fp, char** map, playerPool_t* pool);
+
 /**************** player_delete ****************/
 /* delete a player
  *
  * Caller provides:
  *   player
- * We free the memory story the player and the local information inside
+ * We return the player's record to its pool, for reuse
  * We return:
  *   nothing
  */
@@ -157,4 +280,11 @@ void player_delete(void* arg);
  * We return:
  *   nothing
  */
-void player_compositeDisplay(player_t* player, char** items, char** output);
\ No newline at end of file
+void player_compositeDisplay(player_t* player, char** items, char** output);
+
+/**************** player_compositeView ****************/
+/* as player_compositeDisplay, for the rectangle of rows lines of cols
+ * characters at (top, left), which must lie within the map
+ */
+void player_compositeView(player_t* player, char** items, int top, int left,
+                          int rows, int cols, char** output);
\ No newline at end of file
@@ -14,27 +14,64 @@
  *
  * Palmer's Scholars, February 2022
  *
- * Usage: ./server map.txt [seed]
+ * Usage: ./server map.txt [seed] [--option=value ...]
+ *
+ * Options:
+ *   --stats=FILE   append KEY-to-response latency percentiles (and other
+ *                  server counters) to FILE every few seconds
+ *   --log-level=error|info|debug
+ *                  log only errors; or also events, message addresses and
+ *                  lengths; or also full message bodies (the default)
+ *   --log-async    do logging I/O on a background thread
+ *   --record=FILE  write the game's seed and map, and every message the
+ *                  server handles, to FILE, from which ./replay can play
+ *                  the game again exactly (see the REPLAY section); a
+ *                  second's records at most are held in memory, and
+ *                  SIGINT or SIGTERM writes them out before exiting
+ *   --snapshot=FILE
+ *                  every few seconds, save the game's state to FILE, from
+ *                  a forked child process, so the game loop never waits
+ *   --restore=FILE resume the game saved in FILE, if it exists
+ *   --port=N       listen on port N, so that clients can find a restarted
+ *                  server where it was
+ *   --spectators=N let at most N spectators (default 100) watch at once;
+ *                  when another joins, the one watching longest must leave
+ *   --threads=N    composite the players' frames after each move on N
+ *                  threads (default 1), then send them in the usual order
+ *   --shards=N     with --port, fork N servers that share the port, each
+ *                  playing game after game with the clients the kernel
+ *                  sends it, by a hash of their address
  */
 
 /*********** Include ***********/
+#define _POSIX_C_SOURCE 200809L  // for kill, to stop the shards
 
 #include <assert.h>
 #include <ctype.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "counters.h"
 #include "file.h"
+#include "histogram.h"
+#include "jobs.h"
 #include "log.h"
 #include "mem.h"
 #include "message.h"
 #include "player.h"
+#include "proto.h"
+#include "record.h"
+#include "rle.h"
+#include "rng.h"
 #include "set.h"
 #include "username.h"
+#include "xxhash.h"
 
 // TODO: write gameOver() marvin
 // TODO: write createLeaderBoard() Jack
@@ -42,18 +79,68 @@
 // TODO: revise design & implementation
 
 /**************** global types ****************/
+/* Where a frame is composited and encoded; see composeFrame */
+typedef struct frameBuffers {
+    char* frame;         // header room + composited map
+    char* packed;        // header room + frame's map, run-length encoded
+    char* binary;        // frame's map as a binary DISPLAY (support/proto.h)
+} frameBuffers_t;
+
+/* A player's frame, as composeFrame leaves it for sending */
+typedef struct frameJob {
+    player_t* player;
+    frameBuffers_t buffers;  // where it is composited and encoded
+    const char* message;     // the frame, in buffers; NULL if unchanged
+    int length;              // of message
+    int mapLength;           // of the map, as composited
+    int encodedLength;       // ... and as encoded, without its header
+    int encoding;            // capsBIN or capsRLE if so encoded; else 0
+} frameJob_t;
+
+/* A spectator sees the whole map and is not on it, so, unlike a player,
+ * it needs no visibility grids: just where to send, and how */
+typedef struct spectator {
+    addr_t addr;
+    int caps;            // as announced with CAPS; see serverCaps
+    int viewRows, viewCols, viewTop, viewLeft;  // see handleVIEW; 0 if none
+    uint64_t frameHash;  // of the last viewport sent it; 0 if none
+} spectator_t;
+
+/* A player's place in game->players, under its letter: the player, or,
+ * once it has quit and its record has gone back to the pool, the name
+ * and purse that the leaderboard still shows */
+typedef struct seat {
+    player_t* player;  // NULL once the player has quit
+    char* name;        // set, in the game's arena, when the player quits
+    int purse;         // ... likewise
+} seat_t;
+
 typedef struct game {
     int numPlayers;
     char** baseMap;      // game map that is loaded in the beginning
     char** liveGameMap;  // game map that is updated to include players + gold
     int goldRemaining;
-    set_t* players;
+    set_t* players;      // the seat_t of each who joined, by letter
     int gridWidth;
     int gridHeight;
     int mapStringLength;
-    player_t* spectator;
+    spectator_t* spectators;  // those watching, oldest first
+    int numSpectators;
+    addr_t* spectatorAddrs;   // room for all their addresses, to send to many
+    uint64_t spectatorFrame;  // hash of the last whole map sent them
     int* goldPiles;
+    int numPiles;        // length of goldPiles
     int pilesFound;
+    int* openCells;      // index y*gridWidth+x of every '.' in baseMap
+    int numOpen;         // length of openCells
+    int openDrawn;       // openCells[0..openDrawn-1] have been used
+    rng_t rng;           // this game's random numbers, from its seed
+    frameBuffers_t buffers;  // for each frame sent, one at a time
+    frameJob_t* frameJobs;   // maxPlayers, with buffers of their own, for
+                             // sendDisplayAll's scheduler; or NULL
+    int numFrameJobs;        // in use
+    playerPool_t* pool;  // records for players
+    mem_arena_t* arena;  // holds everything above, and the game_t itself
 } game_t;
 
 typedef struct {
@@ -61,41 +148,223 @@ typedef struct {
     addr_t match;  // address we are searching for in players
 } addrStruct;
 
+/* Runtime options; see the usage comment at the top of this file */
+typedef struct serverOptions {
+    const char* statsPath;  // where to report stats; NULL if not wanted
+    int logLevel;           // LOG_ERROR, LOG_INFO or LOG_DEBUG
+    bool logAsync;          // log from a background thread
+    const char* recordPath; // where to record the game; NULL if not wanted
+    const char* snapshotPath;  // where to save the game; NULL if not wanted
+    const char* restorePath;   // saved game to resume; NULL if none
+    int port;               // port to listen on; 0 for any
+    int maxSpectators;      // spectators at once; the oldest makes way
+    int threads;            // threads compositing players' frames
+    int shards;             // servers sharing options.port
+} serverOptions_t;
+
+/* Server instrumentation, reported periodically to options.statsPath */
+typedef struct serverStats {
+    FILE* fp;                 // open statsPath, or NULL if not reporting
+    histogram_t* keyLatency;  // KEY receipt to last reply sent, this interval
+    histogram_t* keyLatencyTotal;  // ... and since the server started
+    uint64_t lastReport;      // message_now() at the last report
+    uint64_t frames;          // DISPLAY frames sent, since the server started
+    uint64_t unchangedFrames; // ... not sent, being the same as the last
+    uint64_t packedFrames;    // ... of which were sent as DISPLAYZ
+    uint64_t binaryFrames;    // ... or in the binary encoding
+    uint64_t frameBytes;      // ... their maps' bytes, as composited
+    uint64_t frameBytesSent;  // ... and as sent (encoded, if packed)
+    uint64_t spectatorsJoined;  // spectators who joined, since the start
+    uint64_t spectatorsLeft;    // ... and who quit or were replaced
+} serverStats_t;
+
+/* The game's record, written to options.recordPath; see support/record.h */
+typedef struct serverRecording {
+    record_t* log;     // open log, or NULL if not recording
+    uint64_t start;    // message_now() when the log began
+    uint64_t flushed;  // message_now() when the log was last written out
+    addr_t* clients;   // clients[i] is the address recorded as client i
+    int numClients;    // clients in use
+    int maxClients;    // clients allocated
+} serverRecording_t;
+
+#ifdef BENCH
+/* Counters for the offline benchmark; see the BENCH section at the end */
+static struct {
+    long moves;     // successful movePlayer calls
+    long frames;    // DISPLAY frames composited
+    long unchanged; // ... and not sent, being the same as the last
+    long messages;  // messages that would have been sent
+    long bytes;     // ... and their total length
+} bench;
+#define benchCount(counter) (bench.counter++)
+#else
+#define benchCount(counter)
+#endif
+
+#ifdef REPLAY
+/* The replay's progress; see the REPLAY section at the end */
+static struct {
+    int length;       // length of the recorded message being handled
+    long messages;    // messages that would have been sent
+    long bytes;       // ... and their total length
+    uint64_t digest;  // xxhash64 chained over them and their addressees
+} replay;
+#endif
+
+/* Capabilities a client may announce with CAPS, before PLAY or SPECTATE;
+ * see handleCAPS */
+enum serverCaps {
+    capsRLE = 0x1,  // "RLE1": accepts DISPLAYZ, run-length encoded DISPLAY
+    capsBIN = 0x2,  // "BIN1": is sent the binary encoding of support/proto.h
+};
+static const struct {
+    const char* name;
+    int bit;
+} capsNames[] = {
+    {"RLE1", capsRLE},
+    {"BIN1", capsBIN},
+};
+#define PENDING_CAPS 16  // CAPS remembered from clients not yet joined
+#define SNAPSHOT_MAGIC "NUGSNAP3"  // first bytes of a snapshot, version 3
+
 /* Global variables */
 game_t* game;  // represents a universal game state
+static mem_arena_t* scratch;  // for one message's replies; see handleMessage
+static serverOptions_t options = {  // filled in by parseArgs
+    .logLevel = LOG_DEBUG,
+    .maxSpectators = 100,
+    .threads = 1,
+    .shards = 1,
+};
+static jobs_t* scheduler;  // if options.threads > 1; see sendDisplayAll
+static volatile sig_atomic_t stopSignal;  // set by stopServer; else 0
+static serverStats_t stats;      // zeroed until runNetwork starts reporting
+static serverRecording_t recording;  // zeroed unless main starts recording
+static struct {
+    uint64_t mapHash;  // of the game's map, to be checked on restore
+    uint64_t last;     // message_now() when the last snapshot was taken
+    bool changed;      // a message has been handled since
+    pid_t writer;      // child process writing that snapshot; 0 if none
+} snapshot;
+static struct {
+    addr_t from;  // client that sent CAPS before joining
+    int caps;     // what it announced; 0 if the slot is unused
+} pendingCaps[PENDING_CAPS];
+static int nextPendingCaps;  // slot to overwrite next
+static struct {
+    int index;          // this server's number, of options.shards
+    pid_t* children;    // in the parent, the shards; else NULL
+    const char* mapPath;  // for nextGame
+    int seed;           // ... the first game's seed
+    int games;          // games begun
+} shard;
 
 /* Global constants */
 const int maxNameLength = 10;  // maximum name length for player name
 const int maxPlayers = 26;     // maximum number of players allowed
+const int maxShards = 64;      // servers sharing a port, at most
+const int statsSeconds = 10;   // interval between stats reports
+const int snapshotSeconds = 5; // least interval between snapshots
+const int recordFlushSeconds = 1; // most time a record stays in memory
+const size_t gameArenaBlock = 64 * 1024;    // block size of game->arena
+const size_t scratchArenaBlock = 4 * 1024;  // block size of scratch
+const int frameHeaderRoom = 64;  // room for a header before each frame's map
 
 /* Function prototypes */
 static bool parseArgs(const int argc, const char* argv[], int* randomSeed,
                       const char** mapPathFile);
 static bool str2int(const char string[], int* number);
-static bool loadGame(const char* mapPathFile);
+static bool parseOption(const char* arg);
+static const char* optionValue(const char* arg, const char* name);
+static bool loadGame(const char* mapPathFile, int randomSeed);
 static bool runNetwork();
+static bool startShards(int* randomSeed);
+static void stopShards(int signum);
+static void stopServer(int signum);
+static bool nextGame();
 static bool gameOver();
 static bool buildMap(char* mapString);
+static bool drawOpenCell(int* y, int* x);
+static void newFrameBuffers(frameBuffers_t* buffers);
 
 static bool handleMessage(void* arg, const addr_t from, const char* message);
+static bool dispatchMessage(void* arg, const addr_t from, const char* message);
+static bool dispatchBinary(void* arg, const addr_t from, const char* message);
+static bool dispatchKEY(void* arg, const addr_t from, const char keyStroke,
+                        const int seq);
 static bool handlePLAY(void* arg, const addr_t from, const char* userName);
 static bool handleSPECTATE(void* arg, const addr_t from);
+static bool handleCAPS(void* arg, const addr_t from, const char* list);
+static bool handleVIEW(void* arg, const addr_t from, const char* size);
+static void setCaps(const addr_t from, const int caps);
+static int takeCaps(const addr_t from);
+static int capsOf(const addr_t to);
 static bool handleKEY(void* arg, const addr_t from, const char keyStroke);
 
+static void transmit(addr_t to, const char* message);
+static void transmitBytes(addr_t to, const char* message, const int length);
+static void transmitMany(const addr_t to[], const int count,
+                         const char* message, const int length);
+static void sendBinary(addr_t to, const proto_msg_t* msg);
 static void sendMsg(addr_t to, char* type, char* body);
 static void sendOK(addr_t to, char* playerKey);
 static void sendGRID(addr_t to);
-static void sendGOLD(addr_t to, player_t* player, int n);
+static void sendGOLD(addr_t to, int caps, int n, int p);
+static void sendSEQ(addr_t to, int seq);
 static void sendDISPLAY(addr_t to, player_t* player);
+static void composeFrame(frameJob_t* job);
+static void startScheduler();
+static void playerFrameJob(void* arg, const char* key, void* item);
+static void composeTask(void* arg, const int i);
+static void sendFrameJob(addr_t to, frameJob_t* job);
+static uint64_t frameHash(const char* map, int top, int left, int rows,
+                          int cols);
+static void sendMap(const addr_t to[], const int count, const int caps,
+                    bool view, int top, int left, int rows, int cols);
+static void encodeMap(frameJob_t* job, const int caps, bool view, int top,
+                      int left, int rows, int cols);
+static void countFrame(const frameJob_t* job, const int count);
 static void sendQUIT(addr_t to, char* explanation);
 static void sendERROR(addr_t to, char* explanation);
 
+static bool startStats();
+static void recordLatency();
+static void reportStats(bool force);
+static void stopStats();
+static bool handleTimeout(void* arg);
+
+static bool mapHash(const char* mapPathFile, uint64_t* hash);
+static bool startRecording(const char* mapPathFile, int randomSeed);
+static void recordMessage(const addr_t from, const char* message);
+static void stopRecording();
+static int messageLength();
+
+static void takeSnapshot();
+static bool writeSnapshot(const char* path);
+static bool restoreSnapshot(const char* path);
+static void stopSnapshots(bool discard);
+
 static void sendDisplayAll();
 static void sendGoldAll();
 static void sendQuitAll();
+static void sendSpectators(const proto_msg_t* msg, const char* text);
+static void sendSpectatorsDISPLAY();
+static void sendSpectatorDISPLAY(spectator_t* spectator);
 
 static bool movePlayer(player_t* player, int y, int x);
+static void removePlayer(player_t* player);
+static seat_t* newSeat(player_t* player);
 static player_t* playerFromAddr(addr_t address);
+static spectator_t* spectatorFromAddr(addr_t address);
+static int gatherSpectators(const int caps, const int mask,
+                            const bool wholeMap);
+static void removeSpectator(const int i);
+static bool spectatorView(spectator_t* spectator, int* top, int* left,
+                          int* rows, int* cols);
+static void compositeSpectator(int top, int left, int rows, int cols,
+                               char* output);
+static int clampView(int value, int min, int max);
 static void matchAddress(void* arg, const char* key, void* item);
 static void playerSendDisplay(void* arg, const char* key, void* item);
 static void playerSendGold(void* arg, const char* key, void* item);
@@ -109,6 +378,7 @@ char* playerLeaderBoard();
  *
  * Logs errors
  */
+#if !defined(BENCH) && !defined(REPLAY)
 int main(const int argc, const char* argv[])
 {
     // Variables
@@ -122,23 +392,71 @@ int main(const int argc, const char* argv[])
     // Handle parseArgs()
     log_s("Parsing arguments of %s to parseArgs \n", progName);
     if (!parseArgs(argc, argv, &randomSeed, &mapPathFile)) {
-        log_s("Usage: %s map.txt [seed] \n", progName);
+        log_s("Usage: %s map.txt [seed] [--option=value ...] \n", progName);
+        return EXIT_FAILURE;
+    }
+    log_setLevel(options.logLevel);
+
+    // Fork the servers that share the port, if asked to; only they
+    // return, each to play its own games
+    if (options.shards > 1 && !startShards(&randomSeed)) {
         return EXIT_FAILURE;
     }
+    shard.mapPath = mapPathFile;
+    shard.seed = randomSeed;
+    if (options.logAsync && !log_startAsync()) {
+        log_v("Could not start async logging; logging synchronously. \n");
+    }
 
     // Handle loadGame()
     log_s("Loading game for %s \n", argv[0]);
-    if (!loadGame(mapPathFile)) {
+    if (!loadGame(mapPathFile, randomSeed)) {
         log_s("Error in loadGame() in %s \n", progName);
+        log_stopAsync();
+        return EXIT_FAILURE;
+    }
+
+    // A record of a resumed game could not be replayed, as it would not
+    // begin at the beginning
+    if (options.recordPath != NULL && options.restorePath != NULL) {
+        log_v("A restored game cannot be recorded. \n");
+        log_stopAsync();
+        return EXIT_FAILURE;
+    }
+
+    // Resume a saved game, if asked to
+    if ((options.snapshotPath != NULL || options.restorePath != NULL) &&
+        !mapHash(mapPathFile, &snapshot.mapHash)) {
+        log_s("Could not read map %s. \n", mapPathFile);
+        log_stopAsync();
+        return EXIT_FAILURE;
+    }
+    if (options.restorePath != NULL && !restoreSnapshot(options.restorePath)) {
+        log_stopAsync();
+        return EXIT_FAILURE;
+    }
+
+    // Start recording, if asked to
+    if (options.recordPath != NULL &&
+        !startRecording(mapPathFile, randomSeed)) {
+        log_stopAsync();
         return EXIT_FAILURE;
     }
 
     // Handle runNetwork()
     log_s("Running network for %s \n", progName);
+    startScheduler();
     if (!runNetwork()) {
         log_s("Error in runNetwork() in %s \n", progName);
+        stopRecording();
+        stopSnapshots(false);
+        jobs_delete(scheduler);
+        log_stopAsync();
         return EXIT_FAILURE;
     }
+    stopRecording();
+    stopSnapshots(false);
+    jobs_delete(scheduler);
 
     // Handle endGame()
     // TODO: write endGame()
@@ -150,10 +468,12 @@ int main(const int argc, const char* argv[])
 
     // End logging
     log_done();
+    log_stopAsync();
 
     // Exit
     exit(0);
 }
+#endif  // BENCH, REPLAY
 
 /************ parseArgs *********/
 /*
@@ -172,28 +492,45 @@ static bool parseArgs(const int argc, const char* argv[], int* randomSeed,
         return false;
     }
 
+    // separate --options from the positional arguments
+    const char* positional[2 + 1] = {progName, NULL, NULL};
+    int numPositional = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", strlen("--")) == 0) {
+            if (!parseOption(argv[i])) {
+                log_s("Unknown or malformed option %s. \n", argv[i]);
+                return false;
+            }
+        } else if (numPositional < 2 + 1) {
+            positional[numPositional++] = argv[i];
+        } else {
+            numPositional++;  // too many; counted for the check below
+        }
+    }
+
     // CHECK: Proper argument count
-    if (argc != 1 + 1 && argc != 2 + 1) {
+    if (numPositional != 1 + 1 && numPositional != 2 + 1) {
         log_s("Incorrect number of parameters in %s. \n", progName);
         return false;
     }
 
     FILE* fp;
     // CHECK: Can open provided file
-    if ((fp = fopen(argv[1], "r")) == NULL) {
-        log_s("File %s does not exist. \n", argv[1]);
+    if ((fp = fopen(positional[1], "r")) == NULL) {
+        log_s("File %s does not exist. \n", positional[1]);
         return false;
     }
 
-    *mapPathFile = argv[1];
+    *mapPathFile = positional[1];
     fclose(fp);
-    log_s("mapFilePath '%s' successfully opened and closed. \n", argv[1]);
+    log_s("mapFilePath '%s' successfully opened and closed. \n",
+          positional[1]);
 
     // Seeding with random seed
-    if (argv[2] != NULL) {
+    if (positional[2] != NULL) {
         // CHECK: If randomSeed is an int
-        if (!str2int(argv[2], randomSeed)) {
-            log_s("Seed %s is not a valid integer.", argv[2]);
+        if (!str2int(positional[2], randomSeed)) {
+            log_s("Seed %s is not a valid integer.", positional[2]);
             return false;
         }
         // CHECK: If randomSeed is positive integer
@@ -202,13 +539,12 @@ static bool parseArgs(const int argc, const char* argv[], int* randomSeed,
                   *randomSeed);
             return false;
         }
-        srand(*randomSeed);
         log_d("Random number generator seeded with %d. \n", *randomSeed);
     }
 
     // Seeding with getPid()
     else {
-        srand(getpid());
+        *randomSeed = getpid();
         log_v("Random number generator seeded. \n");
     }
 
@@ -216,13 +552,90 @@ static bool parseArgs(const int argc, const char* argv[], int* randomSeed,
     log_v("Arguments parsed successfully. \n");
     return true;
 }
+/************ parseOption *********/
+/*
+ * Parse one --name=value (or --flag) option into the global options struct.
+ * Returns false if the option is unknown or its value is missing or bad.
+ */
+static bool parseOption(const char* arg)
+{
+    const char* value;
+
+    if ((value = optionValue(arg, "--stats")) != NULL) {
+        options.statsPath = value;
+        return true;
+    }
+    if ((value = optionValue(arg, "--log-level")) != NULL) {
+        if (strcmp(value, "error") == 0) {
+            options.logLevel = LOG_ERROR;
+        } else if (strcmp(value, "info") == 0) {
+            options.logLevel = LOG_INFO;
+        } else if (strcmp(value, "debug") == 0) {
+            options.logLevel = LOG_DEBUG;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if ((value = optionValue(arg, "--record")) != NULL) {
+        options.recordPath = value;
+        return true;
+    }
+    if ((value = optionValue(arg, "--snapshot")) != NULL) {
+        options.snapshotPath = value;
+        return true;
+    }
+    if ((value = optionValue(arg, "--restore")) != NULL) {
+        options.restorePath = value;
+        return true;
+    }
+    if ((value = optionValue(arg, "--port")) != NULL) {
+        return str2int(value, &options.port) && options.port > 0 &&
+               options.port < 65536;
+    }
+    if ((value = optionValue(arg, "--threads")) != NULL) {
+        return str2int(value, &options.threads) && options.threads > 0 &&
+               options.threads <= maxPlayers;
+    }
+    if ((value = optionValue(arg, "--shards")) != NULL) {
+        return str2int(value, &options.shards) && options.shards > 0 &&
+               options.shards <= maxShards;
+    }
+    if ((value = optionValue(arg, "--spectators")) != NULL) {
+        return str2int(value, &options.maxSpectators) &&
+               options.maxSpectators > 0;
+    }
+    if (strcmp(arg, "--log-async") == 0) {
+        options.logAsync = true;
+        return true;
+    }
+    return false;
+}
+
+/************ optionValue *********/
+/*
+ * If arg has the form name=value, with a non-empty value, return value;
+ * otherwise return NULL.
+ */
+static const char* optionValue(const char* arg, const char* name)
+{
+    size_t nameLength = strlen(name);
+    if (strncmp(arg, name, nameLength) == 0 && arg[nameLength] == '=' &&
+        arg[nameLength + 1] != '\0') {
+        return arg + nameLength + 1;
+    }
+    return NULL;
+}
+
 /************ loadGame *********/
 /*
- * Opens map, initializes gold in map, prepares game
+ * Opens map, initializes gold in map, prepares game;
+ * all the game's random choices come from its own generator, seeded
+ * with randomSeed, so the same seed always yields the same game
  *
  * Logs errors
  */
-static bool loadGame(const char* mapPathFile)
+static bool loadGame(const char* mapPathFile, int randomSeed)
 {
     // Variables
     const int goldMinNumPiles = 10;
@@ -233,6 +646,7 @@ static bool loadGame(const char* mapPathFile)
     int currentYPos = 0;
     int toDrop = 0;
 
+
     // CHECK: Parameters are non-NULL
     if (mapPathFile == NULL) {
         log_v("Parameters must be non-NULL. \n");
@@ -245,12 +659,25 @@ static bool loadGame(const char* mapPathFile)
         return false;
     }
 
-    // init game struct
-    game = mem_malloc_assert(sizeof(game_t),
-                             "Game state could not be allocated. \n");
+    // init game struct; it and everything that lives as long as
+    // the game is allocated from the game's arena
+    mem_arena_t* arena = mem_assert(mem_arena_new(gameArenaBlock),
+                                    "Game arena could not be allocated. \n");
+    game = mem_arena_alloc_assert(arena, sizeof(game_t),
+                                  "Game state could not be allocated. \n");
 
     // initialize game struct members
+    game->arena = arena;
+    rng_seed(&game->rng, randomSeed);
     game->numPlayers = 0;
+    game->spectators = mem_arena_alloc_assert(
+        arena, sizeof(spectator_t) * options.maxSpectators,
+        "Spectators could not be allocated. \n");
+    game->spectatorAddrs = mem_arena_alloc_assert(
+        arena, sizeof(addr_t) * options.maxSpectators,
+        "Spectators could not be allocated. \n");
+    game->numSpectators = 0;
+    game->spectatorFrame = 0;
 
     // init game->gridHeight
     game->gridHeight = file_numLines(fp);
@@ -271,14 +698,28 @@ static bool loadGame(const char* mapPathFile)
     }
 
     free(mapString);
-    
-    // Calculate number of piles of gold to drop based on max and min
+
+    // players come from a pool sized for this map
+    game->pool = mem_assert(playerPool_new(game->gridWidth, game->gridHeight,
+                                           maxNameLength, game->arena),
+                            "Player pool could not be allocated. \n");
+
+    // Calculate number of piles of gold to drop based on max and min,
+    // but no more than there are spots for
+    if (game->numOpen == 0) {
+        log_v("Map has no room for gold or players. \n");
+        return false;
+    }
     int difference = (goldMaxNumPiles - goldMinNumPiles);
-    int pilesToDrop = goldMinNumPiles + (rand() % difference);
+    int pilesToDrop = goldMinNumPiles + rng_below(&game->rng, difference);
+    if (pilesToDrop > game->numOpen) {
+        pilesToDrop = game->numOpen;
+    }
 
     // create an array of gold piles
-    int* goldPiles = mem_malloc_assert((sizeof(int) * pilesToDrop),
-                                       "could not make piles array\n");
+    int* goldPiles = mem_arena_alloc_assert(game->arena,
+                                            (sizeof(int) * pilesToDrop),
+                                            "could not make piles array\n");
 
     for (int i = 0; i < pilesToDrop; i++) {
         goldPiles[i] = 0;
@@ -287,7 +728,7 @@ static bool loadGame(const char* mapPathFile)
     // loop of the array several times to insure even distribution of gold
     while (goldTotalToDrop > goldDropped) {
         for (int i = 0; i < pilesToDrop; i++) {
-            toDrop = (rand() % 5);
+            toDrop = rng_below(&game->rng, 5);
             if (goldDropped + toDrop > goldTotalToDrop) {
                 toDrop = goldTotalToDrop - goldDropped;
                 goldPiles[i] += toDrop;
@@ -300,19 +741,14 @@ static bool loadGame(const char* mapPathFile)
         }
     }
 
-    // create the right number of '*' symbols on the map
-    for (int i = 0; i < pilesToDrop;) {
-        currentXPos = (rand() % (game->gridWidth - 1));
-        currentYPos = (rand() % (game->gridHeight - 1));
-        char c = game->liveGameMap[currentYPos][currentXPos];
-
-        // Only place gold on '.'
-        if (c == '.') {
-            game->liveGameMap[currentYPos][currentXPos] = '*';
-            i++;
-        }
+    // create the right number of '*' symbols on the map,
+    // each on a distinct '.' spot
+    for (int i = 0; i < pilesToDrop; i++) {
+        drawOpenCell(&currentYPos, &currentXPos);
+        game->liveGameMap[currentYPos][currentXPos] = '*';
     }
     game->goldPiles = goldPiles;
+    game->numPiles = pilesToDrop;
     game->pilesFound = 0;
     game->goldRemaining = goldDropped;
     log_v("Gold successfully dropped into the map. \n");
@@ -329,202 +765,932 @@ static bool loadGame(const char* mapPathFile)
  */
 static bool runNetwork()
 {
-    // Initialize network
-    int portNumber = message_init(NULL);
+    // Initialize network; a shard shares the port with the others
+    int portNumber = options.shards > 1
+                         ? message_initShared(NULL, options.port)
+                         : message_initPort(NULL, options.port);
     if (portNumber == 0) {
         log_v("Could not initialize message module. \n");
         return false;
     }
 
+    // Replies are built in the scratch arena
+    scratch = mem_assert(mem_arena_new(scratchArenaBlock),
+                         "Scratch arena could not be allocated. \n");
+
     // Announce port number
-    printf("Waiting on port %d for contact...\n", portNumber);
+    if (options.shards > 1) {
+        printf("Waiting on port %d for contact (shard %d of %d)...\n",
+               portNumber, shard.index, options.shards);
+    } else {
+        printf("Waiting on port %d for contact...\n", portNumber);
+    }
+    fflush(stdout);  // in case stdout is a pipe, e.g., in loadtest.sh
     log_v("Port number announced to players. \n");
 
-    // Listen for messages and handle game execution
+    // Bring the clients of a resumed game up to date
+    if (game->numPlayers > 0 || game->numSpectators > 0) {
+        sendGoldAll();
+        sendDisplayAll();
+    }
+
+    // Start reporting stats, if asked to
+    if (options.statsPath != NULL && !startStats()) {
+        message_done();
+        mem_arena_delete(scratch);
+        scratch = NULL;
+        return false;
+    }
+
+    // Listen for messages and handle game execution;
+    // the timeout lets stats reports continue, and the game's record and
+    // snapshot be written out, while the server is idle, and lets
+    // SIGINT or SIGTERM stop the loop, so that they are written out on
+    // the way out too; a shard plays game after game
     log_v("Listening for messages from players. \n");
-    message_loop(NULL, 0, NULL, NULL, handleMessage);
+    bool timed = stats.fp != NULL || recording.log != NULL ||
+                 options.snapshotPath != NULL;
+    if (timed) {
+        signal(SIGINT, stopServer);
+        signal(SIGTERM, stopServer);
+    }
+    do {
+        if (timed) {
+            message_loop(NULL, statsSeconds, handleTimeout, NULL,
+                         handleMessage);
+        } else {
+            message_loop(NULL, 0, NULL, NULL, handleMessage);
+        }
+    } while (game == NULL && stopSignal == 0 && nextGame());
+    if (stopSignal != 0) {
+        log_d("Stopped by signal %d. \n", stopSignal);
+    }
 
     // Close messaging stream
+    stopStats();
     message_done();
+    mem_arena_delete(scratch);
+    scratch = NULL;
     return true;
 }
 
-/************* gameOver *********/
+/************ startShards ********/
 /*
- * A function to end the game
+ * Fork options.shards servers, to share options.port; the kernel sends
+ * each the datagrams of some of the clients, always the same ones for a
+ * given client, by a hash of its address (see message_initShared).
+ * Each shard plays its own games, with a seed of its own, and reports
+ * its stats, if asked to, to the stats file named with ".N" after it.
+ * Returns true in each shard; the parent waits for them all, stopping
+ * them if it is interrupted or terminated, then exits.
+ * Returns false, having forked none, if the options don't allow shards.
  */
-static bool gameOver()
+static bool startShards(int* randomSeed)
 {
-    if (game->goldRemaining <= 0) {
-        sendQuitAll();
-
-        // free all data used
-        // free player set
-        set_delete(game->players, player_delete);
+    // each shard's game must outlive the others', so that the shards
+    // sharing the port, and so the clients each is sent, don't change;
+    // and one file can't hold all their games
+    if (options.port == 0) {
+        log_v("Shards need a fixed --port to share. \n");
+        return false;
+    }
+    if (options.recordPath != NULL || options.snapshotPath != NULL ||
+        options.restorePath != NULL) {
+        log_v("Shards cannot --record, --snapshot or --restore. \n");
+        return false;
+    }
 
-        // free maps
-        for (int y = 0; y < game->gridHeight; y++) {
-            mem_free(game->baseMap[y]);
-            mem_free(game->liveGameMap[y]);
+    shard.children = mem_calloc_assert(options.shards, sizeof(pid_t),
+                                       "Shards could not be allocated. \n");
+    for (int s = 0; s < options.shards; s++) {
+        pid_t child = fork();
+        if (child < 0) {
+            log_d("Could not fork shard %d. \n", s);
+            stopShards(SIGTERM);
+            break;
+        }
+        if (child == 0) {
+            mem_free(shard.children);
+            shard.children = NULL;
+            shard.index = s;
+            *randomSeed += s;
+            if (options.statsPath != NULL) {
+                size_t size = strlen(options.statsPath) + 16;
+                char* path = mem_malloc_assert(size, "Stats path. \n");
+                snprintf(path, size, "%s.%d", options.statsPath, s);
+                options.statsPath = path;  // for the life of the shard
+            }
+            return true;
         }
+        shard.children[s] = child;
+    }
 
-        mem_free(game->baseMap);
-        mem_free(game->liveGameMap);
+    // wait for the shards, passing on a request to stop
+    signal(SIGINT, stopShards);
+    signal(SIGTERM, stopShards);
+    int failed = 0;
+    for (int s = 0; s < options.shards; s++) {
+        int status;
+        if (shard.children[s] > 0 &&
+            (waitpid(shard.children[s], &status, 0) != shard.children[s] ||
+             !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)) {
+            failed++;
+        }
+    }
+    log_d("%d shards failed or were stopped. \n", failed);
+    mem_free(shard.children);
+    log_done();
+    exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
 
-        // free spectator (if any)
-        if (game->spectator != NULL) {
-            player_delete(game->spectator);
+/************ stopShards ********/
+/*
+ * Signal handler in the parent of the shards: terminate them all.
+ */
+static void stopShards(int signum)
+{
+    for (int s = 0; s < options.shards; s++) {
+        if (shard.children[s] > 0) {
+            kill(shard.children[s], SIGTERM);
         }
+    }
+}
 
-        // free gold piles array
-        mem_free(game->goldPiles);
+/************ stopServer ********/
+/*
+ * Signal handler for SIGINT and SIGTERM, while the server has a record,
+ * snapshot or stats to write out: note the signal, for handleTimeout
+ * (which message_loop calls when a signal interrupts it) or
+ * handleMessage to stop the loop, and main to write them out.
+ */
+static void stopServer(int signum)
+{
+    stopSignal = signum;
+}
 
-        // free game struct
-        mem_free(game);
-        return true;  // game over
+/************ nextGame ********/
+/*
+ * In a shard, the game having ended, load the next, with a seed of its
+ * own, and resume stats reports, if asked to.
+ * Returns false if this server is not a shard, or the game can't load.
+ */
+static bool nextGame()
+{
+    if (options.shards == 1) {
+        return false;
     }
-    return false;  // game not over -- continue looping
+    shard.games++;
+    if (!loadGame(shard.mapPath, shard.seed + shard.games * options.shards)) {
+        log_s("Could not load the next game in %s. \n", shard.mapPath);
+        return false;
+    }
+    log_d("Shard %d: a new game begins. \n", shard.index);
+    return options.statsPath == NULL || startStats();
 }
 
-/* ***************** str2int ********************** */
+/************ startStats ********/
 /*
- * Citation: Taken from CS50 Knowledge units.
- *
- * Convert a string to an integer, updating that integer using a pointer
- * Returns true if successful, or false if any error.
- * It is an error if there is any additional character beyond the integer.
- * Assumes number is a valid pointer.
+ * Open options.statsPath for appending and allocate the histograms.
+ * Returns false if the file cannot be opened.
  */
-static bool str2int(const char string[], int* number)
+static bool startStats()
 {
-    char nextchar;
-    return (sscanf(string, "%d%c", number, &nextchar) == 1);
+    stats.fp = fopen(options.statsPath, "a");
+    if (stats.fp == NULL) {
+        log_s("Could not open stats file %s. \n", options.statsPath);
+        return false;
+    }
+    stats.keyLatency = mem_assert(histogram_new(), "keyLatency histogram");
+    stats.keyLatencyTotal =
+        mem_assert(histogram_new(), "keyLatencyTotal histogram");
+    stats.lastReport = message_now();
+    return true;
 }
 
-/**************** handleMessage() ****************/
-/* handleMessage: Parses message from the client and calls a corresponding
- * helper function to handle that specific message.
- *
- * Caller provides: A pointer to anything, a NON-NULL, VALID address from
- *                  correspondent, and the message
- *
- * Function returns: true if error -- stops the server from looping for more
- * messages false if successful -- server continues to loop for more messages
- *
- * Logs: nothing.
+/************ recordLatency ********/
+/*
+ * Record the time from receipt of the message being handled until now,
+ * i.e., until the last reply it caused has been handed to the socket.
+ * Does nothing unless stats are being reported.
  */
-static bool handleMessage(void* arg, const addr_t from, const char* message)
+static void recordLatency()
 {
-    if (game == NULL) {  // defensive
-        log_v("Game struct has not been initialized.");
-        return true;  // error in usage
+    if (stats.fp == NULL) {
+        return;
     }
+    uint64_t latency = message_now() - message_receivedTime();
+    histogram_record(stats.keyLatency, latency);
+    histogram_record(stats.keyLatencyTotal, latency);
+}
 
-    if (!message_isAddr(from)) {  // defensive
-        log_v("handleMessage called without a correspondent.");
-        return true;  // error in usage
+/************ reportStats ********/
+/*
+ * Write a stats report if statsSeconds have passed since the last one
+ * (or unconditionally, if force is true), then start a new interval.
+ * Does nothing unless stats are being reported.
+ */
+static void reportStats(bool force)
+{
+    if (stats.fp == NULL) {
+        return;
+    }
+    uint64_t now = message_now();
+    if (!force && now - stats.lastReport < statsSeconds * 1000000000ULL) {
+        return;
     }
 
-    // parse type of message
-    if (strncmp(message, "PLAY ", strlen("PLAY ")) == 0) {  // PLAY
-        const char* realName = message + strlen("PLAY ");
+    fprintf(stats.fp, "--- stats after %.1f seconds\n",
+            (now - stats.lastReport) / 1e9);
+    histogram_print(stats.keyLatency, stats.fp, "key latency (interval)");
+    histogram_print(stats.keyLatencyTotal, stats.fp, "key latency (total)");
+    if (game != NULL) {
+        playerPool_report(game->pool, stats.fp);
+    }
+    fprintf(stats.fp, "display frames: %llu sent, %llu unchanged and not "
+            "sent, %llu as DISPLAYZ, %llu binary; %.1f KB composited, "
+            "%.1f KB sent\n",
+            (unsigned long long)stats.frames,
+            (unsigned long long)stats.unchangedFrames,
+            (unsigned long long)stats.packedFrames,
+            (unsigned long long)stats.binaryFrames, stats.frameBytes / 1e3,
+            stats.frameBytesSent / 1e3);
+    fprintf(stats.fp, "spectators: %d watching, %llu joined, %llu left\n",
+            game != NULL ? game->numSpectators : 0,
+            (unsigned long long)stats.spectatorsJoined,
+            (unsigned long long)stats.spectatorsLeft);
+    if (scheduler != NULL) {
+        jobs_stats_t jobs;
+        jobs_stats(scheduler, &jobs);
+        fprintf(stats.fp, "jobs on %d threads: %lu run, %lu stolen, %lu "
+                "steals missed, %lu locks contended, %lu sleeps\n",
+                jobs_size(scheduler), jobs.run, jobs.steals,
+                jobs.missedSteals, jobs.contended, jobs.sleeps);
+    }
+    fflush(stats.fp);
 
-        return handlePLAY(arg, from, realName);
-    } else if (strncmp(message, "SPECTATE", strlen("SPECTATE")) ==
-               0) {  // SPECTATE
-        return handleSPECTATE(arg, from);
-    } else if (strncmp(message, "KEY ", strlen("KEY ")) == 0) {  // KEY
-        char keyStroke = *(message + strlen("KEY "));
-        return handleKEY(arg, from, keyStroke);
-    } else {  // ERROR
-        sendERROR(from, "Unknown command.");
-        return false;  // continue looping
+    histogram_reset(stats.keyLatency);
+    stats.lastReport = now;
+}
+
+/************ stopStats ********/
+/*
+ * Write a final report, close the stats file and free the histograms.
+ */
+static void stopStats()
+{
+    if (stats.fp == NULL) {
+        return;
     }
+    reportStats(true);
+    fclose(stats.fp);
+    histogram_delete(stats.keyLatency);
+    histogram_delete(stats.keyLatencyTotal);
+    stats.fp = NULL;
 }
 
-/******************************************/
-/* handlePLAY: Handles what the server should do upon receiving PLAY message
- * from client.
- *
- * Caller provides: A pointer to anything, an address from correspondent, and
- * the player's username
- *
- * Function returns: true if error -- stops the server from looping for more
- * messages false if successful -- server continues to loop for more messages
- *
- * Logs: nothing.
+/************ handleTimeout ********/
+/*
+ * Called by message_loop when no message has arrived for statsSeconds,
+ * or a signal interrupted it; keeps stats reports flowing, and writes out
+ * the game's record, during quiet periods.
+ * Returns true to stop looping if stopServer caught a signal; else false.
  */
-static bool handlePLAY(void* arg, const addr_t from, const char* userName)
+static bool handleTimeout(void* arg)
 {
-    if (game == NULL) {  // defensive
-        log_v("Game struct has not been initialized. \n");
+    if (stopSignal != 0) {
         return true;
     }
+    reportStats(false);
+    if (recording.log != NULL && !record_flush(recording.log)) {
+        log_s("Could not write record file %s; no longer recording. \n",
+              options.recordPath);
+        stopRecording();
+    }
+    takeSnapshot();
+    return false;
+}
 
-    if (!message_isAddr(from)) {  // defensive
-        log_v("handlePLAY called without a correspondent. \n");
-        return true;
+/************ mapHash ********/
+/*
+ * Hash the contents of the map file, so that a replay can tell whether
+ * it has the map the game was recorded with.
+ * Returns false if the file cannot be read.
+ */
+static bool mapHash(const char* mapPathFile, uint64_t* hash)
+{
+    FILE* fp = fopen(mapPathFile, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    char* mapString = file_readFile(fp);
+    fclose(fp);
+    if (mapString == NULL) {
+        return false;
     }
+    *hash = xxhash64(mapString, strlen(mapString), 0);
+    free(mapString);
+    return true;
+}
 
-    if (isEmpty(userName)) {  // no name provided
-        message_send(from, "QUIT Sorry - you must provide player's name.");
+/************ startRecording ********/
+/*
+ * Create options.recordPath, and write the game's seed and map to it;
+ * from now on handleMessage records every message it handles.
+ * Returns false if the file cannot be written.
+ */
+static bool startRecording(const char* mapPathFile, int randomSeed)
+{
+    record_header_t header = {.seed = randomSeed,
+                              .maxSpectators = options.maxSpectators};
+    if (!mapHash(mapPathFile, &header.mapHash) ||
+        strlen(mapPathFile) >= sizeof(header.mapPath)) {
+        log_s("Could not record map %s. \n", mapPathFile);
         return false;
-    } else if (game->numPlayers == maxPlayers) {  // game full
-        message_send(from, "QUIT Game is full: no more players can join.");
+    }
+    strcpy(header.mapPath, mapPathFile);
+    recording.log = record_create(options.recordPath, &header);
+    if (recording.log == NULL) {
+        log_s("Could not create record file %s. \n", options.recordPath);
         return false;
-    } else {  // add player to game
-        // normalize username
-        char* name = mem_assert(normalizeUserName(userName, maxNameLength),
-                                "Player name could not be allocated.");
+    }
+    recording.start = message_now();
+    recording.flushed = recording.start;
+    return true;
+}
 
-        log_s("Player name initialized as: %s \n", name);
+/************ recordMessage ********/
+/*
+ * Append the message being handled to the game's record, numbering its
+ * sender by the order in which clients first wrote.  The record is
+ * buffered in memory, so this is a copy, not a write, but for every
+ * 64 KB of records, or recordFlushSeconds of them, whichever comes
+ * first; so a crash loses at most that much.  Does nothing unless
+ * recording.
+ */
+static void recordMessage(const addr_t from, const char* message)
+{
+    if (recording.log == NULL) {
+        return;
+    }
+    int client = 0;
+    while (client < recording.numClients &&
+           !message_eqAddr(recording.clients[client], from)) {
+        client++;
+    }
+    if (client == recording.maxClients) {
+        recording.maxClients = recording.maxClients * 2 + maxPlayers;
+        recording.clients = mem_assert(
+            realloc(recording.clients,
+                    recording.maxClients * sizeof(addr_t)),
+            "Record clients could not be allocated. \n");
+    }
+    if (client == recording.numClients) {
+        recording.clients[recording.numClients++] = from;
+    }
 
-        // add player to game
-        game->numPlayers++;
-        char playerLetter = 'A' + game->numPlayers - 1;
+    uint64_t now = message_receivedTime();
+    uint64_t tick = (now - recording.start) / 1000;
+    bool written = record_append(recording.log, tick, client, message,
+                                 messageLength());
+    if (written && now - recording.flushed >=
+                       recordFlushSeconds * 1000000000ULL) {
+        written = record_flush(recording.log);
+        recording.flushed = now;
+    }
+    if (!written) {
+        log_s("Could not write record file %s; no longer recording. \n",
+              options.recordPath);
+        stopRecording();
+    }
+}
 
-        // init new player
-        player_t* player = mem_assert(
-            player_newPlayer(userName, playerLetter, false, game->baseMap,
-                             game->gridWidth, game->gridHeight, from),
-            "Player could not be allocated.");
-        free(name);
-        int x = -1, y = -1;
-        player_getLocation(player, &y, &x);
-
-        char c;
-        c = game->liveGameMap[y][x];
-        if (c == '*'){
-            int goldFound = game->goldPiles[game->pilesFound];
-            game->goldRemaining -= goldFound;
-            game->pilesFound += 1;
-            player_addGold(player, goldFound);
-            // update gold for everyone
-            sendGoldAll();
-
-            // update gold to show the player the amount they picked up
-            sendGOLD(from, player, goldFound);
-        }
-        game->liveGameMap[y][x] = playerLetter;
+/************ stopRecording ********/
+/*
+ * Write out and close the game's record, if recording.
+ */
+static void stopRecording()
+{
+    if (recording.log == NULL) {
+        return;
+    }
+    if (!record_close(recording.log)) {
+        log_s("Could not write record file %s. \n", options.recordPath);
+    }
+    free(recording.clients);
+    memset(&recording, 0, sizeof(recording));
+}
 
-        // add player to set
-        if (game->players != NULL) {
-            char* playerKey = mem_malloc_assert(sizeof(char) * 2, "set key");
-            playerKey[0] = playerLetter;
-            playerKey[1] = '\0';
-            if (set_insert(game->players, playerKey, player)) {
-                log_c("Player %c inserted successfully. \n", playerLetter);
+/************ takeSnapshot ********/
+/*
+ * If snapshotSeconds have passed since the last snapshot, and the game
+ * has changed since, save it to options.snapshotPath.  The saving is
+ * done by a child process, which has a copy-on-write image of the game
+ * as it is now, so all the server does is fork; a snapshot is not begun
+ * while the last is still being written.  Does nothing unless asked to
+ * take snapshots.
+ */
+static void takeSnapshot()
+{
+    if (options.snapshotPath == NULL || game == NULL) {
+        return;
+    }
 
-                // send OK (playerLetter)
-                sendOK(from, playerKey);
+    // collect the last snapshot's writer, if it has finished
+    if (snapshot.writer != 0) {
+        int status;
+        pid_t done = waitpid(snapshot.writer, &status, WNOHANG);
+        if (done == 0) {
+            return;  // still writing; try again later
+        }
+        if (done < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+            log_s("Could not write snapshot %s. \n", options.snapshotPath);
+        }
+        snapshot.writer = 0;
+    }
+
+    uint64_t now = message_now();
+    if (!snapshot.changed ||
+        now - snapshot.last < snapshotSeconds * 1000000000ULL) {
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_s("Could not fork to write snapshot %s. \n", options.snapshotPath);
+        snapshot.last = now;  // don't try again at once
+        return;
+    }
+    if (pid == 0) {  // the child: no logging, and no exit handlers
+        _exit(writeSnapshot(options.snapshotPath) ? EXIT_SUCCESS
+                                                  : EXIT_FAILURE);
+    }
+    snapshot.writer = pid;
+    snapshot.last = now;
+    snapshot.changed = false;
+    log_d("Snapshot forked in %d us. \n", (int)((message_now() - now) / 1000));
+}
+
+/************ writeSnapshot ********/
+/*
+ * Write the game's state to a file beside path, then rename it to path,
+ * so that path always holds a whole snapshot: the map's hash and size,
+ * the random generator, the gold piles, the open spots not yet drawn,
+ * the live map, every player (see player_save), and the spectators.
+ * Numbers are written in this machine's byte order.
+ * Returns false if the snapshot could not be written.
+ */
+static bool writeSnapshot(const char* path)
+{
+    char* temp = malloc(strlen(path) + sizeof(".tmp"));
+    if (temp == NULL) {
+        return false;
+    }
+    sprintf(temp, "%s.tmp", path);
+    FILE* fp = fopen(temp, "wb");
+    if (fp == NULL) {
+        free(temp);
+        return false;
+    }
+
+    const int size[] = {game->gridHeight, game->gridWidth};
+    const int gold[] = {game->goldRemaining, game->pilesFound,
+                        game->numPiles};
+    const int open[] = {game->numOpen, game->openDrawn};
+    bool ok =
+        fwrite(SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC), 1, fp) == 1 &&
+        fwrite(&snapshot.mapHash, sizeof(snapshot.mapHash), 1, fp) == 1 &&
+        fwrite(size, sizeof(size), 1, fp) == 1 &&
+        fwrite(&game->rng, sizeof(game->rng), 1, fp) == 1 &&
+        fwrite(gold, sizeof(gold), 1, fp) == 1 &&
+        fwrite(game->goldPiles, sizeof(int), game->numPiles, fp) ==
+            game->numPiles &&
+        fwrite(open, sizeof(open), 1, fp) == 1 &&
+        fwrite(game->openCells, sizeof(int), game->numOpen, fp) ==
+            game->numOpen;
+    for (int y = 0; ok && y < game->gridHeight; y++) {
+        ok = fwrite(game->liveGameMap[y], game->gridWidth, 1, fp) == 1;
+    }
+    ok = ok && fwrite(&game->numPlayers, sizeof(int), 1, fp) == 1;
+    for (int i = 0; ok && i < game->numPlayers; i++) {
+        // a player who has quit is saved as its seat: name and purse
+        char playerKey[] = {'A' + i, '\0'};
+        seat_t* seat = set_find(game->players, playerKey);
+        const int quit[] = {seat->player == NULL, seat->purse,
+                            seat->name == NULL ? 0 : strlen(seat->name)};
+        ok = fwrite(quit, sizeof(quit), 1, fp) == 1 &&
+             (seat->player != NULL
+                  ? player_save(seat->player, fp)
+                  : fwrite(seat->name, 1, quit[2], fp) == quit[2]);
+    }
+    ok = ok && fwrite(&game->numSpectators, sizeof(int), 1, fp) == 1 &&
+         fwrite(game->spectators, sizeof(spectator_t), game->numSpectators,
+                fp) == game->numSpectators;
+
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && rename(temp, path) == 0;
+    if (!ok) {
+        remove(temp);
+    }
+    free(temp);
+    return ok;
+}
+
+/************ restoreSnapshot ********/
+/*
+ * Replace the state of the game just loaded with that saved by
+ * writeSnapshot in path, which must have been saved from the same map.
+ * If there is no file at path there is nothing to resume, and the new
+ * game is played.
+ * Returns false, having logged why, if the snapshot is malformed.
+ */
+static bool restoreSnapshot(const char* path)
+{
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        log_s("No snapshot %s; starting a new game. \n", path);
+        return true;
+    }
+
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    uint64_t hash;
+    int size[2], gold[3], open[2];
+    bool ok =
+        fread(magic, strlen(SNAPSHOT_MAGIC), 1, fp) == 1 &&
+        memcmp(magic, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) == 0 &&
+        fread(&hash, sizeof(hash), 1, fp) == 1 &&
+        hash == snapshot.mapHash &&
+        fread(size, sizeof(size), 1, fp) == 1 &&
+        size[0] == game->gridHeight && size[1] == game->gridWidth &&
+        fread(&game->rng, sizeof(game->rng), 1, fp) == 1 &&
+        fread(gold, sizeof(gold), 1, fp) == 1 && gold[2] >= 0 &&
+        gold[2] <= game->numOpen && gold[1] >= 0 && gold[1] <= gold[2];
+    if (ok) {
+        game->goldRemaining = gold[0];
+        game->pilesFound = gold[1];
+        game->numPiles = gold[2];
+        game->goldPiles = mem_arena_alloc_assert(
+            game->arena, sizeof(int) * (game->numPiles + 1),
+            "Gold piles could not be allocated. \n");
+        ok = fread(game->goldPiles, sizeof(int), game->numPiles, fp) ==
+                 game->numPiles &&
+             fread(open, sizeof(open), 1, fp) == 1 &&
+             open[0] == game->numOpen && open[1] >= 0 &&
+             open[1] <= game->numOpen &&
+             fread(game->openCells, sizeof(int), game->numOpen, fp) ==
+                 game->numOpen;
+        game->openDrawn = open[1];
+    }
+    for (int i = 0; ok && i < game->numOpen; i++) {
+        ok = game->openCells[i] >= 0 &&
+             game->openCells[i] < game->gridHeight * game->gridWidth;
+    }
+    for (int y = 0; ok && y < game->gridHeight; y++) {
+        ok = fread(game->liveGameMap[y], game->gridWidth, 1, fp) == 1;
+    }
+
+    int numPlayers = 0;
+    ok = ok && fread(&numPlayers, sizeof(int), 1, fp) == 1 &&
+         numPlayers >= 0 && numPlayers <= maxPlayers;
+    for (int i = 0; ok && i < numPlayers; i++) {
+        char playerKey[] = {'A' + i, '\0'};
+        seat_t* seat = newSeat(NULL);
+        int quit[3];
+        ok = fread(quit, sizeof(quit), 1, fp) == 1 && quit[2] >= 0 &&
+             quit[2] <= maxNameLength;
+        if (ok && quit[0]) {  // a player who has quit
+            seat->purse = quit[1];
+            seat->name = mem_arena_alloc_assert(
+                game->arena, quit[2] + 1, "Name could not be allocated. \n");
+            ok = fread(seat->name, 1, quit[2], fp) == quit[2];
+            seat->name[quit[2]] = '\0';
+        } else if (ok) {
+            seat->player = player_load(fp, game->baseMap, game->pool);
+            ok = seat->player != NULL &&
+                 player_getID(seat->player) == playerKey[0] &&
+                 !player_isSpectator(seat->player);
+        }
+        ok = ok && set_insert(game->players, playerKey, seat);
+        game->numPlayers += ok;
+    }
+    int numSpectators = 0;
+    ok = ok && fread(&numSpectators, sizeof(int), 1, fp) == 1 &&
+         numSpectators >= 0;
+    for (int i = 0; ok && i < numSpectators; i++) {
+        spectator_t spectator;
+        ok = fread(&spectator, sizeof(spectator), 1, fp) == 1;
+        if (ok && game->numSpectators == options.maxSpectators) {
+            removeSpectator(0);  // saved with a larger --spectators
+        }
+        spectator.frameHash = 0;  // the resumed game's frame is sent anew
+        if (ok) {
+            game->spectators[game->numSpectators++] = spectator;
+        }
+    }
+    ok = ok && getc(fp) == EOF;
+    fclose(fp);
+
+    if (!ok) {
+        log_s("Snapshot %s is malformed, or not of this map. \n", path);
+        return false;
+    }
+    log_s("Resumed the game saved in %s. \n", path);
+    return true;
+}
+
+/************ stopSnapshots ********/
+/*
+ * Wait for the snapshot being written, if any; then, if discard is
+ * true, remove the snapshot.  Does nothing unless taking snapshots.
+ */
+static void stopSnapshots(bool discard)
+{
+    if (options.snapshotPath == NULL) {
+        return;
+    }
+    if (snapshot.writer != 0) {
+        waitpid(snapshot.writer, NULL, 0);
+        snapshot.writer = 0;
+    }
+    if (discard) {
+        remove(options.snapshotPath);
+    }
+}
+
+/************* gameOver *********/
+/*
+ * A function to end the game
+ */
+static bool gameOver()
+{
+    if (game->goldRemaining <= 0) {
+        sendQuitAll();
+
+        // final stats report, while the game (and its pool) still exists
+        stopStats();
+
+        // a finished game is not to be resumed
+        stopSnapshots(true);
+
+        // free all data used: the player set, then everything in the
+        // game's arena -- player pool, maps, gold piles, and the
+        // game struct itself
+        set_delete(game->players, NULL);
+        mem_arena_delete(game->arena);
+        game = NULL;
+        return true;  // game over
+    }
+    return false;  // game not over -- continue looping
+}
+
+/* ***************** str2int ********************** */
+/*
+ * Citation: Taken from CS50 Knowledge units.
+ *
+ * Convert a string to an integer, updating that integer using a pointer
+ * Returns true if successful, or false if any error.
+ * It is an error if there is any additional character beyond the integer.
+ * Assumes number is a valid pointer.
+ */
+static bool str2int(const char string[], int* number)
+{
+    char nextchar;
+    return (sscanf(string, "%d%c", number, &nextchar) == 1);
+}
+
+/**************** handleMessage() ****************/
+/* handleMessage: Handles one message from a client, then releases
+ * everything allocated from the scratch arena while handling it.
+ *
+ * Caller provides: A pointer to anything, a NON-NULL, VALID address from
+ *                  correspondent, and the message
+ *
+ * Function returns: true if error -- stops the server from looping for more
+ * messages false if successful -- server continues to loop for more messages
+ *
+ * Logs: nothing.
+ */
+static bool handleMessage(void* arg, const addr_t from, const char* message)
+{
+    if (stopSignal != 0) {  // see stopServer
+        return true;
+    }
+    recordMessage(from, message);
+    bool done = dispatchMessage(arg, from, message);
+    mem_arena_reset(scratch);
+    if (!done) {
+        snapshot.changed = true;
+        takeSnapshot();
+    }
+    return done;
+}
+
+/**************** messageLength() ****************/
+/* messageLength: the length of the message being handled, which need not
+ * be a string (see support/proto.h).  In the REPLAY build the message
+ * comes from the record, not the network.
+ */
+static int messageLength()
+{
+#ifdef REPLAY
+    return replay.length;
+#else
+    return message_length();
+#endif
+}
+
+/**************** dispatchMessage() ****************/
+/* dispatchMessage: Parses message from the client and calls a corresponding
+ * helper function to handle that specific message.
+ *
+ * Caller provides: as for handleMessage
+ *
+ * Function returns: as for handleMessage
+ *
+ * Logs: nothing.
+ */
+static bool dispatchMessage(void* arg, const addr_t from, const char* message)
+{
+    if (game == NULL) {  // defensive
+        log_v("Game struct has not been initialized.");
+        return true;  // error in usage
+    }
+
+    if (!message_isAddr(from)) {  // defensive
+        log_v("handleMessage called without a correspondent.");
+        return true;  // error in usage
+    }
+
+    // binary messages begin with a byte no text message does
+    if (proto_isBinary(message, messageLength())) {
+        return dispatchBinary(arg, from, message);
+    }
+
+    // parse type of message
+    if (strncmp(message, "PLAY ", strlen("PLAY ")) == 0) {  // PLAY
+        const char* realName = message + strlen("PLAY ");
+
+        return handlePLAY(arg, from, realName);
+    } else if (strncmp(message, "SPECTATE", strlen("SPECTATE")) ==
+               0) {  // SPECTATE
+        return handleSPECTATE(arg, from);
+    } else if (strncmp(message, "CAPS ", strlen("CAPS ")) == 0) {  // CAPS
+        return handleCAPS(arg, from, message + strlen("CAPS "));
+    } else if (strncmp(message, "VIEW ", strlen("VIEW ")) == 0) {  // VIEW
+        return handleVIEW(arg, from, message + strlen("VIEW "));
+    } else if (strncmp(message, "KEY ", strlen("KEY ")) == 0) {  // KEY
+        char keyStroke = *(message + strlen("KEY "));
+        int seq = 0;  // the client's number for this keystroke, if any
+        if (keyStroke != '\0' && message[strlen("KEY ") + 1] == ' ') {
+            seq = atoi(message + strlen("KEY ") + 2);
+        }
+        return dispatchKEY(arg, from, keyStroke, seq);
+    } else {  // ERROR
+        sendERROR(from, "Unknown command.");
+        return false;  // continue looping
+    }
+}
+
+/**************** dispatchBinary() ****************/
+/* dispatchBinary: as dispatchMessage, for a message in the binary
+ * encoding of support/proto.h.  A client that joins with a binary PLAY
+ * or SPECTATE is taken to have announced CAPS BIN1, and is answered in
+ * the binary encoding from then on.
+ *
+ * Caller provides: as for handleMessage
+ *
+ * Function returns: as for handleMessage
+ *
+ * Logs: nothing.
+ */
+static bool dispatchBinary(void* arg, const addr_t from, const char* message)
+{
+    proto_msg_t msg;
+    if (!proto_decode(message, messageLength(), &msg)) {
+        sendERROR(from, "Malformed message.");
+        return false;  // continue looping
+    }
 
-                mem_free(playerKey);
+    switch (msg.type) {
+        case PROTO_PLAY: {
+            // the name is not terminated in the message
+            char* realName = mem_arena_alloc_assert(
+                scratch, msg.textLength + 1, "dispatchBinary: out of memory.");
+            memcpy(realName, msg.text, msg.textLength);
+            realName[msg.textLength] = '\0';
+            setCaps(from, capsOf(from) | capsBIN);
+            return handlePLAY(arg, from, realName);
+        }
+        case PROTO_SPECTATE:
+            setCaps(from, capsOf(from) | capsBIN);
+            return handleSPECTATE(arg, from);
+        case PROTO_KEY:
+            return dispatchKEY(arg, from, msg.ch, msg.seq);
+        default:
+            sendERROR(from, "Unknown command.");
+            return false;  // continue looping
+    }
+}
+
+/**************** dispatchKEY() ****************/
+/* dispatchKEY: handle a keystroke, in either encoding, then record the
+ * latency of its replies.  A client that numbers its keystrokes, as
+ * "KEY k seq", is first sent SEQ seq, so that it can tell which of its
+ * keystrokes the DISPLAYs that follow reflect.
+ *
+ * Caller provides: as for handleKEY, and the keystroke's number (0 if
+ * the client gave none)
+ *
+ * Function returns: as for handleKEY
+ *
+ * Logs: nothing.
+ */
+static bool dispatchKEY(void* arg, const addr_t from, const char keyStroke,
+                        const int seq)
+{
+    if (seq > 0) {
+        sendSEQ(from, seq);
+    }
+    bool done = handleKEY(arg, from, keyStroke);
+
+    // all replies to this KEY have been sent by now
+    recordLatency();
+    reportStats(false);
+    return done;
+}
+
+/******************************************/
+/* handlePLAY: Handles what the server should do upon receiving PLAY message
+ * from client.
+ *
+ * Caller provides: A pointer to anything, an address from correspondent, and
+ * the player's username
+ *
+ * Function returns: true if error -- stops the server from looping for more
+ * messages false if successful -- server continues to loop for more messages
+ *
+ * Logs: nothing.
+ */
+static bool handlePLAY(void* arg, const addr_t from, const char* userName)
+{
+    if (game == NULL) {  // defensive
+        log_v("Game struct has not been initialized. \n");
+        return true;
+    }
+
+    if (!message_isAddr(from)) {  // defensive
+        log_v("handlePLAY called without a correspondent. \n");
+        return true;
+    }
+
+    if (isEmpty(userName)) {  // no name provided
+        sendQUIT(from, "Sorry - you must provide player's name.");
+        return false;
+    } else if (game->numPlayers == maxPlayers) {  // game full
+        sendQUIT(from, "Game is full: no more players can join.");
+        return false;
+    }
+
+    int x = -1, y = -1;  // where the player starts
+    if (!drawOpenCell(&y, &x)) {  // no empty spot left on the map
+        sendQUIT(from, "Game is full: no room for more players.");
+        return false;
+    } else {  // add player to game
+        // normalize username
+        char* name = mem_assert(normalizeUserName(userName, maxNameLength),
+                                "Player name could not be allocated.");
+
+        log_s("Player name initialized as: %s \n", name);
+
+        // add player to game
+        game->numPlayers++;
+        char playerLetter = 'A' + game->numPlayers - 1;
+
+        // init new player
+        player_t* player = mem_assert(
+            player_newPlayer(name, playerLetter, false, game->baseMap, y, x,
+                             from, game->pool),
+            "Player could not be allocated.");
+        free(name);
+        player_setCaps(player, takeCaps(from));
+
+        // the spot is empty floor: never gold, never another player
+        game->liveGameMap[y][x] = playerLetter;
+
+        // add player to set
+        if (game->players != NULL) {
+            char playerKey[] = {playerLetter, '\0'};
+            if (set_insert(game->players, playerKey, newSeat(player))) {
+                log_c("Player %c inserted successfully. \n", playerLetter);
+
+                // send OK (playerLetter)
+                sendOK(from, playerKey);
 
                 // send GRID nrows ncols
                 sendGRID(from);
 
                 // send GOLD n p r
-                sendGOLD(from, player, 0);
+                sendGOLD(from, player_getCaps(player), 0,
+                         player_getGold(player));
 
                 // send DISPLAY\nstring
                 sendDisplayAll();
@@ -533,10 +1699,8 @@ static bool handlePLAY(void* arg, const addr_t from, const char* userName)
             }
 
             return false;
-        } else {  // defensive
+        } else {  // defensive; player is freed with the game arena
             log_v("Player set has not been initialized. \n");
-            free(name);
-            free(player);
             return true;  // stop looping
         }
     }
@@ -545,7 +1709,9 @@ static bool handlePLAY(void* arg, const addr_t from, const char* userName)
 
 /******************************************/
 /* handleSPECTATE: handles what the server should do upon receiving SPECTATE
- *                 message from client.
+ *                 message from client.  Up to options.maxSpectators may
+ *                 watch at once; when one more joins, the one who has
+ *                 watched longest is sent QUIT.
  *
  * Caller provides: A pointer to anything, an address from correspondent
  *
@@ -566,31 +1732,186 @@ static bool handleSPECTATE(void* arg, const addr_t from)
         return true;
     }
 
-    // init new player
-    player_t* spectator =
-        mem_assert(player_newPlayer(NULL, '\0', false, game->baseMap,
-                                    game->gridWidth, game->gridHeight, from),
-                   "Spectator could not be allocated.");
+    // a spectator already watching (whose GRID, say, was lost) is just
+    // sent the game again; a new one may need the oldest to make way
+    spectator_t* spectator = spectatorFromAddr(from);
+    if (spectator == NULL) {
+        if (game->numSpectators == options.maxSpectators) {
+            sendQUIT(game->spectators[0].addr,
+                     "You have been replaced by a new spectator.");
+            removeSpectator(0);
+            stats.spectatorsLeft++;
+        }
+        spectator = &game->spectators[game->numSpectators++];
+        *spectator = (spectator_t){.addr = from, .caps = takeCaps(from)};
+        stats.spectatorsJoined++;
+        log_d("%d spectators watching. \n", game->numSpectators);
+    }
+    spectator->frameHash = 0;  // send the whole frame, even if unchanged
 
     // send GRID nrows ncols
     sendGRID(from);
 
     // send GOLD n p r
-    sendGOLD(from, spectator, 0);
+    sendGOLD(from, spectator->caps, 0, 0);
 
     // send DISPLAY\nstring
-    sendDISPLAY(from, spectator);
+    sendSpectatorDISPLAY(spectator);
+
+    return false;
+}
+
+/******************************************/
+/* handleCAPS: handles a CAPS message, in which a client announces the
+ * protocol extensions it understands, as a list of names separated by
+ * spaces, e.g., "CAPS RLE1".  Names the server doesn't know are ignored,
+ * and a client that never sends CAPS gets the plain protocol.  Clients
+ * send CAPS just before PLAY or SPECTATE; since it may arrive after
+ * (or, if PLAY is lost, long before) the player joins, it applies to
+ * the player or spectator at that address if there is one, and is
+ * otherwise remembered for takeCaps.
+ *
+ * Caller provides: A pointer to anything, an address from correspondent, and
+ * the list of capabilities
+ *
+ * Function returns: false -- server continues to loop for more messages
+ *
+ * Logs: the capabilities recognized.
+ */
+static bool handleCAPS(void* arg, const addr_t from, const char* list)
+{
+    int caps = 0;
+    while (*list != '\0') {
+        size_t length = strcspn(list, " ");
+        for (int i = 0; i < sizeof(capsNames) / sizeof(capsNames[0]); i++) {
+            if (strlen(capsNames[i].name) == length &&
+                strncmp(list, capsNames[i].name, length) == 0) {
+                caps |= capsNames[i].bit;
+            }
+        }
+        list += length;
+        list += strspn(list, " ");
+    }
+    log_d("CAPS: client capabilities 0x%x \n", caps);
+
+    setCaps(from, caps);
+    return false;
+}
+
+/******************************************/
+/* setCaps: set the capabilities of the client at an address: of its
+ * player or spectator if it has joined, else those remembered for takeCaps.
+ */
+static void setCaps(const addr_t from, const int caps)
+{
+    player_t* player = playerFromAddr(from);
+    if (player != NULL) {
+        player_setCaps(player, caps);
+        return;
+    }
+    spectator_t* spectator = spectatorFromAddr(from);
+    if (spectator != NULL) {
+        spectator->caps = caps;
+        return;
+    }
+    for (int i = 0; i < PENDING_CAPS; i++) {
+        if (pendingCaps[i].caps != 0 &&
+            message_eqAddr(pendingCaps[i].from, from)) {
+            pendingCaps[i].caps = caps;
+            return;
+        }
+    }
+    if (caps != 0) {
+        pendingCaps[nextPendingCaps].from = from;
+        pendingCaps[nextPendingCaps].caps = caps;
+        nextPendingCaps = (nextPendingCaps + 1) % PENDING_CAPS;
+    }
+}
 
-    if (game->spectator == NULL) {
-        game->spectator = spectator;
+/******************************************/
+/* handleVIEW: handles a VIEW message, "VIEW rows cols [top left]", in
+ * which a client whose screen is smaller than the map asks for DISPLAYs
+ * of just a rows x cols viewport: around its player, or for a
+ * spectator, with its top-left corner at (top, left).  Those are sent
+ * as VIEWPORT messages (see sendDISPLAY); VIEW 0 0 returns to DISPLAY.
+ * The client must have joined; the new view is sent at once.
+ *
+ * Caller provides: A pointer to anything, an address from correspondent, and
+ * the viewport's size (and position)
+ *
+ * Function returns: false -- server continues to loop for more messages
+ *
+ * Logs: a VIEW from a client that has not joined.
+ */
+static bool handleVIEW(void* arg, const addr_t from, const char* size)
+{
+    int rows = 0, cols = 0, top = 0, left = 0;
+    int n = sscanf(size, "%d %d %d %d", &rows, &cols, &top, &left);
+    if (n != 2 && n != 4) {
+        sendERROR(from, "Malformed VIEW.");
         return false;
-    } else {
-        player_t* oldSpectator = game->spectator;
-        game->spectator = spectator;
-        addr_t oldAddress = player_getAddr(oldSpectator);
-        sendQUIT(oldAddress, "You have been replaced by a new spectator.");
+    }
+
+    player_t* player = playerFromAddr(from);
+    if (player != NULL) {
+        player_setView(player, rows, cols, top, left);
+        sendDISPLAY(from, player);
+        return false;
+    }
+    spectator_t* spectator = spectatorFromAddr(from);
+    if (spectator == NULL) {
+        log_v("VIEW from a client that has not joined. \n");
         return false;
     }
+    if (rows <= 0 || cols <= 0) {  // no viewport
+        rows = cols = 0;
+    }
+    spectator->viewRows = rows;
+    spectator->viewCols = cols;
+    spectator->viewTop = top;
+    spectator->viewLeft = left;
+    sendSpectatorDISPLAY(spectator);
+    return false;
+}
+
+/******************************************/
+/* takeCaps: return the capabilities remembered by handleCAPS for a client
+ * that is now joining, and forget them; 0 if there are none.
+ */
+static int takeCaps(const addr_t from)
+{
+    for (int i = 0; i < PENDING_CAPS; i++) {
+        if (pendingCaps[i].caps != 0 &&
+            message_eqAddr(pendingCaps[i].from, from)) {
+            int caps = pendingCaps[i].caps;
+            pendingCaps[i].caps = 0;
+            return caps;
+        }
+    }
+    return 0;
+}
+
+/******************************************/
+/* capsOf: the capabilities of the client at an address, for replies to
+ * it that are not about a particular player: as setCaps would find them.
+ */
+static int capsOf(const addr_t to)
+{
+    player_t* player = playerFromAddr(to);
+    if (player != NULL) {
+        return player_getCaps(player);
+    }
+    spectator_t* spectator = spectatorFromAddr(to);
+    if (spectator != NULL) {
+        return spectator->caps;
+    }
+    for (int i = 0; i < PENDING_CAPS; i++) {
+        if (pendingCaps[i].caps != 0 &&
+            message_eqAddr(pendingCaps[i].from, to)) {
+            return pendingCaps[i].caps;
+        }
+    }
+    return 0;
 }
 
 /******************************************/
@@ -616,23 +1937,19 @@ static bool handleKEY(void* arg, const addr_t from, const char keyStroke)
         return true;  // error in usage
     }
 
-    player_t* player = NULL;
-    if (game->spectator != NULL &&
-        message_eqAddr(from, player_getAddr(game->spectator))) {
-        player = game->spectator;
-    } else {
-        player = playerFromAddr(from);  // player we are updating
-
-        if (player == NULL) {  // player not found or error
-            log_v("Player not found in set. \n");
-            return false;  // error in usage
-        }
+    player_t* player = playerFromAddr(from);  // player we are updating
+    spectator_t* spectator = player == NULL ? spectatorFromAddr(from) : NULL;
+    if (player == NULL && spectator == NULL) {  // not found or error
+        log_v("Player not found in set. \n");
+        return false;  // error in usage
     }
 
-    if (player_isSpectator(player)) {  // player is spectator
+    if (spectator != NULL) {  // client is spectator
         switch (keyStroke) {
             case 'Q':  // spectator quits
                 sendQUIT(from, "Thanks for watching!");
+                removeSpectator(spectator - game->spectators);
+                stats.spectatorsLeft++;
                 break;
 
             default:  // error
@@ -649,6 +1966,8 @@ static bool handleKEY(void* arg, const addr_t from, const char keyStroke)
             case 'q':  // player quits
                 if (keyStroke == 'Q') {
                     sendQUIT(from, "Thanks for playing!");
+                    removePlayer(player);
+                    sendDisplayAll();  // others see the player go
                 } else {
                     sendERROR(from, "Unknown keystroke.");
                 }
@@ -773,7 +2092,12 @@ static bool handleKEY(void* arg, const addr_t from, const char keyStroke)
  * Assumptions: We assume that mapString is in valid map format;
  * We assume game->gridHeight has already been initialized
  *
- * User must remember to free() game->baseMap and free() game->liveGameMap
+ * Also lists the open floor ('.') spots in game->openCells, from which
+ * drawOpenCell picks spots for gold and players
+ *
+ * game->baseMap, game->liveGameMap, game->openCells and game->buffers
+ * (and, if compositing on several threads, game->frameJobs and theirs)
+ * are allocated from game->arena, and freed with it.
  */
 static bool buildMap(char* mapString)
 {
@@ -786,45 +2110,50 @@ static bool buildMap(char* mapString)
         return false;  // error in usage
     }
 
-    // init game->gridWidth
+    // init game->gridWidth as the longest line; shorter lines
+    // (found in some contributed maps) are padded with solid rock
     int gridWidth = 0;
+    int lineWidth = 0;
     for (char* c = mapString; *c != '\0'; c++) {
         if (*c == '\n') {
-            break;
+            lineWidth = 0;
+        } else if (++lineWidth > gridWidth) {
+            gridWidth = lineWidth;
         }
-        gridWidth++;
     }
     game->gridWidth = gridWidth;
 
-    // update game->mapStringLength
-    game->mapStringLength = strlen(mapString);
+    // update game->mapStringLength: the length of a composited display,
+    // i.e., every row padded to gridWidth plus its newline
+    game->mapStringLength = game->gridHeight * (gridWidth + 1);
 
-    // malloc memory for array of pointers
-    game->baseMap = mem_malloc_assert(game->gridHeight * sizeof(char*),
-                                      "baseMap could not be allocated. \n");
+    // allocate memory for array of pointers
+    game->baseMap = mem_arena_alloc_assert(game->arena,
+                                           game->gridHeight * sizeof(char*),
+                                           "baseMap could not be allocated. \n");
 
     game->liveGameMap =
-        mem_malloc_assert(game->gridHeight * sizeof(char*),
-                          "liveGameMap could not be allocated. \n");
+        mem_arena_alloc_assert(game->arena, game->gridHeight * sizeof(char*),
+                               "liveGameMap could not be allocated. \n");
 
     for (int y = 0; y < game->gridHeight; y++) {
-        game->baseMap[y] = mem_malloc_assert(game->gridWidth * sizeof(char) + 1,
-                                             "baseMap row");
-        game->liveGameMap[y] = mem_malloc_assert(
-            game->gridWidth * sizeof(char) + 1, "liveGameMap row");
+        game->baseMap[y] = mem_arena_alloc_assert(
+            game->arena, game->gridWidth * sizeof(char) + 1, "baseMap row");
+        game->liveGameMap[y] = mem_arena_alloc_assert(
+            game->arena, game->gridWidth * sizeof(char) + 1, "liveGameMap row");
+        memset(game->baseMap[y], ' ', game->gridWidth);
+        game->baseMap[y][game->gridWidth] = '\0';
     }
 
     // loop through mapString char by char
-    char* startPointer = mapString;  // pointer to start of string
-    int i = 0;                       // current index in baseMap array
-    for (char* c = mapString; *c != '\0'; c++) {
+    int i = 0;  // current index in baseMap array
+    int x = 0;  // current column in that row
+    for (char* c = mapString; *c != '\0' && i < game->gridHeight; c++) {
         if (*c == '\n') {  // new line encountered
-            // squash with '\0'
-            *c = '\0';
-            strcpy(game->baseMap[i], startPointer);
             i++;
-            c++;
-            startPointer = c;
+            x = 0;
+        } else {
+            game->baseMap[i][x++] = *c;
         }
     }
 
@@ -832,9 +2161,176 @@ static bool buildMap(char* mapString)
         strcpy(game->liveGameMap[y], game->baseMap[y]);
     }
 
+    // list every open spot, once: count them, then fill in the list
+    game->numOpen = 0;
+    for (int y = 0; y < game->gridHeight; y++) {
+        for (int x = 0; x < game->gridWidth; x++) {
+            game->numOpen += (game->baseMap[y][x] == '.');
+        }
+    }
+    game->openCells = mem_arena_alloc_assert(
+        game->arena, (game->numOpen + 1) * sizeof(int),
+        "openCells could not be allocated. \n");
+    int n = 0;
+    for (int y = 0; y < game->gridHeight; y++) {
+        for (int x = 0; x < game->gridWidth; x++) {
+            if (game->baseMap[y][x] == '.') {
+                game->openCells[n++] = y * game->gridWidth + x;
+            }
+        }
+    }
+    game->openDrawn = 0;
+
+    // buffers for every DISPLAY message; and for each player's, if they
+    // are composited in parallel
+    newFrameBuffers(&game->buffers);
+    game->frameJobs = NULL;
+    game->numFrameJobs = 0;
+    if (options.threads > 1) {
+        game->frameJobs = mem_arena_alloc_assert(
+            game->arena, sizeof(frameJob_t) * maxPlayers,
+            "frame jobs could not be allocated. \n");
+        for (int i = 0; i < maxPlayers; i++) {
+            newFrameBuffers(&game->frameJobs[i].buffers);
+        }
+    }
+
     return true;  // success
 }
 
+/**************** newFrameBuffers ****************/
+/*
+ * Allocate, from game->arena, buffers for a frame of game's map: room
+ * for the header, then the map; the same for its run-length encoding,
+ * for DISPLAYZ; and room for its binary encoding, which is never longer
+ * than the map plus a header
+ */
+static void newFrameBuffers(frameBuffers_t* buffers)
+{
+    buffers->frame = mem_arena_alloc_assert(
+        game->arena, frameHeaderRoom + game->mapStringLength + 1,
+        "frame could not be allocated. \n");
+    buffers->packed = mem_arena_alloc_assert(
+        game->arena, frameHeaderRoom + game->mapStringLength + 1,
+        "packed frame could not be allocated. \n");
+    buffers->binary = mem_arena_alloc_assert(
+        game->arena, game->mapStringLength + PROTO_MAX_FIXED,
+        "binary frame could not be allocated. \n");
+}
+
+/**************** drawOpenCell ****************/
+/*
+ * Pick an open floor spot, uniformly at random among those not yet
+ * picked, by one step of a Fisher-Yates shuffle of game->openCells:
+ * the spots picked so far are the first game->openDrawn in the list.
+ * So gold piles and players' starting spots are all distinct.
+ * A spot a player has since moved onto is skipped.  Once every spot has
+ * been picked (only on maps with little floor), fall back to searching
+ * the list for any spot that is empty floor now, e.g., once held gold.
+ *
+ * Returns false, leaving y and x alone, if no spot is empty floor.
+ */
+static bool drawOpenCell(int* y, int* x)
+{
+    while (game->openDrawn < game->numOpen) {
+        int i = game->openDrawn++;
+        int j = i + rng_below(&game->rng, game->numOpen - i);
+        int cell = game->openCells[j];
+        game->openCells[j] = game->openCells[i];
+        game->openCells[i] = cell;
+
+        if (game->liveGameMap[cell / game->gridWidth][cell % game->gridWidth]
+            == '.') {
+            *y = cell / game->gridWidth;
+            *x = cell % game->gridWidth;
+            return true;
+        }
+    }
+
+    // every spot has been picked; look for one that is empty again
+    int start = rng_below(&game->rng, game->numOpen);
+    for (int k = 0; k < game->numOpen; k++) {
+        int cell = game->openCells[(start + k) % game->numOpen];
+        if (game->liveGameMap[cell / game->gridWidth][cell % game->gridWidth]
+            == '.') {
+            *y = cell / game->gridWidth;
+            *x = cell % game->gridWidth;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**************** transmit ****************/
+/*
+ * Hand a complete message to the network; every message the server sends
+ * passes through here.  In the BENCH and REPLAY builds nothing is sent:
+ * the bytes are only counted (and, in REPLAY, hashed).
+ */
+static void transmit(addr_t to, const char* message)
+{
+    transmitBytes(to, message, strlen(message));
+}
+
+/**************** transmitBytes ****************/
+/*
+ * As transmit, for a message of the given length, which need not be a
+ * string (see support/proto.h).
+ */
+static void transmitBytes(addr_t to, const char* message, const int length)
+{
+#if defined(BENCH)
+    bench.messages++;
+    bench.bytes += length;
+#elif defined(REPLAY)
+    replay.messages++;
+    replay.bytes += length;
+    replay.digest = xxhash64(message, length,
+                             replay.digest ^ ntohl(to.sin_addr.s_addr));
+#else
+    message_sendBytes(to, message, length);
+#endif
+}
+
+/**************** transmitMany ****************/
+/*
+ * As transmitBytes, to each of count addresses; the network module
+ * fragments the message once and sends the datagrams in batches (see
+ * message_sendMany).
+ */
+static void transmitMany(const addr_t to[], const int count,
+                         const char* message, const int length)
+{
+#if defined(BENCH) || defined(REPLAY)
+    for (int i = 0; i < count; i++) {
+        transmitBytes(to[i], message, length);
+    }
+#else
+    message_sendMany(to, count, message, length);
+#endif
+}
+
+/**************** sendBinary ****************/
+/*
+ * Encode a message with support/proto.h, in the scratch arena, and send
+ * it.  DISPLAY, which has a buffer of its own, is sent by sendDISPLAY.
+ *
+ * Logs errors
+ */
+static void sendBinary(addr_t to, const proto_msg_t* msg)
+{
+    const int size = PROTO_MAX_FIXED + msg->textLength;
+    char* message = mem_arena_alloc_assert(scratch, size,
+                                           "sendBinary: System out of memory.");
+    int length = proto_encode(msg, message, size);
+    if (length < 0) {
+        log_d("sendBinary could not encode a message of type %d. \n",
+              msg->type);
+        return;  // error in usage
+    }
+    transmitBytes(to, message, length);
+}
+
 /**************** sendMsg ****************/
 /*
  * Send a message to the client.
@@ -851,19 +2347,18 @@ static void sendMsg(addr_t to, char* type, char* body)
         return;  // error in usage
     }
     if (body == NULL) {  // no body
-        message_send(to, type);
+        transmit(to, type);
         return;
     }
 
     // + 1 for player letter
     // + 1 for space between type and body
     // + 1 for termining null character
-    char* message =
-        mem_malloc_assert(sizeof(char) * (strlen(type) + strlen(body)) + 1 + 1,
-                          "sendMsg: System out of memory.");
+    char* message = mem_arena_alloc_assert(
+        scratch, sizeof(char) * (strlen(type) + strlen(body)) + 1 + 1,
+        "sendMsg: System out of memory.");
     sprintf(message, "%s %s", type, body);
-    message_send(to, message);
-    mem_free(message);
+    transmit(to, message);
 }
 
 /**************** sendOK ****************/
@@ -880,6 +2375,10 @@ static void sendOK(addr_t to, char* playerKey)
         return;  // error in usage
     }
 
+    if (capsOf(to) & capsBIN) {
+        sendBinary(to, &(proto_msg_t){.type = PROTO_OK, .ch = playerKey[0]});
+        return;
+    }
     sendMsg(to, "OK", playerKey);
 }
 
@@ -892,6 +2391,13 @@ static void sendOK(addr_t to, char* playerKey)
  */
 static void sendGRID(addr_t to)
 {
+    if (capsOf(to) & capsBIN) {
+        sendBinary(to, &(proto_msg_t){.type = PROTO_GRID,
+                                      .rows = game->gridHeight,
+                                      .cols = game->gridWidth});
+        return;
+    }
+
     // build gridMsg
     int gridHeightLength = snprintf(NULL, 0, "%d", game->gridHeight);  // nrows
     int gridWidthLength = snprintf(NULL, 0, "%d", game->gridWidth);    // ncols
@@ -899,165 +2405,525 @@ static void sendGRID(addr_t to)
     // + 1 for space between nrows and ncols
     // + 1 for termining null character
     char* gridMsg =
-        mem_malloc_assert(gridHeightLength + gridWidthLength + 1 + 1,
-                          "GridMsg could not be allocated.");
+        mem_arena_alloc_assert(scratch,
+                               gridHeightLength + gridWidthLength + 1 + 1,
+                               "GridMsg could not be allocated.");
 
     sprintf(gridMsg, "%d %d", game->gridHeight, game->gridWidth);
     sendMsg(to, "GRID", gridMsg);
-    mem_free(gridMsg);
 }
 
-/**************** sendGOLD ****************/
+/**************** sendGOLD ****************/
+/*
+ * send GOLD [n] [p] [r] to client.
+ * where n is the number of gold nuggets the player has just collected,
+ * p is the player's purse (0 for a spectator)
+ * and r is the remaining number of nuggets left to be found;
+ * caps are those of the client's player or spectator
+ *
+ * returns nothing
+ *
+ * Logs errors
+ */
+static void sendGOLD(addr_t to, int caps, int n, int p)
+{
+    if (!message_isAddr(to)) {
+        log_v("sendGOLD called without a correspondent. \n");
+        return;  // error in usage
+    }
+
+    if (caps & capsBIN) {
+        sendBinary(to, &(proto_msg_t){.type = PROTO_GOLD, .n = n, .p = p,
+                                      .r = game->goldRemaining});
+        return;
+    }
+
+    // build goldMsg
+    int nLength = snprintf(NULL, 0, "%d", n);                    // n
+    int pLength = snprintf(NULL, 0, "%d", p);                    // p
+    int rLength = snprintf(NULL, 0, "%d", game->goldRemaining);  // r
+
+    // + 1 for space between n and p
+    // + 1 for space between p and r
+    // + 1 for termining null character
+    char* goldMsg =
+        mem_arena_alloc_assert(scratch, nLength + pLength + rLength + 1 + 1 + 1,
+                               "goldMsg could not be allocated.");
+
+    sprintf(goldMsg, "%d %d %d", n, p, game->goldRemaining);
+
+    sendMsg(to, "GOLD", goldMsg);
+}
+
+/**************** sendSEQ ****************/
+/*
+ * send SEQ [seq] to client, where seq is the number the client gave the
+ * keystroke it sent; the replies to that keystroke follow
+ *
+ * returns nothing
+ */
+static void sendSEQ(addr_t to, int seq)
+{
+    if (capsOf(to) & capsBIN) {
+        sendBinary(to, &(proto_msg_t){.type = PROTO_SEQ, .seq = seq});
+        return;
+    }
+    char body[16];
+    snprintf(body, sizeof(body), "%d", seq);
+    sendMsg(to, "SEQ", body);
+}
+
+/**************** sendGoldAll ****************/
+/*
+ * iterates through each player in player set and calls sendGOLD,
+ * then sends the spectators theirs, all at once (see sendSpectators)
+ *
+ * each client receives GOLD n p r
+ *
+ * returns nothing
+ *
+ * Logs errors
+ */
+static void sendGoldAll()
+{
+    if (game->players != NULL) {  // defensive
+        set_iterate(game->players, NULL, playerSendGold);
+    }
+    if (game->numSpectators > 0) {
+        char text[32];
+        snprintf(text, sizeof(text), "GOLD 0 0 %d", game->goldRemaining);
+        sendSpectators(&(proto_msg_t){.type = PROTO_GOLD,
+                                      .r = game->goldRemaining},
+                       text);
+    }
+}
+
+/**************** playerSendGold ****************/
+/*
+ * calls sendGOLD on player object
+ *
+ */
+static void playerSendGold(void* arg, const char* key, void* item)
+{
+    seat_t* seat = item;
+    if (seat == NULL) {
+        log_v("playerSendGold called with NULL seat. \n");
+        return;  // error in usage
+    }
+    player_t* player = seat->player;
+    if (player == NULL) {
+        return;  // has quit
+    }
+
+    sendGOLD(player_getAddr(player), player_getCaps(player), 0,
+             player_getGold(player));
+}
+
+/**************** sendDISPLAY ****************/
+/*
+ * send DISPLAY\n[string] to client.
+ * where string is a multi-line textual representation of the grid as known/seen
+ * by this client.
+ *
+ * each client receives a different version of map
+ *
+ * spectator sees all but is not represented on the map
+ * players only see what is in their field of vision and the player's own
+ * position is represented by an '@'
+ *
+ * Assumes that loadGame() has been called and game, game->mapStringLength,
+ * game->liveGameMap and game->buffers have been initialized; the frame
+ * is composited in place, then its header is put in front (see
+ * composeFrame), so nothing is allocated
+ *
+ * a client that announced CAPS RLE1 is sent DISPLAYZ\n[encoded string]
+ * instead, unless the encoding is no shorter (see support/rle.h); one that
+ * announced CAPS BIN1 is sent a binary DISPLAY (see support/proto.h)
+ *
+ * a client that asked for a viewport (see handleVIEW) smaller than the
+ * map is sent just that rectangle, as VIEWPORT top left rows cols\n[string]
+ * (or VIEWPORTZ ..., or a binary VIEWPORT)
+ *
+ * a frame identical to the last this client was sent, as when another
+ * player moves out of its sight, is not sent again (see support/xxhash.h)
+ *
+ * returns nothing
+ *
+ * Logs errors
+ */
+static void sendDISPLAY(addr_t to, player_t* player)
+{
+    if (!message_isAddr(to)) {
+        log_v("sendDISPLAY called without a correspondent. \n");
+        return;  // error in usage
+    }
+
+    if (player == NULL) {
+        log_v("sendDISPLAY called with NULL player. \n");
+        return;  // error in usage
+    }
+
+    frameJob_t job = {.player = player, .buffers = game->buffers};
+    composeFrame(&job);
+    sendFrameJob(to, &job);
+}
+
+/**************** composeFrame ****************/
+/*
+ * composite a player's frame -- the whole map, or its viewport -- in
+ * job->buffers, and encode it as sendDISPLAY describes, leaving the
+ * message to send in job->message; or NULL there, if the frame is the
+ * same as the last this player was sent
+ *
+ * touches nothing but the job, its buffers and its player, and only
+ * reads the map, so the frames of different players may be composed at
+ * once, on different threads (see sendDisplayAll)
+ */
+static void composeFrame(frameJob_t* job)
+{
+    player_t* player = job->player;
+
+    // the whole map, or the player's viewport
+    int top = 0, left = 0, rows = game->gridHeight, cols = game->gridWidth;
+    bool view = player_getView(player, &top, &left, &rows, &cols);
+
+    char* output = job->buffers.frame + frameHeaderRoom;
+    player_compositeView(player, game->liveGameMap, top, left, rows, cols,
+                         &output);
+
+    // skip a frame identical to the last this client was sent
+    if (!player_frameChanged(player,
+                             frameHash(output, top, left, rows, cols))) {
+        job->message = NULL;
+        return;
+    }
+    encodeMap(job, player_getCaps(player), view, top, left, rows, cols);
+}
+
+/**************** sendFrameJob ****************/
+/*
+ * send the frame composeFrame left in a job, if it changed; and count it
+ */
+static void sendFrameJob(addr_t to, frameJob_t* job)
+{
+    benchCount(frames);
+    if (job->message == NULL) {
+        benchCount(unchanged);
+        stats.unchangedFrames++;
+        return;
+    }
+    countFrame(job, 1);
+    transmitBytes(to, job->message, job->length);
+}
+
+/**************** frameHash ****************/
+/*
+ * hash a composited map, for telling whether a client has already been
+ * sent it; the seed tells apart equal maps of different viewports, and
+ * the hash is never 0, which stands for no frame
+ */
+static uint64_t frameHash(const char* map, int top, int left, int rows,
+                          int cols)
+{
+    uint64_t seed = ((uint64_t)top << 48) ^ ((uint64_t)left << 32) ^
+                    ((uint64_t)rows << 16) ^ (uint64_t)cols;
+    uint64_t hash = xxhash64(map, rows * (cols + 1), seed);
+    return hash == 0 ? 1 : hash;
+}
+
+/**************** sendMap ****************/
+/*
+ * send the map composited in game->buffers to count clients that share
+ * the capabilities caps, encoding it once for them all (see encodeMap)
+ */
+static void sendMap(const addr_t to[], const int count, const int caps,
+                    bool view, int top, int left, int rows, int cols)
+{
+    frameJob_t job = {.buffers = game->buffers};
+    encodeMap(&job, caps, view, top, left, rows, cols);
+    countFrame(&job, count);
+    transmitMany(to, count, job.message, job.length);
+}
+
+/**************** encodeMap ****************/
+/*
+ * encode a map composited in job->buffers.frame, behind frameHeaderRoom
+ * bytes, for a client with the capabilities caps: in binary, run-length
+ * encoded, or as it is, with its header line in front -- the type, then
+ * for a viewport its top, left, rows and cols; leave the message to send,
+ * which lies in the job's buffers, in job->message
+ */
+static void encodeMap(frameJob_t* job, const int caps, bool view, int top,
+                      int left, int rows, int cols)
+{
+    char* map = job->buffers.frame + frameHeaderRoom;
+    job->mapLength = rows * (cols + 1);
+    job->encodedLength = job->mapLength;
+    job->encoding = 0;
+    const char* type = view ? "VIEWPORT" : "DISPLAY";
+
+    if (caps & capsBIN) {
+        proto_msg_t msg = {.type = view ? PROTO_VIEWPORT : PROTO_DISPLAY,
+                           .top = top, .left = left, .rows = rows,
+                           .cols = cols, .text = map,
+                           .textLength = job->mapLength};
+        int length = proto_encode(&msg, job->buffers.binary,
+                                  game->mapStringLength + PROTO_MAX_FIXED);
+        if (length >= 0) {  // else, a map proto.h can't carry; send text
+            job->encoding = capsBIN;
+            job->message = job->buffers.binary;
+            job->length = job->encodedLength = length;
+            return;
+        }
+    }
+    if (caps & capsRLE) {
+        char* packed = job->buffers.packed + frameHeaderRoom;
+        int length = rle_encode(map, job->mapLength, packed,
+                                job->mapLength + 1);
+        if (length >= 0) {  // no longer than the frame itself
+            job->encoding = capsRLE;
+            job->encodedLength = length;
+            map = packed;
+            type = view ? "VIEWPORTZ" : "DISPLAYZ";
+        }
+    }
+
+    char header[64];  // no longer than frameHeaderRoom
+    int headerLength =
+        view ? snprintf(header, sizeof(header), "%s %d %d %d %d\n", type,
+                        top, left, rows, cols)
+             : snprintf(header, sizeof(header), "%s\n", type);
+    memcpy(map - headerLength, header, headerLength);
+    job->message = map - headerLength;
+    job->length = headerLength + job->encodedLength;
+}
+
+/**************** countFrame ****************/
+/*
+ * count a frame, as encodeMap left it in a job, sent to count clients
+ */
+static void countFrame(const frameJob_t* job, const int count)
+{
+    stats.frames += count;
+    stats.frameBytes += (uint64_t)job->mapLength * count;
+    stats.frameBytesSent += (uint64_t)job->encodedLength * count;
+    if (job->encoding == capsBIN) {
+        stats.binaryFrames += count;
+    } else if (job->encoding == capsRLE) {
+        stats.packedFrames += count;
+    }
+}
+
+/**************** sendDisplayAll ****************/
 /*
- * send GOLD [n] [p] [r] to client.
- * where n is the number of gold nuggets the player has just collected,
- * p is the player's purse
- * and r is the remaining number of nuggets left to be found
+ * iterates through each player in player set and calls sendDISPLAY,
+ * then sends the spectators theirs (see sendSpectatorsDISPLAY)
+ *
+ * each client receives a different version of map; with --threads, the
+ * players' frames are composited and encoded at once, each in its own
+ * game->frameJobs buffers, as jobs on the scheduler's threads (see
+ * support/jobs.h), then counted and sent on this thread, in the same
+ * order as ever, so that the messages, and so a recording and its
+ * replay, are just what they would be on one thread
  *
  * returns nothing
  *
  * Logs errors
  */
-static void sendGOLD(addr_t to, player_t* player, int n)
+static void sendDisplayAll()
 {
-    if (!message_isAddr(to)) {
-        log_v("sendGOLD called without a correspondent. \n");
-        return;  // error in usage
+    if (game->players == NULL) {  // defensive
+        sendSpectatorsDISPLAY();
+        return;
     }
-
-    if (player == NULL) {
-        log_v("sendGOLD called with NULL player. \n");
-        return;  // error in usage
+    if (scheduler == NULL) {
+        set_iterate(game->players, NULL, playerSendDisplay);
+        sendSpectatorsDISPLAY();
+        return;
     }
 
-    // build goldMsg
-    int nLength = snprintf(NULL, 0, "%d", n);                       // n
-    int pLength = snprintf(NULL, 0, "%d", player_getGold(player));  // p
-    int rLength = snprintf(NULL, 0, "%d", game->goldRemaining);     // r
-
-    // + 1 for space between n and p
-    // + 1 for space between p and r
-    // + 1 for termining null character
-    char* goldMsg = mem_malloc_assert(nLength + pLength + rLength + 1 + 1 + 1,
-                                      "goldMsg could not be allocated.");
-
-    sprintf(goldMsg, "%d %d %d", n, player_getGold(player),
-            game->goldRemaining);
-
-    sendMsg(to, "GOLD", goldMsg);
-    mem_free(goldMsg);
+    game->numFrameJobs = 0;
+    set_iterate(game->players, NULL, playerFrameJob);
+    jobs_run(scheduler, game->numFrameJobs, composeTask, game->frameJobs);
+    for (int i = 0; i < game->numFrameJobs; i++) {
+        frameJob_t* job = &game->frameJobs[i];
+        sendFrameJob(player_getAddr(job->player), job);
+    }
+    sendSpectatorsDISPLAY();
 }
 
-/**************** sendGoldAll ****************/
+/**************** startScheduler ****************/
 /*
- * iterates through each player in player set and calls sendGOLD
- *
- * each client receives GOLD n p r
- *
- * returns nothing
- *
- * Logs errors
+ * start the work-stealing scheduler, with options.threads threads, that
+ * sendDisplayAll composites the players' frames on, if there is to be
+ * one; if it can't be started, they are composited on this thread alone
  */
-static void sendGoldAll()
+static void startScheduler()
 {
-    if (game->players != NULL) {  // defensive
-        set_iterate(game->players, NULL, playerSendGold);
+    if (options.threads > 1) {
+        scheduler = jobs_new(options.threads);
+        if (scheduler == NULL) {
+            log_d("Could not start %d compositing threads; using one. \n",
+                  options.threads);
+        }
     }
 }
 
-/**************** playerSendGold ****************/
+/**************** playerFrameJob ****************/
 /*
- * calls sendGOLD on player object
- *
+ * give a player the next of game->frameJobs, for sendDisplayAll
  */
-static void playerSendGold(void* arg, const char* key, void* item)
+static void playerFrameJob(void* arg, const char* key, void* item)
 {
-    player_t* player = item;
-    if (player == NULL) {
-        log_v("playerSendGold called with NULL player. \n");
+    seat_t* seat = item;
+    if (seat == NULL || game->numFrameJobs == maxPlayers) {
+        log_v("playerFrameJob called with NULL seat, or too many");
         return;  // error in usage
     }
+    player_t* player = seat->player;
+    if (player == NULL) {
+        return;  // has quit
+    }
+    game->frameJobs[game->numFrameJobs++].player = player;
+}
 
-    sendGOLD(player_getAddr(player), player, 0);
+/**************** composeTask ****************/
+/*
+ * compose the ith of an array of frame jobs; run by the scheduler
+ */
+static void composeTask(void* arg, const int i)
+{
+    frameJob_t* jobs = arg;
+    composeFrame(&jobs[i]);
 }
 
-/**************** sendDISPLAY ****************/
+/**************** playerSendDisplay ****************/
 /*
- * send DISPLAY\n[string] to client.
- * where string is a multi-line textual representation of the grid as known/seen
- * by this client.
- *
- * each client receives a different version of map
- *
- * spectator sees all but is not represented on the map
- * players only see what is in their field of vision and the player's own
- * position is represented by an '@'
- *
- * Assumes that loadGame() has been called and game, game->mapStringLength, and
- * game->liveGameMap have been initialized
- *
- * returns nothing
+ * calls sendDISPLAY on player object
  *
- * Logs errors
  */
-static void sendDISPLAY(addr_t to, player_t* player)
+static void playerSendDisplay(void* arg, const char* key, void* item)
 {
-    if (!message_isAddr(to)) {
-        log_v("sendDISPLAY called without a correspondent. \n");
+    seat_t* seat = item;
+    if (seat == NULL) {
+        log_v("playerSendDisplay called with NULL seat");
         return;  // error in usage
     }
-
+    player_t* player = seat->player;
     if (player == NULL) {
-        log_v("sendDISPLAY called with NULL player. \n");
-        return;  // error in usage
+        return;  // has quit
     }
+    sendDISPLAY(player_getAddr(player), player);
+}
 
-    char* output = mem_malloc_assert(sizeof(char) * game->mapStringLength + 1,
-                                     "Display could not be allocated.");
-
-    player_compositeDisplay(player, game->liveGameMap, &output);
+/**************** sendSpectators ****************/
+/*
+ * send a message to every spectator, encoded once for those that
+ * announced CAPS BIN1, as msg, and once for the rest, as text; each
+ * group is sent it with one transmitMany
+ *
+ * returns nothing
+ */
+static void sendSpectators(const proto_msg_t* msg, const char* text)
+{
+    int count = gatherSpectators(0, capsBIN, false);
+    if (count > 0) {
+        transmitMany(game->spectatorAddrs, count, text, strlen(text));
+    }
 
-    if (output != NULL) {
-        char* displayMsg = mem_malloc_assert(
-            sizeof(char) * (strlen("DISPLAY\n") + game->mapStringLength) + 1,
-            "displayMsg could not be allocated.");
-        sprintf(displayMsg, "%s\n%s", "DISPLAY", output);
-        sendMsg(to, displayMsg, NULL);
-        mem_free(displayMsg);
-        mem_free(output);
+    count = gatherSpectators(capsBIN, capsBIN, false);
+    if (count > 0) {
+        const int size = PROTO_MAX_FIXED + msg->textLength;
+        char* message = mem_arena_alloc_assert(
+            scratch, size, "sendSpectators: System out of memory.");
+        int length = proto_encode(msg, message, size);
+        if (length < 0) {
+            log_d("sendSpectators could not encode a message of type %d. \n",
+                  msg->type);
+            return;  // error in usage
+        }
+        transmitMany(game->spectatorAddrs, count, message, length);
     }
 }
 
-/**************** sendDisplayAll ****************/
+/**************** sendSpectatorsDISPLAY ****************/
 /*
- * iterates through each player in player set and calls sendDISPLAY
+ * send the frame to every spectator: the whole map is composited once,
+ * and encoded at most once each way -- as it is, as DISPLAYZ, and in
+ * binary -- for all the spectators that want it so, each group being
+ * sent it with one transmitMany; a spectator with a viewport is sent
+ * its own, by sendSpectatorDISPLAY
  *
- * each client receives a different version of map
+ * a whole map identical to the last sent, as when a player moves along
+ * a passage, is not sent again
  *
  * returns nothing
- *
- * Logs errors
  */
-static void sendDisplayAll()
+static void sendSpectatorsDISPLAY()
 {
-    if (game->players != NULL) {  // defensive
-        set_iterate(game->players, NULL, playerSendDisplay);
+    int top = 0, left = 0, rows = 0, cols = 0;
+    int viewers = 0;  // spectators with a viewport
+    for (int i = 0; i < game->numSpectators; i++) {
+        if (spectatorView(&game->spectators[i], &top, &left, &rows, &cols)) {
+            sendSpectatorDISPLAY(&game->spectators[i]);
+            viewers++;
+        }
+    }
+    if (viewers == game->numSpectators) {
+        return;  // no one to share the whole map
+    }
+
+    rows = game->gridHeight;
+    cols = game->gridWidth;
+    char* output = game->buffers.frame + frameHeaderRoom;
+    compositeSpectator(0, 0, rows, cols, output);
+    benchCount(frames);
+    uint64_t hash = frameHash(output, 0, 0, rows, cols);
+    if (hash == game->spectatorFrame) {
+        benchCount(unchanged);
+        stats.unchangedFrames += game->numSpectators - viewers;
+        return;
+    }
+    game->spectatorFrame = hash;
+
+    // by encoding: plain, run-length encoded, binary
+    const int groups[][2] = {{0, capsRLE | capsBIN},
+                             {capsRLE, capsRLE | capsBIN},
+                             {capsBIN, capsBIN}};
+    for (int g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        int count = gatherSpectators(groups[g][0], groups[g][1], true);
+        if (count > 0) {
+            sendMap(game->spectatorAddrs, count, groups[g][0], false, 0, 0,
+                    rows, cols);
+        }
     }
 }
 
-/**************** playerSendDisplay ****************/
+/**************** sendSpectatorDISPLAY ****************/
 /*
- * calls sendDISPLAY on player object
+ * send one spectator the whole map, or its viewport, as sendDISPLAY
+ * would a player; as for a player, a frame identical to the last this
+ * spectator was sent is not sent again
  *
+ * returns nothing
  */
-static void playerSendDisplay(void* arg, const char* key, void* item)
+static void sendSpectatorDISPLAY(spectator_t* spectator)
 {
-    player_t* player = item;
-    if (player == NULL) {
-        log_v("playerSendDisplay called with NULL player");
-        return;  // error in usage
+    int top = 0, left = 0, rows = game->gridHeight, cols = game->gridWidth;
+    bool view = spectatorView(spectator, &top, &left, &rows, &cols);
+
+    char* output = game->buffers.frame + frameHeaderRoom;
+    compositeSpectator(top, left, rows, cols, output);
+    benchCount(frames);
+    uint64_t hash = frameHash(output, top, left, rows, cols);
+    if (hash == spectator->frameHash) {
+        benchCount(unchanged);
+        stats.unchangedFrames++;
+        return;
     }
-    sendDISPLAY(player_getAddr(player), player);
+    spectator->frameHash = hash;
+    sendMap(&spectator->addr, 1, spectator->caps, view, top, left, rows,
+            cols);
 }
 
 /**************** sendERROR ****************/
@@ -1080,6 +2946,11 @@ static void sendERROR(addr_t to, char* explanation)
         return;  // error in usage
     }
 
+    if (capsOf(to) & capsBIN) {
+        sendBinary(to, &(proto_msg_t){.type = PROTO_ERROR, .text = explanation,
+                                      .textLength = strlen(explanation)});
+        return;
+    }
     sendMsg(to, "ERROR", explanation);
 }
 
@@ -1103,6 +2974,11 @@ static void sendQUIT(addr_t to, char* explanation)
         return;  // error in usage
     }
 
+    if (capsOf(to) & capsBIN) {
+        sendBinary(to, &(proto_msg_t){.type = PROTO_QUIT, .text = explanation,
+                                      .textLength = strlen(explanation)});
+        return;
+    }
     sendMsg(to, "QUIT", explanation);
 }
 
@@ -1113,7 +2989,8 @@ static void sendQUIT(addr_t to, char* explanation)
  *      B         16 Bob*
  *      C         230 Carol*
  *
- * Alice, Bob, and Carol are all example player names
+ * Alice, Bob, and Carol are all example player names; the spectators
+ * are sent it too, all at once (see sendSpectators)
  *
  * returns nothing
  *
@@ -1124,6 +3001,16 @@ static void sendQuitAll()
     if (game->players != NULL) {  // defensive
         set_iterate(game->players, NULL, playerSendQUIT);
     }
+    if (game->numSpectators > 0) {
+        char* leaderBoard = playerLeaderBoard();
+        char* text = mem_arena_alloc_assert(
+            scratch, strlen("QUIT ") + strlen(leaderBoard) + 1,
+            "sendQuitAll: System out of memory.");
+        sprintf(text, "QUIT %s", leaderBoard);
+        sendSpectators(&(proto_msg_t){.type = PROTO_QUIT, .text = leaderBoard,
+                                      .textLength = strlen(leaderBoard)},
+                       text);
+    }
 }
 
 /**************** playerSendQUIT ****************/
@@ -1136,20 +3023,23 @@ static void sendQuitAll()
  */
 static void playerSendQUIT(void* arg, const char* key, void* item)
 {
-    player_t* player = item;
-    if (player == NULL) {
-        log_v("playerSendQUIT called with NULL player");
+    seat_t* seat = item;
+    if (seat == NULL) {
+        log_v("playerSendQUIT called with NULL seat");
         return;  // error in usage
     }
+    player_t* player = seat->player;
+    if (player == NULL) {
+        return;  // has quit, and been sent QUIT already
+    }
 
     char* leaderBoard = playerLeaderBoard();
     sendQUIT(player_getAddr(player), leaderBoard);
-    mem_free(leaderBoard);
 }
 
 /**************** playerLeaderBoard ****************/
 /*
- * creates a formatted leaderboard
+ * creates a formatted leaderboard, in the scratch arena
  *
  */
 char* playerLeaderBoard()
@@ -1162,36 +3052,34 @@ char* playerLeaderBoard()
     char* header = "QUIT GAME OVER:\n";
     const int maxlineLength = 28;
 
-    char* leaderBoard = mem_malloc_assert(
-        sizeof(char) * ((game->numPlayers + 1) * (maxlineLength) + 1), "leaderboard could not be allocated.");
+    char* leaderBoard = mem_arena_alloc_assert(
+        scratch, sizeof(char) * ((game->numPlayers + 1) * (maxlineLength) + 1),
+        "leaderboard could not be allocated.");
 
     strncpy(leaderBoard, header, maxlineLength);
 
     for (int i = 0; i < game->numPlayers; i++) {
         // iterate through each player letter in the players set
         playerLetter = 'A' + i;
-        char* playerLetterPtr = mem_malloc_assert(
-            sizeof(char) + 1, "playerLetterPtr could not be allocated.");
-        playerLetterPtr[0] = playerLetter;
-        playerLetterPtr[1] = '\0';
-        player = set_find(game->players, playerLetterPtr);
-        mem_free(playerLetterPtr);
-        
-        ID = player_getID(player);
-        fflush(stdout);
-        gold = player_getGold(player);
-        name = player_getName(player);
-
-        char* nextLine = mem_malloc_assert(sizeof(char) * maxlineLength,
-                                     "NextLine could not be allocated.");
+        char playerLetterPtr[] = {playerLetter, '\0'};
+        seat_t* seat = set_find(game->players, playerLetterPtr);
+        player = seat->player;
+
+        ID = playerLetter;
+        if (player != NULL) {
+            gold = player_getGold(player);
+            name = player_getName(player);
+        } else {  // has quit; its seat remembers
+            gold = seat->purse;
+            name = seat->name;
+        }
+
+        char nextLine[maxlineLength];
         // format output line for a player's results
         snprintf(nextLine, maxlineLength, "%c%10d %s\n", ID, gold, name);
 
         // add the new line to the leaderboard
         strcat(leaderBoard, nextLine);
-
-        // free memory
-        mem_free(nextLine);
     }
     return leaderBoard;
 }
@@ -1202,6 +3090,10 @@ char* playerLeaderBoard()
  */
 static bool movePlayer(player_t* player, int y, int x)
 {
+    if (y < 0 || y >= game->gridHeight || x < 0 || x >= game->gridWidth) {
+        return false;  // can't move off the edge of the map
+    }
+
     char c = game->liveGameMap[y][x];    // temp char for game character at
                                          // intended move index
     char thisID = player_getID(player);  // holds letterID of the current player
@@ -1212,7 +3104,10 @@ static bool movePlayer(player_t* player, int y, int x)
     if (c == ' ' || c == '|' || c == '-' || c == '+') {
         // can't move into a wall
         return false;
-    } else if (c == '.' || c == '#') {
+    }
+    benchCount(moves);  // every other case is a move
+
+    if (c == '.' || c == '#') {
         // normal valid move
         player_setLocation(player, y, x);
         game->liveGameMap[y][x] = thisID;
@@ -1235,7 +3130,8 @@ static bool movePlayer(player_t* player, int y, int x)
 
         // update gold to show the player the amount they picked up
         addr_t address = player_getAddr(player);
-        sendGOLD(address, player, goldFound);
+        sendGOLD(address, player_getCaps(player), goldFound,
+                 player_getGold(player));
 
         return true;
     } else {
@@ -1245,17 +3141,52 @@ static bool movePlayer(player_t* player, int y, int x)
         game->liveGameMap[y][x] = thisID;
 
         // swap the other player into the current player's location
-        char* otherKey = mem_malloc_assert(sizeof(char) * 2, "set key");
-        otherKey[0] = otherID;
-        otherKey[1] = '\0';
-        player_t* other = set_find(game->players, otherKey);
-        mem_free(otherKey);
-        player_setLocation(other, py, px);
+        char otherKey[] = {otherID, '\0'};
+        seat_t* other = set_find(game->players, otherKey);
+        player_setLocation(other->player, py, px);
         game->liveGameMap[py][px] = otherID;
         return true;
     }
 }
 
+/**************** removePlayer ****************/
+/*
+ * take a player who has quit off the map, and return its record to the
+ * pool, for the next player to join; its seat keeps the name and purse
+ * for the leaderboard
+ */
+static void removePlayer(player_t* player)
+{
+    char playerKey[] = {player_getID(player), '\0'};
+    seat_t* seat = set_find(game->players, playerKey);
+    const char* name = player_getName(player);
+    seat->name = mem_arena_alloc_assert(game->arena, strlen(name) + 1,
+                                        "Name could not be allocated. \n");
+    strcpy(seat->name, name);
+    seat->purse = player_getGold(player);
+    seat->player = NULL;
+
+    int py, px;
+    player_getLocation(player, &py, &px);
+    game->liveGameMap[py][px] = game->baseMap[py][px];
+    player_delete(player);
+}
+
+/**************** newSeat ****************/
+/*
+ * returns a seat for the given player, or for one about to be loaded
+ * if NULL, allocated from the game's arena
+ */
+static seat_t* newSeat(player_t* player)
+{
+    seat_t* seat = mem_arena_alloc_assert(game->arena, sizeof(seat_t),
+                                          "Seat could not be allocated. \n");
+    seat->player = player;
+    seat->name = NULL;
+    seat->purse = 0;
+    return seat;
+}
+
 /**************** sendQUIT ****************/
 /*
  * returns pointer to player object associated with given address
@@ -1274,16 +3205,103 @@ static player_t* playerFromAddr(addr_t address)
         return NULL;  // error in usage
     }
 
-    addrStruct* adrs = mem_malloc_assert(sizeof(addrStruct),
-                                         "addrStruct could not be allocated.");
-    adrs->p = NULL;
-    adrs->match = address;
+    addrStruct adrs = {NULL, address};
+    set_iterate(game->players, &adrs, matchAddress);
+    return adrs.p;
+}
+
+/**************** spectatorFromAddr ****************/
+/*
+ * returns the spectator at the given address, or NULL if there is none
+ */
+static spectator_t* spectatorFromAddr(addr_t address)
+{
+    for (int i = 0; i < game->numSpectators; i++) {
+        if (message_eqAddr(game->spectators[i].addr, address)) {
+            return &game->spectators[i];
+        }
+    }
+    return NULL;
+}
+
+/**************** gatherSpectators ****************/
+/*
+ * fill game->spectatorAddrs with the addresses of the spectators whose
+ * capabilities, masked with mask, are caps -- only those watching the
+ * whole map, if wholeMap is true -- and return how many there are
+ */
+static int gatherSpectators(const int caps, const int mask,
+                            const bool wholeMap)
+{
+    int top, left, rows, cols;
+    int count = 0;
+    for (int i = 0; i < game->numSpectators; i++) {
+        spectator_t* spectator = &game->spectators[i];
+        if ((spectator->caps & mask) == caps &&
+            !(wholeMap &&
+              spectatorView(spectator, &top, &left, &rows, &cols))) {
+            game->spectatorAddrs[count++] = spectator->addr;
+        }
+    }
+    return count;
+}
+
+/**************** removeSpectator ****************/
+/*
+ * stop sending to spectator i; those who joined after it move up, so the
+ * oldest is always first
+ */
+static void removeSpectator(const int i)
+{
+    memmove(&game->spectators[i], &game->spectators[i + 1],
+            sizeof(spectator_t) * (game->numSpectators - i - 1));
+    game->numSpectators--;
+}
+
+/**************** spectatorView ****************/
+/*
+ * as player_getView, for a spectator: if it asked for a viewport smaller
+ * than the map, set top, left, rows and cols to that viewport, clamped
+ * to the map, and return true; else return false
+ */
+static bool spectatorView(spectator_t* spectator, int* top, int* left,
+                          int* rows, int* cols)
+{
+    if (spectator->viewRows == 0 ||
+        (spectator->viewRows >= game->gridHeight &&
+         spectator->viewCols >= game->gridWidth)) {
+        return false;  // the whole map fits
+    }
+    *rows = clampView(spectator->viewRows, 1, game->gridHeight);
+    *cols = clampView(spectator->viewCols, 1, game->gridWidth);
+    *top = clampView(spectator->viewTop, 0, game->gridHeight - *rows);
+    *left = clampView(spectator->viewLeft, 0, game->gridWidth - *cols);
+    return true;
+}
 
-    set_iterate(game->players, adrs, matchAddress);
+/**************** compositeSpectator ****************/
+/*
+ * as player_compositeView, for a spectator, who sees everything: copy
+ * the rectangle of the live map, a line at a time
+ */
+static void compositeSpectator(int top, int left, int rows, int cols,
+                               char* output)
+{
+    for (int y = top; y < top + rows; y++) {
+        memcpy(output, game->liveGameMap[y] + left, cols);
+        output += cols;
+        *(output++) = '\n';
+    }
+    *output = '\0';
+}
 
-    player_t* matchPlayer = adrs->p;
-    mem_free(adrs);
-    return matchPlayer;
+/**************** clampView ****************/
+/*
+ * value, or the nearer of min and max if it is outside them
+ */
+static int clampView(int value, int min, int max)
+{
+    return value < min ? min : value > max ? max : value;
 }
 
 /**************** matchAddress ****************/
@@ -1303,11 +3321,15 @@ static void matchAddress(void* arg, const char* key, void* item)
         return;  // error in usage
     }
 
-    player_t* player = item;
-    if (player == NULL) {
-        log_v("matchAddress called with NULL player. \n");
+    seat_t* seat = item;
+    if (seat == NULL) {
+        log_v("matchAddress called with NULL seat. \n");
         return;  // error in usage
     }
+    player_t* player = seat->player;
+    if (player == NULL) {
+        return;  // has quit
+    }
 
     addr_t playerAddr = player_getAddr(player);
 
@@ -1316,3 +3338,332 @@ static void matchAddress(void* arg, const char* key, void* item)
         adrs->p = player;
     }
 }
+
+/* ****************************************************************** */
+/* *************************** BENCH ******************************** */
+/*
+ * An offline benchmark of the game core, with no networking: for each
+ * map, join N players through handlePLAY and replay a seeded stream of
+ * random movement keys through handleKEY, which exercises movePlayer,
+ * player_updateVisible and player_compositeDisplay exactly as a live game
+ * would.  Messages are counted by transmit() instead of being sent.
+ * When all the gold is found the game is reloaded and the run continues.
+ *
+ * Compile with -DBENCH (see the server-bench target in the Makefile):
+ *   ./server-bench [--players=N] [--keys=K] [--seed=S] [--caps=LIST]
+ *                  [--view=ROWSxCOLS] [--threads=N] map.txt ...
+ * where LIST (e.g., RLE1) is announced with CAPS by every player, and
+ * each asks with VIEW for a viewport of the given size; --threads is as
+ * for the server.
+ */
+
+#ifdef BENCH
+
+static char benchCaps[64];  // --caps, for benchJoin; empty if none
+static char benchView[32];  // --view, as a VIEW body; empty if none
+static jobs_stats_t benchJobs;  // the scheduler's stats after the last map
+
+static bool benchMap(const char* mapPath, int numPlayers, long numKeys,
+                     int seed);
+static bool benchJoin(int numPlayers);
+static addr_t benchAddr(int i);
+
+int main(const int argc, const char* argv[])
+{
+    int numPlayers = maxPlayers;
+    long numKeys = 2000;
+    int seed = 1;
+    int numMaps = 0;
+    int viewRows, viewCols;
+    scratch = mem_assert(mem_arena_new(scratchArenaBlock), "scratch arena");
+
+    for (int i = 1; i < argc; i++) {
+        if (sscanf(argv[i], "--players=%d", &numPlayers) == 1 ||
+            sscanf(argv[i], "--keys=%ld", &numKeys) == 1 ||
+            sscanf(argv[i], "--seed=%d", &seed) == 1 ||
+            sscanf(argv[i], "--caps=%63s", benchCaps) == 1 ||
+            sscanf(argv[i], "--threads=%d", &options.threads) == 1) {
+            continue;
+        }
+        if (sscanf(argv[i], "--view=%dx%d", &viewRows, &viewCols) == 2) {
+            snprintf(benchView, sizeof(benchView), "%d %d", viewRows,
+                     viewCols);
+            continue;
+        }
+        if (strncmp(argv[i], "--", strlen("--")) == 0 || numPlayers < 1 ||
+            numPlayers > maxPlayers || numKeys < 1 || options.threads < 1 ||
+            options.threads > maxPlayers) {
+            fprintf(stderr,
+                    "usage: %s [--players=1..%d] [--keys=K] [--seed=S] "
+                    "[--caps=LIST] [--view=ROWSxCOLS] [--threads=N] "
+                    "map.txt ...\n",
+                    argv[0], maxPlayers);
+            return EXIT_FAILURE;
+        }
+        if (scheduler == NULL) {
+            startScheduler();
+        }
+        numMaps++;
+        if (!benchMap(argv[i], numPlayers, numKeys, seed)) {
+            jobs_delete(scheduler);
+            return EXIT_FAILURE;
+        }
+    }
+    if (numMaps == 0) {
+        fprintf(stderr, "usage: %s [--players=N] [--keys=K] map.txt ...\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    jobs_delete(scheduler);
+    mem_arena_delete(scratch);
+    return EXIT_SUCCESS;
+}
+
+/**************** benchMap ****************/
+/*
+ * Run and report the benchmark for one map.
+ */
+static bool benchMap(const char* mapPath, int numPlayers, long numKeys,
+                     int seed)
+{
+    const char* keys = "hjklyubnHJKLYUBN";
+    memset(&bench, 0, sizeof(bench));
+    rng_t keyRng;  // the stream of keys, separate from the games' streams
+    rng_seed(&keyRng, seed);
+
+    uint64_t loadTime = 0;  // time spent loading and joining, excluded
+    int games = 0;
+    uint64_t start = message_now();
+    for (long k = 0; k < numKeys; k++) {
+        if (game == NULL) {
+            uint64_t loadStart = message_now();
+            if (!loadGame(mapPath, seed + games) || !benchJoin(numPlayers)) {
+                fprintf(stderr, "%s: could not load game\n", mapPath);
+                return false;
+            }
+            games++;
+            loadTime += message_now() - loadStart;
+        }
+        int who = rng_below(&keyRng, numPlayers);
+        char key = keys[rng_below(&keyRng, strlen(keys))];
+        handleKEY(NULL, benchAddr(who), key);
+        mem_arena_reset(scratch);  // as handleMessage does
+    }
+    double seconds = (message_now() - start - loadTime) / 1e9;
+
+    printf("%s: %d players, %ld keys, %d games, %.3f s: "
+           "%.0f moves/s, %.0f frames/s (%.0f%% unchanged), "
+           "%.0f messages/s, %.1f MB would be sent (%.0f bytes/key)\n",
+           mapPath, numPlayers, numKeys, games, seconds,
+           bench.moves / seconds, bench.frames / seconds,
+           bench.frames > 0 ? 100.0 * bench.unchanged / bench.frames : 0.0,
+           bench.messages / seconds, bench.bytes / 1e6,
+           (double)bench.bytes / numKeys);
+    if (scheduler != NULL) {
+        jobs_stats_t jobs;
+        jobs_stats(scheduler, &jobs);
+        printf("%s: jobs on %d threads: %.1f run, %.2f stolen, %.2f steals "
+               "missed, %.2f locks contended, %.2f sleeps per key\n",
+               mapPath, jobs_size(scheduler),
+               (double)(jobs.run - benchJobs.run) / numKeys,
+               (double)(jobs.steals - benchJobs.steals) / numKeys,
+               (double)(jobs.missedSteals - benchJobs.missedSteals) / numKeys,
+               (double)(jobs.contended - benchJobs.contended) / numKeys,
+               (double)(jobs.sleeps - benchJobs.sleeps) / numKeys);
+        benchJobs = jobs;
+    }
+
+    // end the game in progress, if any, to free it
+    if (game != NULL) {
+        game->goldRemaining = 0;
+        gameOver();
+    }
+    return true;
+}
+
+/**************** benchJoin ****************/
+/*
+ * Join numPlayers players to the freshly loaded game.
+ */
+static bool benchJoin(int numPlayers)
+{
+    for (int i = 0; i < numPlayers; i++) {
+        char name[] = "bench?";
+        name[strlen(name) - 1] = 'a' + i;
+        if (benchCaps[0] != '\0') {
+            handleCAPS(NULL, benchAddr(i), benchCaps);
+        }
+        if (handlePLAY(NULL, benchAddr(i), name)) {
+            return false;
+        }
+        if (benchView[0] != '\0') {
+            handleVIEW(NULL, benchAddr(i), benchView);
+        }
+        mem_arena_reset(scratch);
+    }
+    return true;
+}
+
+/**************** benchAddr ****************/
+/*
+ * A distinct, valid-looking address for simulated player i.
+ */
+static addr_t benchAddr(int i)
+{
+    addr_t addr = message_noAddr();
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(10000 + i);
+    return addr;
+}
+
+#endif  // BENCH
+
+/* ************************* REPLAY ****************************** */
+/*
+ * Play again a game recorded with --record, by handing each recorded
+ * message to handleMessage, from a made-up address for its client, as
+ * message_loop did.  All the game's random choices come from its seed,
+ * so the replay makes the same moves and composes the same frames; and
+ * it admits as many spectators at once as the recorded game did.
+ * Nothing is sent, but every message that would be is counted and
+ * hashed into a digest, on which two replays of a record -- say, by two
+ * versions of the server -- agree if they behaved identically.  Messages
+ * are handled as fast as possible, not at their recorded times.
+ *
+ * Compile with -DREPLAY (see the replay target in the Makefile):
+ *   ./replay [--map=PATH] [--threads=N] game.rec
+ * where PATH, if given, replaces the map's recorded path; it must hold
+ * the same map; --threads is as for the server, and must not change the
+ * digest.
+ */
+
+#ifdef REPLAY
+
+static addr_t replayAddr(int client);
+
+int main(const int argc, const char* argv[])
+{
+    const char* recordPath = NULL;
+    const char* mapPath = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char* value;
+        if ((value = optionValue(argv[i], "--map")) != NULL) {
+            mapPath = value;
+        } else if ((value = optionValue(argv[i], "--threads")) != NULL) {
+            if (!str2int(value, &options.threads) || options.threads < 1 ||
+                options.threads > maxPlayers) {
+                recordPath = NULL;
+                break;
+            }
+        } else if (strncmp(argv[i], "--", strlen("--")) != 0 &&
+                   recordPath == NULL) {
+            recordPath = argv[i];
+        } else {
+            recordPath = NULL;
+            break;
+        }
+    }
+    if (recordPath == NULL) {
+        fprintf(stderr, "usage: %s [--map=PATH] [--threads=N] game.rec\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // the record's header says which game to load
+    record_header_t header;
+    record_t* rec = record_open(recordPath, &header);
+    if (rec == NULL) {
+        fprintf(stderr, "%s: not a readable record\n", recordPath);
+        return EXIT_FAILURE;
+    }
+    if (mapPath == NULL) {
+        mapPath = header.mapPath;
+    }
+    if (header.maxSpectators > 0) {  // else recorded before it was
+        options.maxSpectators = header.maxSpectators;
+    }
+    uint64_t hash;
+    if (!mapHash(mapPath, &hash) || hash != header.mapHash) {
+        fprintf(stderr, "%s: %s is not the map it was recorded with\n",
+                recordPath, mapPath);
+        record_close(rec);
+        return EXIT_FAILURE;
+    }
+    scratch = mem_assert(mem_arena_new(scratchArenaBlock), "scratch arena");
+    if (!loadGame(mapPath, header.seed)) {
+        fprintf(stderr, "%s: could not load game\n", mapPath);
+        record_close(rec);
+        return EXIT_FAILURE;
+    }
+
+    // hand over the messages until the record, or the game, ends
+    long records = 0;
+    int numClients = 0;
+    uint64_t tick = 0;
+    int client;
+    const char* message;
+    int status;
+    bool over = false;
+    startScheduler();
+    uint64_t start = message_now();
+    while (!over && (status = record_next(rec, &tick, &client, &message,
+                                          &replay.length)) == 1) {
+        records++;
+        if (client >= numClients) {
+            numClients = client + 1;
+        }
+        over = handleMessage(NULL, replayAddr(client), message);
+    }
+    double seconds = (message_now() - start) / 1e9;
+    long extra = 0;  // records after the game ended
+    if (over) {
+        while ((status = record_next(rec, &tick, &client, &message,
+                                     &replay.length)) == 1) {
+            extra++;
+        }
+    }
+    record_close(rec);
+
+    printf("%s: map %s, seed %d: %ld messages from %d clients over "
+           "%.1f s, replayed in %.3f s (%.0f messages/s); "
+           "%llu frames (%llu unchanged), %ld messages, %.1f KB sent; "
+           "game %s; digest %016llx\n",
+           recordPath, mapPath, header.seed, records, numClients,
+           tick / 1e6, seconds, records / seconds,
+           (unsigned long long)stats.frames,
+           (unsigned long long)stats.unchangedFrames, replay.messages,
+           replay.bytes / 1e3, over ? "over" : "in progress",
+           (unsigned long long)replay.digest);
+    if (extra > 0) {
+        fprintf(stderr, "%s: %ld messages after the game ended\n",
+                recordPath, extra);
+    }
+    if (status < 0) {
+        fprintf(stderr, "%s: record is damaged or cut short\n", recordPath);
+    }
+
+    // end the game in progress, if any, to free it
+    if (game != NULL) {
+        game->goldRemaining = 0;
+        gameOver();
+    }
+    jobs_delete(scheduler);
+    mem_arena_delete(scratch);
+    return status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**************** replayAddr ****************/
+/*
+ * A distinct, valid-looking address for recorded client i.
+ */
+static addr_t replayAddr(int client)
+{
+    addr_t addr = message_noAddr();
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + client);
+    addr.sin_port = htons(10000);
+    return addr;
+}
+
+#endif  // REPLAY
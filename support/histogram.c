@@ -0,0 +1,274 @@
+/*
+ * histogram - a fixed-size latency histogram in the style of HdrHistogram
+ *
+ * See histogram.h for detailed interface description for each function.
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test; see below.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "histogram.h"
+
+/**************** file-local constants ****************/
+/* Values below LinearMax get one bucket each; above that, each
+ * power-of-two range [2^k, 2^(k+1)) is split into SubBuckets buckets.
+ */
+#define SUB_BITS 5
+static const int SubBuckets = 1 << SUB_BITS;          // 32
+static const uint64_t LinearMax = 2 << SUB_BITS;      // 64
+#define NUM_BUCKETS ((2 << SUB_BITS) + (64 - SUB_BITS - 1) * (1 << SUB_BITS))
+
+/**************** global types ****************/
+typedef struct histogram {
+  uint64_t counts[NUM_BUCKETS];
+  uint64_t total;       // number of values recorded
+  uint64_t min, max;    // extremes of recorded values
+  double sum;           // for the mean; double avoids overflow
+} histogram_t;
+
+/**************** bucketIndex ****************/
+/* Map a value to its bucket. */
+static int
+bucketIndex(const uint64_t value)
+{
+  if (value < LinearMax) {
+    return (int)value;
+  }
+  int msb = 63 - __builtin_clzll(value);  // msb >= SUB_BITS + 1
+  int shift = msb - SUB_BITS;
+  int mantissa = (int)(value >> shift);   // in [SubBuckets, 2*SubBuckets)
+  return LinearMax + (shift - 1) * SubBuckets + (mantissa - SubBuckets);
+}
+
+/**************** bucketHighest ****************/
+/* Return the largest value that maps to the given bucket. */
+static uint64_t
+bucketHighest(const int index)
+{
+  if (index < LinearMax) {
+    return index;
+  }
+  int k = index - LinearMax;
+  int shift = k / SubBuckets + 1;
+  uint64_t mantissa = k % SubBuckets + SubBuckets;
+  return (mantissa << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+/**************** histogram_new ****************/
+histogram_t*
+histogram_new(void)
+{
+  histogram_t* h = malloc(sizeof(histogram_t));
+  if (h != NULL) {
+    histogram_reset(h);
+  }
+  return h;
+}
+
+/**************** histogram_record ****************/
+void
+histogram_record(histogram_t* h, const uint64_t value)
+{
+  if (h == NULL) {
+    return;
+  }
+  h->counts[bucketIndex(value)]++;
+  if (h->total == 0 || value < h->min) {
+    h->min = value;
+  }
+  if (value > h->max) {
+    h->max = value;
+  }
+  h->total++;
+  h->sum += (double)value;
+}
+
+/**************** histogram_count ****************/
+uint64_t
+histogram_count(const histogram_t* h)
+{
+  return h == NULL ? 0 : h->total;
+}
+
+/**************** histogram_min ****************/
+uint64_t
+histogram_min(const histogram_t* h)
+{
+  return h == NULL ? 0 : h->min;
+}
+
+/**************** histogram_max ****************/
+uint64_t
+histogram_max(const histogram_t* h)
+{
+  return h == NULL ? 0 : h->max;
+}
+
+/**************** histogram_mean ****************/
+double
+histogram_mean(const histogram_t* h)
+{
+  if (h == NULL || h->total == 0) {
+    return 0.0;
+  }
+  return h->sum / (double)h->total;
+}
+
+/**************** histogram_percentile ****************/
+uint64_t
+histogram_percentile(const histogram_t* h, const double percentile)
+{
+  if (h == NULL || h->total == 0) {
+    return 0;
+  }
+  double p = percentile < 0.0 ? 0.0 : (percentile > 100.0 ? 100.0 : percentile);
+
+  // the rank of the value we want; at least the first value
+  uint64_t rank = (uint64_t)(p / 100.0 * (double)h->total + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t value = bucketHighest(i);
+      return value > h->max ? h->max : value;
+    }
+  }
+  return h->max;
+}
+
+/**************** histogram_merge ****************/
+void
+histogram_merge(histogram_t* into, const histogram_t* from)
+{
+  if (into == NULL || from == NULL || from->total == 0) {
+    return;
+  }
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    into->counts[i] += from->counts[i];
+  }
+  if (into->total == 0 || from->min < into->min) {
+    into->min = from->min;
+  }
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+  into->total += from->total;
+  into->sum += from->sum;
+}
+
+/**************** histogram_reset ****************/
+void
+histogram_reset(histogram_t* h)
+{
+  if (h != NULL) {
+    memset(h, 0, sizeof(histogram_t));
+  }
+}
+
+/**************** histogram_print ****************/
+void
+histogram_print(const histogram_t* h, FILE* fp, const char* label)
+{
+  if (fp == NULL) {
+    return;
+  }
+  const double us = 1000.0;   // nanoseconds per microsecond
+  fprintf(fp, "%s: n=%llu min=%.1fus p50=%.1fus p99=%.1fus p999=%.1fus "
+          "max=%.1fus mean=%.1fus\n",
+          label == NULL ? "histogram" : label,
+          (unsigned long long)histogram_count(h),
+          histogram_min(h) / us,
+          histogram_percentile(h, 50.0) / us,
+          histogram_percentile(h, 99.0) / us,
+          histogram_percentile(h, 99.9) / us,
+          histogram_max(h) / us,
+          histogram_mean(h) / us);
+}
+
+/**************** histogram_delete ****************/
+void
+histogram_delete(histogram_t* h)
+{
+  free(h);
+}
+
+/* ****************************************************************** */
+/* ************************* UNIT_TEST ****************************** */
+/*
+ * Record known distributions and check the reported percentiles
+ * fall within the promised bucket precision.
+ */
+
+#ifdef UNIT_TEST
+
+#include <assert.h>
+
+/* true if 'got' is within 1/SubBuckets of 'want' */
+static int
+nearlyEqual(const uint64_t got, const uint64_t want)
+{
+  uint64_t diff = got > want ? got - want : want - got;
+  return diff <= want / SubBuckets + 1;
+}
+
+int
+main(const int argc, char* argv[])
+{
+  histogram_t* h = histogram_new();
+  assert(h != NULL);
+
+  printf("Testing empty histogram\n");
+  assert(histogram_count(h) == 0);
+  assert(histogram_percentile(h, 50.0) == 0);
+
+  printf("Testing exact small values\n");
+  for (uint64_t v = 1; v <= 50; v++) {
+    histogram_record(h, v);
+  }
+  assert(histogram_count(h) == 50);
+  assert(histogram_min(h) == 1);
+  assert(histogram_max(h) == 50);
+  assert(histogram_percentile(h, 50.0) == 25);
+  assert(histogram_percentile(h, 100.0) == 50);
+
+  printf("Testing bucket round trip\n");
+  for (uint64_t v = 1; v < ((uint64_t)1 << 62); v = v * 3 + 1) {
+    assert(v <= bucketHighest(bucketIndex(v)));
+    assert(nearlyEqual(bucketHighest(bucketIndex(v)), v));
+  }
+  assert(bucketIndex(UINT64_MAX) == NUM_BUCKETS - 1);
+
+  printf("Testing uniform 1..1000000\n");
+  histogram_reset(h);
+  for (uint64_t v = 1; v <= 1000000; v++) {
+    histogram_record(h, v);
+  }
+  assert(nearlyEqual(histogram_percentile(h, 50.0), 500000));
+  assert(nearlyEqual(histogram_percentile(h, 99.0), 990000));
+  assert(nearlyEqual(histogram_percentile(h, 99.9), 999000));
+  assert(histogram_percentile(h, 100.0) == 1000000);
+
+  printf("Testing merge\n");
+  histogram_t* other = histogram_new();
+  histogram_record(other, 5000000);
+  histogram_merge(h, other);
+  assert(histogram_count(h) == 1000001);
+  assert(histogram_max(h) == 5000000);
+  histogram_print(h, stdout, "merged");
+
+  histogram_delete(other);
+  histogram_delete(h);
+  printf("Tests passed successfully.\n");
+  return 0;
+}
+
+#endif // UNIT_TEST
@@ -0,0 +1,93 @@
+/*
+ * histogram - a fixed-size latency histogram in the style of HdrHistogram
+ *
+ * Records non-negative 64-bit values (typically nanoseconds) into
+ * log-linear buckets: values below 64 are counted exactly, and every
+ * power-of-two range above that is split into 32 equal sub-buckets,
+ * so any reported value is within about 3% of the true value.
+ * Recording is O(1) and never allocates; percentile queries walk the
+ * (fixed, ~2000-entry) bucket array.
+ *
+ * Typical usage:
+ *   histogram_t* h = histogram_new();
+ *   uint64_t start = message_now();
+ *   ... do the work being measured ...
+ *   histogram_record(h, message_now() - start);
+ *   histogram_print(h, stdout, "work");
+ *   histogram_delete(h);
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test; see histogram.c.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/****************** types *********************/
+typedef struct histogram histogram_t;  // opaque to users of the module
+
+/****************** global functions *********************/
+
+/******************************************/
+/* histogram_new: create an empty histogram.
+ * Function returns:
+ *   pointer to a new histogram, or NULL on out-of-memory.
+ * Caller expectations:
+ *   call histogram_delete() when done.
+ */
+histogram_t* histogram_new(void);
+
+/******************************************/
+/* histogram_record: count one occurrence of 'value'.
+ * Ignored if h is NULL.
+ */
+void histogram_record(histogram_t* h, const uint64_t value);
+
+/******************************************/
+/* histogram_count, histogram_min, histogram_max, histogram_mean:
+ * summary statistics over all values recorded since the last reset;
+ * all return zero for an empty (or NULL) histogram.
+ */
+uint64_t histogram_count(const histogram_t* h);
+uint64_t histogram_min(const histogram_t* h);
+uint64_t histogram_max(const histogram_t* h);
+double histogram_mean(const histogram_t* h);
+
+/******************************************/
+/* histogram_percentile:
+ * Caller provides:
+ *   a percentile in [0.0, 100.0], e.g. 99.9.
+ * Function returns:
+ *   the highest value equivalent (within bucket precision) to the
+ *   requested percentile, clamped to the recorded maximum;
+ *   zero for an empty (or NULL) histogram.
+ */
+uint64_t histogram_percentile(const histogram_t* h, const double percentile);
+
+/******************************************/
+/* histogram_merge: add every count in 'from' into 'into'.
+ */
+void histogram_merge(histogram_t* into, const histogram_t* from);
+
+/******************************************/
+/* histogram_reset: forget all recorded values.
+ */
+void histogram_reset(histogram_t* h);
+
+/******************************************/
+/* histogram_print: write one summary line to fp, of the form
+ *   label: n=1234 min=12.0us p50=40.1us p99=88.0us p999=130.0us max=151.2us
+ * Values are assumed to be nanoseconds and are printed in microseconds.
+ */
+void histogram_print(const histogram_t* h, FILE* fp, const char* label);
+
+/******************************************/
+/* histogram_delete: free the histogram.  NULL is ignored.
+ */
+void histogram_delete(histogram_t* h);
+
+#endif // _HISTOGRAM_H_
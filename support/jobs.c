@@ -0,0 +1,760 @@
+/*
+ * jobs.c - a small work-stealing job system
+ *
+ * See jobs.h for usage.  Every deque is a ring of jobs under a mutex of
+ * its own, which its owner takes from one end and thieves from the
+ * other, so it is rarely contended; an atomic count lets a thread pass
+ * by an empty deque without locking it.  The pool counts the jobs
+ * queued in all its deques, so that a thread sleeps only when there are
+ * none, and a spawner wakes one only when one sleeps.
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test and benchmark;
+ * see below.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#define _POSIX_C_SOURCE 199309L   // for clock_gettime in the unit test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "jobs.h"
+
+/**************** file-local types ****************/
+
+/* A job: task(arg, i) for each i in begin..end-1, joined by counter */
+typedef struct job {
+  jobs_task_t task;
+  void* arg;
+  int begin, end;
+  jobs_counter_t* counter;
+} job_t;
+
+/* A double-ended queue of jobs */
+typedef struct deque {
+  pthread_mutex_t lock;     // guards all below; count is only read without
+  job_t* jobs;              // a ring of size slots
+  int size;
+  int top;                  // the oldest job's place in the ring
+  atomic_int count;         // jobs in the ring
+} deque_t;
+
+/* A thread's deque and counts; slot 0 is for callers outside the pool,
+ * whose jobs go to the injector, and its deque is unused */
+typedef struct slot {
+  deque_t deque;
+  struct jobs* pool;
+  int index;
+  atomic_ulong spawned, injected, run, steals, missedSteals, contended,
+               sleeps;
+} slot_t;
+
+typedef struct jobs {
+  int numThreads;             // counting the callers'
+  pthread_t* threads;         // numThreads - 1 of them
+  int numStarted;             // ... of which are running
+  slot_t* slots;              // numThreads of them
+  deque_t injector;           // jobs spawned from outside the pool
+  atomic_int queued;          // jobs in all the deques and the injector
+  atomic_int sleepers;        // threads asleep, or about to sleep
+  atomic_bool stopping;       // threads should exit
+  pthread_mutex_t sleepLock;  // guards sleeping and waking
+  pthread_cond_t wake;        // a job is queued, or the pool is stopping
+} jobs_t;
+
+/**************** file-local global variables ****************/
+static _Thread_local jobs_t* myPool;   // the pool this thread is in, if any
+static _Thread_local int mySlot;       // ... and its slot there
+static _Thread_local uint32_t mySeed;  // for picking whom to steal from
+
+/**************** file-local constants ****************/
+static const int initialDequeSize = 64;  // jobs; deques grow as needed
+static const int spinsBeforeSleep = 64;  // looks for a job, between yields
+
+/**************** file-local functions ****************/
+static void* workerThread(void* arg);
+static int selfSlot(const jobs_t* pool);
+static void spawnJob(jobs_t* pool, const int self, job_t job);
+static void execute(jobs_t* pool, const int self, job_t job);
+static bool findJob(jobs_t* pool, const int self, job_t* job);
+static uint32_t nextRandom(void);
+static bool dequeInit(deque_t* deque);
+static void dequeFree(deque_t* deque);
+static bool dequePush(deque_t* deque, const job_t* job, slot_t* self);
+static bool dequePopBottom(deque_t* deque, job_t* job, slot_t* self);
+static int dequePopTop(deque_t* deque, job_t* job, slot_t* self);
+static void lockCounting(pthread_mutex_t* lock, slot_t* self);
+static void tally(atomic_ulong* counter);
+
+/**************** jobs_new ****************/
+/* see jobs.h for description */
+jobs_t*
+jobs_new(const int numThreads)
+{
+  if (numThreads < 1) {
+    return NULL;
+  }
+  jobs_t* pool = calloc(1, sizeof(jobs_t));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->threads = calloc(numThreads, sizeof(pthread_t));
+  pool->slots = calloc(numThreads, sizeof(slot_t));
+  if (pool->threads == NULL || pool->slots == NULL ||
+      !dequeInit(&pool->injector)) {
+    free(pool->threads);
+    free(pool->slots);
+    free(pool);
+    return NULL;
+  }
+  atomic_init(&pool->queued, 0);
+  atomic_init(&pool->sleepers, 0);
+  atomic_init(&pool->stopping, false);
+  pthread_mutex_init(&pool->sleepLock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+
+  // every deque is ready before any thread starts, as a thread may steal
+  // from any; a thread is counted once it is running, so that if one
+  // can't be started, jobs_delete stops just those that were
+  pool->numThreads = numThreads;
+  bool ok = true;
+  for (int t = 0; t < numThreads; t++) {
+    pool->slots[t].pool = pool;
+    pool->slots[t].index = t;
+    ok = ok && dequeInit(&pool->slots[t].deque);
+  }
+  for (int t = 1; ok && t < numThreads; t++) {
+    ok = pthread_create(&pool->threads[t - 1], NULL, workerThread,
+                        &pool->slots[t]) == 0;
+    pool->numStarted += ok;
+  }
+  if (!ok) {
+    jobs_delete(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/**************** jobs_size ****************/
+/* see jobs.h for description */
+int
+jobs_size(const jobs_t* pool)
+{
+  return pool == NULL ? 0 : pool->numThreads;
+}
+
+/**************** jobs_spawn ****************/
+/* see jobs.h for description */
+void
+jobs_spawn(jobs_t* pool, jobs_counter_t* counter, jobs_task_t task,
+           void* arg, const int i)
+{
+  if (task == NULL || counter == NULL) {
+    return;
+  }
+  if (pool == NULL || pool->numThreads == 1) {
+    task(arg, i);
+    return;
+  }
+  job_t job = {.task = task, .arg = arg, .begin = i, .end = i + 1,
+               .counter = counter};
+  spawnJob(pool, selfSlot(pool), job);
+}
+
+/**************** jobs_wait ****************/
+/* see jobs.h for description */
+void
+jobs_wait(jobs_t* pool, jobs_counter_t* counter)
+{
+  if (pool == NULL || counter == NULL) {
+    return;
+  }
+  const int self = selfSlot(pool);
+  job_t job;
+  while (atomic_load(&counter->pending) > 0) {
+    if (findJob(pool, self, &job)) {
+      execute(pool, self, job);
+    } else {
+      sched_yield();  // the last of them are running elsewhere
+    }
+  }
+}
+
+/**************** jobs_run ****************/
+/* see jobs.h for description */
+void
+jobs_run(jobs_t* pool, const int count, jobs_task_t task, void* arg)
+{
+  if (task == NULL || count <= 0) {
+    return;
+  }
+  if (pool == NULL || pool->numThreads == 1 || count == 1) {
+    for (int i = 0; i < count; i++) {
+      task(arg, i);
+    }
+    return;
+  }
+
+  // run the whole loop as one job here, which splits off halves for
+  // other threads to steal as it goes
+  const int self = selfSlot(pool);
+  jobs_counter_t done = JOBS_COUNTER_INIT;
+  job_t job = {.task = task, .arg = arg, .begin = 0, .end = count,
+               .counter = &done};
+  atomic_store(&done.pending, 1);
+  tally(&pool->slots[self].spawned);
+  execute(pool, self, job);
+  jobs_wait(pool, &done);
+}
+
+/**************** jobs_stats ****************/
+/* see jobs.h for description */
+void
+jobs_stats(const jobs_t* pool, jobs_stats_t* stats)
+{
+  if (stats == NULL) {
+    return;
+  }
+  memset(stats, 0, sizeof(jobs_stats_t));
+  if (pool == NULL) {
+    return;
+  }
+  for (int t = 0; t < pool->numThreads; t++) {
+    slot_t* slot = &pool->slots[t];
+    stats->spawned += atomic_load_explicit(&slot->spawned,
+                                           memory_order_relaxed);
+    stats->injected += atomic_load_explicit(&slot->injected,
+                                            memory_order_relaxed);
+    stats->run += atomic_load_explicit(&slot->run, memory_order_relaxed);
+    stats->steals += atomic_load_explicit(&slot->steals,
+                                          memory_order_relaxed);
+    stats->missedSteals += atomic_load_explicit(&slot->missedSteals,
+                                                memory_order_relaxed);
+    stats->contended += atomic_load_explicit(&slot->contended,
+                                             memory_order_relaxed);
+    stats->sleeps += atomic_load_explicit(&slot->sleeps,
+                                          memory_order_relaxed);
+  }
+}
+
+/**************** jobs_delete ****************/
+/* see jobs.h for description */
+void
+jobs_delete(jobs_t* pool)
+{
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->sleepLock);
+  atomic_store(&pool->stopping, true);
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->sleepLock);
+  for (int t = 0; t < pool->numStarted; t++) {
+    pthread_join(pool->threads[t], NULL);
+  }
+  for (int t = 0; t < pool->numThreads; t++) {
+    dequeFree(&pool->slots[t].deque);
+  }
+  dequeFree(&pool->injector);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->sleepLock);
+  free(pool->threads);
+  free(pool->slots);
+  free(pool);
+}
+
+/**************** workerThread ****************/
+/*
+ * Run jobs -- our own, the injector's, or stolen -- until the pool
+ * stops; when there are none, spin a while, then sleep until one is
+ * queued.
+ */
+static void*
+workerThread(void* arg)
+{
+  slot_t* slot = arg;
+  jobs_t* pool = slot->pool;
+  const int self = slot->index;
+  myPool = pool;
+  mySlot = self;
+
+  job_t job;
+  int idle = 0;
+  while (!atomic_load(&pool->stopping)) {
+    if (findJob(pool, self, &job)) {
+      execute(pool, self, job);
+      idle = 0;
+      continue;
+    }
+    if (++idle < spinsBeforeSleep) {
+      sched_yield();
+      continue;
+    }
+    idle = 0;
+
+    // a spawner that queues a job after we count ourselves a sleeper
+    // sees us, and takes sleepLock to wake us; one that queued it
+    // before, we see in queued
+    pthread_mutex_lock(&pool->sleepLock);
+    atomic_fetch_add(&pool->sleepers, 1);
+    if (atomic_load(&pool->queued) <= 0 && !atomic_load(&pool->stopping)) {
+      tally(&slot->sleeps);
+    }
+    while (atomic_load(&pool->queued) <= 0 &&
+           !atomic_load(&pool->stopping)) {
+      pthread_cond_wait(&pool->wake, &pool->sleepLock);
+    }
+    atomic_fetch_sub(&pool->sleepers, 1);
+    pthread_mutex_unlock(&pool->sleepLock);
+  }
+  return NULL;
+}
+
+/**************** selfSlot ****************/
+/*
+ * The calling thread's slot in the pool: its own, if it is one of the
+ * pool's threads; else 0, the callers'.
+ */
+static int
+selfSlot(const jobs_t* pool)
+{
+  return myPool == pool ? mySlot : 0;
+}
+
+/**************** spawnJob ****************/
+/*
+ * Queue a job, counted in its counter, on our deque, or the injector if
+ * we are not one of the pool's threads, and wake a sleeping thread to
+ * take it; if it can't be queued, run it at once.
+ */
+static void
+spawnJob(jobs_t* pool, const int self, job_t job)
+{
+  slot_t* slot = &pool->slots[self];
+  deque_t* deque = self > 0 ? &slot->deque : &pool->injector;
+
+  atomic_fetch_add(&job.counter->pending, 1);
+  tally(&slot->spawned);
+  if (self == 0) {
+    tally(&slot->injected);
+  }
+  atomic_fetch_add(&pool->queued, 1);
+  if (!dequePush(deque, &job, slot)) {
+    atomic_fetch_sub(&pool->queued, 1);
+    execute(pool, self, job);
+    return;
+  }
+
+  if (atomic_load(&pool->sleepers) > 0) {
+    pthread_mutex_lock(&pool->sleepLock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->sleepLock);
+  }
+}
+
+/**************** execute ****************/
+/*
+ * Run a job: while it covers more than one index, split off its upper
+ * half as a job of its own, for us or a thief to run later; then call
+ * its task for the one index left, and count it finished.
+ */
+static void
+execute(jobs_t* pool, const int self, job_t job)
+{
+  while (job.end - job.begin > 1) {
+    job_t half = job;
+    half.begin = job.begin + (job.end - job.begin) / 2;
+    spawnJob(pool, self, half);
+    job.end = half.begin;
+  }
+  job.task(job.arg, job.begin);
+  tally(&pool->slots[self].run);
+  atomic_fetch_sub(&job.counter->pending, 1);
+}
+
+/**************** findJob ****************/
+/*
+ * Take the next job to run: our own newest, else the injector's oldest,
+ * else the oldest of another thread's, starting from one at random.
+ * Returns false if there is none.
+ */
+static bool
+findJob(jobs_t* pool, const int self, job_t* job)
+{
+  slot_t* slot = &pool->slots[self];
+  if ((self > 0 && dequePopBottom(&slot->deque, job, slot)) ||
+      dequePopTop(&pool->injector, job, slot) > 0) {
+    atomic_fetch_sub(&pool->queued, 1);
+    return true;
+  }
+
+  const int others = pool->numThreads - 1;  // threads with deques
+  const int start = nextRandom() % others;
+  for (int k = 0; k < others; k++) {
+    const int victim = 1 + (start + k) % others;
+    if (victim == self) {
+      continue;
+    }
+    int taken = dequePopTop(&pool->slots[victim].deque, job, slot);
+    if (taken > 0) {
+      tally(&slot->steals);
+      atomic_fetch_sub(&pool->queued, 1);
+      return true;
+    }
+    if (taken < 0) {
+      tally(&slot->missedSteals);
+    }
+  }
+  return false;
+}
+
+/**************** nextRandom ****************/
+/*
+ * A thread's own xorshift32 stream, seeded from where its state lies.
+ */
+static uint32_t
+nextRandom(void)
+{
+  if (mySeed == 0) {
+    mySeed = (uint32_t)(uintptr_t)&mySeed | 1;
+  }
+  mySeed ^= mySeed << 13;
+  mySeed ^= mySeed >> 17;
+  mySeed ^= mySeed << 5;
+  return mySeed;
+}
+
+/**************** dequeInit ****************/
+/*
+ * Make an empty deque; returns false if it can't be allocated.
+ */
+static bool
+dequeInit(deque_t* deque)
+{
+  deque->jobs = malloc(initialDequeSize * sizeof(job_t));
+  if (deque->jobs == NULL) {
+    return false;
+  }
+  deque->size = initialDequeSize;
+  deque->top = 0;
+  atomic_init(&deque->count, 0);
+  pthread_mutex_init(&deque->lock, NULL);
+  return true;
+}
+
+/**************** dequeFree ****************/
+/*
+ * Free a deque made by dequeInit; ignored if it was not.
+ */
+static void
+dequeFree(deque_t* deque)
+{
+  if (deque->jobs != NULL) {
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->jobs);
+    deque->jobs = NULL;
+  }
+}
+
+/**************** dequePush ****************/
+/*
+ * Add a job at the bottom, growing the ring if it is full.
+ * Returns false if it can't be grown.
+ */
+static bool
+dequePush(deque_t* deque, const job_t* job, slot_t* self)
+{
+  lockCounting(&deque->lock, self);
+  int n = atomic_load_explicit(&deque->count, memory_order_relaxed);
+  if (n == deque->size) {
+    job_t* jobs = malloc(2 * deque->size * sizeof(job_t));
+    if (jobs == NULL) {
+      pthread_mutex_unlock(&deque->lock);
+      return false;
+    }
+    for (int j = 0; j < n; j++) {
+      jobs[j] = deque->jobs[(deque->top + j) % deque->size];
+    }
+    free(deque->jobs);
+    deque->jobs = jobs;
+    deque->size *= 2;
+    deque->top = 0;
+  }
+  deque->jobs[(deque->top + n) % deque->size] = *job;
+  atomic_store_explicit(&deque->count, n + 1, memory_order_relaxed);
+  pthread_mutex_unlock(&deque->lock);
+  return true;
+}
+
+/**************** dequePopBottom ****************/
+/*
+ * Take the newest job, for the deque's owner.
+ * Returns false if there is none.
+ */
+static bool
+dequePopBottom(deque_t* deque, job_t* job, slot_t* self)
+{
+  if (atomic_load_explicit(&deque->count, memory_order_relaxed) == 0) {
+    return false;
+  }
+  lockCounting(&deque->lock, self);
+  int n = atomic_load_explicit(&deque->count, memory_order_relaxed);
+  if (n > 0) {
+    *job = deque->jobs[(deque->top + n - 1) % deque->size];
+    atomic_store_explicit(&deque->count, n - 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return n > 0;
+}
+
+/**************** dequePopTop ****************/
+/*
+ * Take the oldest job, as a thief does (or any thread, from the
+ * injector).  Returns 1 if one was taken; 0 if there was none; and -1
+ * if there was one, but another thread took it first.
+ */
+static int
+dequePopTop(deque_t* deque, job_t* job, slot_t* self)
+{
+  if (atomic_load_explicit(&deque->count, memory_order_relaxed) == 0) {
+    return 0;
+  }
+  lockCounting(&deque->lock, self);
+  int n = atomic_load_explicit(&deque->count, memory_order_relaxed);
+  if (n > 0) {
+    *job = deque->jobs[deque->top];
+    deque->top = (deque->top + 1) % deque->size;
+    atomic_store_explicit(&deque->count, n - 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return n > 0 ? 1 : -1;
+}
+
+/**************** lockCounting ****************/
+/*
+ * Lock a mutex, counting it contended if another thread holds it.
+ */
+static void
+lockCounting(pthread_mutex_t* lock, slot_t* self)
+{
+  if (pthread_mutex_trylock(lock) != 0) {
+    tally(&self->contended);
+    pthread_mutex_lock(lock);
+  }
+}
+
+/**************** tally ****************/
+/*
+ * Add one to a statistic; only its thread writes it, so order is moot.
+ */
+static void
+tally(atomic_ulong* counter)
+{
+  atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+/* ************************* UNIT_TEST ****************************** */
+/*
+ * Check that jobs_run runs every index exactly once, whatever the
+ * number of threads and of indices, and over many runs of one pool;
+ * that jobs may spawn jobs and wait for them, to any depth, and that
+ * jobs_run nests; then time a loop of 26 compositing-sized tasks on 1,
+ * 2, 4 and 8 threads, with the pool's statistics.
+ *
+ * Usage: ./jobstest [runs]
+ */
+
+#ifdef UNIT_TEST
+
+#include <assert.h>
+#include <time.h>
+
+#define MAX_COUNT 1000
+#define TASK_BYTES (42 * 147)  // a big map's frame
+
+static double seconds(void);
+
+/* counts[i] is how often index i has been run */
+static void
+countTask(void* arg, const int i)
+{
+  atomic_int* counts = arg;
+  atomic_fetch_add(&counts[i], 1);
+}
+
+/* fib(n), by spawning fib(n-1) and fib(n-2) and waiting for both */
+typedef struct fib {
+  jobs_t* pool;
+  int n;
+  long result;
+} fib_t;
+
+static void
+fibTask(void* arg, const int i)
+{
+  fib_t* fib = arg;
+  if (fib->n < 2) {
+    fib->result = fib->n;
+    return;
+  }
+  jobs_counter_t done = JOBS_COUNTER_INIT;
+  fib_t a = {fib->pool, fib->n - 1, 0}, b = {fib->pool, fib->n - 2, 0};
+  jobs_spawn(fib->pool, &done, fibTask, &a, 0);
+  jobs_spawn(fib->pool, &done, fibTask, &b, 0);
+  jobs_wait(fib->pool, &done);
+  fib->result = a.result + b.result;
+}
+
+/* row i of a 26x26 grid of counts, run as a jobs_run of its own */
+typedef struct grid {
+  jobs_t* pool;
+  atomic_int counts[26][26];
+} grid_t;
+
+static void
+cellTask(void* arg, const int i)
+{
+  atomic_int* row = arg;
+  atomic_fetch_add(&row[i], 1);
+}
+
+static void
+rowTask(void* arg, const int i)
+{
+  grid_t* grid = arg;
+  jobs_run(grid->pool, 26, cellTask, grid->counts[i]);
+}
+
+/* about as much work as compositing one player's frame of a big map */
+static void
+frameTask(void* arg, const int i)
+{
+  unsigned char (*frames)[TASK_BYTES] = arg;
+  unsigned sum = i;
+  for (int j = 0; j < TASK_BYTES; j++) {
+    sum = sum * 31 + (j ^ i);
+    frames[i][j] = sum >> 24;
+  }
+}
+
+int
+main(const int argc, char* argv[])
+{
+  int runs = argc > 1 ? atoi(argv[1]) : 2000;
+  if (runs < 1) {
+    fprintf(stderr, "usage: %s [runs]\n", argv[0]);
+    return 1;
+  }
+
+  printf("Testing NULL and empty pools\n");
+  assert(jobs_new(0) == NULL);
+  assert(jobs_size(NULL) == 0);
+  jobs_delete(NULL);
+  static atomic_int counts[MAX_COUNT];
+  jobs_run(NULL, 3, countTask, counts);
+  assert(counts[0] == 1 && counts[2] == 1 && counts[3] == 0);
+  jobs_counter_t none = JOBS_COUNTER_INIT;
+  jobs_spawn(NULL, &none, countTask, counts, 3);
+  jobs_wait(NULL, &none);
+  assert(counts[3] == 1);
+  jobs_stats_t stats;
+  jobs_stats(NULL, &stats);
+  assert(stats.spawned == 0 && stats.run == 0);
+  memset(counts, 0, sizeof(counts));
+
+  const int sizes[] = {1, 2, 4, 8};
+  const int numSizes = sizeof(sizes) / sizeof(sizes[0]);
+  for (int s = 0; s < numSizes; s++) {
+    printf("Testing %d threads: every index once\n", sizes[s]);
+    jobs_t* pool = jobs_new(sizes[s]);
+    assert(pool != NULL && jobs_size(pool) == sizes[s]);
+    const int lengths[] = {0, 1, 2, 7, 26, MAX_COUNT};
+    for (int c = 0; c < sizeof(lengths) / sizeof(lengths[0]); c++) {
+      for (int r = 0; r < 50; r++) {
+        jobs_run(pool, lengths[c], countTask, counts);
+      }
+      for (int i = 0; i < MAX_COUNT; i++) {
+        assert(counts[i] == (i < lengths[c] ? 50 : 0));
+      }
+      memset(counts, 0, sizeof(counts));
+    }
+
+    printf("Testing %d threads: nested spawns and runs\n", sizes[s]);
+    fib_t fib = {pool, 20, 0};
+    fibTask(&fib, 0);
+    assert(fib.result == 6765);
+    static grid_t grid;
+    memset(&grid, 0, sizeof(grid));
+    grid.pool = pool;
+    jobs_run(pool, 26, rowTask, &grid);
+    for (int i = 0; i < 26; i++) {
+      for (int j = 0; j < 26; j++) {
+        assert(grid.counts[i][j] == 1);
+      }
+    }
+
+    printf("Testing %d threads: sleeping, and waking\n", sizes[s]);
+    struct timespec nap = {0, 20 * 1000 * 1000};
+    nanosleep(&nap, NULL);
+    jobs_stats(pool, &stats);
+    assert(stats.sleeps >= sizes[s] - 1);
+    jobs_run(pool, MAX_COUNT, countTask, counts);
+    for (int i = 0; i < MAX_COUNT; i++) {
+      assert(counts[i] == 1);
+    }
+    memset(counts, 0, sizeof(counts));
+
+    jobs_stats(pool, &stats);
+    assert(sizes[s] == 1 || stats.spawned == stats.run);
+    printf("  %lu jobs, %lu injected, %lu stolen, %lu steals missed, "
+           "%lu locks contended, %lu sleeps\n",
+           stats.run, stats.injected, stats.steals, stats.missedSteals,
+           stats.contended, stats.sleeps);
+    jobs_delete(pool);
+  }
+
+  printf("Timing %d runs of 26 tasks of %d bytes each\n", runs, TASK_BYTES);
+  static unsigned char frames[26][TASK_BYTES];
+  static unsigned char expected[26][TASK_BYTES];
+  jobs_run(NULL, 26, frameTask, expected);
+  double serial = 0;
+  for (int s = 0; s < numSizes; s++) {
+    jobs_t* pool = jobs_new(sizes[s]);
+    memset(frames, 0, sizeof(frames));
+    double start = seconds();
+    for (int r = 0; r < runs; r++) {
+      jobs_run(pool, 26, frameTask, frames);
+    }
+    double elapsed = seconds() - start;
+    assert(memcmp(frames, expected, sizeof(frames)) == 0);
+    if (s == 0) {
+      serial = elapsed;
+    }
+    jobs_stats(pool, &stats);
+    printf("%d threads: %.1f us per run, %.2fx; %.1f steals, "
+           "%.2f locks contended per run\n", sizes[s],
+           elapsed / runs * 1e6, serial / elapsed,
+           (double)stats.steals / runs, (double)stats.contended / runs);
+    jobs_delete(pool);
+  }
+
+  printf("jobs test: PASS\n");
+  return 0;
+}
+
+/* the time now, in seconds, from a monotonic clock */
+static double
+seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+#endif // UNIT_TEST
@@ -0,0 +1,137 @@
+/*
+ * jobs - a small work-stealing job system
+ *
+ * A pool of threads, each with a deque of jobs of its own: a thread
+ * pushes the jobs it spawns onto the bottom of its deque and takes its
+ * next job from there too, newest first, while a thread with none left
+ * steals the oldest from the top of another's.  Jobs spawned from
+ * outside the pool go to a shared injector queue that every thread
+ * takes from.  A job may spawn more jobs, and wait for them; a thread
+ * that waits runs other jobs meanwhile, so waiting never idles it.
+ *
+ * A job is a task called with an argument and an index, as in a loop.
+ * Jobs are joined through a counter: each job spawned with a counter
+ * adds one to it, each that finishes takes one away, and jobs_wait
+ * returns once it is back to zero.  jobs_run is the usual case: a loop
+ * over 0..count-1, split in halves, and halves of those, as threads
+ * steal them.
+ *
+ * Threads with nothing to do spin briefly, then sleep until more jobs
+ * are spawned.  Each thread counts the jobs it spawned, ran and stole,
+ * its failed attempts to steal, the times it had to wait for a lock,
+ * and the times it slept; see jobs_stats.
+ *
+ * Typical usage:
+ *   jobs_t* pool = jobs_new(4);                // the caller and 3 threads
+ *   jobs_run(pool, numPlayers, composite, frames);
+ *   ... send frames[0..numPlayers-1], in order ...
+ *   jobs_delete(pool);
+ * or, to join jobs of different kinds:
+ *   jobs_counter_t done = JOBS_COUNTER_INIT;
+ *   jobs_spawn(pool, &done, updateVisible, players, i);
+ *   jobs_spawn(pool, &done, precompute, map, 0);
+ *   jobs_wait(pool, &done);
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test and benchmark;
+ * see jobs.c.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#ifndef _JOBS_H_
+#define _JOBS_H_
+
+#include <stdatomic.h>
+
+/****************** types *********************/
+typedef struct jobs jobs_t;  // opaque to users of the module
+
+/* A task: called with the argument it was spawned with, and an index. */
+typedef void (*jobs_task_t)(void* arg, const int i);
+
+/* Jobs spawned with a counter and not yet finished; initialize it with
+ * JOBS_COUNTER_INIT, and touch it only through this module. */
+typedef struct jobs_counter {
+  atomic_int pending;
+} jobs_counter_t;
+#define JOBS_COUNTER_INIT {0}
+
+/* What the pool's threads (and its callers) have done since it started */
+typedef struct jobs_stats {
+  unsigned long spawned;      // jobs spawned, counting jobs_run's halves
+  unsigned long injected;     // ... of them, from outside the pool
+  unsigned long run;          // jobs run
+  unsigned long steals;       // jobs taken from another thread's deque
+  unsigned long missedSteals; // searches of every other deque in vain
+  unsigned long contended;    // locks (of deques or the injector) that
+                              // were held by another thread when taken
+  unsigned long sleeps;       // times a thread slept for want of jobs
+} jobs_stats_t;
+
+/****************** global functions *********************/
+
+/******************************************/
+/* jobs_new: start a pool.
+ * Caller provides:
+ *   the number of threads to run jobs on, counting the caller's; a pool
+ *   of 1 starts no threads, and runs every job on the caller's, at once.
+ * Function returns:
+ *   the pool; or NULL if numThreads < 1, or a thread can't be started.
+ * Caller expectations:
+ *   call jobs_delete() when done.
+ */
+jobs_t* jobs_new(const int numThreads);
+
+/******************************************/
+/* jobs_size: the number of threads given to jobs_new; 0 if NULL.
+ */
+int jobs_size(const jobs_t* pool);
+
+/******************************************/
+/* jobs_spawn: have task(arg, i) called by one of the pool's threads.
+ * Caller provides:
+ *   the pool (if NULL, or of one thread, the task is called at once, on
+ *   the caller's thread), a counter to join the job through, and the
+ *   task, its argument and index.
+ * Notes:
+ *   the job may start before jobs_spawn returns, and may itself spawn
+ *   jobs, and wait for them.
+ */
+void jobs_spawn(jobs_t* pool, jobs_counter_t* counter, jobs_task_t task,
+                void* arg, const int i);
+
+/******************************************/
+/* jobs_wait: return once every job spawned with counter has finished,
+ * running jobs (these, or any others) in the meantime.
+ * Their effects are then visible to the caller.
+ */
+void jobs_wait(jobs_t* pool, jobs_counter_t* counter);
+
+/******************************************/
+/* jobs_run: call task(arg, i) for every i in 0..count-1, in parallel.
+ * Caller provides:
+ *   the pool (if NULL, the calls are made on the caller's thread, in
+ *   order), the number of calls, the task, and its argument.
+ * Function returns:
+ *   when all the calls have returned; their effects are then visible
+ *   to the caller.
+ * Notes:
+ *   each call must touch only what belongs to its index (and read what
+ *   no call writes); a task may itself call jobs_run.
+ */
+void jobs_run(jobs_t* pool, const int count, jobs_task_t task, void* arg);
+
+/******************************************/
+/* jobs_stats: fill in *stats with the sums over all of the pool's
+ * threads, and its callers; all zeros if pool is NULL.  May be called
+ * while jobs run, in which case the sums are only approximate.
+ */
+void jobs_stats(const jobs_t* pool, jobs_stats_t* stats);
+
+/******************************************/
+/* jobs_delete: stop the pool's threads, and free it.
+ * Every job must have finished.  Ignored if pool is NULL.
+ */
+void jobs_delete(jobs_t* pool);
+
+#endif // _JOBS_H_
@@ -0,0 +1,373 @@
+/*
+ * loadgen - a headless load generator for the nuggets server
+ *
+ * Simulates many players at once, each on its own UDP socket (the server
+ * tells players apart by address), over loopback or any other network.
+ * Every simulated player sends PLAY, then a stream of KEY messages at a
+ * configurable rate, either cycling through a scripted key sequence or
+ * choosing random movement keys.  Replies (OK, GRID, GOLD, DISPLAY, QUIT,
+ * ERROR) are consumed and counted but never rendered.
+ *
+ * When the run ends (duration elapsed, or every player has been sent QUIT)
+ * loadgen prints one report: messages and bytes received per second,
+ * the fraction of KEYs that got no reply, and the distribution of
+ * round-trip times from a KEY to the first reply that follows it.
+ *
+ * Note that the server sends nothing back for a move into a wall, and
+ * that a DISPLAY caused by another player's move is indistinguishable from
+ * a reply; 'unanswered' therefore counts blocked moves as well as lost
+ * datagrams, and round-trip times are an upper bound on queueing delay.
+ *
+ * usage: loadgen hostname port [--option=value ...]
+ *   --players=N     number of simulated players (default 26, the most
+ *                   one game admits; any more are refused with QUIT,
+ *                   and counted as refused in the report)
+ *   --rate=R        KEYs per second per player (default 10)
+ *   --duration=S    seconds to run (default 10)
+ *   --keys=STRING   cycle through these keys instead of random moves
+ *   --seed=N        seed for random keys (default 1)
+ *   --label=NAME    label for the report, e.g., the server's map name
+ *   --capture=FILE  write every datagram the first player receives to
+ *                   FILE, each as its length in decimal, a newline, and
+ *                   its bytes; the client's benchmark replays such a file
+ *
+ * See loadtest.sh to run loadgen against a fresh server for every map.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#define _DEFAULT_SOURCE   // for poll()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include "message.h"
+#include "histogram.h"
+
+/**************** file-local constants ****************/
+static const char* RandomKeys = "hjklyubn";     // single-step moves
+static const uint64_t ReplyTimeout = 1000000000ULL;  // 1s, in ns
+static const uint64_t SecondNanos = 1000000000ULL;
+
+/**************** file-local types ****************/
+typedef enum { JOINING, PLAYING, DONE } simState_t;
+
+typedef struct simPlayer {
+  int socket;             // this player's own UDP socket
+  simState_t state;
+  char letter;            // assigned by the server's OK
+  int nextKey;            // index into the key script
+  uint64_t nextSend;      // when to send the next KEY
+  uint64_t pendingSince;  // when the unanswered KEY was sent; 0 if none
+} simPlayer_t;
+
+typedef struct loadOptions {
+  int players;
+  double rate;
+  double duration;
+  const char* keys;
+  unsigned int seed;
+  const char* label;
+  const char* capture;
+} loadOptions_t;
+
+typedef struct loadStats {
+  uint64_t keysSent;
+  uint64_t unanswered;      // KEYs with no reply within ReplyTimeout
+  uint64_t messages;        // datagrams received, all types
+  uint64_t bytes;           // bytes received, all types
+  uint64_t displays, golds, quits, errors;
+  int joined;               // players that received OK
+  int refused;              // players sent QUIT instead of OK
+  histogram_t* rtt;         // KEY to first following reply, in ns
+} loadStats_t;
+
+/**************** file-local functions ****************/
+static bool parseArgs(const int argc, char* argv[], loadOptions_t* options);
+static int openSocket(void);
+static void sendKey(simPlayer_t* player, const loadOptions_t* options,
+                    const addr_t server, loadStats_t* stats);
+static void receive(simPlayer_t* player, loadStats_t* stats, FILE* capture);
+static void report(const loadOptions_t* options, const loadStats_t* stats,
+                   const double seconds);
+
+/***************** main *******************************/
+int
+main(const int argc, char* argv[])
+{
+  loadOptions_t options = {26, 10.0, 10.0, NULL, 1, NULL, NULL};
+  if (!parseArgs(argc, argv, &options)) {
+    fprintf(stderr, "usage: %s hostname port [--players=N] [--rate=R] "
+            "[--duration=S] [--keys=STRING] [--seed=N] [--label=NAME] "
+            "[--capture=FILE]\n",
+            argv[0]);
+    return 3; // bad commandline
+  }
+
+  addr_t server; // address of the server
+  if (!message_setAddr(argv[1], argv[2], &server)) {
+    fprintf(stderr, "can't form address from %s %s\n", argv[1], argv[2]);
+    return 4; // bad hostname/port
+  }
+  srand(options.seed);
+  FILE* capture = NULL;
+  if (options.capture != NULL &&
+      (capture = fopen(options.capture, "w")) == NULL) {
+    fprintf(stderr, "can't write %s\n", options.capture);
+    return 2;
+  }
+
+  simPlayer_t* players = calloc(options.players, sizeof(simPlayer_t));
+  struct pollfd* pollfds = calloc(options.players, sizeof(struct pollfd));
+  loadStats_t stats = {0};
+  stats.rtt = histogram_new();
+  if (players == NULL || pollfds == NULL || stats.rtt == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 2;
+  }
+
+  // every player joins at once; KEYs are staggered across one interval
+  const uint64_t interval = (uint64_t)(SecondNanos / options.rate);
+  const uint64_t start = message_now();
+  for (int i = 0; i < options.players; i++) {
+    if ((players[i].socket = openSocket()) < 0) {
+      fprintf(stderr, "could only open %d sockets\n", i);
+      return 2;
+    }
+    char play[32];
+    snprintf(play, sizeof(play), "PLAY sim%d", i);
+    sendto(players[i].socket, play, strlen(play), 0,
+           (struct sockaddr *) &server, sizeof(server));
+    players[i].state = JOINING;
+    players[i].nextSend = start + interval * i / options.players;
+    pollfds[i].fd = players[i].socket;
+    pollfds[i].events = POLLIN;
+  }
+
+  const uint64_t end = start + (uint64_t)(options.duration * SecondNanos);
+  int active = options.players;
+  uint64_t now;
+  while ((now = message_now()) < end && active > 0) {
+    // send every KEY that is due, and note when the next one is
+    uint64_t wake = end;
+    for (int i = 0; i < options.players; i++) {
+      simPlayer_t* p = &players[i];
+      if (p->state != PLAYING) {
+        continue;
+      }
+      if (p->nextSend <= now) {
+        sendKey(p, &options, server, &stats);
+        p->nextSend += interval;
+        if (p->nextSend < now) {
+          p->nextSend = now + interval;  // fell behind; don't burst
+        }
+      }
+      if (p->nextSend < wake) {
+        wake = p->nextSend;
+      }
+    }
+
+    // wait for replies until the next KEY is due
+    int waitMillis = wake > now ? (int)((wake - now) / 1000000) : 0;
+    if (poll(pollfds, options.players, waitMillis) > 0) {
+      for (int i = 0; i < options.players; i++) {
+        if (pollfds[i].revents & POLLIN) {
+          receive(&players[i], &stats, i == 0 ? capture : NULL);
+          if (players[i].state == DONE) {
+            pollfds[i].fd = -1;   // poll() ignores negative descriptors
+            active--;
+          }
+        }
+      }
+    }
+  }
+
+  // anything still outstanding was never answered
+  for (int i = 0; i < options.players; i++) {
+    if (players[i].pendingSince != 0) {
+      stats.unanswered++;
+    }
+    close(players[i].socket);
+  }
+
+  report(&options, &stats, (message_now() - start) / (double)SecondNanos);
+  if (capture != NULL) {
+    fclose(capture);
+  }
+
+  histogram_delete(stats.rtt);
+  free(pollfds);
+  free(players);
+  return 0;
+}
+
+/**************** parseArgs ****************/
+/* Check the positional arguments and parse any --name=value options.
+ * Return false on any error.
+ */
+static bool
+parseArgs(const int argc, char* argv[], loadOptions_t* options)
+{
+  if (argc < 3) {
+    return false;
+  }
+  for (int i = 3; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = strchr(arg, '=');
+    if (strncmp(arg, "--", 2) != 0 || value == NULL || value[1] == '\0') {
+      return false;
+    }
+    value++;
+    if (strncmp(arg, "--players=", 10) == 0) {
+      options->players = atoi(value);
+    } else if (strncmp(arg, "--rate=", 7) == 0) {
+      options->rate = atof(value);
+    } else if (strncmp(arg, "--duration=", 11) == 0) {
+      options->duration = atof(value);
+    } else if (strncmp(arg, "--keys=", 7) == 0) {
+      options->keys = value;
+    } else if (strncmp(arg, "--seed=", 7) == 0) {
+      options->seed = atoi(value);
+    } else if (strncmp(arg, "--label=", 8) == 0) {
+      options->label = value;
+    } else if (strncmp(arg, "--capture=", 10) == 0) {
+      options->capture = value;
+    } else {
+      return false;
+    }
+  }
+  return options->players > 0 && options->rate > 0 && options->duration > 0;
+}
+
+/**************** openSocket ****************/
+/* Open a UDP socket bound to an ephemeral port; return it, or -1. */
+static int
+openSocket(void)
+{
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    return -1;
+  }
+  struct sockaddr_in self;
+  memset(&self, 0, sizeof(self));
+  self.sin_family = AF_INET;
+  self.sin_addr.s_addr = INADDR_ANY;
+  self.sin_port = 0;
+  if (bind(sock, (struct sockaddr *) &self, sizeof(self)) != 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/**************** sendKey ****************/
+/* Send the player's next KEY, and start timing it if no KEY is
+ * already waiting for a reply.
+ */
+static void
+sendKey(simPlayer_t* player, const loadOptions_t* options,
+        const addr_t server, loadStats_t* stats)
+{
+  const uint64_t now = message_now();
+  if (player->pendingSince != 0 && now - player->pendingSince > ReplyTimeout) {
+    stats->unanswered++;
+    player->pendingSince = 0;
+  }
+
+  char key;
+  if (options->keys != NULL) {
+    key = options->keys[player->nextKey];
+    player->nextKey = options->keys[player->nextKey + 1] == '\0' ?
+      0 : player->nextKey + 1;
+  } else {
+    key = RandomKeys[rand() % strlen(RandomKeys)];
+  }
+
+  char message[] = "KEY ?";
+  message[4] = key;
+  sendto(player->socket, message, strlen(message), 0,
+         (struct sockaddr *) &server, sizeof(server));
+  stats->keysSent++;
+  if (player->pendingSince == 0) {
+    player->pendingSince = now;
+  }
+}
+
+/**************** receive ****************/
+/* Read one datagram for this player and account for it; if capture is
+ * not NULL, record it there too.
+ */
+static void
+receive(simPlayer_t* player, loadStats_t* stats, FILE* capture)
+{
+  char buf[message_MaxBytes + 1];  // + 1 for the terminating null
+  int nbytes = recv(player->socket, buf, message_MaxBytes, 0);
+  if (nbytes < 0) {
+    return;
+  }
+  buf[nbytes] = '\0';
+  if (capture != NULL) {
+    fprintf(capture, "%d\n", nbytes);
+    fwrite(buf, 1, nbytes, capture);
+  }
+  stats->messages++;
+  stats->bytes += nbytes;
+
+  bool isReply = false;
+  if (strncmp(buf, "DISPLAY", 7) == 0) {
+    stats->displays++;
+    isReply = true;
+  } else if (strncmp(buf, "GOLD ", 5) == 0) {
+    stats->golds++;
+    isReply = true;
+  } else if (strncmp(buf, "ERROR ", 6) == 0) {
+    stats->errors++;
+    isReply = true;
+  } else if (strncmp(buf, "OK ", 3) == 0 && player->state == JOINING) {
+    player->letter = buf[3];
+    player->state = PLAYING;
+    stats->joined++;
+  } else if (strncmp(buf, "QUIT", 4) == 0) {
+    stats->quits++;
+    if (player->state == JOINING) {
+      stats->refused++;
+    }
+    player->state = DONE;
+  }
+
+  if (isReply && player->pendingSince != 0) {
+    histogram_record(stats->rtt, message_now() - player->pendingSince);
+    player->pendingSince = 0;
+  }
+}
+
+/**************** report ****************/
+/* Print a summary of the run to stdout. */
+static void
+report(const loadOptions_t* options, const loadStats_t* stats,
+       const double seconds)
+{
+  const char* label = options->label == NULL ? "loadgen" : options->label;
+  printf("%s: %d players (%d joined, %d refused), %.1f s, "
+         "%.1f keys/s/player\n", label, options->players, stats->joined,
+         stats->refused, seconds, options->rate);
+  printf("%s: sent %llu KEY (%.0f/s); received %llu messages (%.0f/s, "
+         "%.2f MB/s): %llu DISPLAY, %llu GOLD, %llu ERROR, %llu QUIT\n",
+         label, (unsigned long long)stats->keysSent,
+         stats->keysSent / seconds,
+         (unsigned long long)stats->messages, stats->messages / seconds,
+         stats->bytes / seconds / 1e6,
+         (unsigned long long)stats->displays, (unsigned long long)stats->golds,
+         (unsigned long long)stats->errors, (unsigned long long)stats->quits);
+  uint64_t timed = histogram_count(stats->rtt) + stats->unanswered;
+  printf("%s: unanswered %llu of %llu timed KEYs (%.2f%%)\n",
+         label, (unsigned long long)stats->unanswered,
+         (unsigned long long)timed,
+         timed == 0 ? 0.0 : 100.0 * stats->unanswered / timed);
+  char rttLabel[128];
+  snprintf(rttLabel, sizeof(rttLabel), "%s: round trip", label);
+  histogram_print(stats->rtt, stdout, rttLabel);
+}
@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+# Run loadgen against a fresh server for each map, one report per map.
+#
+# usage: ./loadtest.sh [loadgen options...]
+#   e.g. ./loadtest.sh --players=20 --rate=20 --duration=5
+# Maps default to ../maps/*.txt; set MAPS to override:
+#   MAPS="../maps/big.txt ../maps/small.txt" ./loadtest.sh
+#
+# Palmer's Scholars, March 2022
+
+SERVER=../server/server
+MAPS=${MAPS:-../maps/*.txt}
+
+for map in $MAPS; do
+    out=$(mktemp)
+    $SERVER --log-level=error "$map" 1 >"$out" 2>/dev/null &
+    pid=$!
+
+    # wait for the server to announce its port
+    port=""
+    for try in 1 2 3 4 5 6 7 8 9 10; do
+        port=$(sed -n 's/^Waiting on port \([0-9]*\).*/\1/p' "$out")
+        [ -n "$port" ] && break
+        sleep 0.2
+    done
+
+    if [ -z "$port" ]; then
+        echo "$map: server did not start"
+    else
+        ./loadgen localhost "$port" --label="$(basename "$map" .txt)" "$@"
+    fi
+
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+    rm -f "$out"
+done
@@ -1,15 +1,83 @@
-/* 
+/*
  * log module - a simple way to log messages to a file
- * 
+ *
+ * The asynchronous mode uses a bounded multi-producer, single-consumer
+ * ring of fixed-size slots, after Dmitry Vyukov's bounded MPMC queue:
+ * each slot carries a sequence number saying whether it is free for the
+ * producer at a given position, or full for the consumer at that position.
+ * A producer claims one or more consecutive slots with a single
+ * compare-and-swap on the enqueue position, so long lines (message bodies)
+ * are never interleaved with other lines.  The only consumer is the
+ * writer thread, which sleeps briefly whenever the ring is empty.
+ * The writer flushes, and reports lines dropped, only when every slot
+ * claimed has been published and written, i.e., between whole lines.
+ * Producers count themselves in and out of the ring, so that stopping
+ * can wait for every claim to be published before the writer exits.
+ *
  * David Kotz, May 2019
  */
 
+#define _DEFAULT_SOURCE   // for nanosleep
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
-#include <sys/errno.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "log.h"
 
+/**************** file-local constants ****************/
+#define RING_SLOTS 4096           // must be a power of two
+#define SLOT_BYTES 240            // text bytes per slot
+static const int LineBytes = 1024;  // formatted lines longer than this
+                                    // are allocated on the heap
+static const int MaxFlushFPs = 8;   // distinct files the writer flushes
+#define MAX_DROP_FPS 8            // distinct files whose drops are counted
+static const long IdleNanos = 1000000;  // writer's sleep when ring is empty
+
+/**************** file-local types ****************/
+typedef struct slot {
+  atomic_size_t seq;        // position this slot is free (== pos) or full
+                            // (== pos + 1) for
+  FILE* fp;                 // where the text goes
+  int length;               // bytes of text used
+  char text[SLOT_BYTES];
+} slot_t;
+
+/**************** file-local global variables ****************/
+static atomic_int currentLevel = LOG_DEBUG;  // see log_setLevel
+
+static slot_t ring[RING_SLOTS];
+static atomic_size_t enqueuePos;     // next position producers claim
+static atomic_size_t dequeuePos;     // next position the writer reads
+static atomic_bool asyncOn = false;  // producers should use the ring
+static atomic_bool stopping = false; // writer should exit once drained
+static atomic_int emitters = 0;      // producers between checking asyncOn
+                                     // and publishing their line
+static struct {
+  _Atomic(FILE*) fp;                 // claimed by the first drop for it
+  atomic_ulong count;                // lines for fp lost to a full ring
+} dropped[MAX_DROP_FPS];
+static atomic_ulong droppedElsewhere = 0;  // lost once dropped[] is full
+static pthread_t writer;
+
+/**************** file-local functions ****************/
+static void logFormatted(const int level, FILE* fp, const char* format, ...);
+static void emit(FILE* fp, const char* parts[], const int lengths[],
+                 const int nparts);
+static void emitAsync(FILE* fp, const char* parts[], const int lengths[],
+                      const int nparts);
+static void drop(FILE* fp);
+static bool drainOne(FILE* flushFPs[], int* nflush);
+static void* writerThread(void* arg);
+static int numLines(const char* string);
+
 /**************** flog_init ****************/
 /* Initialize the logging module.
  */
@@ -19,66 +87,75 @@ void flog_init(FILE* fp)
 }
 
 /**************** flog_s ****************/
-/* 
+/*
  * log a string to the logfile, if logging is enabled.
  * The string `format` can reference '%s' to incorporate `str`.
  */
 void
 flog_s(FILE* fp, const char* format, const char* str)
 {
-  if (fp != NULL && format != NULL && str != NULL) {
-    fprintf(fp, format, str);
-    fputc('\n', fp);
-    fflush(fp);
+  if (str != NULL) {
+    logFormatted(LOG_INFO, fp, format, str);
   }
 }
 
 /**************** flog_d ****************/
-/* 
+/*
  * log an integer to the logfile, if logging is enabled.
  * The string `format` can reference '%d' to incorporate `num`.
  */
 void
 flog_d(FILE* fp, const char* format, const int num)
 {
-  if (fp != NULL && format != NULL) {
-    fprintf(fp, format, num);
-    fputc('\n', fp);
-    fflush(fp);
-  }
+  logFormatted(LOG_INFO, fp, format, num);
 }
 
 /**************** flog_c ****************/
-/* 
+/*
  * log a character to the logfile, if logging is enabled.
  * The string `format` can reference '%c' to incorporate `ch`.
  */
 void
 flog_c(FILE* fp, const char* format, const char ch)
 {
-  if (fp != NULL && format != NULL) {
-    fprintf(fp, format, ch);
-    fputc('\n', fp);
-    fflush(fp);
-  }
+  logFormatted(LOG_INFO, fp, format, ch);
 }
 
 /**************** flog_v ****************/
-/* 
+/*
  * log a message to the logfile, if logging is enabled.
  */
 void
 flog_v(FILE* fp, const char* str)
 {
-  if (fp != NULL && str != NULL) {
-    fputs(str, fp);
-    fputc('\n', fp);
-    fflush(fp);
+  if (str != NULL) {
+    logFormatted(LOG_INFO, fp, "%s", str);
   }
 }
 
+/**************** flog_b ****************/
+/*
+ * log a message body to the logfile, if logging is enabled
+ * at the LOG_DEBUG level.
+ */
+void
+flog_b(FILE* fp, const char* body)
+{
+  if (fp == NULL || body == NULL || atomic_load(&currentLevel) < LOG_DEBUG) {
+    return;
+  }
+  char header[32];
+  const char* parts[] = {header, body, "\n"};
+  const int lengths[] = {
+    snprintf(header, sizeof(header), "%d lines:\n", numLines(body)),
+    strlen(body),
+    1
+  };
+  emit(fp, parts, lengths, 3);
+}
+
 /**************** flog_e ****************/
-/* 
+/*
  * log an error to the logfile, if logging is enabled.
  * Expects the global variable errno (sys/errno.h) to indicate the error,
  * so this is best used immediately after a system call.
@@ -86,18 +163,467 @@ flog_v(FILE* fp, const char* str)
 void
 flog_e(FILE* fp, const char* str)
 {
-  if (fp != NULL && str != NULL) {
-    fprintf(fp, "%s: %s\n", str, strerror(errno));
-    fflush(fp);
+  if (str != NULL) {
+    const char* error = strerror(errno);
+    logFormatted(LOG_ERROR, fp, "%s: %s", str, error);
   }
 }
 
 /**************** flog_done ****************/
-/* 
- * Done with logging.  Notes this, then disables logging. 
+/*
+ * Done with logging.  Notes this, then disables logging.
  */
 void
 flog_done(FILE* fp)
 {
   flog_v(fp, "END OF LOG");
 }
+
+/**************** flog_setLevel ****************/
+/*
+ * Set the run-time log level for all files.
+ */
+void
+flog_setLevel(const int level)
+{
+  atomic_store(&currentLevel, level);
+}
+
+/**************** flog_enabled ****************/
+/*
+ * Return true if the run-time log level admits calls at the given level.
+ */
+bool
+flog_enabled(const int level)
+{
+  return atomic_load_explicit(&currentLevel, memory_order_relaxed) >= level;
+}
+
+/**************** flog_startAsync ****************/
+/*
+ * Start the writer thread; see log.h.
+ */
+bool
+flog_startAsync(void)
+{
+  if (atomic_load(&asyncOn)) {
+    return true;  // already running
+  }
+
+  // every slot starts out free for the position it will first hold
+  for (size_t i = 0; i < RING_SLOTS; i++) {
+    atomic_store(&ring[i].seq, i);
+  }
+  atomic_store(&enqueuePos, 0);
+  atomic_store(&dequeuePos, 0);
+  atomic_store(&stopping, false);
+
+  if (pthread_create(&writer, NULL, writerThread, NULL) != 0) {
+    return false;
+  }
+  atomic_store(&asyncOn, true);
+  return true;
+}
+
+/**************** flog_stopAsync ****************/
+/*
+ * Drain the ring and stop the writer thread; see log.h.
+ */
+void
+flog_stopAsync(void)
+{
+  if (!atomic_load(&asyncOn)) {
+    return;
+  }
+  atomic_store(&asyncOn, false);   // new lines are written directly
+
+  // a producer that saw asyncOn still true may yet claim slots; once it
+  // has published them, the writer may drain the ring for the last time
+  while (atomic_load(&emitters) > 0) {
+    sched_yield();
+  }
+  atomic_store(&stopping, true);
+  pthread_join(writer, NULL);
+}
+
+/**************** logFormatted ****************/
+/*
+ * printf a line (adding the newline) to fp, if fp is non-NULL and
+ * the level is enabled; directly, or via the ring if logging is async.
+ */
+static void
+logFormatted(const int level, FILE* fp, const char* format, ...)
+{
+  if (fp == NULL || format == NULL || atomic_load(&currentLevel) < level) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, format);
+  if (!atomic_load(&asyncOn)) {
+    vfprintf(fp, format, args);
+    fputc('\n', fp);
+    fflush(fp);
+    va_end(args);
+    return;
+  }
+
+  // format in the caller's thread; the writer only copies bytes out
+  char line[LineBytes];
+  char* text = line;
+  va_list again;
+  va_copy(again, args);
+  int length = vsnprintf(line, LineBytes, format, args);
+  if (length >= LineBytes) {
+    text = malloc(length + 1);
+    if (text != NULL) {
+      vsnprintf(text, length + 1, format, again);
+    }
+  }
+  va_end(again);
+  va_end(args);
+
+  if (length >= 0 && text != NULL) {
+    const char* parts[] = {text, "\n"};
+    const int lengths[] = {length, 1};
+    emit(fp, parts, lengths, 2);
+  }
+  if (text != line) {
+    free(text);
+  }
+}
+
+/**************** emit ****************/
+/*
+ * Write the concatenation of the given parts to fp as one unit:
+ * directly if logging is synchronous, else into consecutive ring slots.
+ * Never blocks; if the ring is full the text is dropped and counted.
+ */
+static void
+emit(FILE* fp, const char* parts[], const int lengths[], const int nparts)
+{
+  // count ourselves in before looking at asyncOn, so that flog_stopAsync
+  // either stops us using the ring or waits until we are done with it
+  atomic_fetch_add(&emitters, 1);
+  if (atomic_load(&asyncOn)) {
+    emitAsync(fp, parts, lengths, nparts);
+    atomic_fetch_sub(&emitters, 1);
+    return;
+  }
+  atomic_fetch_sub(&emitters, 1);
+
+  for (int i = 0; i < nparts; i++) {
+    fwrite(parts[i], 1, lengths[i], fp);
+  }
+  fflush(fp);
+}
+
+/**************** emitAsync ****************/
+/*
+ * As emit, into consecutive ring slots; the caller has counted itself
+ * among the emitters.
+ */
+static void
+emitAsync(FILE* fp, const char* parts[], const int lengths[],
+          const int nparts)
+{
+  size_t total = 0;
+  for (int i = 0; i < nparts; i++) {
+    total += lengths[i];
+  }
+  size_t need = total == 0 ? 1 : (total + SLOT_BYTES - 1) / SLOT_BYTES;
+  if (need > RING_SLOTS / 2) {
+    drop(fp);  // would starve everyone else
+    return;
+  }
+
+  // claim 'need' consecutive free slots
+  size_t pos = atomic_load_explicit(&enqueuePos, memory_order_relaxed);
+  while (true) {
+    size_t i;
+    intptr_t diff = 0;
+    for (i = 0; i < need; i++) {
+      slot_t* slot = &ring[(pos + i) & (RING_SLOTS - 1)];
+      size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+      diff = (intptr_t)seq - (intptr_t)(pos + i);
+      if (diff != 0) {
+        break;
+      }
+    }
+    if (i == need) {
+      if (atomic_compare_exchange_weak_explicit(&enqueuePos, &pos, pos + need,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;  // the slots are ours
+      }
+      // pos was reloaded by the failed exchange; try again
+    } else if (diff < 0) {
+      drop(fp);  // ring is full
+      return;
+    } else {
+      // another producer claimed this position first
+      pos = atomic_load_explicit(&enqueuePos, memory_order_relaxed);
+    }
+  }
+
+  // copy the parts into the claimed slots, then publish each slot
+  int part = 0;
+  int offset = 0;   // into parts[part]
+  for (size_t i = 0; i < need; i++) {
+    slot_t* slot = &ring[(pos + i) & (RING_SLOTS - 1)];
+    slot->fp = fp;
+    slot->length = 0;
+    while (part < nparts && slot->length < SLOT_BYTES) {
+      int n = lengths[part] - offset;
+      if (n > SLOT_BYTES - slot->length) {
+        n = SLOT_BYTES - slot->length;
+      }
+      memcpy(slot->text + slot->length, parts[part] + offset, n);
+      slot->length += n;
+      offset += n;
+      if (offset == lengths[part]) {
+        part++;
+        offset = 0;
+      }
+    }
+    atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+  }
+}
+
+/**************** drop ****************/
+/*
+ * Count a line for fp lost, for the writer to report there; each file
+ * keeps its own count, in the first entry of dropped[] it claims.
+ * Lines for more files than that are counted together, for stderr.
+ */
+static void
+drop(FILE* fp)
+{
+  for (int i = 0; i < MAX_DROP_FPS; i++) {
+    FILE* claimed = atomic_load(&dropped[i].fp);
+    if (claimed == NULL &&
+        atomic_compare_exchange_strong(&dropped[i].fp, &claimed, fp)) {
+      claimed = fp;
+    }
+    if (claimed == fp) {
+      atomic_fetch_add(&dropped[i].count, 1);
+      return;
+    }
+  }
+  atomic_fetch_add(&droppedElsewhere, 1);
+}
+
+/**************** drainOne ****************/
+/*
+ * Write out the next full slot, if any, noting its file for flushing.
+ * Returns false if the ring is empty, or the next slot is claimed but
+ * not yet published.  Only the writer thread may call this.
+ */
+static bool
+drainOne(FILE* flushFPs[], int* nflush)
+{
+  size_t pos = atomic_load_explicit(&dequeuePos, memory_order_relaxed);
+  slot_t* slot = &ring[pos & (RING_SLOTS - 1)];
+  size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  if (seq != pos + 1) {
+    return false;
+  }
+
+  fwrite(slot->text, 1, slot->length, slot->fp);
+  int i;
+  for (i = 0; i < *nflush && flushFPs[i] != slot->fp; i++) {
+  }
+  if (i == *nflush && *nflush < MaxFlushFPs) {
+    flushFPs[(*nflush)++] = slot->fp;
+  } else if (i == *nflush) {
+    fflush(slot->fp);   // too many files to track; flush now
+  }
+
+  atomic_store_explicit(&slot->seq, pos + RING_SLOTS, memory_order_release);
+  atomic_store_explicit(&dequeuePos, pos + 1, memory_order_relaxed);
+  return true;
+}
+
+/**************** writerThread ****************/
+/*
+ * Copy lines from the ring to their files; whenever the ring empties,
+ * report any lines dropped, and flush; exit once asked to stop and the
+ * ring is empty.
+ */
+static void*
+writerThread(void* arg)
+{
+  FILE* flushFPs[MaxFlushFPs];
+  int nflush = 0;
+  const struct timespec idle = {0, IdleNanos};
+
+  while (true) {
+    // once stopping is set, every slot claimed has been published
+    // (see flog_stopAsync), so if we then find the ring empty, it is
+    // empty for good
+    bool stop = atomic_load(&stopping);
+    if (drainOne(flushFPs, &nflush)) {
+      continue;
+    }
+    if (atomic_load(&enqueuePos) != atomic_load(&dequeuePos)) {
+      // a producer is still copying a line into slots it has claimed;
+      // wait for it, so as not to write anything into that line
+      sched_yield();
+      continue;
+    }
+
+    // ring is empty, between whole lines: note lines dropped in each
+    // file they were meant for, and make everything written visible
+    for (int i = 0; i < MAX_DROP_FPS; i++) {
+      FILE* fp = atomic_load(&dropped[i].fp);
+      if (fp != NULL && atomic_load(&dropped[i].count) > 0) {
+        unsigned long lost = atomic_exchange(&dropped[i].count, 0);
+        fprintf(fp, "log: %lu lines dropped (buffer full)\n", lost);
+        fflush(fp);
+      }
+    }
+    if (atomic_load(&droppedElsewhere) > 0) {
+      unsigned long lost = atomic_exchange(&droppedElsewhere, 0);
+      fprintf(stderr, "log: %lu lines dropped (buffer full)\n", lost);
+      fflush(stderr);
+    }
+    for (int i = 0; i < nflush; i++) {
+      fflush(flushFPs[i]);
+    }
+    nflush = 0;
+
+    if (stop) {
+      return NULL;
+    }
+    nanosleep(&idle, NULL);
+  }
+}
+
+/**************** numLines ****************/
+/*
+ * Return number of lines needed to print the string:
+ * 0 if string is NULL or empty;
+ * Otherwise return number of newline characters,
+ *  plus 1 if string does not end with newline.
+ */
+static int
+numLines(const char* string)
+{
+  if (string == NULL || *string == '\0') {
+    // string is null or empty
+    return 0;
+  } else {
+    // string is not empty; count newlines
+    int n = 0;
+    const char* p;
+    for (p = string; *p != '\0'; p++) {
+      if (*p == '\n') {
+	n++;
+      }
+    }
+    // if the string does not end with newline, count the partial line
+    if (*(p-1) != '\n') {
+      n++;
+    }
+    return n;
+  }
+}
+
+/* ****************************************************************** */
+/* ************************* UNIT_TEST ****************************** */
+/*
+ * Several threads log numbered lines, short and long, through the async
+ * ring into two temporary files, half the threads to each; then check
+ * that every line that was not reported dropped, in its own file,
+ * arrived there exactly once and intact.
+ */
+
+#ifdef UNIT_TEST
+
+#include <assert.h>
+
+#define THREADS 4
+#define LINES 20000
+#define FILES 2
+
+static FILE* testFPs[FILES];
+
+static void*
+producer(void* arg)
+{
+  const int id = *(int*)arg;
+  FILE* testFP = testFPs[id % FILES];
+  char body[3 * SLOT_BYTES];   // spans several slots
+  for (int i = 0; i < LINES; i++) {
+    if (i % 100 == 0) {
+      snprintf(body, sizeof(body), "body %d %d %0*d", id, i,
+               (int)sizeof(body) - 40, 0);
+      flog_b(testFP, body);
+    } else {
+      char line[64];
+      snprintf(line, sizeof(line), "line %d %d", id, i);
+      flog_v(testFP, line);
+    }
+  }
+  return NULL;
+}
+
+int
+main(const int argc, char* argv[])
+{
+  for (int f = 0; f < FILES; f++) {
+    testFPs[f] = tmpfile();
+    assert(testFPs[f] != NULL);
+  }
+
+  printf("Testing level filtering\n");
+  flog_setLevel(LOG_INFO);
+  assert(flog_enabled(LOG_INFO) && !flog_enabled(LOG_DEBUG));
+  flog_b(testFPs[0], "should not appear");
+  flog_setLevel(LOG_DEBUG);
+  assert(ftell(testFPs[0]) == 0);
+
+  printf("Testing %d threads x %d lines through the ring\n", THREADS, LINES);
+  assert(flog_startAsync());
+  pthread_t threads[THREADS];
+  int ids[THREADS];
+  for (int t = 0; t < THREADS; t++) {
+    ids[t] = t;
+    assert(pthread_create(&threads[t], NULL, producer, &ids[t]) == 0);
+  }
+  for (int t = 0; t < THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  flog_stopAsync();
+
+  // check what arrived in each file
+  static char seen[THREADS][LINES];
+  char line[4 * SLOT_BYTES];
+  for (int f = 0; f < FILES; f++) {
+    int id, i, count = 0, droppedLines = 0;
+    unsigned long lost;
+    rewind(testFPs[f]);
+    while (fgets(line, sizeof(line), testFPs[f]) != NULL) {
+      if (sscanf(line, "line %d %d", &id, &i) == 2 ||
+          sscanf(line, "body %d %d", &id, &i) == 2) {
+        assert(id >= 0 && id < THREADS && i >= 0 && i < LINES);
+        assert(id % FILES == f);
+        assert(!seen[id][i]);
+        seen[id][i] = 1;
+        count++;
+      } else if (sscanf(line, "log: %lu lines dropped", &lost) == 1) {
+        droppedLines += lost;
+      } else {
+        assert(strcmp(line, "1 lines:\n") == 0);
+      }
+    }
+    printf("file %d: %d lines arrived, %d dropped\n", f, count, droppedLines);
+    assert(count + droppedLines == THREADS / FILES * LINES);
+    fclose(testFPs[f]);
+  }
+
+  printf("Tests passed successfully.\n");
+  return 0;
+}
+
+#endif // UNIT_TEST
@@ -1,21 +1,39 @@
-/* 
+/*
  * log module - a simple way to log messages to a file.
- * 
+ *
  * Users of this module should call log_init(fp); stderr is one option,
- * but it could be any file open for writing. Then call a sequence of 
- * log_s, log_d, log_c, log_v, log_e functions to write formatted information
+ * but it could be any file open for writing. Then call a sequence of
+ * log_s, log_d, log_c, log_v, log_e macros to write formatted information
  * to that log.  Finally, call log_done.
- * 
+ *
  * If the user of the module does not call log_init(), or calls log_init(NULL),
- * the log_x functions will be ignored and nothing will be logged.
- * 
+ * the log_x calls will be ignored (without evaluating their arguments)
+ * and nothing will be logged.
+ *
  * The flog_x functions should not be called by the module user.
- * 
+ *
  * See the note below about file-local global variables; if log.h is included
  * by multiple source files within a single program, *each* such file has
  * its own logging fp and thus can independently control whether to log and
  * where to log.
- * 
+ *
+ * Levels: every log_x call logs at one of the levels below; log_e at
+ * LOG_ERROR, log_b (message bodies) at LOG_DEBUG, and all others at
+ * LOG_INFO.  Calls above the level set by log_setLevel() are ignored at
+ * run time; calls above LOG_LEVEL (a compile-time ceiling, e.g.,
+ * make BUILDENV=-DLOG_LEVEL=LOG_INFO) are compiled out, arguments and all.
+ * So log_setLevel(LOG_INFO)
+ * keeps message metadata (addresses, lengths) but drops the bodies.
+ *
+ * Asynchronous logging: after log_startAsync(), the log_x calls only
+ * format their line into a lock-free ring buffer, and a background thread
+ * does the (slow, flushed) writes; log_stopAsync() drains the buffer.
+ * If the ring fills, lines are dropped rather than stalling the caller,
+ * and the number dropped is logged, to the file they were meant for,
+ * when the buffer is next drained; each of the first eight files that
+ * lose lines has its own count, and lines for any more are counted on
+ * stderr.
+ *
  * David Kotz, May 2019
  */
 
@@ -24,24 +42,43 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+
+/*********** log levels ****************/
+#define LOG_ERROR 1   // log_e
+#define LOG_INFO  2   // log_s, log_d, log_c, log_v
+#define LOG_DEBUG 3   // log_b
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG   // compile-time ceiling; default: everything
+#endif
 
 /*********** file-local global variable ****************/
 /* Here is an example of a judicious use of a global variable.
- * This module stashes a file pointer(FP) for use in all the logging 
+ * This module stashes a file pointer(FP) for use in all the logging
  * functions, so the module user need not pass the FP to every call.
- * This approach is unusual in that there is a copy of this variable local to 
+ * This approach is unusual in that there is a copy of this variable local to
  * *each file* that #includes "log.h" as well as to the module itself.
  * Each file that includes log.h will be able to log to its own file,
  * and thus *must* call log_init to provide that file descriptor.
- * Default is NULL, which means "do not log". 
+ * Default is NULL, which means "do not log".
  */
 static FILE* logFP = NULL;
 
 /*********** logging-related functions ****************/
-/* Module users should call the inline log_x functions; these simply provide
+/* Module users should call the log_x macros; these simply provide
  * the logFP to the flog_x functions that are coded in log.c.
+ * They are macros, not functions, so that a call whose level is above
+ * LOG_LEVEL or the run-time level, or made while logFP is NULL, never
+ * evaluates its arguments: a disabled call costs at most one test of
+ * logFP and one read of the run-time level, and with LOG_LEVEL below
+ * its level the compiler drops the call entirely.  Thus arguments
+ * must not have side effects the caller depends on.
  */
 
+#define LOG_ON(level) \
+  (LOG_LEVEL >= (level) && logFP != NULL && log_enabled(level))
+
 void flog_init(FILE* fp);
 static inline void log_init(FILE* fp) { logFP = fp; flog_init(logFP); }
 /* log_init: to begin logging, provide an fp open for writing;
@@ -50,7 +87,8 @@ static inline void log_init(FILE* fp) { logFP = fp; flog_init(logFP); }
  */
 
 void flog_s(FILE* fp, const char* format, const char* str);
-static inline void log_s(const char* f, const char* s) { flog_s(logFP, f, s); }
+#define log_s(f, s) \
+  do { if (LOG_ON(LOG_INFO)) flog_s(logFP, (f), (s)); } while (0)
 /* log_s: printf a string to the log, using the given format string.
  * Expects exactly one format specifier within the string,
  * corresponding to the one argument.  A newline is added.
@@ -59,25 +97,37 @@ static inline void log_s(const char* f, const char* s) { flog_s(logFP, f, s); }
  */
 
 void flog_d(FILE* fp, const char* format, const int  num);
-static inline void log_d(const char* f, const int n) { flog_d(logFP, f, n); }
+#define log_d(f, n) \
+  do { if (LOG_ON(LOG_INFO)) flog_d(logFP, (f), (n)); } while (0)
 /* log_c: like the above, but to print an integer. Example:
  *   int age = ...;        log_d("You are %d years old.", age);
  */
 
 void flog_c(FILE* fp, const char* format, const char ch);
-static inline void log_c(const char* f, const char c) { flog_c(logFP, f, c); }
+#define log_c(f, c) \
+  do { if (LOG_ON(LOG_INFO)) flog_c(logFP, (f), (c)); } while (0)
 /* log_c: like the above, but to print a character. Example:
  *   char player = ...;    log_c("Player %c is winning.", player);
  */
 
 void flog_v(FILE* fp, const char* str);
-static inline void log_v(const char* str) { flog_v(logFP, str); }
+#define log_v(str) \
+  do { if (LOG_ON(LOG_INFO)) flog_v(logFP, (str)); } while (0)
 /* log_v: like the above, but used when no additional argument is needed.
  * Thus v stands for 'void'.
  */
 
+void flog_b(FILE* fp, const char* body);
+#define log_b(body) \
+  do { if (LOG_ON(LOG_DEBUG)) flog_b(logFP, (body)); } while (0)
+/* log_b: log a (possibly long, multi-line) message body verbatim,
+ * preceded by a line giving its number of lines.  Thus b stands for 'body'.
+ * Logged at LOG_DEBUG, unlike the above.
+ */
+
 void flog_e(FILE* fp, const char* str);
-static inline void log_e(const char* str) { flog_e(logFP, str); }
+#define log_e(str) \
+  do { if (LOG_ON(LOG_ERROR)) flog_e(logFP, (str)); } while (0)
 /* log_e: print the given string to the log, with a message representing
  * an internal error.  See 'man errno' and 'man perror';
  * This function is best used immediately after a system call.
@@ -90,4 +140,35 @@ static inline void log_done(void) { flog_done(logFP); logFP = NULL; }
  * It is the caller's responsibility to close the file, if desired.
  */
 
+/*********** process-wide settings ****************/
+/* These affect every file's logging, not just the caller's. */
+
+void flog_setLevel(const int level);
+static inline void log_setLevel(const int level) { flog_setLevel(level); }
+/* log_setLevel: log only calls at or below the given level from now on;
+ * LOG_DEBUG (everything compiled in) is the default.
+ */
+
+bool flog_enabled(const int level);
+static inline bool log_enabled(const int level) { return flog_enabled(level); }
+/* log_enabled: true if calls at the given level are logged at run time,
+ * i.e., the level is at or below that set by log_setLevel.
+ */
+
+bool flog_startAsync(void);
+static inline bool log_startAsync(void) { return flog_startAsync(); }
+/* log_startAsync: start the background writer thread; from now on, log
+ * calls return without doing any I/O.  Returns false if the thread
+ * could not be started, in which case logging remains synchronous.
+ */
+
+void flog_stopAsync(void);
+static inline void log_stopAsync(void) { flog_stopAsync(); }
+/* log_stopAsync: write everything still buffered, stop the writer thread,
+ * and return to synchronous logging.  A line logged on another thread
+ * meanwhile is either written out before this returns, or written
+ * directly.  Call this before the program exits, and before closing any
+ * file that is being logged to.
+ */
+
 #endif // _LOG_H_
@@ -6,13 +6,49 @@
  * and may be reordered, but require no connection setup or teardown.
  * 
  * See message.h for detailed interface description for each function.
- * Depends on the 'log' module and thus must be linked with log.o.
+ * Depends on the 'log' and 'rng' modules and thus must be linked with
+ * log.o and rng.o.
+ *
+ * The optional reliability layer keeps a little state for each peer
+ * that speaks it.  A framed datagram is a header line, then the message:
+ *   RUDP rseq useq rack rbits uack\n<message>
+ * where rseq numbers the reliable messages to this peer (0 if this one
+ * isn't), useq numbers the latest-wins messages (0 if this one isn't),
+ * rack is the highest rseq received from the peer, bit i of rbits (hex)
+ * says whether rack-1-i was received too, and uack is the highest useq
+ * received.  A frame with an empty message is a pure acknowledgement.
+ * Reliable messages are kept until acknowledged and retransmitted with
+ * exponential backoff; at most AckWindow of them are outstanding at once,
+ * so that rbits always covers every one the receiver might not yet have
+ * acknowledged.  For latest-wins messages only the most recent is kept,
+ * and it is retransmitted until acknowledged or superseded; a receiver
+ * drops any that is older than one it has already delivered.  A peer not
+ * heard from for PeerIdleTimeout, to which nothing is owed, is forgotten;
+ * if it returns, its messages are numbered above any sent before.
+ *
+ * Beneath all that, a datagram too long to send whole is split into
+ * fragments of (nearly) equal size, each behind its own header line:
+ *   FRAG id index count total\n<piece>
+ * where id numbers the fragmented datagrams we send, index runs from 0
+ * to count-1, and total is the length of the whole.  The receiver keeps
+ * the pieces of at most MAX_REASSEMBLY datagrams, dropping the oldest to
+ * make room and any that has had no fragment for ReassemblyTimeout, and
+ * hands on each datagram once it is complete.  A reliable message too
+ * long for one frame is split the same way above the reliability layer
+ * instead, and each fragment is framed, acknowledged and retransmitted
+ * as a reliable message of its own; so a lost fragment costs only itself,
+ * and the receiver reassembles the message as its fragments arrive.
  * 
  * Compile with -DUNIT_TEST for a standalone unit test; see below.
  *
  * David Kotz - May 2019
  */
 
+#define _DEFAULT_SOURCE   // for clock_gettime and CLOCK_MONOTONIC
+#ifdef __linux__
+#define _GNU_SOURCE       // for sendmmsg
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -23,9 +59,12 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <math.h>
+#include <time.h>
 #include "message.h"
 #include "log.h"
+#include "rng.h"
 
 /**************** file-local constants ****************/
 /* See message.h for other constants (shared with users of this module).
@@ -35,6 +74,76 @@
 static const int MinPort = 1024;
 static const int MaxPort = 65535;
 
+/* The reliability layer: which messages are critical (retransmitted until
+ * acknowledged) and which are superseded by the next of their type, by
+ * the word that begins them; everything else is sent once, unordered.
+ */
+static const char* ReliableTypes[] = {
+  "OK ", "GRID ", "GOLD ", "QUIT", "PLAY ", "SPECTATE", "CAPS ", "VIEW ",
+  // and OK, GRID, GOLD, QUIT, PLAY, SPECTATE in the binary encoding (proto.h)
+  "\xB1\x01", "\xB1\x02", "\xB1\x03", "\xB1\x05", "\xB1\x07", "\xB1\x08", NULL
+};
+static const char* LatestTypes[] = {
+  "DISPLAY", "VIEWPORT", "\xB1\x04", "\xB1\x0A", NULL
+};
+static const char* FrameTag = "RUDP ";
+#define FRAME_HEADER_BYTES 64        // more than any header we write
+#define FRAME_BYTES 65508            // message_MaxBytes + 1 (for a NUL)
+#define ACK_WINDOW 32                // bits in rbits
+static const uint64_t InitialRto = 100000000ULL;   // 100ms, in ns
+static const uint64_t AckDelay = 20000000ULL;      // 20ms, in ns
+static const int MaxRetries = 8;     // then give up on the message
+static const uint64_t PeerIdleTimeout = 30000000000ULL;  // 30s, in ns
+static const char* FragTag = "FRAG ";
+#define FRAG_HEADER_BYTES 64         // more than any header we write
+#define FRAG_PIECE_BYTES (message_MaxBytes - FRAG_HEADER_BYTES)
+#define RELIABLE_PIECE_BYTES (FRAG_PIECE_BYTES - FRAME_HEADER_BYTES)
+#define MAX_REASSEMBLY 4             // datagrams in reassembly at once
+static const uint64_t ReassemblyTimeout = 2000000000ULL;  // 2s, in ns
+static const int RecvBufferBytes = 4 * 1024 * 1024;  // room for fragments
+
+/**************** file-local types ****************/
+typedef struct pending {
+  uint32_t seq;           // rseq
+  char* message;          // malloc'd copy
+  int length;             // its length
+  uint64_t sentAt;        // when last sent; 0 if not yet sent
+  int retries;            // times resent
+} pending_t;
+
+typedef struct peer {
+  addr_t addr;
+  // sending
+  uint32_t nextRSeq;      // rseq of the last reliable message queued
+  uint32_t nextUSeq;      // useq of the last latest-wins message sent
+  pending_t* pending;     // unacknowledged reliable messages, by seq
+  int numPending, maxPending;
+  char* latest;           // the last latest-wins message, while unacked
+  size_t latestSize;      // bytes allocated to latest
+  int latestLength;       // length of the message in latest
+  uint64_t latestSentAt;  // when it was last sent
+  int latestRetries;
+  uint32_t peerUAck;      // highest useq the peer has acknowledged
+  // receiving
+  uint32_t rHighest;      // highest rseq received
+  uint32_t rBits;         // bit i: rHighest-1-i received
+  uint32_t uHighest;      // highest useq delivered
+  uint64_t ackDue;        // when we owe the peer an ack; 0 if we don't
+  uint64_t heard;         // when it last sent us a frame, or was made
+} peer_t;
+
+typedef struct reassembly {
+  addr_t from;
+  uint32_t id;            // the sender's fragment id
+  int count;              // fragments in the datagram; 0 if slot is free
+  int total;              // bytes in the datagram
+  int received;           // fragments received so far
+  char* have;             // have[i] iff fragment i was received
+  char* buf;              // total+1 bytes, for the datagram and a NUL
+  uint64_t started;       // when its first fragment arrived
+  uint64_t latest;        // when its latest fragment arrived
+} reassembly_t;
+
 /**************** file-local global variables ****************/
 /* This is an example of a judicious use of a global variable.
  * This module provides init() and done() functions that allow it
@@ -47,17 +156,97 @@ static const int MaxPort = 65535;
  * but a more flexible approach would require a much more complex interface.
  */
 static int ourSocket = 0;     // socket on which to receive messages
+static uint64_t receivedTime = 0;  // when the latest message was read
+static int receivedLength = 0;     // length of the message being handled
+
+static bool reliable = false;   // frame everything we send?
+static peer_t* peers = NULL;    // peers that speak the reliability layer
+static int numPeers = 0, maxPeers = 0;
+static uint32_t seqFloor = 0;   // new peers number their messages above
+static double lossRate = 0.0;   // fraction of datagrams to drop on send
+static rng_t lossRng;           // decides which
+static char* frame = NULL;      // sendFrame's buffer, grown as needed
+static int frameSize = 0;
+static uint32_t nextFragId = 0; // id of the last message we fragmented
+static reassembly_t reassembly[MAX_REASSEMBLY];
+
+/**************** file-local functions ****************/
+static int openSocket(FILE* logFP, const int port, const bool shared);
+static bool transmit(const addr_t to, const char* buf, const size_t len);
+static bool transmitMany(const addr_t to[], const int count, const char* buf,
+                         const size_t len);
+static bool sendDatagram(const addr_t to, const char* buf, const size_t len);
+static bool sendDatagrams(const addr_t to[], const int count,
+                          const char* buf, const size_t len);
+static bool lossDrops(void);
+static void logBody(const char* buf, const size_t len);
+static int countPieces(const size_t len, const int pieceBytes);
+static int makeFragment(char* fragment, const uint32_t id, const int index,
+                        const int pieces, const char* buf, const size_t len);
+static char* reassemble(const addr_t from, const char* buf, int* length);
+static void freeReassembly(reassembly_t* r);
+static peer_t* findPeer(const addr_t addr, const bool create);
+static bool isType(const char* message, const int length,
+                   const char* types[]);
+static void sendFrame(peer_t* peer, const uint32_t rseq, const uint32_t useq,
+                      const char* message, const int length);
+static void queueReliable(peer_t* peer, const char* message, const int length);
+static void queueFragments(peer_t* peer, const char* message,
+                           const int length);
+static void sendPending(peer_t* peer);
+static void sendLatest(peer_t* peer, const char* message, const int length);
+static const char* receiveFrame(const addr_t from, const char* buf,
+                                int* length);
+static void handleAcks(peer_t* peer, const uint32_t rack,
+                       const uint32_t rbits, const uint32_t uack);
+static uint64_t serviceTimers(const uint64_t now);
+static void expirePeers(const uint64_t now);
+static uint64_t rto(const int retries);
 
 /***********************************************************************/
 /**************** message_init ****************/
 /* 
- * Set up a socket on which to receive messages; return the port number.
- * Invariant: ourSocket = 0 if we return with error, else ourSocket > 0.
- * Log error and return zero if any error.
+ * As message_initPort, on any free port.
  * See message.h for detailed description.
  */
 int
 message_init(FILE* logFP)
+{
+  return message_initPort(logFP, 0);
+}
+
+/**************** message_initPort ****************/
+/*
+ * As openSocket, for this process alone.
+ * See message.h for detailed description.
+ */
+int
+message_initPort(FILE* logFP, const int port)
+{
+  return openSocket(logFP, port, false);
+}
+
+/**************** message_initShared ****************/
+/*
+ * As openSocket, sharing the port with other sockets.
+ * See message.h for detailed description.
+ */
+int
+message_initShared(FILE* logFP, const int port)
+{
+  return openSocket(logFP, port, true);
+}
+
+/**************** openSocket ****************/
+/*
+ * Set up a socket on which to receive messages; return the port number.
+ * If shared, set SO_REUSEPORT on it first, so that other sockets may be
+ * bound to the same port.
+ * Invariant: ourSocket = 0 if we return with error, else ourSocket > 0.
+ * Log error and return zero if any error.
+ */
+static int
+openSocket(FILE* logFP, const int port, const bool shared)
 {
   log_init(logFP);
 
@@ -75,11 +264,22 @@ message_init(FILE* logFP)
     return 0;
   }
 
-  // Name socket using wildcards
+  // let the kernel spread the port's datagrams over every socket bound
+  // to it, by a hash of their sender's address
+  const int on = 1;
+  if (shared && setsockopt(ourSocket, SOL_SOCKET, SO_REUSEPORT,
+                           &on, sizeof(on)) != 0) {
+    log_e("message_init: sharing the port");
+    close(ourSocket);
+    ourSocket = 0;
+    return 0;
+  }
+
+  // Name socket using wildcards, unless given a port
   struct sockaddr_in self;  // our address
   self.sin_family = AF_INET;
   self.sin_addr.s_addr = INADDR_ANY;
-  self.sin_port = 0;
+  self.sin_port = htons(port);
   if (bind(ourSocket, (struct sockaddr *) &self, sizeof(self))) {
     log_e("message_init: binding socket name");
     close(ourSocket);
@@ -87,6 +287,12 @@ message_init(FILE* logFP)
     return 0;
   }
 
+  // fragments of a long message arrive in a burst; make room for them
+  if (setsockopt(ourSocket, SOL_SOCKET, SO_RCVBUF,
+                 &RecvBufferBytes, sizeof(RecvBufferBytes)) != 0) {
+    log_e("message_init: enlarging receive buffer");  // not fatal
+  }
+
   // get our assigned address
   socklen_t selflen = sizeof(self); // length of our address
   if (getsockname(ourSocket, (struct sockaddr *) &self, &selflen)) {
@@ -96,10 +302,10 @@ message_init(FILE* logFP)
     return 0;
   }
   // extract our port number
-  int port = ntohs(self.sin_port);
-  log_d("message_init: ready at port '%d'", port);
+  const int ourPort = ntohs(self.sin_port);
+  log_d("message_init: ready at port '%d'", ourPort);
 
-  return port;
+  return ourPort;
 }
 
 /**************** message_noAddr ****************/
@@ -207,34 +413,28 @@ message_stringAddr(const addr_t addr)
   return addrString;
 }
 
-/**************** numLines ****************/
-/*
- * Return number of lines needed to print the string:
- * 0 if string is NULL or empty;
- * Otherwise return number of newline characters,
- *  plus 1 if string does not end with newline.
+/**************** message_receivedTime ****************/
+/* 
+ * Return the monotonic time at which the latest message was read.
+ * See message.h for detailed description.
  */
-static const int
-numLines(const char* string)
+uint64_t
+message_receivedTime(void)
 {
-  if (string == NULL || *string == '\0') {
-    // string is null or empty
-    return 0;
-  } else {
-    // string is not empty; count newlines
-    int n = 0;
-    const char* p;
-    for (p = string; *p != '\0'; p++) {
-      if (*p == '\n') {
-	n++;
-      }
-    }
-    // if the string does not end with newline, count the partial line
-    if (*(p-1) != '\n') {
-      n++;
-    }
-    return n;
-  }
+  return receivedTime;
+}
+
+/**************** message_now ****************/
+/* 
+ * Return a monotonic clock reading in nanoseconds.
+ * See message.h for detailed description.
+ */
+uint64_t
+message_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
 /**************** message_send ****************/
@@ -253,14 +453,842 @@ message_send(const addr_t to, const char* message)
     log_v("message_send: called with null message");
     return; // error in usage of this function.
   }
-  if (sendto(ourSocket, message, strlen(message), 0,
+  message_sendBytes(to, message, strlen(message));
+}
+
+/**************** message_sendBytes ****************/
+/* 
+ * Send a message of the given length, which may contain NULs.
+ * See message.h for detailed description.
+ */
+void
+message_sendBytes(const addr_t to, const char* message, const int length)
+{
+  if (ourSocket == 0) {
+    log_v("message_sendBytes: called before message_init");
+    return; // error in usage of this function.
+  }
+  if (message == NULL || length < 0) {
+    log_v("message_sendBytes: called with null message");
+    return; // error in usage of this function.
+  }
+  if (length > message_MaxMessageBytes) {
+    log_d("message_sendBytes: message of %d bytes is too long", length);
+    return; // error in usage of this function.
+  }
+
+  // frame it if we are reliable, or the peer is
+  peer_t* peer = findPeer(to, reliable);
+  if (peer == NULL) {
+    transmit(to, message, length);
+  } else if (isType(message, length, ReliableTypes)) {
+    if (length > RELIABLE_PIECE_BYTES) {
+      queueFragments(peer, message, length);
+    } else {
+      queueReliable(peer, message, length);
+    }
+  } else if (isType(message, length, LatestTypes)) {
+    sendLatest(peer, message, length);
+  } else {
+    sendFrame(peer, 0, 0, message, length);
+  }
+}
+
+/**************** message_sendMany ****************/
+/* 
+ * Send a message to many correspondents, in batches.
+ * See message.h for detailed description.
+ */
+void
+message_sendMany(const addr_t to[], const int count, const char* message,
+                 const int length)
+{
+  if (ourSocket == 0) {
+    log_v("message_sendMany: called before message_init");
+    return; // error in usage of this function.
+  }
+  if (to == NULL || count < 0 || message == NULL || length < 0) {
+    log_v("message_sendMany: called with null addresses or message");
+    return; // error in usage of this function.
+  }
+  if (length > message_MaxMessageBytes) {
+    log_d("message_sendMany: message of %d bytes is too long", length);
+    return; // error in usage of this function.
+  }
+
+  // peers of the reliability layer are sent theirs one by one; the rest
+  // are gathered into a batch, and sent together
+  addr_t batch[message_SendBatch];
+  int batched = 0;
+  for (int i = 0; i < count; i++) {
+    if (findPeer(to[i], reliable) != NULL) {
+      message_sendBytes(to[i], message, length);
+      continue;
+    }
+    batch[batched++] = to[i];
+    if (batched == message_SendBatch) {
+      transmitMany(batch, batched, message, length);
+      batched = 0;
+    }
+  }
+  if (batched > 0) {
+    transmitMany(batch, batched, message, length);
+  }
+}
+
+/**************** message_length ****************/
+/* 
+ * Return the length of the message being handled.
+ * See message.h for detailed description.
+ */
+int
+message_length(void)
+{
+  return receivedLength;
+}
+
+/**************** message_pending ****************/
+/* 
+ * Return true if a datagram is waiting on the socket.
+ * See message.h for detailed description.
+ */
+bool
+message_pending(void)
+{
+  if (ourSocket == 0) {
+    return false;
+  }
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  FD_SET(ourSocket, &rfds);
+  struct timeval now = { 0, 0 };   // poll; don't wait
+  return select(ourSocket + 1, &rfds, NULL, NULL, &now) > 0;
+}
+
+/**************** message_setReliable ****************/
+/* 
+ * Turn framing of everything we send on or off.
+ * See message.h for detailed description.
+ */
+void
+message_setReliable(const bool on)
+{
+  reliable = on;
+}
+
+/**************** message_setLoss ****************/
+/* 
+ * Simulate packet loss on send.
+ * See message.h for detailed description.
+ */
+void
+message_setLoss(const double rate, const uint64_t seed)
+{
+  lossRate = rate;
+  rng_seed(&lossRng, seed);
+}
+
+/**************** message_unacked ****************/
+/* 
+ * Count reliable messages not yet acknowledged, to every peer.
+ * See message.h for detailed description.
+ */
+int
+message_unacked(void)
+{
+  int count = 0;
+  for (int i = 0; i < numPeers; i++) {
+    count += peers[i].numPending;
+  }
+  return count;
+}
+
+/**************** transmit ****************/
+/* 
+ * Send a datagram, in fragments if it is too long to go whole.
+ * Return false on error.
+ */
+static bool
+transmit(const addr_t to, const char* buf, const size_t len)
+{
+  return transmitMany(&to, 1, buf, len);
+}
+
+/**************** transmitMany ****************/
+/* 
+ * As transmit, to each of 'count' addresses; a datagram is fragmented
+ * once, and each fragment sent to all of them.
+ * Return false on error.
+ */
+static bool
+transmitMany(const addr_t to[], const int count, const char* buf,
+             const size_t len)
+{
+  if (len <= message_MaxBytes) {
+    return sendDatagrams(to, count, buf, len);
+  }
+
+  static char fragment[FRAME_BYTES];
+  const int pieces = countPieces(len, FRAG_PIECE_BYTES);
+  const uint32_t id = ++nextFragId;
+  bool ok = true;
+  for (int i = 0; i < pieces; i++) {
+    const int n = makeFragment(fragment, id, i, pieces, buf, len);
+    ok = sendDatagrams(to, count, fragment, n) && ok;
+  }
+  return ok;
+}
+
+/**************** countPieces ****************/
+/* 
+ * How many fragments a datagram of len bytes needs, if each carries at
+ * most pieceBytes of it.
+ */
+static int
+countPieces(const size_t len, const int pieceBytes)
+{
+  return (len + pieceBytes - 1) / pieceBytes;
+}
+
+/**************** makeFragment ****************/
+/* 
+ * Write fragment 'index' of the 'pieces' into which buf (len bytes) is
+ * split, header and all, into 'fragment', and NUL-terminate it.  The
+ * pieces are of (nearly) equal size, as reassemble expects.
+ * Return the fragment's length.
+ */
+static int
+makeFragment(char* fragment, const uint32_t id, const int index,
+             const int pieces, const char* buf, const size_t len)
+{
+  const int piece = (len + pieces - 1) / pieces;
+  const int offset = index * piece;
+  const int n = len - offset < piece ? len - offset : piece;
+  int header = snprintf(fragment, FRAG_HEADER_BYTES, "%s%u %d %d %d\n",
+                        FragTag, id, index, pieces, (int)len);
+  memcpy(fragment + header, buf + offset, n);
+  fragment[header + n] = '\0';
+  return header + n;
+}
+
+/**************** sendDatagram ****************/
+/* 
+ * Send one datagram, unless the loss shim drops it.
+ * Return false on error.
+ */
+static bool
+sendDatagram(const addr_t to, const char* buf, const size_t len)
+{
+  if (lossDrops()) {
+    log_s("message_send: TO %s dropped by loss simulation",
+          message_stringAddr(to));
+    return true;
+  }
+  if (sendto(ourSocket, buf, len, 0,
              (struct sockaddr *) &to, sizeof(to)) < 0) {
     log_e("message_send: error sending to datagram socket");
-  } else {
-    log_s("message_send: TO %s", message_stringAddr(to));
-    log_d("message_send: %d lines:", numLines(message));
-    log_s("%s", message);
+    return false;
+  }
+  log_s("message_send: TO %s", message_stringAddr(to));
+  if (LOG_ON(LOG_DEBUG)) {
+    logBody(buf, len);
+  }
+  return true;
+}
+
+/**************** sendDatagrams ****************/
+/* 
+ * Send one datagram to each of 'count' addresses, up to
+ * message_SendBatch of them per system call where sendmmsg is available.
+ * Return false on error.
+ */
+static bool
+sendDatagrams(const addr_t to[], const int count, const char* buf,
+              const size_t len)
+{
+#ifdef __linux__
+  if (count == 1) {
+    return sendDatagram(to[0], buf, len);
+  }
+  struct iovec iov = { (void*) buf, len };
+  struct mmsghdr batch[message_SendBatch];
+  bool ok = true;
+  for (int first = 0; first < count; first += message_SendBatch) {
+    int n = 0;
+    for (int i = first; i < count && i < first + message_SendBatch; i++) {
+      if (lossDrops()) {
+        log_s("message_sendMany: TO %s dropped by loss simulation",
+              message_stringAddr(to[i]));
+        continue;
+      }
+      memset(&batch[n], 0, sizeof(batch[n]));
+      batch[n].msg_hdr.msg_name = (void*) &to[i];
+      batch[n].msg_hdr.msg_namelen = sizeof(to[i]);
+      batch[n].msg_hdr.msg_iov = &iov;
+      batch[n].msg_hdr.msg_iovlen = 1;
+      n++;
+    }
+    for (int sent = 0; sent < n; ) {
+      const int done = sendmmsg(ourSocket, batch + sent, n - sent, 0);
+      if (done < 0) {
+        log_e("message_sendMany: error sending to datagram socket");
+        ok = false;
+        break;
+      }
+      sent += done;
+    }
+  }
+  log_d("message_sendMany: TO %d addresses", count);
+  if (LOG_ON(LOG_DEBUG)) {
+    logBody(buf, len);
+  }
+  return ok;
+#else
+  bool ok = true;
+  for (int i = 0; i < count; i++) {
+    ok = sendDatagram(to[i], buf, len) && ok;
+  }
+  return ok;
+#endif
+}
+
+/**************** lossDrops ****************/
+/* 
+ * Should the loss shim drop the next datagram?
+ */
+static bool
+lossDrops(void)
+{
+  return lossRate > 0 && (rng_next(&lossRng) >> 11) * 0x1.0p-53 < lossRate;
+}
+
+/**************** logBody ****************/
+/* 
+ * Log a datagram's body, which need not be terminated (see
+ * message_sendBytes), with log_b.
+ */
+static void
+logBody(const char* buf, const size_t len)
+{
+  char* copy = malloc(len + 1);
+  if (copy != NULL) {
+    memcpy(copy, buf, len);
+    copy[len] = '\0';
+    log_b(copy);
+    free(copy);
+  }
+}
+
+/**************** reassemble ****************/
+/* 
+ * Add a fragment (a datagram, or a reliable message, beginning with
+ * FragTag), of the given length, from 'from' to its reassembly.
+ * Return NULL if that datagram is still incomplete, or the fragment is
+ * malformed or duplicate; else return the whole datagram, NUL-terminated,
+ * with *length set to its length, which the caller must free.
+ */
+static char*
+reassemble(const addr_t from, const char* buf, int* length)
+{
+  unsigned int id;
+  int index, count, total, header = 0;
+  if (sscanf(buf, "FRAG %u %d %d %d\n%n", &id, &index, &count, &total,
+             &header) != 4 || header == 0 || count < 2 || index < 0 ||
+      index >= count || total > message_MaxMessageBytes || count > total) {
+    log_v("message_loop: malformed fragment header; dropped");
+    return NULL;
+  }
+  const int piece = (total + count - 1) / count;
+  const int offset = index * piece;
+  const int n = *length - header;
+  if (offset >= total ||
+      n != (total - offset < piece ? total - offset : piece)) {
+    log_v("message_loop: fragment of the wrong length; dropped");
+    return NULL;
+  }
+
+  // find its reassembly, or start one: in a free slot, else one that has
+  // timed out, else the oldest; one times out if none of its fragments
+  // has arrived for a while, not when it has been long in arriving, as
+  // a reliable message's may be, each retransmitted in its own time
+  const uint64_t now = message_now();
+  reassembly_t* r = NULL;
+  reassembly_t* victim = &reassembly[0];
+  for (int i = 0; i < MAX_REASSEMBLY; i++) {
+    reassembly_t* slot = &reassembly[i];
+    if (slot->count != 0 && now - slot->latest > ReassemblyTimeout) {
+      log_s("message_loop: incomplete message from %s discarded",
+            message_stringAddr(slot->from));
+      freeReassembly(slot);
+    }
+    if (slot->count != 0 && slot->id == id &&
+        message_eqAddr(slot->from, from)) {
+      r = slot;
+      break;
+    }
+    if (victim->count != 0 &&
+        (slot->count == 0 || slot->started < victim->started)) {
+      victim = slot;
+    }
+  }
+  if (r == NULL) {
+    freeReassembly(victim);
+    victim->buf = malloc(total + 1);
+    victim->have = calloc(count, 1);
+    if (victim->buf == NULL || victim->have == NULL) {
+      log_v("message_loop: out of memory for reassembly; fragment dropped");
+      freeReassembly(victim);
+      return NULL;
+    }
+    r = victim;
+    r->from = from;
+    r->id = id;
+    r->count = count;
+    r->total = total;
+    r->received = 0;
+    r->started = now;
+  } else if (r->count != count || r->total != total) {
+    log_v("message_loop: inconsistent fragment; dropped");
+    return NULL;
+  }
+
+  if (r->have[index]) {
+    return NULL;               // duplicate
+  }
+  r->latest = now;
+  r->have[index] = 1;
+  r->received++;
+  memcpy(r->buf + offset, buf + header, n);
+  if (r->received < r->count) {
+    return NULL;
+  }
+
+  // complete: hand over the buffer
+  char* whole = r->buf;
+  whole[total] = '\0';
+  *length = total;
+  r->buf = NULL;
+  freeReassembly(r);
+  return whole;
+}
+
+/**************** freeReassembly ****************/
+/* 
+ * Free a reassembly slot.
+ */
+static void
+freeReassembly(reassembly_t* r)
+{
+  free(r->buf);
+  free(r->have);
+  r->buf = NULL;
+  r->have = NULL;
+  r->count = 0;
+}
+
+/**************** findPeer ****************/
+/* 
+ * Return the state for the peer at addr; if there is none, make it
+ * if 'create', else return NULL.  Also NULL if out of memory.
+ */
+static peer_t*
+findPeer(const addr_t addr, const bool create)
+{
+  for (int i = 0; i < numPeers; i++) {
+    if (message_eqAddr(peers[i].addr, addr)) {
+      return &peers[i];
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  if (numPeers == maxPeers) {
+    int more = maxPeers == 0 ? 8 : 2 * maxPeers;
+    peer_t* bigger = realloc(peers, more * sizeof(peer_t));
+    if (bigger == NULL) {
+      log_v("findPeer: out of memory");
+      return NULL;
+    }
+    peers = bigger;
+    maxPeers = more;
+  }
+  peer_t* peer = &peers[numPeers++];
+  memset(peer, 0, sizeof(peer_t));
+  peer->addr = addr;
+  peer->nextRSeq = peer->nextUSeq = seqFloor;  // see expirePeers
+  peer->heard = message_now();
+  return peer;
+}
+
+/**************** isType ****************/
+/* 
+ * Does message begin with one of the given (NULL-terminated) words?
+ */
+static bool
+isType(const char* message, const int length, const char* types[])
+{
+  for (int i = 0; types[i] != NULL; i++) {
+    const int typeLength = strlen(types[i]);
+    if (length >= typeLength && memcmp(message, types[i], typeLength) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**************** sendFrame ****************/
+/* 
+ * Send message (may be empty) to the peer behind a header carrying the
+ * given sequence numbers and our acknowledgements, which are then no
+ * longer owed.
+ */
+static void
+sendFrame(peer_t* peer, const uint32_t rseq, const uint32_t useq,
+          const char* message, const int length)
+{
+  if (FRAME_HEADER_BYTES + length + 1 > frameSize) {
+    int size = FRAME_HEADER_BYTES + length + 1;
+    char* bigger = realloc(frame, size);
+    if (bigger == NULL) {
+      log_v("message_send: out of memory; message not sent");
+      return;
+    }
+    frame = bigger;
+    frameSize = size;
+  }
+  int header = snprintf(frame, FRAME_HEADER_BYTES, "%s%u %u %u %x %u\n",
+                        FrameTag, rseq, useq, peer->rHighest, peer->rBits,
+                        peer->uHighest);
+  memcpy(frame + header, message, length);
+  frame[header + length] = '\0';
+  transmit(peer->addr, frame, header + length);
+  peer->ackDue = 0;
+}
+
+/**************** queueReliable ****************/
+/* 
+ * Number a reliable message, keep a copy until it is acknowledged,
+ * and send it if the window allows.
+ */
+static void
+queueReliable(peer_t* peer, const char* message, const int length)
+{
+  if (peer->numPending == peer->maxPending) {
+    int more = peer->maxPending == 0 ? 8 : 2 * peer->maxPending;
+    pending_t* bigger = realloc(peer->pending, more * sizeof(pending_t));
+    if (bigger == NULL) {
+      log_v("message_send: out of memory; sending unreliably");
+      sendFrame(peer, 0, 0, message, length);
+      return;
+    }
+    peer->pending = bigger;
+    peer->maxPending = more;
+  }
+  char* copy = malloc(length + 1);
+  if (copy == NULL) {
+    log_v("message_send: out of memory; sending unreliably");
+    sendFrame(peer, 0, 0, message, length);
+    return;
+  }
+  memcpy(copy, message, length);
+  pending_t* p = &peer->pending[peer->numPending++];
+  p->seq = ++peer->nextRSeq;
+  p->message = copy;
+  p->length = length;
+  p->sentAt = 0;
+  p->retries = 0;
+  sendPending(peer);
+}
+
+/**************** queueFragments ****************/
+/* 
+ * Split a reliable message too long for one frame into fragments, and
+ * queue each as a reliable message of its own, so that each is
+ * acknowledged, and retransmitted if lost, by itself.
+ */
+static void
+queueFragments(peer_t* peer, const char* message, const int length)
+{
+  static char fragment[FRAME_BYTES];
+  const int pieces = countPieces(length, RELIABLE_PIECE_BYTES);
+  const uint32_t id = ++nextFragId;
+  for (int i = 0; i < pieces; i++) {
+    const int n = makeFragment(fragment, id, i, pieces, message, length);
+    queueReliable(peer, fragment, n);
+  }
+}
+
+/**************** sendPending ****************/
+/* 
+ * Send every pending message not yet sent that is within the window,
+ * i.e., fewer than ACK_WINDOW after the oldest one unacknowledged.
+ */
+static void
+sendPending(peer_t* peer)
+{
+  for (int i = 0; i < peer->numPending; i++) {
+    pending_t* p = &peer->pending[i];
+    if (p->seq - peer->pending[0].seq >= ACK_WINDOW) {
+      break;
+    }
+    if (p->sentAt == 0) {
+      sendFrame(peer, p->seq, 0, p->message, p->length);
+      p->sentAt = message_now();
+    }
+  }
+}
+
+/**************** sendLatest ****************/
+/* 
+ * Send a latest-wins message, and keep it (replacing any earlier one)
+ * for retransmission until acknowledged.
+ */
+static void
+sendLatest(peer_t* peer, const char* message, const int length)
+{
+  size_t size = length + 1;
+  if (size > peer->latestSize) {
+    char* bigger = realloc(peer->latest, size);
+    if (bigger == NULL) {
+      log_v("message_send: out of memory; not keeping latest message");
+      sendFrame(peer, 0, 0, message, length);
+      return;
+    }
+    peer->latest = bigger;
+    peer->latestSize = size;
   }
+  memcpy(peer->latest, message, length);
+  peer->latestLength = length;
+  sendFrame(peer, 0, ++peer->nextUSeq, message, length);
+  peer->latestSentAt = message_now();
+  peer->latestRetries = 0;
+}
+
+/**************** receiveFrame ****************/
+/* 
+ * Strip and act on the header of a framed datagram from 'from', whose
+ * *length is updated to that of the message inside.
+ * Return the message to deliver to the handler: buf itself if it is not
+ * framed, NULL if there is nothing to deliver (a pure acknowledgement,
+ * a duplicate, or a latest-wins message older than one delivered).
+ */
+static const char*
+receiveFrame(const addr_t from, const char* buf, int* length)
+{
+  const int tagLength = strlen(FrameTag);
+  if (*length < tagLength || memcmp(buf, FrameTag, tagLength) != 0) {
+    return buf;
+  }
+  unsigned int rseq, useq, rack, rbits, uack;
+  int header = 0;
+  if (sscanf(buf, "RUDP %u %u %u %x %u\n%n",
+             &rseq, &useq, &rack, &rbits, &uack, &header) != 5
+      || header == 0) {
+    log_v("message_loop: malformed frame header; dropped");
+    return NULL;
+  }
+  *length -= header;
+  peer_t* peer = findPeer(from, true);
+  if (peer == NULL) {
+    return buf + header;     // can't track it; deliver it anyway
+  }
+  handleAcks(peer, rack, rbits, uack);
+
+  const uint64_t now = message_now();
+  peer->heard = now;
+  bool deliver = true;
+  if (rseq != 0) {
+    // critical: note it in rHighest/rBits, deliver once, ack now
+    if (rseq > peer->rHighest) {
+      uint32_t shift = rseq - peer->rHighest;
+      uint32_t old = peer->rHighest == 0 ? 0 : 1;  // the previous highest
+      if (shift < ACK_WINDOW) {
+        peer->rBits = (peer->rBits << shift) | (old << (shift - 1));
+      } else {
+        peer->rBits = shift == ACK_WINDOW ? old << (ACK_WINDOW - 1) : 0;
+      }
+      peer->rHighest = rseq;
+    } else if (rseq == peer->rHighest) {
+      deliver = false;
+    } else {
+      uint32_t back = peer->rHighest - rseq;   // 1 means rBits bit 0
+      if (back > ACK_WINDOW || (peer->rBits & (1u << (back - 1)))) {
+        deliver = false;     // too old to be unacknowledged, or seen
+      } else {
+        peer->rBits |= 1u << (back - 1);
+      }
+    }
+    peer->ackDue = now;
+  } else if (useq != 0) {
+    // latest-wins: deliver only if newer than any delivered; ack soon
+    if (useq > peer->uHighest) {
+      peer->uHighest = useq;
+    } else {
+      deliver = false;
+    }
+    if (peer->ackDue == 0) {
+      peer->ackDue = now + AckDelay;
+    }
+  } else if (*length == 0) {
+    deliver = false;         // pure acknowledgement
+  }
+  return deliver ? buf + header : NULL;
+}
+
+/**************** handleAcks ****************/
+/* 
+ * Forget the reliable messages the peer acknowledges (rack, and each
+ * rack-1-i for which bit i of rbits is set), and note its latest-wins ack;
+ * then send whatever the window now allows.
+ */
+static void
+handleAcks(peer_t* peer, const uint32_t rack, const uint32_t rbits,
+           const uint32_t uack)
+{
+  int kept = 0;
+  for (int i = 0; i < peer->numPending; i++) {
+    pending_t* p = &peer->pending[i];
+    uint32_t back = rack - p->seq;           // 0 means rack itself
+    bool acked = p->seq <= rack &&
+      (back == 0 || (back <= ACK_WINDOW && (rbits & (1u << (back - 1)))));
+    if (acked) {
+      free(p->message);
+    } else {
+      peer->pending[kept++] = *p;
+    }
+  }
+  if (kept < peer->numPending) {
+    peer->numPending = kept;
+    sendPending(peer);
+  }
+  if (uack > peer->peerUAck) {
+    peer->peerUAck = uack;
+  }
+}
+
+/**************** rto ****************/
+/* 
+ * Retransmission timeout after a message has been resent 'retries' times.
+ */
+static uint64_t
+rto(const int retries)
+{
+  return InitialRto << (retries < 4 ? retries : 4);
+}
+
+/**************** serviceTimers ****************/
+/* 
+ * Send every acknowledgement that is due, and retransmit every message
+ * whose timeout has expired, giving up after MaxRetries.
+ * Return when the next of these falls due, or 0 if none is pending.
+ */
+static uint64_t
+serviceTimers(const uint64_t now)
+{
+  expirePeers(now);
+
+  uint64_t next = 0;
+  for (int i = 0; i < numPeers; i++) {
+    peer_t* peer = &peers[i];
+
+    // retransmit; any ack owed goes with it
+    bool gaveUp = false;
+    for (int j = 0; j < peer->numPending; j++) {
+      pending_t* p = &peer->pending[j];
+      if (p->sentAt == 0) {
+        break;               // outside the window; so are the rest
+      }
+      if (now - p->sentAt >= rto(p->retries)) {
+        if (p->retries >= MaxRetries) {
+          log_s("message_send: giving up on message to %s",
+                message_stringAddr(peer->addr));
+          free(p->message);
+          p->message = NULL;
+          gaveUp = true;
+          continue;
+        }
+        sendFrame(peer, p->seq, 0, p->message, p->length);
+        p->sentAt = now;
+        p->retries++;
+      }
+    }
+    if (gaveUp) {
+      int kept = 0;
+      for (int j = 0; j < peer->numPending; j++) {
+        if (peer->pending[j].message != NULL) {
+          peer->pending[kept++] = peer->pending[j];
+        }
+      }
+      peer->numPending = kept;
+      sendPending(peer);
+    }
+    bool latestDue = peer->latest != NULL && peer->peerUAck < peer->nextUSeq
+      && peer->latestRetries < MaxRetries;
+    if (latestDue && now - peer->latestSentAt >= rto(peer->latestRetries)) {
+      sendFrame(peer, 0, peer->nextUSeq, peer->latest, peer->latestLength);
+      peer->latestSentAt = now;
+      peer->latestRetries++;
+    }
+
+    // acknowledge, if nothing above did
+    if (peer->ackDue != 0 && peer->ackDue <= now) {
+      sendFrame(peer, 0, 0, "", 0);
+    }
+
+    // when is this peer next due?
+    uint64_t due[3] = { peer->ackDue, 0, 0 };
+    for (int j = 0; j < peer->numPending && peer->pending[j].sentAt; j++) {
+      uint64_t t = peer->pending[j].sentAt + rto(peer->pending[j].retries);
+      if (due[1] == 0 || t < due[1]) {
+        due[1] = t;
+      }
+    }
+    if (latestDue) {
+      due[2] = peer->latestSentAt + rto(peer->latestRetries);
+    }
+    for (int k = 0; k < 3; k++) {
+      if (due[k] != 0 && (next == 0 || due[k] < next)) {
+        next = due[k];
+      }
+    }
+  }
+  return next;
+}
+
+/**************** expirePeers ****************/
+/* 
+ * Forget every peer not heard from for PeerIdleTimeout to which we owe
+ * nothing: no reliable message unacknowledged, latest-wins message still
+ * to be retransmitted, or ack.  By then neither side is retransmitting.
+ * Should such a peer return, it is made afresh, and numbers its messages
+ * above seqFloor, i.e., above any sent to a peer we forgot, so that the
+ * other side never drops them as old.
+ */
+static void
+expirePeers(const uint64_t now)
+{
+  int kept = 0;
+  for (int i = 0; i < numPeers; i++) {
+    peer_t* peer = &peers[i];
+    bool latestDue = peer->latest != NULL && peer->peerUAck < peer->nextUSeq
+      && peer->latestRetries < MaxRetries;
+    if (now - peer->heard < PeerIdleTimeout || peer->numPending > 0 ||
+        peer->ackDue != 0 || latestDue) {
+      peers[kept++] = *peer;
+      continue;
+    }
+    log_s("message_loop: forgetting idle peer %s",
+          message_stringAddr(peer->addr));
+    if (peer->nextRSeq > seqFloor) {
+      seqFloor = peer->nextRSeq;
+    }
+    if (peer->nextUSeq > seqFloor) {
+      seqFloor = peer->nextUSeq;
+    }
+    free(peer->pending);
+    free(peer->latest);
+  }
+  numPeers = kept;
 }
 
 /**************** message_loop ****************/
@@ -297,17 +1325,33 @@ message_loop(void* arg, const float timeout,
     return false; // error in usage of this function.
   }
 
-  // set up for timeouts, if desired
-  struct timeval* timerp = NULL; // stays null if no timeout desired
-  struct timeval  timer;          // timerp = &timer if timeout desired
-  struct timeval  timeoutval;     // timeval equivalent of parameter 'timeout'
-  if (timeout > 0.0) {
-    timeoutval.tv_sec  = (int)timeout;
-    timeoutval.tv_usec = timeout - (int)timeout;
-  }
+  // set up for timeouts, if desired; the timeout runs from the latest
+  // input or message, and the reliability layer has deadlines of its own
+  struct timeval* timerp = NULL; // stays null if no deadline
+  struct timeval  timer;          // timerp = &timer if any deadline
+  const uint64_t timeoutNanos = (uint64_t)(timeout * 1e9);
+  uint64_t lastActivity = message_now();
 
   // loop until error or some handler indicates time to quit looping
   while (true) {
+    // service the reliability layer, and the user's timeout if it's due
+    uint64_t now = message_now();
+    uint64_t deadline = serviceTimers(now);
+    if (timeout > 0.0) {
+      uint64_t userDeadline = lastActivity + timeoutNanos;
+      if (now >= userDeadline) {
+        log_v("message_loop: select() timed out");
+        lastActivity = now;
+        if (handleTimeout != NULL && (*handleTimeout)(arg)) {
+          break; // handler says to exit loop 
+        }
+        continue;
+      }
+      if (deadline == 0 || userDeadline < deadline) {
+        deadline = userDeadline;
+      }
+    }
+
     // for use with select()
     fd_set rfds;        // set of file descriptors we want to read
     
@@ -322,8 +1366,10 @@ message_loop(void* arg, const float timeout,
       FD_SET(ourSocket, &rfds); // monitor the socket
       nfds = ourSocket+1;       // highest-numbered fd in rfds
     }
-    if (timeout > 0.0) {      // is timeout desired?
-      timer = timeoutval;     // set the timer to the timeout value
+    if (deadline != 0) {      // is a timeout desired?
+      uint64_t wait = deadline > now ? deadline - now : 0;
+      timer.tv_sec  = wait / 1000000000ULL;
+      timer.tv_usec = (wait % 1000000000ULL) / 1000;
       timerp = &timer;        // pass that timer to select
     } else {
       timerp = NULL;          // no timeout is desired
@@ -336,21 +1382,22 @@ message_loop(void* arg, const float timeout,
     if (select_response < 0) {
       if (errno == EINTR) {
 	// select() was interrupted by a signal - most likely SIGWINCH;
-	// just ignore this and loop around to select() again.
+	// let the timeout handler see to any flag the signal's handler set,
+	// then loop around to select() again.
 	log_e("message_loop: select() EINTR: interrupted by signal");
+	if (handleTimeout != NULL && (*handleTimeout)(arg)) {
+	  break; // handler says to exit loop
+	}
       } else {
 	// some error occurred; this should not happen
 	log_e("message_loop: select()");
 	return false; // error
       }
     } else if (select_response == 0) {
-      // timeout occurred
-      log_v("message_loop: select() timed out");
-      if (handleTimeout != NULL && (*handleTimeout)(arg)) {
-        break; // handler says to exit loop 
-      }
+      // a deadline passed; handled at the top of the loop
     } else if (select_response > 0) {
       // some data is ready on either source, or both
+      lastActivity = message_now();
 
       if (FD_ISSET(0, &rfds)) {
         // stdin has input ready
@@ -365,9 +1412,10 @@ message_loop(void* arg, const float timeout,
         struct sockaddr_in sender;     // sender of this message
         struct sockaddr *senderp = (struct sockaddr *) &sender;
         socklen_t senderlen = sizeof(sender);  // must pass address to length
-        char buf[message_MaxBytes]; // buffer for reading data from socket
-        int nbytes = recvfrom(ourSocket, buf, message_MaxBytes-1, 
+        char buf[FRAME_BYTES];  // buffer for reading data from socket
+        int nbytes = recvfrom(ourSocket, buf, message_MaxBytes,
                               0, senderp, &senderlen);
+        receivedTime = message_now();
         if (nbytes < 0) {
           // error, ignore it
           log_e("message_loop: receiving from socket");
@@ -380,11 +1428,32 @@ message_loop(void* arg, const float timeout,
           } else {
 	    // record it
 	    log_s("message_loop: FROM %s", message_stringAddr(sender));
-	    log_d("message_loop: %d lines:", numLines(buf));
-	    log_s("%s", buf);
+	    log_b(buf);
 
-            // handle it
-            if (handleMessage != NULL && (*handleMessage)(arg, sender, buf)) {
+            // reassemble it if it's a fragment; then unwrap it, and handle
+            // it unless it's a duplicate or an ack, or a fragment of a
+            // reliable message, still incomplete
+            receivedLength = nbytes;
+            char* whole = NULL;   // reassembled datagram, if any
+            const char* message = buf;
+            const int fragTagLength = strlen(FragTag);
+            if (nbytes >= fragTagLength &&
+                memcmp(buf, FragTag, fragTagLength) == 0) {
+              message = whole = reassemble(sender, buf, &receivedLength);
+            }
+            if (message != NULL) {
+              message = receiveFrame(sender, message, &receivedLength);
+            }
+            if (message != NULL && whole == NULL &&
+                receivedLength >= fragTagLength &&
+                memcmp(message, FragTag, fragTagLength) == 0) {
+              message = whole = reassemble(sender, message, &receivedLength);
+            }
+            bool quit = message != NULL && handleMessage != NULL
+              && (*handleMessage)(arg, sender, message);
+            free(whole);
+            if (quit) {
+              serviceTimers(message_now());  // send any ack still owed
               break; // handler says to exit loop 
             }
           }
@@ -407,6 +1476,23 @@ message_done(void)
     close(ourSocket);
     ourSocket = 0;
   }
+  for (int i = 0; i < numPeers; i++) {
+    for (int j = 0; j < peers[i].numPending; j++) {
+      free(peers[i].pending[j].message);
+    }
+    free(peers[i].pending);
+    free(peers[i].latest);
+  }
+  free(peers);
+  peers = NULL;
+  numPeers = maxPeers = 0;
+  seqFloor = 0;
+  free(frame);
+  frame = NULL;
+  frameSize = 0;
+  for (int i = 0; i < MAX_REASSEMBLY; i++) {
+    freeReassembly(&reassembly[i]);
+  }
   log_v("message_done: message module closing down.");
 }
 
@@ -437,6 +1523,40 @@ message_done(void)
  *   ./messagetest 2>second.log hostName portNumber
  * 
  * ^D (EOF) to exit either side.
+ *
+ * Run with
+ *   ./messagetest --reliable [lossPercent]
+ * instead for an automated test of the reliability layer: the program
+ * sends itself a stream of GOLD (reliable) and DISPLAY (latest-wins)
+ * messages through a loss shim dropping lossPercent (default 20) of all
+ * datagrams, acks included, and checks that every GOLD arrives exactly
+ * once, that DISPLAYs arrive in increasing order, and that the last
+ * DISPLAY arrives.  Exit status is zero on success.
+ *
+ * Run with
+ *   ./messagetest --fragment [lossPercent]
+ * for an automated test of fragmentation: the program sends itself
+ * messages from one byte to several datagrams long, and checks that each
+ * arrives intact (and that message_pending notices the first before it is
+ * read).  With lossPercent (default 0) above zero, they go
+ * through the loss shim and the reliability layer, which resends each
+ * lost fragment by itself; 20 or even 40 percent loss should pass.
+ *
+ * Run with
+ *   ./messagetest --many [receivers]
+ * for an automated test of message_sendMany: the program opens that many
+ * (default 200) plain UDP sockets, sends messages of one and of several
+ * datagrams to all of them at once, and checks that each socket receives
+ * every datagram intact; then it reports the time to send a DISPLAY-sized
+ * message to them all, one by one and with message_sendMany.
+ *
+ * Run with
+ *   ./messagetest --shared [shards]
+ * for an automated test of message_initShared: the program forks that
+ * many (default 4) processes, each of which shares one port and answers
+ * every datagram with its number; then many clients each send to the
+ * port several times, and it checks that each client is always answered
+ * by the same process, and that the clients are spread over several.
  */
 
 #ifdef UNIT_TEST
@@ -444,12 +1564,29 @@ message_done(void)
 static bool handleTimeout(void* arg);
 static bool handleInput  (void* arg);
 static bool handleMessage(void* arg, const addr_t from, const char* message);
+static int reliableTest(const int lossPercent);
+static int fragmentTest(const int lossPercent);
+static int manyTest(const int receivers);
+static int sharedTest(const int shards);
 
 int
 main(const int argc, char* argv[])
 {
   addr_t other; // address of the other side of this communication (init below)
 
+  if (argc >= 2 && strcmp(argv[1], "--reliable") == 0) {
+    return reliableTest(argc > 2 ? atoi(argv[2]) : 20);
+  }
+  if (argc >= 2 && strcmp(argv[1], "--fragment") == 0) {
+    return fragmentTest(argc > 2 ? atoi(argv[2]) : 0);
+  }
+  if (argc >= 2 && strcmp(argv[1], "--many") == 0) {
+    return manyTest(argc > 2 ? atoi(argv[2]) : 200);
+  }
+  if (argc >= 2 && strcmp(argv[1], "--shared") == 0) {
+    return sharedTest(argc > 2 ? atoi(argv[2]) : 4);
+  }
+
   // initialize the logging module
   log_init(stderr);
 
@@ -579,4 +1716,432 @@ handleMessage(void* arg, const addr_t from, const char* message)
   return false;
 }
 
+/**************** reliableTest ****************/
+/* The automated test of the reliability layer; see above. */
+#define TEST_GOLDS 50
+#define TEST_DISPLAYS 200
+static int goldsSeen[TEST_GOLDS];  // times each was delivered
+static int lastDisplay = -1;
+static bool inOrder = true;
+static uint64_t testStart;
+static bool testTimedOut = false;
+
+static bool
+reliableTimeout(void* arg)
+{
+  if (message_unacked() == 0 && lastDisplay == TEST_DISPLAYS - 1) {
+    return true;              // all delivered, all acknowledged
+  }
+  if (message_now() - testStart > 20000000000ULL) {
+    testTimedOut = true;      // 20s
+    return true;
+  }
+  return false;
+}
+
+static bool
+reliableMessage(void* arg, const addr_t from, const char* message)
+{
+  int n;
+  if (sscanf(message, "GOLD %d", &n) == 1 && n >= 0 && n < TEST_GOLDS) {
+    goldsSeen[n]++;
+  } else if (sscanf(message, "DISPLAY %d", &n) == 1) {
+    if (n <= lastDisplay) {
+      inOrder = false;
+    }
+    lastDisplay = n;
+  }
+  return false;
+}
+
+static int
+reliableTest(const int lossPercent)
+{
+  int ourPort = message_init(NULL);
+  char portString[16];
+  snprintf(portString, sizeof(portString), "%d", ourPort);
+  addr_t self;
+  if (ourPort == 0 || !message_setAddr("localhost", portString, &self)) {
+    return 2;
+  }
+  message_setReliable(true);
+  message_setLoss(lossPercent / 100.0, 1);
+
+  // interleave GOLD and DISPLAY, four DISPLAYs to each GOLD
+  testStart = message_now();
+  char buf[32];
+  for (int i = 0; i < TEST_DISPLAYS; i++) {
+    if (i % 4 == 0 && i / 4 < TEST_GOLDS) {
+      snprintf(buf, sizeof(buf), "GOLD %d", i / 4);
+      message_send(self, buf);
+    }
+    snprintf(buf, sizeof(buf), "DISPLAY %d", i);
+    message_send(self, buf);
+  }
+  bool ok = message_loop(NULL, 0.05, reliableTimeout, NULL, reliableMessage);
+  message_done();
+
+  int failures = 0;
+  for (int i = 0; i < TEST_GOLDS; i++) {
+    if (goldsSeen[i] != 1) {
+      printf("FAIL: GOLD %d delivered %d times\n", i, goldsSeen[i]);
+      failures++;
+    }
+  }
+  if (!inOrder) {
+    printf("FAIL: DISPLAY delivered out of order\n");
+    failures++;
+  }
+  if (lastDisplay != TEST_DISPLAYS - 1) {
+    printf("FAIL: last DISPLAY delivered was %d\n", lastDisplay);
+    failures++;
+  }
+  if (!ok || testTimedOut) {
+    printf("FAIL: %s\n", ok ? "timed out" : "message_loop error");
+    failures++;
+  }
+  printf("reliable test, %d%% loss, %.2f s: %s\n", lossPercent,
+         (message_now() - testStart) / 1e9, failures == 0 ? "PASS" : "FAIL");
+  return failures == 0 ? 0 : 1;
+}
+
+/**************** fragmentTest ****************/
+/* The automated test of fragmentation; see above.  Message i is
+ * "OK i\n" (so that it is reliable) followed by fragmentSizes[i] bytes
+ * of a pattern that depends on i.
+ */
+static const int fragmentSizes[] = {
+  1, 65000, 65502, 65503, 65504, 200000, 500000, 3000000
+};
+#define TEST_FRAGMENTS (sizeof(fragmentSizes) / sizeof(fragmentSizes[0]))
+static int fragmentsSeen[TEST_FRAGMENTS];  // times each arrived intact
+static int fragmentsBad = 0;               // messages that arrived damaged
+
+static char
+fragmentByte(const int i, const int k)
+{
+  return 'a' + (k * 7 + i) % 26;
+}
+
+static bool
+fragmentTimeout(void* arg)
+{
+  int seen = 0;
+  for (int i = 0; i < TEST_FRAGMENTS; i++) {
+    seen += fragmentsSeen[i] > 0;
+  }
+  if (seen == TEST_FRAGMENTS && message_unacked() == 0) {
+    return true;
+  }
+  if (message_now() - testStart > 20000000000ULL) {
+    testTimedOut = true;      // 20s
+    return true;
+  }
+  return false;
+}
+
+static bool
+fragmentMessage(void* arg, const addr_t from, const char* message)
+{
+  int i, header = 0;
+  if (sscanf(message, "OK %d\n%n", &i, &header) != 1 || header == 0 ||
+      i < 0 || i >= TEST_FRAGMENTS) {
+    fragmentsBad++;
+    return false;
+  }
+  bool intact = message_length() == header + fragmentSizes[i];
+  for (int k = 0; intact && k < fragmentSizes[i]; k++) {
+    intact = message[header + k] == fragmentByte(i, k);
+  }
+  if (intact) {
+    fragmentsSeen[i]++;
+  } else {
+    fragmentsBad++;
+  }
+  return false;
+}
+
+static int
+fragmentTest(const int lossPercent)
+{
+  int ourPort = message_init(NULL);
+  char portString[16];
+  snprintf(portString, sizeof(portString), "%d", ourPort);
+  addr_t self;
+  if (ourPort == 0 || !message_setAddr("localhost", portString, &self)) {
+    return 2;
+  }
+  if (lossPercent > 0) {
+    message_setReliable(true);
+    message_setLoss(lossPercent / 100.0, 1);
+  }
+
+  testStart = message_now();
+  bool pendingOk = !message_pending();   // nothing sent yet
+  for (int i = 0; i < TEST_FRAGMENTS; i++) {
+    char* message = malloc(fragmentSizes[i] + 16);
+    int header = sprintf(message, "OK %d\n", i);
+    for (int k = 0; k < fragmentSizes[i]; k++) {
+      message[header + k] = fragmentByte(i, k);
+    }
+    message_sendBytes(self, message, header + fragmentSizes[i]);
+    free(message);
+  }
+  pendingOk = pendingOk && (lossPercent > 0 || message_pending());
+  bool ok = message_loop(NULL, 0.05, fragmentTimeout, NULL, fragmentMessage);
+  message_done();
+
+  int failures = 0;
+  for (int i = 0; i < TEST_FRAGMENTS; i++) {
+    if (fragmentsSeen[i] != 1) {
+      printf("FAIL: message of %d bytes arrived intact %d times\n",
+             fragmentSizes[i], fragmentsSeen[i]);
+      failures++;
+    }
+  }
+  if (fragmentsBad > 0) {
+    printf("FAIL: %d messages arrived damaged\n", fragmentsBad);
+    failures++;
+  }
+  if (!ok || testTimedOut) {
+    printf("FAIL: %s\n", ok ? "timed out" : "message_loop error");
+    failures++;
+  }
+  if (!pendingOk) {
+    printf("FAIL: message_pending was wrong before or after sending\n");
+    failures++;
+  }
+  printf("fragment test, %d%% loss, %.2f s: %s\n", lossPercent,
+         (message_now() - testStart) / 1e9, failures == 0 ? "PASS" : "FAIL");
+  return failures == 0 ? 0 : 1;
+}
+
+/**************** manyTest ****************/
+/* The automated test of message_sendMany; see above.  Message i is
+ * "OK i\n" followed by manySizes[i] bytes of fragmentByte's pattern.
+ */
+#include <poll.h>
+
+static const int manySizes[] = { 10, 2000, 65600, 150000 };
+#define TEST_MANY (sizeof(manySizes) / sizeof(manySizes[0]))
+
+/* Read what socket sock receives until it has 'length' bytes or is quiet
+ * for 200ms, and check that it is message (in order, if fragmented); any
+ * extra datagram is caught when the next message is checked.  Return
+ * true if so. */
+static bool
+manyReceived(const int sock, const char* message, const int length)
+{
+  static char datagram[FRAME_BYTES];
+  int have = 0;           // bytes of message received so far
+  struct pollfd pfd = { sock, POLLIN, 0 };
+  while (have < length && poll(&pfd, 1, 200) > 0) {
+    int n = recv(sock, datagram, sizeof(datagram) - 1, 0);
+    if (n < 0) {
+      return false;
+    }
+    datagram[n] = '\0';
+    int index, count, total, header = 0;
+    unsigned id;
+    if (sscanf(datagram, "FRAG %u %d %d %d\n%n", &id, &index, &count,
+               &total, &header) == 4 && header > 0) {
+      if (total != length || have + n - header > length
+          || memcmp(datagram + header, message + have, n - header) != 0) {
+        return false;
+      }
+      have += n - header;
+    } else if (have != 0 || n != length
+               || memcmp(datagram, message, length) != 0) {
+      return false;
+    } else {
+      have = n;
+    }
+  }
+  return have == length;
+}
+
+static int
+manyTest(const int receivers)
+{
+  if (message_init(NULL) == 0 || receivers < 1) {
+    return 2;
+  }
+  int* socks = calloc(receivers, sizeof(int));
+  addr_t* addrs = calloc(receivers, sizeof(addr_t));
+  const int bufferBytes = 1 << 20;
+  for (int r = 0; r < receivers; r++) {
+    socks[r] = socket(AF_INET, SOCK_DGRAM, 0);
+    addrs[r] = message_noAddr();
+    addrs[r].sin_family = AF_INET;
+    addrs[r].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLength = sizeof(addrs[r]);
+    if (socks[r] < 0
+        || bind(socks[r], (struct sockaddr*) &addrs[r], sizeof(addrs[r])) != 0
+        || getsockname(socks[r], (struct sockaddr*) &addrs[r],
+                       &addrLength) != 0) {
+      printf("FAIL: could not open receiver %d\n", r);
+      return 2;
+    }
+    setsockopt(socks[r], SOL_SOCKET, SO_RCVBUF, &bufferBytes,
+               sizeof(bufferBytes));
+  }
+
+  int failures = 0;
+  for (int i = 0; i < TEST_MANY; i++) {
+    char* message = malloc(manySizes[i] + 16);
+    int length = sprintf(message, "OK %d\n", i);
+    for (int k = 0; k < manySizes[i]; k++) {
+      message[length++] = fragmentByte(i, k);
+    }
+    message_sendMany(addrs, receivers, message, length);
+    int intact = 0;
+    for (int r = 0; r < receivers; r++) {
+      intact += manyReceived(socks[r], message, length);
+    }
+    if (intact != receivers) {
+      printf("FAIL: message of %d bytes arrived intact at %d of %d\n",
+             length, intact, receivers);
+      failures++;
+    }
+    free(message);
+  }
+
+  // the cost of sending one frame to every receiver, both ways
+  char frame[2000];
+  memset(frame, '.', sizeof(frame));
+  memcpy(frame, "DISPLAY\n", strlen("DISPLAY\n"));
+  const int reps = 20;
+  uint64_t start = message_now();
+  for (int k = 0; k < reps; k++) {
+    for (int r = 0; r < receivers; r++) {
+      message_sendBytes(addrs[r], frame, sizeof(frame));
+    }
+  }
+  const double one = (message_now() - start) / 1e3 / reps;
+  start = message_now();
+  for (int k = 0; k < reps; k++) {
+    message_sendMany(addrs, receivers, frame, sizeof(frame));
+  }
+  const double many = (message_now() - start) / 1e3 / reps;
+  printf("%d bytes to %d receivers: %.0f us one by one, %.0f us with "
+         "message_sendMany\n", (int) sizeof(frame), receivers, one, many);
+
+  for (int r = 0; r < receivers; r++) {
+    close(socks[r]);
+  }
+  free(socks);
+  free(addrs);
+  message_done();
+  printf("many test, %d receivers: %s\n", receivers,
+         failures == 0 ? "PASS" : "FAIL");
+  return failures == 0 ? 0 : 1;
+}
+
+/**************** sharedTest ****************/
+/* The automated test of message_initShared; see above.  Each process
+ * answers "SHARD n"; the clients are plain UDP sockets.
+ */
+#include <signal.h>
+#include <sys/wait.h>
+
+#define TEST_CLIENTS 64
+#define TEST_HELLOS 5
+
+/* answer every datagram with our shard number */
+static bool
+shardMessage(void* arg, const addr_t from, const char* message)
+{
+  message_send(from, arg);
+  return false;
+}
+
+static int
+sharedTest(const int shards)
+{
+  int port = message_initShared(NULL, 0);
+  if (port == 0 || shards < 2) {
+    return 2;
+  }
+  pid_t* children = calloc(shards, sizeof(pid_t));
+  for (int s = 0; s < shards; s++) {
+    children[s] = fork();
+    if (children[s] == 0) {
+      // our parent's socket is not ours to share; open one of our own
+      message_done();
+      char answer[32];
+      snprintf(answer, sizeof(answer), "SHARD %d", s);
+      if (message_initShared(NULL, port) != port) {
+        _exit(2);
+      }
+      message_loop(answer, 0, NULL, NULL, shardMessage);
+      _exit(0);
+    }
+  }
+  sleep(1);        // for every shard to bind
+  message_done();  // leaving the port to the shards
+
+  addr_t server = message_noAddr();
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons(port);
+  int failures = 0;
+  int served[TEST_CLIENTS];    // by which shard; -1 if none yet
+  int clients[TEST_CLIENTS];
+  for (int c = 0; c < TEST_CLIENTS; c++) {
+    clients[c] = socket(AF_INET, SOCK_DGRAM, 0);
+    served[c] = -1;
+  }
+  for (int h = 0; h < TEST_HELLOS; h++) {
+    for (int c = 0; c < TEST_CLIENTS; c++) {
+      sendto(clients[c], "HELLO", strlen("HELLO"), 0,
+             (struct sockaddr*) &server, sizeof(server));
+      char answer[32] = "";
+      struct pollfd pfd = { clients[c], POLLIN, 0 };
+      int n, s = -1;
+      if (poll(&pfd, 1, 1000) <= 0
+          || (n = recv(clients[c], answer, sizeof(answer) - 1, 0)) < 0) {
+        printf("FAIL: client %d had no answer\n", c);
+        failures++;
+        continue;
+      }
+      answer[n] = '\0';
+      if (sscanf(answer, "SHARD %d", &s) != 1 || s < 0 || s >= shards
+          || (served[c] >= 0 && served[c] != s)) {
+        printf("FAIL: client %d was answered by shard %d, then %s\n", c,
+               served[c], answer);
+        failures++;
+      }
+      served[c] = s;
+    }
+  }
+
+  int used = 0;
+  for (int s = 0; s < shards; s++) {
+    int count = 0;
+    for (int c = 0; c < TEST_CLIENTS; c++) {
+      count += served[c] == s;
+    }
+    used += count > 0;
+    printf("shard %d served %d of %d clients\n", s, count, TEST_CLIENTS);
+  }
+  if (used < 2) {
+    printf("FAIL: every client was served by one shard\n");
+    failures++;
+  }
+
+  for (int c = 0; c < TEST_CLIENTS; c++) {
+    close(clients[c]);
+  }
+  for (int s = 0; s < shards; s++) {
+    if (children[s] > 0) {
+      kill(children[s], SIGTERM);
+      waitpid(children[s], NULL, 0);
+    }
+  }
+  free(children);
+  printf("shared test, %d shards: %s\n", shards,
+         failures == 0 ? "PASS" : "FAIL");
+  return failures == 0 ? 0 : 1;
+}
+
 #endif // UNIT_TEST
@@ -20,6 +20,31 @@
  *  handleInput may be NULL if no input expected.
  *  arg may be NULL if not needed by handlers.
  *
+ * Reliability: messages are plain UDP datagrams unless one side calls
+ * message_setReliable(true).  Then everything it sends is framed with
+ * sequence numbers and acknowledgements, and the other side answers in
+ * kind (with no call needed).  Over a framed exchange, OK, GRID, GOLD,
+ * QUIT, PLAY, SPECTATE, CAPS and VIEW messages are retransmitted until
+ * acknowledged and delivered exactly once (though not necessarily in
+ * order); DISPLAY and VIEWPORT messages (and their encoded forms) are
+ * latest-wins, i.e., one that arrives after a newer one is dropped, and
+ * only the newest is retransmitted; other messages are sent once, as
+ * before.  Peers that never frame see no change.  The little state kept
+ * for each peer is dropped once it has been silent for 30 seconds with
+ * nothing outstanding, so it lasts no longer than the peer's use of it.
+ *
+ * Fragmentation: a message longer than one datagram (message_MaxBytes)
+ * is split into numbered fragments, and reassembled by the receiver
+ * before it reaches handleMessage (or the reliability layer), so any
+ * message up to message_MaxMessageBytes can be sent.  If a fragment is
+ * lost the message is lost with it; but a reliable message is split
+ * before it is framed, and each of its fragments is acknowledged and
+ * retransmitted by itself, so it arrives even over a lossy network.  A
+ * partly received message is discarded once a couple of seconds pass
+ * with no fragment of it, and only a few may be in reassembly at once.
+ * Shorter messages are sent exactly as before, so peers that don't
+ * reassemble see no change.
+ *
  * David Kotz - May 2019
  */
 
@@ -28,6 +53,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <arpa/inet.h>  // These two includes are not needed for this file, 
 #include <sys/select.h> // but is needed for users of this file.
 
@@ -49,6 +75,9 @@ typedef struct sockaddr_in addr_t;
 // Maximum payload size for UDP messages, according to
 // https://en.wikipedia.org/wiki/User_Datagram_Protocol
 static const int message_MaxBytes = 65507;
+static const int message_SendBatch = 64;  // datagrams per sendmmsg
+// Maximum message size, when fragmented across several datagrams
+static const int message_MaxMessageBytes = 8 * 1024 * 1024;
 
 /****************** global functions *********************/
 
@@ -64,6 +93,30 @@ static const int message_MaxBytes = 65507;
  */
 int message_init(FILE* logFP);
 
+/******************************************/
+/* message_initPort: as message_init, but listen on the given port, or,
+ * if it is 0, on any free port (as message_init does).  A server that
+ * is restarted on the port it had before can be found by the clients
+ * it had then.
+ * Function returns:
+ *   the port number; zero on error, e.g., if the port is in use.
+ */
+int message_initPort(FILE* logFP, const int port);
+
+/******************************************/
+/* message_initShared: as message_initPort, but let other sockets --
+ * typically in other processes, each having called message_initShared
+ * -- bind the same port (with SO_REUSEPORT).  The kernel hands each
+ * datagram to one of them, chosen by a hash of the sender's address and
+ * port, so every datagram from a given client reaches the same socket,
+ * as long as the same sockets share the port.  Each socket sends from
+ * the shared port, so clients see one server.
+ * Function returns:
+ *   the port number; zero on error, e.g., if the port is in use by a
+ *   socket that does not share it.
+ */
+int message_initShared(FILE* logFP, const int port);
+
 /******************************************/
 /* message_noAddr: return an addr_t representing "no address".
  * Logs: nothing.
@@ -124,7 +177,7 @@ const char* message_stringAddr(const addr_t addr);
 /* message_send: send a message.
  * Caller provides:
  *   a valid address to which to send the message,
- *   a string containing the message.
+ *   a string containing the message, at most message_MaxMessageBytes long.
  * Function returns: none
  * Assumptions: message_init() has already been called.
  * Logs:
@@ -133,6 +186,65 @@ const char* message_stringAddr(const addr_t addr);
  */
 void message_send(const addr_t to, const char* message);
 
+/******************************************/
+/* message_sendBytes: send a message that is not a string.
+ * Caller provides:
+ *   a valid address to which to send the message,
+ *   the message, which may contain NUL characters, and its length.
+ * Function returns: none
+ * Notes:
+ *   message_send(to, s) is message_sendBytes(to, s, strlen(s)).
+ *   The receiver's handleMessage still gets a NUL-terminated buffer,
+ *   and can find the length with message_length().
+ * Logs: as for message_send.
+ */
+void message_sendBytes(const addr_t to, const char* message, const int length);
+
+/******************************************/
+/* message_sendMany: send the same message to many correspondents.
+ * Caller provides:
+ *   an array of 'count' valid addresses;
+ *   the message, which may contain NUL characters, and its length.
+ * Function returns: none
+ * Notes:
+ *   equivalent to message_sendBytes to each address in turn, but cheaper:
+ *   a long message is split into fragments once, not once per address,
+ *   and (on Linux) the datagrams go to the kernel in batches of up to
+ *   message_SendBatch with sendmmsg(2), one system call per batch.
+ *   Correspondents that use the reliability layer are sent theirs one
+ *   by one, each being framed differently.
+ * Logs: as for message_send, but once per call.
+ */
+void message_sendMany(const addr_t to[], const int count, const char* message,
+                      const int length);
+
+/******************************************/
+/* message_setReliable: frame (or stop framing) messages to every peer.
+ * Caller provides: true to turn on the reliability layer described above.
+ * Notes:
+ *   a peer that sends us framed messages is answered in framed messages
+ *   regardless of this setting.
+ * Logs: nothing.
+ */
+void message_setReliable(const bool on);
+
+/******************************************/
+/* message_setLoss: simulate an unreliable network, for testing.
+ * Caller provides:
+ *   the fraction (0.0 to 1.0) of outgoing datagrams to drop silently;
+ *   a seed, so the pattern of losses is reproducible.
+ * Logs: each datagram dropped.
+ */
+void message_setLoss(const double rate, const uint64_t seed);
+
+/******************************************/
+/* message_unacked: how many reliable messages have yet to be acknowledged?
+ * Function returns: the number, summed over all peers; each fragment of
+ *   a long reliable message counts as one.
+ * Logs: nothing.
+ */
+int message_unacked(void);
+
 /******************************************/
 /* message_loop: loop, handling input and incoming messages.
  * Caller provides:
@@ -145,7 +257,11 @@ void message_send(const addr_t to, const char* message);
  *   true, in the normal case when the loop ends due to handler return true;
  *   false, when fatal errors indicate we cannot keep looping.
  * Handlers:
- *   handleTimeout: called when time passes without input or message.
+ *   handleTimeout: called when 'timeout' seconds pass without input or
+ *     message.  (The loop also wakes, without calling it, to retransmit
+ *     and acknowledge messages in the reliability layer.)  Also called
+ *     when a signal interrupts the wait, so that it can act on a flag
+ *     the signal's handler set, e.g., to stop the loop on SIGTERM.
  *   handleInput: should read once from stdin and process it.
  *   handleMessage: provided the address from which the message arrived,
  *     and a string containing the contents of the message. The handler should
@@ -166,6 +282,51 @@ bool message_loop(void* arg, const float timeout,
                                         const addr_t from, 
                                         const char* message));
 
+/******************************************/
+/* message_length: how long is the message currently being handled?
+ * Function returns:
+ *   the length of the message most recently passed to handleMessage, not
+ *   counting the NUL that follows it; it differs from strlen(message)
+ *   only if the message was sent by message_sendBytes and contains NULs.
+ * Logs: nothing.
+ */
+int message_length(void);
+
+/******************************************/
+/* message_pending: has another datagram already arrived?
+ * Function returns:
+ *   true if the socket has a datagram waiting to be read, which the
+ *   loop will handle without blocking; false if not, or before
+ *   message_init.  The datagram may be only a fragment, or an
+ *   acknowledgement, and so never reach handleMessage.
+ * Notes:
+ *   Useful for coalescing work over a burst of messages, e.g., drawing
+ *   only the last of several DISPLAYs that arrived together.
+ * Logs: nothing.
+ */
+bool message_pending(void);
+
+/******************************************/
+/* message_receivedTime: when was the latest message read from the socket?
+ * Function returns:
+ *   the message_now() reading taken as soon as the message currently
+ *   (or most recently) passed to handleMessage was received;
+ *   zero if no message has been received yet.
+ * Notes:
+ *   Useful for measuring how long a handler takes to respond, e.g.,
+ *     latency = message_now() - message_receivedTime();
+ * Logs: nothing.
+ */
+uint64_t message_receivedTime(void);
+
+/******************************************/
+/* message_now: read a monotonic clock.
+ * Function returns: the current time in nanoseconds, from an arbitrary
+ *   fixed starting point; comparable with message_receivedTime().
+ * Logs: nothing.
+ */
+uint64_t message_now(void);
+
 /******************************************/
 /* message_done: shut down the module.
  * Caller provides: nothing.
@@ -0,0 +1,527 @@
+/*
+ * proto - a compact binary encoding of the nuggets protocol (version 1)
+ *
+ * See proto.h for the encoding and a detailed interface description.
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test; see below.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#include <limits.h>
+#include <string.h>
+#include "proto.h"
+
+/**************** file-local constants ****************/
+static const int MinRun = 3;        // shorter runs cost no more written out
+static const unsigned char RunBit = 0x80;
+static const int MaxVarint = 5;     // bytes; enough for INT_MAX
+
+/**************** file-local functions ****************/
+static int putVarint(unsigned char* buf, int o, const int size, int value);
+static bool getVarint(const unsigned char* buf, const int length, int* i,
+                      int* value);
+static int putRun(unsigned char* buf, int o, const int size, const char c,
+                  const int run);
+static int packMap(const proto_msg_t* msg, unsigned char* buf, int o,
+                   const int size);
+static inline bool isCell(const int c) { return c >= ' ' && c <= '~'; }
+
+/**************** proto_isBinary ****************/
+bool
+proto_isBinary(const char* buf, const int length)
+{
+  return buf != NULL && length >= 2 && buf[0] == PROTO_TAG;
+}
+
+/**************** proto_encode ****************/
+int
+proto_encode(const proto_msg_t* msg, char* buffer, const int size)
+{
+  unsigned char* buf = (unsigned char*)buffer;
+  if (msg == NULL || buf == NULL || size < 2) {
+    return -1;
+  }
+  buf[0] = PROTO_TAG;
+  buf[1] = msg->type;
+  int o = 2;
+
+  switch (msg->type) {
+  case PROTO_OK:
+  case PROTO_KEY:
+    if (o >= size) {
+      return -1;
+    }
+    buf[o++] = msg->ch;
+    if (msg->type == PROTO_KEY && msg->seq != 0) {
+      o = putVarint(buf, o, size, msg->seq);
+    }
+    break;
+  case PROTO_SEQ:
+    o = putVarint(buf, o, size, msg->seq);
+    break;
+  case PROTO_GRID:
+    o = putVarint(buf, o, size, msg->rows);
+    o = putVarint(buf, o, size, msg->cols);
+    break;
+  case PROTO_GOLD:
+    o = putVarint(buf, o, size, msg->n);
+    o = putVarint(buf, o, size, msg->p);
+    o = putVarint(buf, o, size, msg->r);
+    break;
+  case PROTO_VIEWPORT:
+    o = putVarint(buf, o, size, msg->top);
+    o = putVarint(buf, o, size, msg->left);
+    // fall through
+  case PROTO_DISPLAY:
+    o = putVarint(buf, o, size, msg->rows);
+    o = putVarint(buf, o, size, msg->cols);
+    o = packMap(msg, buf, o, size);
+    break;
+  case PROTO_QUIT:
+  case PROTO_ERROR:
+  case PROTO_PLAY:
+    if (msg->textLength < 0 || (msg->textLength > 0 && msg->text == NULL)
+        || o + msg->textLength > size) {
+      return -1;
+    }
+    memcpy(buf + o, msg->text, msg->textLength);
+    o += msg->textLength;
+    break;
+  case PROTO_SPECTATE:
+    break;
+  default:
+    return -1;
+  }
+  return o;
+}
+
+/**************** proto_decode ****************/
+bool
+proto_decode(const char* buffer, const int length, proto_msg_t* msg)
+{
+  const unsigned char* buf = (const unsigned char*)buffer;
+  if (msg == NULL || !proto_isBinary(buffer, length)) {
+    return false;
+  }
+  memset(msg, 0, sizeof(proto_msg_t));
+  msg->type = buf[1];
+  int i = 2;
+
+  switch (msg->type) {
+  case PROTO_OK:
+    if (length != 3) {
+      return false;
+    }
+    msg->ch = buf[2];
+    return true;
+  case PROTO_KEY:
+    if (length < 3) {
+      return false;
+    }
+    msg->ch = buf[2];
+    i = 3;
+    return i == length || (getVarint(buf, length, &i, &msg->seq)
+                           && i == length);
+  case PROTO_SEQ:
+    return getVarint(buf, length, &i, &msg->seq) && i == length;
+  case PROTO_GRID:
+    return getVarint(buf, length, &i, &msg->rows)
+      && getVarint(buf, length, &i, &msg->cols) && i == length;
+  case PROTO_GOLD:
+    return getVarint(buf, length, &i, &msg->n)
+      && getVarint(buf, length, &i, &msg->p)
+      && getVarint(buf, length, &i, &msg->r) && i == length;
+  case PROTO_VIEWPORT:
+    if (!getVarint(buf, length, &i, &msg->top)
+        || !getVarint(buf, length, &i, &msg->left)) {
+      return false;
+    }
+    // fall through
+  case PROTO_DISPLAY:
+    if (!getVarint(buf, length, &i, &msg->rows)
+        || !getVarint(buf, length, &i, &msg->cols)) {
+      return false;
+    }
+    msg->text = buffer + i;
+    msg->textLength = length - i;
+    return true;
+  case PROTO_QUIT:
+  case PROTO_ERROR:
+  case PROTO_PLAY:
+    msg->text = buffer + i;
+    msg->textLength = length - i;
+    return true;
+  case PROTO_SPECTATE:
+    return length == 2;
+  default:
+    return false;
+  }
+}
+
+/**************** proto_unpackMap ****************/
+int
+proto_unpackMap(const proto_msg_t* msg, char* out, const int outSize)
+{
+  if (msg == NULL || out == NULL ||
+      (msg->type != PROTO_DISPLAY && msg->type != PROTO_VIEWPORT)) {
+    return -1;
+  }
+  const long long mapLength = (long long)msg->rows * (msg->cols + 1);
+  if (mapLength + 1 > outSize) {
+    return -1;
+  }
+  const unsigned char* buf = (const unsigned char*)msg->text;
+  const int length = msg->textLength;
+  const long long cells = (long long)msg->rows * msg->cols;
+  long long unpacked = 0;   // cells so far
+  int o = 0;                // bytes written to out
+  int x = 0;                // column of the next cell
+
+  // a map with no columns is all newlines
+  if (msg->cols == 0) {
+    memset(out, '\n', msg->rows);
+    o = msg->rows;
+  }
+
+  for (int i = 0; i < length; ) {
+    char c = buf[i] & ~RunBit;
+    int run = 1;
+    if (buf[i++] & RunBit) {
+      if (!getVarint(buf, length, &i, &run) || run < 1) {
+        return -1;
+      }
+    }
+    if (!isCell(c) || run > cells - unpacked) {
+      return -1;
+    }
+    unpacked += run;
+    while (run > 0) {
+      int n = run < msg->cols - x ? run : msg->cols - x;
+      memset(out + o, c, n);
+      o += n;
+      x += n;
+      run -= n;
+      if (x == msg->cols) {
+        out[o++] = '\n';
+        x = 0;
+      }
+    }
+  }
+  if (unpacked != cells) {
+    return -1;
+  }
+  out[o] = '\0';
+  return o;
+}
+
+/**************** putVarint ****************/
+/* Append 'value' to buf at o; return the new o, or -1 if it won't fit,
+ * value is negative, or o is already -1.
+ */
+static int
+putVarint(unsigned char* buf, int o, const int size, int value)
+{
+  if (o < 0 || value < 0) {
+    return -1;
+  }
+  do {
+    if (o >= size) {
+      return -1;
+    }
+    unsigned char byte = value & 0x7F;
+    value >>= 7;
+    buf[o++] = value != 0 ? byte | 0x80 : byte;
+  } while (value != 0);
+  return o;
+}
+
+/**************** getVarint ****************/
+/* Read a varint from buf at *i, advancing *i past it; return false if it
+ * runs past 'length', is longer than MaxVarint bytes, or exceeds INT_MAX.
+ */
+static bool
+getVarint(const unsigned char* buf, const int length, int* i, int* value)
+{
+  long long result = 0;
+  for (int shift = 0, n = 0; n < MaxVarint; shift += 7, n++) {
+    if (*i >= length) {
+      return false;
+    }
+    const unsigned char byte = buf[(*i)++];
+    result |= (long long)(byte & 0x7F) << shift;
+    if (result > INT_MAX) {
+      return false;
+    }
+    if ((byte & 0x80) == 0) {
+      *value = (int)result;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**************** putRun ****************/
+/* Append a run of 'run' copies of cell c; return the new o, or -1. */
+static int
+putRun(unsigned char* buf, int o, const int size, const char c, const int run)
+{
+  if (o < 0) {
+    return -1;
+  }
+  if (run >= MinRun) {
+    if (o >= size) {
+      return -1;
+    }
+    buf[o++] = c | RunBit;
+    return putVarint(buf, o, size, run);
+  }
+  if (o + run > size) {
+    return -1;
+  }
+  memset(buf + o, c, run);
+  return o + run;
+}
+
+/**************** packMap ****************/
+/* Append the cells of msg's map, checking its shape; return the new o,
+ * or -1.  Runs continue from the end of one row to the start of the next.
+ */
+static int
+packMap(const proto_msg_t* msg, unsigned char* buf, int o, const int size)
+{
+  if (o < 0 || msg->text == NULL ||
+      (long long)msg->rows * (msg->cols + 1) != msg->textLength) {
+    return -1;
+  }
+  char runChar = '\0';
+  int run = 0;
+  for (int y = 0; y < msg->rows; y++) {
+    const char* row = msg->text + y * (msg->cols + 1);
+    if (row[msg->cols] != '\n') {
+      return -1;
+    }
+    for (int x = 0; x < msg->cols; x++) {
+      const char c = row[x];
+      if (run > 0 && c == runChar) {
+        run++;
+        continue;
+      }
+      if (!isCell(c)) {
+        return -1;
+      }
+      o = putRun(buf, o, size, runChar, run);
+      runChar = c;
+      run = 1;
+    }
+  }
+  return putRun(buf, o, size, runChar, run);
+}
+
+/* ****************************************************************** */
+/* ************************* UNIT_TEST ****************************** */
+/*
+ * Round-trip every message type and some awkward maps, check the edges
+ * of the varint encoding, then fuzz the decoder: decode many random
+ * mutations (flipped bytes, truncations, extensions) of valid messages,
+ * and random garbage, each in a buffer of exactly its own length, and
+ * unpack any DISPLAY that decodes.  Nothing should crash; build with
+ * -fsanitize=address to catch reads past the end, e.g.,
+ *   gcc -fsanitize=address -DUNIT_TEST proto.c rng.c -o prototest
+ * An optional argument gives the number of fuzz iterations.
+ */
+
+#ifdef UNIT_TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "rng.h"
+
+static void roundTrip(const proto_msg_t* msg);
+static void roundTripMap(const char* map, const int rows, const int cols);
+static void fuzz(const char* seed, const int length, rng_t* rng);
+
+int
+main(const int argc, char* argv[])
+{
+  const int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+  printf("Testing round trips\n");
+  roundTrip(&(proto_msg_t){ .type = PROTO_OK, .ch = 'Q' });
+  roundTrip(&(proto_msg_t){ .type = PROTO_KEY, .ch = 'h' });
+  roundTrip(&(proto_msg_t){ .type = PROTO_KEY, .ch = 'L', .seq = 1000 });
+  roundTrip(&(proto_msg_t){ .type = PROTO_SEQ, .seq = 1 });
+  roundTrip(&(proto_msg_t){ .type = PROTO_GRID, .rows = 21, .cols = 79 });
+  roundTrip(&(proto_msg_t){ .type = PROTO_GOLD, .n = 0, .p = 127,
+                            .r = INT_MAX });
+  roundTrip(&(proto_msg_t){ .type = PROTO_SPECTATE });
+  roundTrip(&(proto_msg_t){ .type = PROTO_PLAY, .text = "alice",
+                            .textLength = 5 });
+  roundTrip(&(proto_msg_t){ .type = PROTO_QUIT, .text = "GAME OVER:\nA 1",
+                            .textLength = 14 });
+  roundTrip(&(proto_msg_t){ .type = PROTO_ERROR, .text = "",
+                            .textLength = 0 });
+
+  printf("Testing maps\n");
+  roundTripMap("", 0, 0);
+  roundTripMap("\n\n", 2, 0);
+  roundTripMap("a\n", 1, 1);
+  roundTripMap("+--+\n|..|\n+--+\n", 3, 4);
+  roundTripMap("    \n    \n    \n", 3, 4);         // one run, three rows
+  char big[300 * 3];
+  for (int y = 0; y < 3; y++) {                     // runs past 127 cells
+    memset(big + y * 300, y == 1 ? '#' : ' ', 299);
+    big[y * 300 + 299] = '\n';
+  }
+  roundTripMap(big, 3, 299);
+
+  printf("Testing rejects\n");
+  char buf[64];
+  assert(proto_encode(&(proto_msg_t){ .type = 99 }, buf, sizeof(buf)) == -1);
+  assert(proto_encode(&(proto_msg_t){ .type = PROTO_GOLD, .n = -1 },
+                      buf, sizeof(buf)) == -1);
+  assert(proto_encode(&(proto_msg_t){ .type = PROTO_GRID, .rows = 300 },
+                      buf, 3) == -1);                 // won't fit
+  assert(proto_encode(&(proto_msg_t){ .type = PROTO_DISPLAY, .rows = 1,
+                      .cols = 2, .text = "ab", .textLength = 2 },
+                      buf, sizeof(buf)) == -1);       // no newline
+  assert(proto_encode(&(proto_msg_t){ .type = PROTO_DISPLAY, .rows = 1,
+                      .cols = 2, .text = "a\t\n", .textLength = 3 },
+                      buf, sizeof(buf)) == -1);       // unprintable
+  proto_msg_t msg;
+  assert(!proto_decode("\xB1", 1, &msg));
+  assert(!proto_decode("GOLD 1 2 3", 10, &msg));
+  assert(!proto_decode("\xB1\x03\x01\x02", 4, &msg));           // short GOLD
+  assert(!proto_decode("\xB1\x09h\x81", 4, &msg));               // short seq
+  assert(!proto_decode("\xB1\x0B", 2, &msg));                     // no seq
+  assert(!proto_decode("\xB1\x02\x80\x80\x80\x80\x80\x01\x01", 9, &msg));
+  assert(!proto_decode("\xB1\x02\xFF\xFF\xFF\xFF\x0F\x01", 8, &msg));
+  assert(proto_decode("\xB1\x02\xFF\xFF\xFF\xFF\x07\x01", 8, &msg)
+         && msg.rows == INT_MAX && msg.cols == 1);
+
+  printf("Fuzzing the decoder, %d iterations\n", iterations);
+  rng_t rng;
+  rng_seed(&rng, 1);
+  char seeds[6][128];
+  int seedLengths[6];
+  seedLengths[0] = proto_encode(&(proto_msg_t){ .type = PROTO_DISPLAY,
+                                .rows = 3, .cols = 4, .text =
+                                "+--+\n|*.|\n+--+\n", .textLength = 15 },
+                                seeds[0], 128);
+  seedLengths[1] = proto_encode(&(proto_msg_t){ .type = PROTO_GOLD, .n = 5,
+                                .p = 300, .r = 20000 }, seeds[1], 128);
+  seedLengths[2] = proto_encode(&(proto_msg_t){ .type = PROTO_QUIT,
+                                .text = "bye", .textLength = 3 },
+                                seeds[2], 128);
+  seedLengths[3] = proto_encode(&(proto_msg_t){ .type = PROTO_GRID,
+                                .rows = 21, .cols = 79 }, seeds[3], 128);
+  seedLengths[4] = proto_encode(&(proto_msg_t){ .type = PROTO_VIEWPORT,
+                                .top = 130, .left = 2, .rows = 2, .cols = 3,
+                                .text = "#  \n  #\n", .textLength = 8 },
+                                seeds[4], 128);
+  seedLengths[5] = proto_encode(&(proto_msg_t){ .type = PROTO_KEY,
+                                .ch = 'k', .seq = 300 }, seeds[5], 128);
+  for (int i = 0; i < iterations; i++) {
+    int s = rng_below(&rng, 6);
+    fuzz(seeds[s], seedLengths[s], &rng);
+  }
+
+  printf("Tests passed successfully.\n");
+  return 0;
+}
+
+/* Encode and decode msg; every field of its type must survive. */
+static void
+roundTrip(const proto_msg_t* msg)
+{
+  char buf[256];
+  proto_msg_t out;
+  int length = proto_encode(msg, buf, sizeof(buf));
+  assert(length >= 2 && proto_isBinary(buf, length));
+  assert(proto_encode(msg, buf, length - 1) == -1);   // one byte short
+  assert(proto_decode(buf, length, &out));
+  assert(out.type == msg->type && out.ch == msg->ch);
+  assert(out.rows == msg->rows && out.cols == msg->cols);
+  assert(out.top == msg->top && out.left == msg->left);
+  assert(out.n == msg->n && out.p == msg->p && out.r == msg->r);
+  assert(out.seq == msg->seq);
+  assert(out.textLength == msg->textLength);
+  assert(msg->textLength == 0 ||
+         memcmp(out.text, msg->text, msg->textLength) == 0);
+}
+
+/* Encode, decode and unpack a DISPLAY of map, and a VIEWPORT of it;
+ * both must survive.
+ */
+static void
+roundTripMap(const char* map, const int rows, const int cols)
+{
+  const int mapLength = rows * (cols + 1);
+  char buf[2048];
+  char out[2048];
+  proto_msg_t msgs[] = {
+    { .type = PROTO_DISPLAY, .rows = rows, .cols = cols,
+      .text = map, .textLength = mapLength },
+    { .type = PROTO_VIEWPORT, .top = 200, .left = 3, .rows = rows,
+      .cols = cols, .text = map, .textLength = mapLength },
+  };
+  for (int i = 0; i < 2; i++) {
+    proto_msg_t msg = msgs[i];
+    int length = proto_encode(&msg, buf, sizeof(buf));
+    assert(length > 0);
+    assert(proto_decode(buf, length, &msg));
+    assert(msg.type == msgs[i].type && msg.top == msgs[i].top &&
+           msg.left == msgs[i].left);
+    assert(proto_unpackMap(&msg, out, mapLength) == -1);  // no room for NUL
+    assert(proto_unpackMap(&msg, out, mapLength + 1) == mapLength);
+    assert(memcmp(out, map, mapLength) == 0 && out[mapLength] == '\0');
+  }
+}
+
+/* Decode one random mutation of the message in seed. */
+static void
+fuzz(const char* seed, const int length, rng_t* rng)
+{
+  char work[160];
+  int n = length;
+  memcpy(work, seed, length);
+  switch (rng_below(rng, 4)) {
+  case 0:                           // flip some bytes
+    for (int k = 1 + rng_below(rng, 3); k > 0; k--) {
+      work[rng_below(rng, n)] = rng_next(rng);
+    }
+    break;
+  case 1:                           // truncate
+    n = rng_below(rng, length + 1);
+    break;
+  case 2:                           // extend with garbage
+    while (n < (int)sizeof(work) && rng_below(rng, 8) != 0) {
+      work[n++] = rng_next(rng);
+    }
+    break;
+  default:                          // garbage after the tag
+    n = 2 + rng_below(rng, 40);
+    for (int k = 1; k < n; k++) {
+      work[k] = rng_next(rng);
+    }
+    break;
+  }
+
+  // an exact-size copy, so that any overread is out of bounds
+  char* exact = malloc(n > 0 ? n : 1);
+  assert(exact != NULL);
+  memcpy(exact, work, n);
+  proto_msg_t msg;
+  if (proto_decode(exact, n, &msg)) {
+    assert(msg.textLength >= 0 && msg.text + msg.textLength <= exact + n);
+    if (msg.type == PROTO_DISPLAY || msg.type == PROTO_VIEWPORT) {
+      char out[512];
+      int m = proto_unpackMap(&msg, out, sizeof(out));
+      assert(m == -1 || (m < (int)sizeof(out) && out[m] == '\0'));
+    }
+  }
+  free(exact);
+}
+
+#endif // UNIT_TEST
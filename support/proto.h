@@ -0,0 +1,130 @@
+/*
+ * proto - a compact binary encoding of the nuggets protocol (version 1)
+ *
+ * The text protocol ("GOLD 5 20 180", "DISPLAY\n...") must be parsed
+ * with strncmp and sscanf on every message.  This module defines an
+ * alternative encoding of the same messages with fixed headers, varints
+ * and packed map cells, which clients and servers may use instead once
+ * they have agreed to (see "CAPS BIN1" in server/README.md).  The two
+ * coexist: every binary message begins with the byte PROTO_TAG, which
+ * is not ASCII and so never begins a text message.
+ *
+ * Encoding, after the tag byte and a type byte:
+ *   OK        the player's letter (1 byte)
+ *   GRID      varint rows, varint cols
+ *   GOLD      varint n, varint p, varint r
+ *   DISPLAY   varint rows, varint cols, then the map's rows*cols cells,
+ *             without newlines; a cell is one printable ASCII byte, and
+ *             a run of 3 or more of the same cell c is (c | 0x80) then
+ *             varint count
+ *   QUIT      the explanation, to the end of the message
+ *   ERROR     the explanation, to the end of the message
+ *   PLAY      the player's name, to the end of the message
+ *   SPECTATE  (nothing)
+ *   KEY       the keystroke (1 byte), then, if the client numbers its
+ *             keystrokes, varint seq
+ *   VIEWPORT  varint top, varint left, then as DISPLAY: a rectangle of the
+ *             map, whose top-left corner is at (top, left)
+ *   SEQ       varint seq, of the KEY whose replies follow
+ * A varint is an unsigned LEB128 number no greater than INT_MAX: seven
+ * bits per byte, least significant first, high bit set on all but the
+ * last byte.
+ *
+ * Nothing here allocates: messages are encoded into, and decoded in
+ * place from, buffers the caller provides.
+ *
+ * Typical usage:
+ *   proto_msg_t msg = { .type = PROTO_GOLD, .n = 5, .p = 20, .r = 180 };
+ *   char buf[PROTO_MAX_FIXED];
+ *   int length = proto_encode(&msg, buf, sizeof(buf));
+ *   message_sendBytes(to, buf, length);
+ * and, in handleMessage,
+ *   proto_msg_t msg;
+ *   if (proto_isBinary(message, message_length())
+ *       && proto_decode(message, message_length(), &msg)) ...
+ *
+ * Compile with -DUNIT_TEST for a standalone unit and fuzz test;
+ * see proto.c.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#ifndef _PROTO_H_
+#define _PROTO_H_
+
+#include <stdbool.h>
+
+/****************** constants *********************/
+#define PROTO_TAG '\xB1'       // first byte of every version-1 message
+#define PROTO_MAX_FIXED 32     // encoding of any but QUIT/ERROR/PLAY/DISPLAY
+
+/****************** types *********************/
+typedef enum proto_type {
+  PROTO_OK = 1, PROTO_GRID, PROTO_GOLD, PROTO_DISPLAY, PROTO_QUIT,
+  PROTO_ERROR, PROTO_PLAY, PROTO_SPECTATE, PROTO_KEY, PROTO_VIEWPORT,
+  PROTO_SEQ,
+} proto_type_t;
+
+/* One message, decoded.  Only the fields its type uses are meaningful. */
+typedef struct proto_msg {
+  proto_type_t type;
+  char ch;               // OK: the player's letter; KEY: the keystroke
+  int rows, cols;        // GRID, DISPLAY, VIEWPORT
+  int top, left;         // VIEWPORT
+  int n, p, r;           // GOLD
+  int seq;               // KEY: the keystroke's number, or 0 if none; SEQ
+  const char* text;      // QUIT, ERROR: explanation; PLAY: name;
+                         // DISPLAY, VIEWPORT: to encode, the map (rows lines
+                         // of cols characters, each ending in '\n');
+                         // decoded, the packed cells, for proto_unpackMap
+  int textLength;        // length of text; not NUL-terminated when decoded
+} proto_msg_t;
+
+/****************** global functions *********************/
+
+/******************************************/
+/* proto_isBinary: is this message in the binary encoding?
+ * Function returns: true iff it has at least a tag and a type byte and
+ *   begins with PROTO_TAG; it may still be malformed.
+ */
+bool proto_isBinary(const char* buf, const int length);
+
+/******************************************/
+/* proto_encode: encode a message.
+ * Caller provides:
+ *   the message, with the fields for its type filled in;
+ *   a buffer and its size.
+ * Function returns:
+ *   the length of the encoding; or -1 if it would not fit, or the message
+ *   can't be encoded (unknown type, negative number, or a DISPLAY map that
+ *   is not rows lines of cols printable characters).
+ */
+int proto_encode(const proto_msg_t* msg, char* buf, const int size);
+
+/******************************************/
+/* proto_decode: decode a message.
+ * Caller provides:
+ *   a message of the given length, and a proto_msg_t to fill in.
+ * Function returns:
+ *   true if the message is well-formed, else false.  msg->text, if used,
+ *   points into buf, which must therefore outlive msg.
+ * Notes:
+ *   a DISPLAY's or VIEWPORT's cells are checked only by proto_unpackMap.
+ */
+bool proto_decode(const char* buf, const int length, proto_msg_t* msg);
+
+/******************************************/
+/* proto_unpackMap: expand a decoded DISPLAY's (or VIEWPORT's) cells into
+ * a map.
+ * Caller provides:
+ *   the decoded message;
+ *   a buffer and its size, which must be at least rows*(cols+1)+1.
+ * Function returns:
+ *   the length of the map (rows lines of cols characters, each ending in
+ *   '\n'), which is written to 'out' followed by a NUL; or -1 if the
+ *   cells are malformed (not exactly rows*cols printable characters), or
+ *   the map would not fit.
+ */
+int proto_unpackMap(const proto_msg_t* msg, char* out, const int outSize);
+
+#endif // _PROTO_H_
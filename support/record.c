@@ -0,0 +1,481 @@
+/*
+ * record - an append-only binary log of the messages a game server handled
+ *
+ * See record.h for detailed interface description.
+ *
+ * A log being written has its own buffer, and its FILE none, so that
+ * each record is one memcpy and the file sees one large write per
+ * BUFFER_BYTES of records.  A log being read uses its FILE's buffering,
+ * and keeps only the current message, in a buffer grown to fit.
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test; see below.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#ifdef UNIT_TEST
+#define _POSIX_C_SOURCE 199309L   // for clock_gettime in the unit test
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include "record.h"
+
+/**************** file-local constants ****************/
+#define BUFFER_BYTES (64 * 1024)    // records buffered before a write
+#define MAX_RECORD_HEAD 30          // three varints: tick, client, length
+static const int MaxVarint = 10;    // bytes in the longest 64-bit varint
+static const int MaxMessage = 1 << 24;  // longest message we will read
+
+/**************** global types ****************/
+typedef struct record {
+  FILE* fp;
+  bool writing;       // made by record_create, not record_open
+  bool failed;        // a write has failed; take no more records
+  uint64_t lastTick;  // tick of the latest record appended or read
+  char* buf;          // writing: records not yet written;
+                      // reading: the current message, and a NUL
+  int used;           // writing: bytes of buf in use
+  int size;           // bytes allocated for buf
+} record_t;
+
+/**************** local functions ****************/
+static int putVarint(char* buf, int o, uint64_t value);
+static bool getVarint(FILE* fp, uint64_t* value);
+static bool writeBytes(record_t* rec, const char* bytes, const int length);
+static record_t* newRecord(FILE* fp, const bool writing, const int size);
+
+/**************** record_create ****************/
+record_t*
+record_create(const char* path, const record_header_t* header)
+{
+  if (path == NULL || header == NULL) {
+    return NULL;
+  }
+  FILE* fp = fopen(path, "wb");
+  if (fp == NULL) {
+    return NULL;
+  }
+  setvbuf(fp, NULL, _IONBF, 0);  // we buffer, in rec->buf
+  record_t* rec = newRecord(fp, true, BUFFER_BYTES);
+  if (rec == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+
+  // the header is small, so it fits in the empty buffer
+  const char* nul = memchr(header->mapPath, '\0', RECORD_MAX_PATH);
+  const int pathLength = nul == NULL ? RECORD_MAX_PATH - 1
+                                     : nul - header->mapPath;
+  char* buf = rec->buf;
+  int o = strlen(RECORD_MAGIC);
+  memcpy(buf, RECORD_MAGIC, o);
+  o = putVarint(buf, o, (uint64_t)(unsigned)header->seed);
+  for (int i = 0; i < 8; i++) {
+    buf[o++] = (char)(header->mapHash >> (8 * i));
+  }
+  o = putVarint(buf, o, pathLength);
+  memcpy(buf + o, header->mapPath, pathLength);
+  o += pathLength;
+  o = putVarint(buf, o, (uint64_t)(unsigned)header->maxSpectators);
+  rec->used = o;
+  if (!record_flush(rec)) {
+    record_close(rec);
+    return NULL;
+  }
+  return rec;
+}
+
+/**************** record_append ****************/
+bool
+record_append(record_t* rec, const uint64_t tick, const int client,
+              const char* message, const int length)
+{
+  if (rec == NULL || !rec->writing || rec->failed || client < 0
+      || length < 0 || tick < rec->lastTick) {
+    return false;
+  }
+
+  // make room for the record, if need be, by writing out the buffer
+  if (rec->used + MAX_RECORD_HEAD + length > rec->size
+      && !record_flush(rec)) {
+    return false;
+  }
+  int o = putVarint(rec->buf, rec->used, tick - rec->lastTick);
+  o = putVarint(rec->buf, o, client);
+  o = putVarint(rec->buf, o, length);
+  rec->lastTick = tick;
+  if (o + length <= rec->size) {
+    memcpy(rec->buf + o, message, length);
+    rec->used = o + length;
+    return true;
+  }
+
+  // a message longer than the buffer goes straight to the file
+  rec->used = o;
+  return record_flush(rec) && writeBytes(rec, message, length);
+}
+
+/**************** record_flush ****************/
+bool
+record_flush(record_t* rec)
+{
+  if (rec == NULL || !rec->writing || rec->failed) {
+    return false;
+  }
+  const int used = rec->used;
+  rec->used = 0;
+  return writeBytes(rec, rec->buf, used);
+}
+
+/**************** record_open ****************/
+record_t*
+record_open(const char* path, record_header_t* header)
+{
+  if (path == NULL || header == NULL) {
+    return NULL;
+  }
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return NULL;
+  }
+  record_t* rec = newRecord(fp, false, 256);
+  if (rec == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+
+  // magic, seed, hash, path, and, but for version 1, spectators
+  char magic[sizeof(RECORD_MAGIC)];
+  const int magicLength = strlen(RECORD_MAGIC);
+  uint64_t seed, pathLength, spectators = 0;
+  unsigned char hash[8];
+  bool v1 = false;
+  if (fread(magic, 1, magicLength, fp) != magicLength
+      || (memcmp(magic, RECORD_MAGIC, magicLength) != 0
+          && !(v1 = memcmp(magic, RECORD_MAGIC_V1, magicLength) == 0))
+      || !getVarint(fp, &seed) || seed > (unsigned)-1
+      || fread(hash, 1, sizeof(hash), fp) != sizeof(hash)
+      || !getVarint(fp, &pathLength) || pathLength >= RECORD_MAX_PATH
+      || fread(header->mapPath, 1, pathLength, fp) != pathLength
+      || (!v1 && (!getVarint(fp, &spectators) || spectators > INT_MAX))) {
+    record_close(rec);
+    return NULL;
+  }
+  header->seed = (int)(unsigned)seed;
+  header->maxSpectators = (int)spectators;
+  header->mapHash = 0;
+  for (int i = 7; i >= 0; i--) {
+    header->mapHash = header->mapHash << 8 | hash[i];
+  }
+  header->mapPath[pathLength] = '\0';
+  return rec;
+}
+
+/**************** record_next ****************/
+int
+record_next(record_t* rec, uint64_t* tick, int* client,
+            const char** message, int* length)
+{
+  if (rec == NULL || rec->writing || tick == NULL || client == NULL
+      || message == NULL || length == NULL) {
+    return -1;
+  }
+
+  // a clean end of file comes just before a record
+  const int c = getc(rec->fp);
+  if (c == EOF) {
+    return 0;
+  }
+  ungetc(c, rec->fp);
+
+  uint64_t delta, sender, bytes;
+  if (!getVarint(rec->fp, &delta) || !getVarint(rec->fp, &sender)
+      || sender > 0x7FFFFFFF || !getVarint(rec->fp, &bytes)
+      || bytes >= MaxMessage) {
+    return -1;
+  }
+  if (bytes + 1 > rec->size) {
+    char* buf = realloc(rec->buf, bytes + 1);
+    if (buf == NULL) {
+      return -1;
+    }
+    rec->buf = buf;
+    rec->size = bytes + 1;
+  }
+  if (fread(rec->buf, 1, bytes, rec->fp) != bytes) {
+    return -1;
+  }
+  rec->buf[bytes] = '\0';
+
+  rec->lastTick += delta;
+  *tick = rec->lastTick;
+  *client = (int)sender;
+  *message = rec->buf;
+  *length = (int)bytes;
+  return 1;
+}
+
+/**************** record_close ****************/
+bool
+record_close(record_t* rec)
+{
+  if (rec == NULL) {
+    return true;
+  }
+  bool ok = !rec->writing || record_flush(rec);
+  if (fclose(rec->fp) != 0 && rec->writing) {
+    ok = false;
+  }
+  free(rec->buf);
+  free(rec);
+  return ok;
+}
+
+/**************** newRecord ****************/
+/* A log on fp, with a buffer of 'size' bytes; NULL if out of memory. */
+static record_t*
+newRecord(FILE* fp, const bool writing, const int size)
+{
+  record_t* rec = calloc(1, sizeof(record_t));
+  if (rec == NULL) {
+    return NULL;
+  }
+  rec->buf = malloc(size);
+  if (rec->buf == NULL) {
+    free(rec);
+    return NULL;
+  }
+  rec->fp = fp;
+  rec->writing = writing;
+  rec->size = size;
+  return rec;
+}
+
+/**************** writeBytes ****************/
+/* Write bytes to the log's file; on failure, mark the log failed. */
+static bool
+writeBytes(record_t* rec, const char* bytes, const int length)
+{
+  if (length > 0 && fwrite(bytes, 1, length, rec->fp) != length) {
+    rec->failed = true;
+  }
+  return !rec->failed;
+}
+
+/**************** putVarint ****************/
+/* Write value as a varint at buf[o], which has room; return the new o. */
+static int
+putVarint(char* buf, int o, uint64_t value)
+{
+  do {
+    unsigned char byte = value & 0x7F;
+    value >>= 7;
+    buf[o++] = (char)(value != 0 ? byte | 0x80 : byte);
+  } while (value != 0);
+  return o;
+}
+
+/**************** getVarint ****************/
+/* Read a varint from fp; return false if the file ends first, or it is
+ * longer than MaxVarint bytes.
+ */
+static bool
+getVarint(FILE* fp, uint64_t* value)
+{
+  uint64_t result = 0;
+  for (int shift = 0, n = 0; n < MaxVarint; shift += 7, n++) {
+    const int c = getc(fp);
+    if (c == EOF) {
+      return false;
+    }
+    result |= (uint64_t)(c & 0x7F) << shift;
+    if ((c & 0x80) == 0) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* ************************* UNIT_TEST ****************************** */
+/*
+ * Write a log of messages of many lengths -- empty, KEY-sized, and
+ * longer than the buffer -- read it back, and check every field; check
+ * that a log cut short, or not a log at all, is rejected, and that a
+ * version 1 log is still read; then report the cost of appending a KEY,
+ * e.g.,
+ *   ./recordtest
+ */
+
+#ifdef UNIT_TEST
+
+#include <assert.h>
+#include <time.h>
+
+#define TEST_PATH "recordtest.tmp"
+#define TEST_RECORDS 500
+
+static int testLength(const int i);
+static char testByte(const int i, const int j);
+static void cut(const char* path, const long length);
+static double seconds(void);
+
+int
+main(const int argc, char* argv[])
+{
+  record_header_t header = { .seed = 12345, .mapHash = 0xFEDCBA9876543210ULL,
+                              .maxSpectators = 300 };
+  strcpy(header.mapPath, "../maps/main.txt");
+  char* message = malloc(3 * BUFFER_BYTES);
+  assert(message != NULL);
+
+  printf("Testing a round trip\n");
+  record_t* rec = record_create(TEST_PATH, &header);
+  assert(rec != NULL);
+  assert(record_next(rec, NULL, NULL, NULL, NULL) == -1);
+  for (int i = 0; i < TEST_RECORDS; i++) {
+    for (int j = 0; j < testLength(i); j++) {
+      message[j] = testByte(i, j);
+    }
+    assert(record_append(rec, (uint64_t)i * i * 1000, i % 7, message,
+                         testLength(i)));
+    if (i == TEST_RECORDS / 2) {
+      assert(record_flush(rec));
+    }
+  }
+  assert(!record_append(rec, 0, 0, message, 1));  // time went backward
+  assert(record_close(rec));
+
+  record_header_t read;
+  memset(&read, 0xAB, sizeof(read));
+  rec = record_open(TEST_PATH, &read);
+  assert(rec != NULL);
+  assert(read.seed == header.seed && read.mapHash == header.mapHash);
+  assert(strcmp(read.mapPath, header.mapPath) == 0);
+  assert(read.maxSpectators == header.maxSpectators);
+  assert(!record_append(rec, 0, 0, message, 1));
+  uint64_t tick;
+  int client, length;
+  const char* got;
+  for (int i = 0; i < TEST_RECORDS; i++) {
+    assert(record_next(rec, &tick, &client, &got, &length) == 1);
+    assert(tick == (uint64_t)i * i * 1000 && client == i % 7);
+    assert(length == testLength(i) && got[length] == '\0');
+    for (int j = 0; j < length; j++) {
+      assert(got[j] == testByte(i, j));
+    }
+  }
+  assert(record_next(rec, &tick, &client, &got, &length) == 0);
+  assert(record_close(rec));
+
+  printf("Testing damaged logs\n");
+  cut(TEST_PATH, 3 * BUFFER_BYTES);  // in the middle of some record
+  rec = record_open(TEST_PATH, &read);
+  assert(rec != NULL);
+  int status;
+  while ((status = record_next(rec, &tick, &client, &got, &length)) == 1) {
+  }
+  assert(status == -1);
+  record_close(rec);
+  cut(TEST_PATH, 12);  // in the middle of the header
+  assert(record_open(TEST_PATH, &read) == NULL);
+  assert(record_open("record.c", &read) == NULL);
+  assert(record_open("no/such/file", &read) == NULL);
+  assert(record_create("no/such/file", &header) == NULL);
+
+  printf("Testing a version 1 log\n");
+  rec = record_create(TEST_PATH, &header);   // just the header
+  assert(rec != NULL && record_close(rec));
+  FILE* fp = fopen(TEST_PATH, "rb");
+  assert(fp != NULL);
+  const long v2Length = fread(message, 1, BUFFER_BYTES, fp);
+  fclose(fp);
+  fp = fopen(TEST_PATH, "wb");               // less the spectators (300)
+  assert(fp != NULL);
+  memcpy(message, RECORD_MAGIC_V1, strlen(RECORD_MAGIC_V1));
+  assert(fwrite(message, 1, v2Length - 2, fp) == v2Length - 2);
+  fclose(fp);
+  rec = record_open(TEST_PATH, &read);
+  assert(rec != NULL);
+  assert(read.seed == header.seed && read.mapHash == header.mapHash);
+  assert(strcmp(read.mapPath, header.mapPath) == 0);
+  assert(read.maxSpectators == 0);
+  assert(record_next(rec, &tick, &client, &got, &length) == 0);
+  record_close(rec);
+
+  printf("Timing KEYs\n");
+  const int keys = 2000000;
+  rec = record_create(TEST_PATH, &header);
+  assert(rec != NULL);
+  double start = seconds();
+  for (int i = 0; i < keys; i++) {
+    assert(record_append(rec, (uint64_t)i * 5000, i % 26, "KEY h", 5));
+  }
+  assert(record_close(rec));
+  double each = (seconds() - start) / keys;
+  fp = fopen(TEST_PATH, "rb");
+  assert(fp != NULL);
+  fseek(fp, 0, SEEK_END);
+  printf("%d KEYs: %.1f ns each, %.1f bytes each\n", keys, each * 1e9,
+         (double)ftell(fp) / keys);
+  fclose(fp);
+
+  remove(TEST_PATH);
+  free(message);
+  printf("Tests passed successfully.\n");
+  return 0;
+}
+
+/* The length of test message i: mostly short, some empty, a few longer
+ * than the buffer. */
+static int
+testLength(const int i)
+{
+  if (i % 97 == 0) {
+    return BUFFER_BYTES + i;
+  }
+  if (i % 13 == 0) {
+    return 0;
+  }
+  return (i * 37) % 300;
+}
+
+/* Byte j of test message i. */
+static char
+testByte(const int i, const int j)
+{
+  return (char)(i * 31 + j * 7);
+}
+
+/* Cut the file at path down to its first 'length' bytes. */
+static void
+cut(const char* path, const long length)
+{
+  FILE* fp = fopen(path, "rb");
+  assert(fp != NULL);
+  char* bytes = malloc(length);
+  assert(bytes != NULL);
+  assert(fread(bytes, 1, length, fp) == length);
+  fclose(fp);
+  fp = fopen(path, "wb");
+  assert(fp != NULL);
+  assert(fwrite(bytes, 1, length, fp) == length);
+  fclose(fp);
+  free(bytes);
+}
+
+/* Read a monotonic clock, in seconds. */
+static double
+seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+#endif // UNIT_TEST
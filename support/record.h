@@ -0,0 +1,134 @@
+/*
+ * record - an append-only binary log of the messages a game server handled
+ *
+ * A game is fully determined by its map, its random seed, the options
+ * that change its rules, and the messages its clients sent, in order;
+ * so a log of just those lets a game be replayed exactly -- every move, every frame -- long after it
+ * was played (see the REPLAY section of server/server.c).  The server
+ * writes the log as it handles messages, so writing must be cheap:
+ * records are appended to a buffer in memory, which reaches the file
+ * only when it fills, or when the caller flushes it, e.g., while idle.
+ *
+ * Format: a header, then one record per message, all varints being
+ * unsigned LEB128 numbers (seven bits per byte, least significant first,
+ * high bit set on all but the last byte):
+ *   header    the 8 bytes RECORD_MAGIC; varint seed; the map's hash, as
+ *             8 bytes, least significant first; varint length of the map's
+ *             path, then the path; varint most spectators at once
+ *   record    varint microseconds since the previous record (or since the
+ *             log began); varint client; varint length, then the message
+ * where the client is a small number standing for the sender's address.
+ * A log of version 1 (magic "NUGREC1\n") lacks the spectators, and is
+ * read as if they were not recorded.
+ *
+ * Typical usage:
+ *   record_header_t header = { .seed = seed, .mapHash = hash,
+ *                              .maxSpectators = spectators };
+ *   strcpy(header.mapPath, mapPath);
+ *   record_t* rec = record_create("game.rec", &header);
+ *   record_append(rec, tick, client, message, length);  // per message
+ *   record_close(rec);
+ * and, to read it back,
+ *   record_t* rec = record_open("game.rec", &header);
+ *   while (record_next(rec, &tick, &client, &message, &length) == 1) ...
+ *   record_close(rec);
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test and benchmark;
+ * see record.c.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/****************** constants *********************/
+#define RECORD_MAGIC "NUGREC2\n"  // first 8 bytes of every log
+#define RECORD_MAGIC_V1 "NUGREC1\n"  // ... of logs before maxSpectators
+#define RECORD_MAX_PATH 256        // room for the map's path, with its NUL
+
+/****************** types *********************/
+typedef struct record record_t;  // opaque to users of the module
+
+/* What a log records about the game, besides its messages. */
+typedef struct record_header {
+  int seed;                       // the game's random seed
+  uint64_t mapHash;               // e.g., xxhash64 of the map file
+  char mapPath[RECORD_MAX_PATH];  // where the map was, when recorded
+  int maxSpectators;              // spectators watching at once, at most;
+                                  // 0 if not recorded (version 1)
+} record_header_t;
+
+/****************** global functions *********************/
+
+/******************************************/
+/* record_create: start a new log, replacing any file at 'path'.
+ * Caller provides:
+ *   the path, and the header to write.
+ * Function returns:
+ *   the log, ready for record_append; or NULL if the file can't be
+ *   created or the header written.
+ * Caller expectations:
+ *   call record_close() when done, or the last records will be lost.
+ */
+record_t* record_create(const char* path, const record_header_t* header);
+
+/******************************************/
+/* record_append: add one message to a log made by record_create.
+ * Caller provides:
+ *   the time the message arrived, in microseconds (never less than that
+ *   of the record before); the sender's number, >= 0; the message and
+ *   its length.
+ * Function returns:
+ *   true if the record was buffered (or written); false if it, or any
+ *   earlier write, failed -- after which the log takes no more records.
+ */
+bool record_append(record_t* rec, const uint64_t tick, const int client,
+                   const char* message, const int length);
+
+/******************************************/
+/* record_flush: write any buffered records to the file.
+ * Function returns:
+ *   false if this, or any earlier write, failed.
+ */
+bool record_flush(record_t* rec);
+
+/******************************************/
+/* record_open: open a log for reading.
+ * Caller provides:
+ *   the path, and a header to fill in.
+ * Function returns:
+ *   the log, ready for record_next; or NULL if the file can't be read or
+ *   does not begin with a well-formed header.
+ * Caller expectations:
+ *   call record_close() when done.
+ */
+record_t* record_open(const char* path, record_header_t* header);
+
+/******************************************/
+/* record_next: read the next record of a log opened by record_open.
+ * Caller provides:
+ *   places for the record's time (as given to record_append), client,
+ *   message and length.
+ * Function returns:
+ *   1 if a record was read, 0 at the end of the log, or -1 if the log
+ *   is malformed (e.g., was cut short when its writer died).
+ * Notes:
+ *   *message points into the log's buffer, and is followed by a NUL; it
+ *   is valid until the next call.
+ */
+int record_next(record_t* rec, uint64_t* tick, int* client,
+                const char** message, int* length);
+
+/******************************************/
+/* record_close: flush (if writing) and close a log, then free it.
+ * Ignored if rec is NULL.
+ * Function returns:
+ *   false if a log being written could not all be written.
+ */
+bool record_close(record_t* rec);
+
+#endif // _RECORD_H_
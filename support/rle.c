@@ -0,0 +1,220 @@
+/*
+ * rle - a run-length codec for DISPLAY frames
+ *
+ * See rle.h for detailed interface description for each function.
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test; see below.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#ifdef UNIT_TEST
+#define _POSIX_C_SOURCE 199309L   // for clock_gettime in the unit test
+#endif
+
+#include <string.h>
+#include "rle.h"
+
+/**************** file-local constants ****************/
+static const int MinRun = 4;     // shorter runs cost no more written out
+static const int MaxRun = 255;   // the most a count byte can say
+
+/**************** rle_encode ****************/
+int
+rle_encode(const char* in, const int length, char* out, const int outSize)
+{
+  int o = 0;
+  for (int i = 0; i < length; ) {
+    const char c = in[i];
+    int run = 1;
+    while (i + run < length && in[i + run] == c && run < MaxRun) {
+      run++;
+    }
+    if (run >= MinRun || c == RLE_MARK) {
+      if (o + 3 >= outSize) {
+        return -1;
+      }
+      out[o++] = RLE_MARK;
+      out[o++] = c;
+      out[o++] = (char)run;
+    } else {
+      if (o + run >= outSize) {
+        return -1;
+      }
+      memcpy(out + o, in + i, run);
+      o += run;
+    }
+    i += run;
+  }
+  if (o >= outSize) {
+    return -1;
+  }
+  out[o] = '\0';
+  return o;
+}
+
+/**************** rle_decode ****************/
+int
+rle_decode(const char* in, const int length, char* out, const int outSize)
+{
+  int o = 0;
+  for (int i = 0; i < length; ) {
+    if (in[i] == RLE_MARK) {
+      if (i + 2 >= length) {
+        return -1;            // truncated run
+      }
+      const int run = (unsigned char)in[i + 2];
+      if (run == 0 || o + run >= outSize) {
+        return -1;
+      }
+      memset(out + o, in[i + 1], run);
+      o += run;
+      i += 3;
+    } else {
+      // copy everything up to the next run in one go
+      const char* mark = memchr(in + i, RLE_MARK, length - i);
+      const int literal = mark == NULL ? length - i : (int)(mark - in) - i;
+      if (o + literal >= outSize) {
+        return -1;
+      }
+      memcpy(out + o, in + i, literal);
+      o += literal;
+      i += literal;
+    }
+  }
+  if (o >= outSize) {
+    return -1;
+  }
+  out[o] = '\0';
+  return o;
+}
+
+/* ****************************************************************** */
+/* ************************* UNIT_TEST ****************************** */
+/*
+ * Check round trips on some awkward cases, then, for each map file named
+ * on the command line, report the compression ratio and the encode and
+ * decode speed, e.g.,
+ *   ./rletest ../maps/main.txt ../maps/big.txt
+ * ('make rlebench' runs it over every map).
+ * A map file is what a spectator sees; a player's early frames, mostly
+ * unseen blanks, compress far better.
+ */
+
+#ifdef UNIT_TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+static void roundTrip(const char* text, const int length);
+static void benchmark(const char* path);
+static double seconds(void);
+
+int
+main(const int argc, char* argv[])
+{
+  printf("Testing round trips\n");
+  char text[1200];
+  roundTrip("", 0);
+  roundTrip("a", 1);
+  roundTrip("aaa", 3);
+  roundTrip("aaaa", 4);
+  roundTrip("\x1D", 1);                      // the marker itself...
+  roundTrip("ab\x1D\x1D\x1D" "cd", 7);       // ...and a run of it
+  for (int n = 250; n <= 1200; n += 5) {     // runs around MaxRun
+    memset(text, ' ', n);
+    roundTrip(text, n);
+  }
+  for (int i = 0; i < (int)sizeof(text); i++) {
+    text[i] = 1 + (i * 7919) % 127;          // no NULs; some markers
+  }
+  roundTrip(text, sizeof(text));
+
+  printf("Testing bounds\n");
+  char out[16];
+  assert(rle_encode("abcdefgh", 8, out, 8) == -1);   // no room for the NUL
+  assert(rle_encode("abcdefgh", 8, out, 9) == 8);
+  assert(rle_decode("\x1D" "a", 2, out, sizeof(out)) == -1);      // truncated
+  assert(rle_decode("\x1D" "a\x00", 3, out, sizeof(out)) == -1);  // zero run
+  assert(rle_decode("\x1D" "a\x10", 3, out, 16) == -1);  // 16 + NUL won't fit
+  assert(rle_decode("\x1D" "a\x0F", 3, out, 16) == 15);
+
+  for (int i = 1; i < argc; i++) {
+    benchmark(argv[i]);
+  }
+  printf("Tests passed successfully.\n");
+  return 0;
+}
+
+/* Encode and decode 'text'; the result must match. */
+static void
+roundTrip(const char* text, const int length)
+{
+  const int size = 3 * length + 1;    // the worst case: all markers
+  char* packed = malloc(size);
+  char* unpacked = malloc(length + 1);
+  assert(packed != NULL && unpacked != NULL);
+  int n = rle_encode(text, length, packed, size);
+  assert(n >= 0 && (int)strlen(packed) == n);
+  assert(rle_decode(packed, n, unpacked, length + 1) == length);
+  assert(memcmp(text, unpacked, length) == 0 && unpacked[length] == '\0');
+  free(packed);
+  free(unpacked);
+}
+
+/* Report ratio and speed for the map in 'path'. */
+static void
+benchmark(const char* path)
+{
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "can't read %s\n", path);
+    return;
+  }
+  char* map = malloc(1 << 20);
+  assert(map != NULL);
+  int length = fread(map, 1, (1 << 20) - 1, fp);
+  fclose(fp);
+  map[length] = '\0';
+
+  char* packed = malloc(length + 1);
+  char* unpacked = malloc(length + 1);
+  assert(packed != NULL && unpacked != NULL);
+  int n = rle_encode(map, length, packed, length + 1);
+  if (n < 0) {
+    printf("%-44s %6d bytes: encoding is no smaller\n", path, length);
+  } else {
+    const int reps = 2000000 / (length + 1) + 10;
+    double start = seconds();
+    for (int r = 0; r < reps; r++) {
+      rle_encode(map, length, packed, length + 1);
+    }
+    double encode = (seconds() - start) / reps;
+    start = seconds();
+    for (int r = 0; r < reps; r++) {
+      rle_decode(packed, n, unpacked, length + 1);
+    }
+    double decode = (seconds() - start) / reps;
+    assert(memcmp(map, unpacked, length + 1) == 0);
+    printf("%-44s %6d -> %5d bytes (%4.1fx); "
+           "encode %5.1f us (%4.0f MB/s), decode %5.1f us\n",
+           path, length, n, (double)length / n,
+           encode * 1e6, length / encode / 1e6, decode * 1e6);
+  }
+  free(map);
+  free(packed);
+  free(unpacked);
+}
+
+/* Read a monotonic clock, in seconds. */
+static double
+seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+#endif // UNIT_TEST
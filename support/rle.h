@@ -0,0 +1,59 @@
+/*
+ * rle - a run-length codec for DISPLAY frames
+ *
+ * A DISPLAY body is mostly long runs of the same character -- spaces
+ * where nothing has been seen yet, and '-', '#', '.' in walls, passages
+ * and rooms -- so plain run-length encoding shrinks it several-fold at
+ * memory-copy speed, which matters because the server encodes a frame
+ * for every player on every move.
+ *
+ * Encoding: a run of 4 to 255 copies of a character c is written as the
+ * three bytes RLE_MARK, c, count; any other character is written as is,
+ * except RLE_MARK itself, which is always written as a run (of length 1
+ * or more).  Count bytes are never zero, so an encoding of a string with
+ * no NUL characters has none either, and can be sent as a message.
+ *
+ * Typical usage:
+ *   int n = rle_encode(frame, strlen(frame), packed, sizeof(packed));
+ *   if (n < 0) ... didn't fit; send frame instead ...
+ *   ...
+ *   int m = rle_decode(packed, n, frame, sizeof(frame));
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test and benchmark;
+ * see rle.c.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#ifndef _RLE_H_
+#define _RLE_H_
+
+/****************** constants *********************/
+#define RLE_MARK '\x1D'   // ASCII group separator; never in a map
+
+/****************** global functions *********************/
+
+/******************************************/
+/* rle_encode: encode the first 'length' characters of 'in'.
+ * Caller provides:
+ *   the text to encode, and its length;
+ *   an output buffer and its size.
+ * Function returns:
+ *   the length of the encoding, which is written to 'out' followed by a
+ *   NUL; or -1 if it would not fit (including the NUL) in outSize bytes.
+ */
+int rle_encode(const char* in, const int length, char* out, const int outSize);
+
+/******************************************/
+/* rle_decode: decode the first 'length' characters of 'in'.
+ * Caller provides:
+ *   an encoding, and its length;
+ *   an output buffer and its size.
+ * Function returns:
+ *   the length of the decoded text, which is written to 'out' followed
+ *   by a NUL; or -1 if the encoding is malformed (a truncated or
+ *   zero-length run) or would not fit (including the NUL) in outSize bytes.
+ */
+int rle_decode(const char* in, const int length, char* out, const int outSize);
+
+#endif // _RLE_H_
@@ -0,0 +1,58 @@
+/*
+ * rng - a small, fast pseudo-random number generator (xoshiro256**)
+ *
+ * Unlike rand(), every generator is a separate value of type rng_t, with
+ * no hidden global state and no locking: give each game (or thread) its
+ * own rng_t, and the numbers one generator produces depend only on its
+ * seed and on how it has been used -- never on what other generators,
+ * perhaps in other threads, are doing.  So a run is reproducible from
+ * its seed however many games run concurrently.
+ *
+ * The generator is xoshiro256** by Blackman and Vigna; its 256-bit state
+ * is expanded from a 64-bit seed with splitmix64, as they recommend.
+ * It is not suitable for cryptography.
+ *
+ * Typical usage:
+ *   rng_t rng;
+ *   rng_seed(&rng, seed);
+ *   int die = 1 + rng_below(&rng, 6);
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test; see rng.c.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#ifndef _RNG_H_
+#define _RNG_H_
+
+#include <stdint.h>
+
+/****************** types *********************/
+/* The generator state.  It is small, and meant to be embedded in the
+ * structure it serves (e.g., the game) rather than allocated; but its
+ * contents are private to this module.
+ */
+typedef struct rng {
+  uint64_t s[4];
+} rng_t;
+
+/****************** global functions *********************/
+
+/******************************************/
+/* rng_seed: (re)start the generator with the sequence for 'seed'.
+ * Every seed, including zero, is fine.
+ */
+void rng_seed(rng_t* rng, const uint64_t seed);
+
+/******************************************/
+/* rng_next: return the next 64 random bits.
+ */
+uint64_t rng_next(rng_t* rng);
+
+/******************************************/
+/* rng_below: return a number uniformly distributed in [0, n), without
+ * the slight bias of rng_next() % n; return 0 if n <= 0.
+ */
+int rng_below(rng_t* rng, const int n);
+
+#endif // _RNG_H_
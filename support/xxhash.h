@@ -0,0 +1,38 @@
+/*
+ * xxhash - the 64-bit xxHash (XXH64) of a buffer
+ *
+ * A fast, well-mixed, non-cryptographic hash: about as fast as reading
+ * the buffer, which makes it cheap enough for the server to fingerprint
+ * every frame it composites and skip those identical to the last one a
+ * client was sent.  Its values match the reference implementation's
+ * XXH64(), so they may be checked against any other.
+ *
+ * Typical usage:
+ *   uint64_t h = xxhash64(frame, length, 0);
+ *   if (h == lastHash) ... nothing changed; don't send it ...
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test and benchmark;
+ * see xxhash.c.
+ *
+ * Palmer's Scholars, March 2022
+ */
+
+#ifndef _XXHASH_H_
+#define _XXHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/****************** global functions *********************/
+
+/******************************************/
+/* xxhash64: hash the first 'length' bytes of 'in'.
+ * Caller provides:
+ *   the bytes, and their number (which may be zero);
+ *   a seed, which selects one of 2^64 unrelated hash functions.
+ * Function returns:
+ *   the XXH64 hash of the bytes with that seed.
+ */
+uint64_t xxhash64(const void* in, const size_t length, const uint64_t seed);
+
+#endif // _XXHASH_H_